@@ -51,6 +51,9 @@ ABSL_FLAG(bool, raw, true,
           "If true, does not send/receive size parameter during "
           "the connection handshake");
 ABSL_FLAG(bool, tcp_nodelay, false, "if true - use tcp_nodelay option for server sockets");
+ABSL_FLAG(bool, resp, false,
+          "In client mode, sends pipelined RESP PING commands and expects PONG replies, "
+          "like memtier_benchmark does. Use it with --raw to benchmark ping_iouring_server");
 
 VarzQps ping_qps("ping-qps");
 VarzCount connections("connections");
@@ -329,6 +332,8 @@ class Driver {
   size_t Run(base::Histogram* dest);
 
  private:
+  size_t RunResp(base::Histogram* dest);
+
   uint8_t buf_[8];
 };
 
@@ -420,6 +425,9 @@ size_t Driver::Run(base::Histogram* dest) {
   size_t pipeline_cnt = absl::GetFlag(FLAGS_p);
   bool is_raw = GetFlag(FLAGS_raw);
 
+  if (GetFlag(FLAGS_resp))
+    return RunResp(dest);
+
   for (; i < absl::GetFlag(FLAGS_n); ++i) {
     auto start = absl::GetCurrentTimeNanos();
 
@@ -468,6 +476,46 @@ size_t Driver::Run(base::Histogram* dest) {
   return i;
 }
 
+// Sends the whole pipeline with a single write, so the server can reply with a single write too.
+size_t Driver::RunResp(base::Histogram* dest) {
+  base::Histogram hist;
+
+  constexpr string_view kPing = "*1\r\n$4\r\nPING\r\n";
+  constexpr string_view kPong = "+PONG\r\n";
+  size_t pipeline_cnt = absl::GetFlag(FLAGS_p);
+  string req, expected;
+  for (size_t j = 0; j < pipeline_cnt; ++j) {
+    req.append(kPing);
+    expected.append(kPong);
+  }
+  string reply(expected.size(), '\0');
+
+  size_t i = 0;
+  for (; i < absl::GetFlag(FLAGS_n); ++i) {
+    auto start = absl::GetCurrentTimeNanos();
+
+    error_code ec = socket_->Write(io::Buffer(req));
+    if (ec && FiberSocketBase::IsConnClosed(ec))
+      break;
+    CHECK(!ec) << ec.message();
+
+    io::Result<size_t> res =
+        socket_->Read(io::MutableBytes(reinterpret_cast<uint8_t*>(reply.data()), reply.size()));
+    if (!res && FiberSocketBase::IsConnClosed(res.error()))
+      break;
+    CHECK(res) << res.error().message();
+    CHECK_EQ(expected, reply);
+
+    hist.Add((absl::GetCurrentTimeNanos() - start) / 1000);
+  }
+
+  socket_->Shutdown(SHUT_RDWR);
+  dest->Merge(hist);
+
+  // Round trips, like Run().
+  return i;
+}
+
 mutex lat_mu;
 base::Histogram lat_hist;
 
@@ -5,13 +5,14 @@
 #include <absl/strings/ascii.h>
 
 #include "base/init.h"
-#include "base/io_buf.h"
-#include "examples/pingserver/resp_parser.h"
 #include "util/accept_server.h"
-#include "util/asio_stream_adapter.h"
 #include "util/fiber_socket_base.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 #include "util/fibers/pool.h"
 #include "util/http/http_handler.h"
+#include "util/resp/resp_connection.h"
+#include "util/tls/ktls.h"
+#include "util/tls/session_cache.h"
 #include "util/tls/tls_socket.h"
 #include "util/varz.h"
 
@@ -27,6 +28,10 @@ ABSL_FLAG(int32_t, http_port, 8080, "Http port.");
 ABSL_FLAG(int32_t, port, 6380, "Redis port");
 ABSL_FLAG(uint32_t, iouring_depth, 512, "Io uring depth");
 ABSL_FLAG(bool, tls, false, "Enable tls");
+ABSL_FLAG(bool, ktls, false, "Offload tls sessions to the kernel if possible");
+ABSL_FLAG(bool, tls_session_cache, false, "Resume tls sessions of reconnecting clients");
+ABSL_FLAG(uint32_t, tls_handshake_threads, 0,
+          "If positive, runs the tls handshakes in that many threads");
 ABSL_FLAG(bool, tls_verify_peer, false,
           "Require peer certificate. Please note that this flag requires loading of "
           "server certificates (not sure why).");
@@ -35,6 +40,8 @@ ABSL_FLAG(bool, use_incoming_cpu, false,
 ABSL_FLAG(string, tls_cert, "", "");
 ABSL_FLAG(string, tls_key, "", "");
 ABSL_FLAG(string, unixsocket, "", "");
+ABSL_FLAG(uint32_t, cork, 0,
+          "If positive, coalesces the replies of pipelined requests up to that many bytes");
 
 VarzQps ping_qps("ping-qps");
 
@@ -44,19 +51,14 @@ inline void ToUpper(const RespParser::Buffer* val) {
   }
 }
 
-static inline std::string_view ToAbsl(const absl::Span<uint8_t>& s) {
-  return std::string_view{reinterpret_cast<char*>(s.data()), s.size()};
-}
-
-class PingConnection : public Connection {
+class PingConnection : public resp::RespConnection {
  public:
   PingConnection(SSL_CTX* ctx) : ctx_(ctx) {
   }
 
-  void Handle(int res, int32_t payload, ProactorBase* mgr);
-
  private:
   void HandleRequests() final;
+  void DispatchCommand(resp::CmdArgList args, resp::ReplyBuilder* rb) final;
 
   SSL_CTX* ctx_ = nullptr;
 };
@@ -66,76 +68,41 @@ atomic_int conn_id{1};
 void PingConnection::HandleRequests() {
   ThisFiber::SetName(absl::StrCat("ping/", conn_id.fetch_add(1, memory_order_relaxed)));
 
-  system::error_code ec;
-  unique_ptr<tls::TlsSocket> tls_sock;
   if (ctx_) {
-    tls_sock.reset(new tls::TlsSocket(std::move(socket_)));
+    unique_ptr<tls::TlsSocket> tls_sock(new tls::TlsSocket(std::move(socket_)));
     tls_sock->InitSSL(ctx_);
 
     FiberSocketBase::AcceptResult aresult = tls_sock->Accept();
+    bool ktls_tx = tls_sock->IsKtlsTx();
     socket_ = std::move(tls_sock);
     if (!aresult) {
       LOG(ERROR) << "Error handshaking " << aresult.error().message();
       return;
     } else {
-      LOG(INFO) << "TLS handshake succeeded";
-    }
-  }
-  FiberSocketBase* peer = tls_sock ? (FiberSocketBase*)tls_sock.get() : socket_.get();
-
-  AsioStreamAdapter<FiberSocketBase> asa(*peer);
-  base::IoBuf io_buf{1024};
-  RespParser resp_parser;
-  uint32_t consumed = 0;
-  vector<RespParser::Buffer> args;
-  while (true) {
-    auto dest = io_buf.AppendBuffer();
-    asio::mutable_buffer mb(dest.data(), dest.size());
-
-    size_t res = asa.read_some(mb, ec);
-    if (FiberSocketBase::IsConnClosed(ec))
-      break;
-
-    CHECK(!ec) << ec << "/" << ec.message();
-    VLOG(1) << "Read " << res << " bytes";
-    io_buf.CommitWrite(res);
-    RespParser::Status st = resp_parser.Parse(io_buf.InputBuffer(), &consumed, &args);
-    io_buf.ConsumeInput(consumed);
-
-    if (st == RespParser::RESP_OK) {
-      if (args.empty())
-        continue;
-      ToUpper(&args[0]);
-      std::string_view cmd = ToAbsl(args.front());
-      if (cmd == "PING") {
-        ping_qps.Inc();
-        const char kReply[] = "+PONG\r\n";
-        auto b = boost::asio::buffer(kReply, sizeof(kReply) - 1);
-
-        asa.write_some(b, ec);
-        if (ec) {
-          break;
-        }
-      } else {
-        const char kReply[] = "+OK\r\n";
-        auto b = boost::asio::buffer(kReply, sizeof(kReply) - 1);
-        asa.write_some(b, ec);
-        if (ec) {
-          break;
-        }
-      }
-    } else if (st == RespParser::MORE_INPUT) {
-      continue;
-    } else {
-      break;
+      LOG(INFO) << "TLS handshake succeeded" << (ktls_tx ? ", offloaded to kernel" : "");
     }
+  } else {
+    socket_->SetCork(GetFlag(FLAGS_cork));
   }
 
+  // Replies to all the pipelined commands of a read with a single write.
+  RespConnection::HandleRequests();
+
   VLOG(1) << "Connection shutting down";
   error_code err = socket_->Shutdown(SHUT_RDWR);
   LOG_IF(WARNING, !err) << "Shutdown failed: " << err.message();
 }
 
+void PingConnection::DispatchCommand(resp::CmdArgList args, resp::ReplyBuilder* rb) {
+  ToUpper(&args[0]);
+  if (resp::ToSV(args.front()) == "PING") {
+    ping_qps.Inc();
+    rb->SendSimpleString("PONG");
+  } else {
+    rb->SendSimpleString("OK");
+  }
+}
+
 class PingListener : public ListenerInterface {
  public:
   PingListener(SSL_CTX* ctx) : ctx_(ctx) {
@@ -215,6 +182,14 @@ static SSL_CTX* CreateSslCntx() {
   CHECK_EQ(1, SSL_CTX_set_cipher_list(ctx, "ADH:DEFAULT"));
   CHECK_EQ(1, SSL_CTX_set_dh_auto(ctx, 1));
 
+  if (GetFlag(FLAGS_ktls)) {
+    CHECK(tls::EnableKtls(ctx));
+  }
+
+  if (GetFlag(FLAGS_tls_session_cache)) {
+    tls::EnableServerSessionCache(ctx);
+  }
+
   return ctx;
 }
 
@@ -233,6 +208,14 @@ int main(int argc, char* argv[]) {
     ctx = CreateSslCntx();
   }
 
+  // Must outlive ctx, which is freed by the listener.
+  unique_ptr<fb2::FiberQueueThreadPool> handshake_pool;
+  unsigned handshake_threads = GetFlag(FLAGS_tls_handshake_threads);
+  if (ctx && handshake_threads > 0) {
+    handshake_pool.reset(new fb2::FiberQueueThreadPool(handshake_threads));
+    tls::EnableHandshakeOffload(ctx, handshake_pool.get(), 4 * handshake_threads);
+  }
+
   unique_ptr<util::ProactorPool> pp;
 #ifdef __linux__
   pp.reset(Pool::IOUring(GetFlag(FLAGS_iouring_depth)));
@@ -35,6 +35,17 @@ class ReadonlyFile {
   struct Options {
     bool sequential = true;           // hint
     bool drop_cache_on_close = true;  // hint
+
+    // Asynchronous read-ahead for implementations that support it (see util::fb2::OpenRead).
+    // Sequential reads are served from a ring of up to `readahead_depth` blocks of
+    // `readahead_block` bytes that are read in the background. The number of reads in flight
+    // starts small and grows while the access stays sequential. 0 disables read-ahead.
+    uint32_t readahead_depth = 0;
+    uint32_t readahead_block = 1U << 17;
+
+    // Bypass the page cache (O_DIRECT). Requires read-ahead, depth 1 is used if it's not set.
+    bool direct = false;
+
     Options() {
     }
   };
@@ -68,6 +79,20 @@ class WriteFile : public Sink {
  public:
   struct Options {
     bool append = false;  // if true - does not overwrite the existing file on open.
+
+    // Write buffering for implementations that support it (see util::fb2::OpenWrite).
+    // Writes are copied into 4K-aligned buffers of `buffer_size` bytes that are flushed
+    // asynchronously, with up to `buffers_in_flight` flushes in flight. The writer blocks only
+    // when all of them are in flight. Errors of background flushes are reported by the
+    // subsequent writes or by Close. Files that are destroyed without Close are closed by
+    // their destructor, which only logs the errors. 0 disables buffering.
+    uint32_t buffers_in_flight = 0;
+    uint32_t buffer_size = 1U << 18;
+
+    // Bypass the page cache (O_DIRECT). Requires buffering, 1 buffer in flight is used
+    // if it's not set. The unaligned tail is padded on Close and the file is truncated back.
+    // Can not be combined with append.
+    bool direct = false;
   };
 
   virtual ~WriteFile();
@@ -23,17 +23,18 @@ static int glob_errfunc(const char* epath, int eerrno) {
   return 0;
 }
 
-Result<vector<StatShort>> StatFiles(std::string_view path) {
+Result<vector<string>> Glob(std::string_view pattern) {
   glob_t glob_result;
 
-  vector<StatShort> res;
+  vector<string> res;
 #ifdef _MAC_OS_
   constexpr int kTilde = GLOB_TILDE;
 #else
   constexpr int kTilde = GLOB_TILDE_CHECK;
 #endif
 
-  int rv = glob(path.data(), kTilde, glob_errfunc, &glob_result);
+  string pattern_str(pattern);
+  int rv = glob(pattern_str.c_str(), kTilde, glob_errfunc, &glob_result);
   if (rv) {
     switch (rv) {
       case GLOB_NOSPACE:
@@ -45,12 +46,26 @@ Result<vector<StatShort>> StatFiles(std::string_view path) {
     }
   }
 
+  res.reserve(glob_result.gl_pathc);
+  for (size_t i = 0; i < glob_result.gl_pathc; i++) {
+    res.emplace_back(glob_result.gl_pathv[i]);
+  }
+  globfree(&glob_result);
+
+  return res;
+}
+
+Result<vector<StatShort>> StatFiles(std::string_view path) {
+  Result<vector<string>> paths = Glob(path);
+  if (!paths)
+    return nonstd::make_unexpected(paths.error());
+
+  vector<StatShort> res;
   struct stat sbuf;
 
   // statx is not implemented in musl-dev
-  for (size_t i = 0; i < glob_result.gl_pathc; i++) {
-    char* path = glob_result.gl_pathv[i];
-    if (fstatat(AT_FDCWD, path, &sbuf, 0) == 0) {
+  for (string& path : *paths) {
+    if (fstatat(AT_FDCWD, path.c_str(), &sbuf, 0) == 0) {
 #ifdef _MAC_OS_
       const auto& st_mt = sbuf.st_mtimespec;
 #else
@@ -59,13 +74,12 @@ Result<vector<StatShort>> StatFiles(std::string_view path) {
 
       time_t ns = st_mt.tv_sec * 1000000000ULL + st_mt.tv_nsec;
 
-      StatShort sshort{path, ns, uint64_t(sbuf.st_size), sbuf.st_mode};
+      StatShort sshort{std::move(path), ns, uint64_t(sbuf.st_size), sbuf.st_mode};
       res.emplace_back(std::move(sshort));
     } else {
-      LOG(WARNING) << "Bad stat for " << glob_result.gl_pathv[i] << " " << strerror(errno);
+      LOG(WARNING) << "Bad stat for " << path << " " << strerror(errno);
     }
   }
-  globfree(&glob_result);
 
   return res;
 }
@@ -20,6 +20,9 @@ struct StatShort {
 
 using StatShortVec = std::vector<StatShort>;
 
+// Returns the paths matching the glob pattern, an empty vector if none match.
+Result<std::vector<std::string>> Glob(std::string_view pattern);
+
 Result<StatShortVec> StatFiles(std::string_view path);
 
 // Create a file and write a std::string to it.
@@ -10,11 +10,24 @@
 
 #include "util/connection.h"
 #include "util/fibers/synchronization.h"
+
+struct addrinfo;
+
 namespace util {
 
 class ListenerInterface;
 class ProactorPool;
 
+// How the kernel distributes connections between the listening sockets of a sharded listener.
+enum class AcceptSteering : uint8_t {
+  HASH,          // by the default SO_REUSEPORT hash of the connection 4-tuple.
+  INCOMING_CPU,  // prefers the socket whose proactor runs on the CPU that received the
+                 // connection (SO_INCOMING_CPU). The CPU of a proactor is sampled once, so
+                 // the proactor threads must be pinned, see --proactor_affinity_mode.
+  CPU_BPF,       // a classic BPF program picks socket `cpu % pool size`. Assumes that proactor
+                 // i runs on CPU i, see --proactor_affinity_mode.
+};
+
 class AcceptServer {
   AcceptServer(const AcceptServer&) = delete;
   void operator=(const AcceptServer&) = delete;
@@ -40,6 +53,13 @@ class AcceptServer {
   // Does not check-fail - it's responsibility of the caller to check the error code.
   std::error_code AddListener(const char* bind_addr, uint16_t port, ListenerInterface* listener);
 
+  // Sharded version of AddListener: every proactor of the pool owns a SO_REUSEPORT
+  // listening socket, accepts its share of the connections and handles them in its own
+  // thread instead of handing them over to PickConnectionProactor. Linux only.
+  std::error_code AddShardedListener(const char* bind_addr, uint16_t port,
+                                     ListenerInterface* listener,
+                                     AcceptSteering steering = AcceptSteering::HASH);
+
   // Adds a listener on unix domain sockets.
   std::error_code AddUDSListener(const char* path, mode_t permissions, ListenerInterface* listener);
 
@@ -54,6 +74,11 @@ class AcceptServer {
  private:
   void BreakListeners();
 
+  // Creates a socket on `proactor` that listens on the first suitable address of servinfo.
+  std::error_code OpenListener(const addrinfo* servinfo, ListenerInterface* listener,
+                               bool reuse_port, fb2::ProactorBase* proactor,
+                               std::unique_ptr<FiberSocketBase>* dest);
+
   ProactorPool* pool_;
 
   // Called if a termination signal has been caught (SIGTERM/SIGINT).
@@ -57,7 +57,7 @@ const char* kMaxConnectionsError = "max connections received";
 
 class TestListener : public ListenerInterface {
  public:
-  virtual Connection* NewConnection(ProactorBase* context) final {
+  virtual Connection* NewConnection(ProactorBase* context) override {
     return new TestConnection;
   }
 
@@ -66,6 +66,23 @@ class TestListener : public ListenerInterface {
   }
 };
 
+// Records the threads that handle the connections.
+class ShardedListener : public TestListener {
+ public:
+  Connection* NewConnection(ProactorBase* context) final {
+    EXPECT_TRUE(context->InMyThread());
+    ++new_connections;
+    return TestListener::NewConnection(context);
+  }
+
+  ProactorBase* PickConnectionProactor(FiberSocketBase* sock) final {
+    ++picked;
+    return ListenerInterface::PickConnectionProactor(sock);
+  }
+
+  atomic_uint32_t new_connections{0}, picked{0};
+};
+
 class AcceptServerTest : public testing::Test {
  protected:
   void SetUp() override;
@@ -171,6 +188,46 @@ TEST_F(AcceptServerTest, ConnectionsLimit) {
   ASSERT_EQ(listener_->GetMaxClients(), (1 << 16) - 1);
 }
 
+#ifdef __linux__
+TEST_F(AcceptServerTest, Sharded) {
+  for (AcceptSteering steering :
+       {AcceptSteering::HASH, AcceptSteering::INCOMING_CPU, AcceptSteering::CPU_BPF}) {
+    AcceptServer as{pp_.get(), false};
+    ShardedListener* listener = new ShardedListener;
+    auto ec = as.AddShardedListener("localhost", 0, listener, steering);
+    ASSERT_FALSE(ec) << ec.message();
+    uint16_t port = listener->socket()->LocalEndpoint().port();
+    as.Run();
+
+    constexpr unsigned kClients = 8;
+    vector<unique_ptr<FiberSocketBase>> clients(kClients);
+    for (unsigned i = 0; i < kClients; ++i) {
+      ProactorBase* pb = pp_->at(i % pp_->size());
+      clients[i].reset(pb->CreateSocket());
+      pb->Await([&] {
+        auto address = boost::asio::ip::make_address("127.0.0.1");
+        FiberSocketBase::error_code ec = clients[i]->Connect({address, port});
+        ASSERT_FALSE(ec) << ec;
+
+        // Echo round trip.
+        ASSERT_FALSE(clients[i]->Write(io::Buffer("ping")));
+        uint8_t buf[4];
+        ASSERT_TRUE(clients[i]->Read(io::MutableBytes(buf)));
+        EXPECT_EQ("ping", io::View(io::Bytes(buf, 4)));
+      });
+    }
+
+    EXPECT_EQ(kClients, listener->new_connections);
+    EXPECT_EQ(0u, listener->picked);
+
+    for (auto& client : clients) {
+      client->proactor()->Await([&] { client->Close(); });
+    }
+    as.Stop(true);
+  }
+}
+#endif
+
 TEST_F(AcceptServerTest, UDS) {
 #ifdef __APPLE__
     GTEST_SKIP() << "Skipped AcceptServerTest.UDS test on MacOS";
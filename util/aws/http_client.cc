@@ -3,6 +3,8 @@
 
 #include "util/aws/http_client.h"
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/numbers.h>
 #include <aws/core/http/HttpRequest.h>
 #include <aws/core/http/HttpResponse.h>
 #include <aws/core/http/standard/StandardHttpResponse.h>
@@ -12,12 +14,12 @@
 #include <boost/beast/http/string_body.hpp>
 #include <boost/beast/http/write.hpp>
 #include <boost/interprocess/streams/bufferstream.hpp>
+#include <atomic>
 
 #include "base/logging.h"
 #include "util/asio_stream_adapter.h"
-#include "util/fibers/dns_resolve.h"
+#include "util/http/client_pool.h"
 #include "util/http/http_client.h"
-#include "util/tls/tls_socket.h"
 
 namespace util {
 namespace aws {
@@ -48,14 +50,46 @@ h2::verb BoostMethod(Aws::Http::HttpMethod method) {
   }
 }
 
+// Requests that may be sent once more if the server closed the connection before responding.
+bool IsIdempotent(Aws::Http::HttpMethod method) {
+  return method != Aws::Http::HttpMethod::HTTP_POST &&
+         method != Aws::Http::HttpMethod::HTTP_PATCH;
+}
+
+// The connection pools of the clients in this thread by client id, plain and TLS.
+// The pools are deleted by their clients, those of a stopped proactor are not destroyed
+// when its thread exits because closing their connections requires a running proactor.
+thread_local absl::flat_hash_map<std::pair<uint64_t, bool>, http::ClientPool*> tl_pools;
+
+std::atomic_uint64_t next_client_id{0};
+
 }  // namespace
 
 HttpClient::HttpClient(const Aws::Client::ClientConfiguration& client_conf)
-    : client_conf_{client_conf} {
+    : client_conf_{client_conf}, id_(next_client_id.fetch_add(1, std::memory_order_relaxed)) {
   ctx_ = util::http::TlsClient::CreateSslContext();
 }
 
 HttpClient::~HttpClient() {
+  std::vector<ProactorBase*> proactors;
+  {
+    std::unique_lock lk(mu_);
+    proactors.swap(proactors_);
+  }
+
+  // The pools close their connections in their threads. We do not wait for them, because
+  // a proactor that was stopped would never run the teardown. The pools do not refer to the
+  // client after their connections were established.
+  for (ProactorBase* proactor : proactors) {
+    proactor->Dispatch([id = id_] {
+      for (bool tls : {false, true}) {
+        auto node = tl_pools.extract(std::pair{id, tls});
+        if (!node.empty())
+          delete node.mapped();
+      }
+    });
+  }
+
   SSL_CTX_free(ctx_);
 }
 
@@ -105,78 +139,59 @@ std::shared_ptr<Aws::Http::HttpResponse> HttpClient::MakeRequest(
   std::shared_ptr<Aws::Http::HttpResponse> response =
       std::make_shared<Aws::Http::Standard::StandardHttpResponse>(request);
 
-  // To keep the HTTP client simple and thread safe, reconect on each request.
-  // Given we have large request/responses (8MB) the cost of reconnecting
-  // is negligible.
-  io::Result<std::unique_ptr<FiberSocketBase>> connect_res =
-      Connect(request->GetUri().GetAuthority(), request->GetUri().GetPort(), proactor);
-  if (!connect_res) {
-    response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
-    response->SetClientErrorMessage("Failed to connect to host");
-    return response;
-  }
+  const Aws::Http::URI& uri = request->GetUri();
+  http::ClientPool* pool = GetPool(uri.GetScheme() == Aws::Http::Scheme::HTTPS, proactor);
 
-  std::unique_ptr<FiberSocketBase> conn = std::move(*connect_res);
-  if (request->GetUri().GetScheme() == Aws::Http::Scheme::HTTPS) {
-    std::unique_ptr<util::tls::TlsSocket> tls_conn(
-        std::make_unique<util::tls::TlsSocket>(conn.release()));
-    tls_conn->InitSSL(ctx_);
-
-    const std::string& hn = request->GetUri().GetAuthority();
-    const char* host = hn.c_str();
-    SSL* ssl_handle = tls_conn->ssl_handle();
-    // Add SNI.
-    SSL_set_tlsext_host_name(ssl_handle, host);
-    // Verify server cert using server hostname.
-    SSL_dane_enable(ssl_handle, host);
-    std::error_code ec = tls_conn->Connect(FiberSocketBase::endpoint_type{});
-    if (ec) {
-      LOG(WARNING) << "aws: http clent: tls connect failed; error=" << ec;
+  h2::response<h2::string_body> boost_resp;
+  for (bool retry = true;; retry = false) {
+    io::Result<http::ClientPool::Handle> handle = pool->Acquire(uri.GetAuthority(), uri.GetPort());
+    if (!handle) {
+      LOG(WARNING) << "aws: http client: failed to connect; host=" << uri.GetAuthority()
+                   << "; error=" << handle.error();
       response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
-      tls_conn->Close();
+      response->SetClientErrorMessage("Failed to connect to host");
       return response;
     }
-    conn.reset(tls_conn.release());
-  }
 
-  boost::system::error_code bec;
-  AsioStreamAdapter<> adapter(*conn);
-  h2::write(adapter, boost_req, bec);
-  if (bec) {
-    LOG(WARNING) << "aws: http client: failed to send request; method="
-                 << Aws::Http::HttpMethodMapper::GetNameForHttpMethod(request->GetMethod())
-                 << "; url=" << request->GetUri().GetURIString() << "; error=" << bec;
-    response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
-    conn->Close();
-    return response;
-  }
+    // The server might have closed a pooled connection meanwhile, then the request is sent
+    // once more on a new connection. Sending does not consume the body.
+    retry = retry && handle->reused();
+    http::Client* client = handle->client();
+
+    std::error_code ec = client->Send(boost_req);
+    // As described above, if we have a known type write the body directly
+    // without copying (the headers are written in Send).
+    if (!ec && buf_body) {
+      auto [buf, size] = buf_body->buffer();
+      ec = client->socket()->Write(io::Bytes{reinterpret_cast<const uint8_t*>(buf), size});
+    }
+    if (ec) {
+      if (retry)
+        continue;
+
+      LOG(WARNING) << "aws: http client: failed to send request; method="
+                   << Aws::Http::HttpMethodMapper::GetNameForHttpMethod(request->GetMethod())
+                   << "; url=" << uri.GetURIString() << "; error=" << ec;
+      response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
+      return response;
+    }
 
-  std::error_code ec;
-  // As described above, if we have a known type write the body directly
-  // without copying (the headers are written in h2::write.
-  if (buf_body) {
-    auto [buf, size] = buf_body->buffer();
-    ec = conn->Write(io::Bytes{reinterpret_cast<const uint8_t*>(buf), size});
+    ec = client->Recv(&boost_resp);
     if (ec) {
-      LOG(WARNING) << "aws: http client: failed to send request body; method="
+      if (retry && IsIdempotent(request->GetMethod())) {
+        boost_resp = {};
+        continue;
+      }
+
+      LOG(WARNING) << "aws: http client: failed to read response; method="
                    << Aws::Http::HttpMethodMapper::GetNameForHttpMethod(request->GetMethod())
-                   << "; url=" << request->GetUri().GetURIString() << "; error=" << ec;
+                   << "; url=" << uri.GetURIString() << "; error=" << ec;
       response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
-      conn->Close();
       return response;
     }
-  }
 
-  h2::response<h2::string_body> boost_resp;
-  boost::beast::flat_buffer buf;
-  h2::read(adapter, buf, boost_resp, bec);
-  if (bec) {
-    LOG(WARNING) << "aws: http client: failed to read response; method="
-                 << Aws::Http::HttpMethodMapper::GetNameForHttpMethod(request->GetMethod())
-                 << "; url=" << request->GetUri().GetURIString() << "; error=" << bec;
-    response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
-    conn->Close();
-    return response;
+    handle->set_keep_alive(boost_req.keep_alive() && boost_resp.keep_alive());
+    break;
   }
 
   response->SetResponseCode(static_cast<Aws::Http::HttpResponseCode>(boost_resp.result_int()));
@@ -191,8 +206,6 @@ std::shared_ptr<Aws::Http::HttpResponse> HttpClient::MakeRequest(
     DVLOG(2) << "aws: http client: response; header=" << h.first << "=" << h.second;
   }
 
-  conn->Close();
-
   return response;
 }
 
@@ -214,62 +227,27 @@ void HttpClient::RetryRequestSleep(std::chrono::milliseconds sleep_time) {
   ThisFiber::SleepFor(sleep_time);
 }
 
-io::Result<std::unique_ptr<FiberSocketBase>> HttpClient::Connect(const std::string& host,
-                                                                 uint16_t port,
-                                                                 ProactorBase* proactor) const {
-  VLOG(1) << "aws: http client: connecting; host=" << host << "; port=" << port;
-
-  io::Result<boost::asio::ip::address> addr = Resolve(host, proactor);
-  if (!addr) {
-    return nonstd::make_unexpected(addr.error());
-  }
-
-  std::unique_ptr<FiberSocketBase> socket;
-  socket.reset(proactor->CreateSocket());
-  FiberSocketBase::endpoint_type ep{*addr, port};
-  std::error_code ec = socket->Connect(ep);
-  if (ec) {
-    LOG(WARNING) << "aws: http client: failed to connect; host=" << host << "; error=" << ec;
-    socket->Close();
-    return nonstd::make_unexpected(ec);
-  }
-
-  VLOG(1) << "aws: http client: connected; host=" << host << "; port=" << port;
+http::ClientPool* HttpClient::GetPool(bool tls, ProactorBase* proactor) const {
+  http::ClientPool*& pool = tl_pools[{id_, tls}];
+  if (pool)
+    return pool;
 
+  http::ClientPoolOptions opts;
+  opts.max_connections = client_conf_.maxConnections;
+  opts.connect_timeout_ms = client_conf_.connectTimeoutMs;
+  opts.ssl_ctx = tls ? ctx_ : nullptr;
   if (client_conf_.enableTcpKeepAlive) {
-    ec = EnableKeepAlive(socket->native_handle());
-    if (ec) {
+    opts.on_connect = [this](int fd) {
+      std::error_code ec = EnableKeepAlive(fd);
       // Log the error but we still continue with the request.
-      LOG(ERROR) << "aws: http client: failed to enable tcp keep alive; error=" << ec;
-    } else {
-      DVLOG(2) << "aws: http client: enabled tcp keep alive";
-    }
+      LOG_IF(ERROR, ec) << "aws: http client: failed to enable tcp keep alive; error=" << ec;
+    };
   }
+  pool = new http::ClientPool(proactor, opts);
 
-  return socket;
-}
-
-io::Result<boost::asio::ip::address> HttpClient::Resolve(const std::string& host,
-                                                         ProactorBase* proactor) const {
-  VLOG(1) << "aws: http client: resolving host; host=" << host;
-
-  char ip[INET_ADDRSTRLEN];
-  std::error_code ec = fb2::DnsResolve(host.data(), client_conf_.connectTimeoutMs, ip, proactor);
-  if (ec) {
-    LOG(WARNING) << "aws: http client: failed to resolve host; host=" << host << "; error=" << ec;
-    return nonstd::make_unexpected(ec);
-  }
-
-  boost::system::error_code bec;
-  boost::asio::ip::address address = boost::asio::ip::make_address(ip, bec);
-  if (bec) {
-    LOG(ERROR) << "aws: http client: resolved invalid address; error=" << ec;
-    return nonstd::make_unexpected(ec);
-  }
-
-  VLOG(1) << "aws: http client: resolved host; host=" << host << "; ip=" << address;
-
-  return address;
+  std::unique_lock lk(mu_);
+  proactors_.push_back(proactor);
+  return pool;
 }
 
 std::error_code HttpClient::EnableKeepAlive(int fd) const {
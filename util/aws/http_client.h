@@ -10,17 +10,26 @@
 #include <boost/beast/core/flat_buffer.hpp>
 
 #include "util/fibers/proactor_base.h"
+#include "util/fibers/synchronization.h"
 
 namespace util {
+
+namespace http {
+class ClientPool;
+}  // namespace http
+
 namespace aws {
 
 // HTTP client manages connecting to and sending HTTP requests.
 //
-// This is stateless so can be accessed by multiple threads.
+// The connections are kept alive in a pool per proactor thread, so the client can be accessed
+// by multiple threads without locking.
 class HttpClient : public Aws::Http::HttpClient {
  public:
   HttpClient(const Aws::Client::ClientConfiguration& client_conf);
 
+  // Closes the connection pools in their proactor threads without waiting for them.
+  // The pools of stopped proactors are leaked.
   ~HttpClient();
 
   HttpClient(const HttpClient&) = delete;
@@ -46,17 +55,22 @@ class HttpClient : public Aws::Http::HttpClient {
   void RetryRequestSleep(std::chrono::milliseconds sleep_time) override;
 
  private:
-  io::Result<std::unique_ptr<FiberSocketBase>> Connect(const std::string& host, uint16_t port,
-                                                       ProactorBase* proactor) const;
-
-  io::Result<boost::asio::ip::address> Resolve(const std::string& host,
-                                               ProactorBase* proactor) const;
+  // Returns the connection pool of the calling proactor thread, creates it on first use.
+  http::ClientPool* GetPool(bool tls, ProactorBase* proactor) const;
 
   std::error_code EnableKeepAlive(int fd) const;
 
   Aws::Client::ClientConfiguration client_conf_;
 
   SSL_CTX* ctx_;
+
+  // Identifies the pools of this client. Unlike its address, it is not reused by later clients
+  // while the pools of this one are being destroyed.
+  const uint64_t id_;
+
+  // The proactors that have pools of this client, which are destroyed in their threads.
+  mutable fb2::Mutex mu_;
+  mutable std::vector<ProactorBase*> proactors_;
 };
 
 }  // namespace aws
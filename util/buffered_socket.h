@@ -0,0 +1,102 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+#include "base/io_buf.h"
+#include "util/fiber_socket_base.h"
+
+namespace util {
+
+// Buffers reads and writes of a FiberSocketBase for protocol handlers.
+//
+// The read side keeps the received data in a growable buffer that parsers inspect in place
+// with Peek/ReadUntil and then Consume. The write side accumulates buffers as io vectors
+// and Flush passes them to FiberSocketBase::Write, up to IOV_MAX vectors per call.
+// Recv/WriteSome have the signatures of FiberSocketBase, so the wrapper can be plugged
+// into AsioStreamAdapter<BufferedSocket> for Beast.
+//
+// Does not own the socket. Must be used from the socket proactor thread.
+class BufferedSocket {
+  BufferedSocket(const BufferedSocket&) = delete;
+  void operator=(const BufferedSocket&) = delete;
+
+ public:
+  using error_code = std::error_code;
+
+  explicit BufferedSocket(FiberSocketBase* sock, size_t read_capacity = 4096);
+
+  FiberSocketBase* socket() {
+    return sock_;
+  }
+
+  // Returns the buffered input. The view is valid until the next call that reads or consumes.
+  io::Bytes Peek() const {
+    return read_buf_.InputBuffer();
+  }
+
+  // Same, for parsers that modify the input in place.
+  io::MutableBytes Peek() {
+    return read_buf_.InputBuffer();
+  }
+
+  void Consume(size_t len) {
+    read_buf_.ConsumeInput(len);
+  }
+
+  // Receives more data into the buffer, suspending until at least one byte arrives.
+  // Returns the number of received bytes.
+  io::Result<size_t> Fill();
+
+  // Fills until at least `len` bytes are buffered.
+  error_code FillAtLeast(size_t len);
+
+  // Returns the buffered input up to and including the first occurrence of delim, receiving
+  // more data as needed. The result is not consumed. Fails with errc::message_size if
+  // delim is not found within max_len bytes.
+  io::Result<io::Bytes> ReadUntil(std::string_view delim, size_t max_len = 1U << 20);
+
+  // Reads into the io vectors: the buffered input first, otherwise straight from the socket
+  // if the request is larger than the buffer or via Fill if it is smaller.
+  io::Result<size_t> Recv(const iovec* v, size_t len);
+
+  // Queues `buf` for writing without copying it. buf must stay valid until Flush.
+  void Enqueue(io::Bytes buf);
+
+  // Queues a copy of `buf` for writing.
+  void EnqueueCopy(io::Bytes buf);
+
+  // Writes all the queued buffers.
+  error_code Flush();
+
+  // Bytes queued for writing.
+  size_t PendingWrite() const {
+    return pending_len_;
+  }
+
+  // Flushes the queued buffers followed by the io vectors if anything is queued,
+  // otherwise writes directly to the socket.
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len);
+
+ private:
+  struct WriteEntry {
+    const uint8_t* data;  // nullptr for copies, then `offset` points into write_buf_.
+    size_t offset;
+    size_t len;
+  };
+
+  FiberSocketBase* sock_;
+  base::IoBuf read_buf_;
+  size_t read_capacity_;
+
+  std::vector<WriteEntry> write_q_;
+  base::IoBuf write_buf_;  // holds the copied buffers.
+  std::vector<iovec> iovs_;
+  size_t pending_len_ = 0;
+};
+
+}  // namespace util
@@ -9,6 +9,7 @@
 // for tcp::endpoint. Consider introducing our own.
 #include <boost/asio/ip/tcp.hpp>
 #include <functional>
+#include <memory>
 
 #include "io/io.h"
 
@@ -25,10 +26,11 @@ class FiberSocketBase : public io::Sink, public io::AsyncSink, public io::Source
   FiberSocketBase& operator=(FiberSocketBase&& other) = delete;
 
  protected:
-  explicit FiberSocketBase(fb2::ProactorBase* pb) : proactor_(pb) {
-  }
+  explicit FiberSocketBase(fb2::ProactorBase* pb);
 
  public:
+  virtual ~FiberSocketBase();
+
   using endpoint_type = ::boost::asio::ip::tcp::endpoint;
   using error_code = std::error_code;
   using AcceptResult = ::io::Result<FiberSocketBase*>;
@@ -75,6 +77,30 @@ class FiberSocketBase : public io::Sink, public io::AsyncSink, public io::Source
     return timeout_;
   }
 
+  //! Sends up to `len` bytes of the file `fd` starting from `offset` without changing
+  //! the file position. Returns the number of bytes sent, which is less than `len` only if
+  //! the end of file was reached. Engines that can not move data directly from the file
+  //! to the socket read it into a temporary buffer and write it.
+  virtual ::io::Result<size_t> SendFile(int fd, off_t offset, size_t len);
+
+  //! Writes of at least `bytes` bytes use zero-copy sends if the engine supports them,
+  //! 0 disables zero-copy. Such writes return only after the kernel released the buffers.
+  //! Engines without zero-copy support keep copying the data.
+  virtual void SetZeroCopyThreshold(uint32_t bytes) {
+  }
+
+  //! Enables write coalescing: WriteSome copies the data into a pending buffer and returns
+  //! immediately. The buffer is sent with a single write once it reaches `threshold` bytes
+  //! or when the proactor finishes running the ready fibers of the current loop iteration.
+  //! AsyncWriteSome joins the pending buffer as well, SendFile and Shutdown flush it first.
+  //! Errors of the background writes are reported by the following writes.
+  //! 0 disables corking after flushing the pending data. If the flush times out, the socket
+  //! is shut down. Must be called from the socket thread.
+  void SetCork(uint32_t threshold);
+
+  //! Sends the pending corked data and waits until it is written, at most timeout() millis.
+  error_code FlushCork();
+
   using AsyncSink::AsyncWrite;
   using AsyncSink::AsyncWriteSome;
 
@@ -129,11 +155,34 @@ class FiberSocketBase : public io::Sink, public io::AsyncSink, public io::Source
   virtual void OnResetProactor() {
   }
 
+  // Engines route WriteSome calls to CorkedWrite when it returns true, and asynchronous
+  // writes to CorkedAsyncWrite. Other writes call FlushCork first.
+  bool IsCorked() const {
+    return cork_ && !IsCorkFlusher();
+  }
+
+  ::io::Result<size_t> CorkedWrite(const iovec* v, uint32_t len);
+
+  // Does not block: the buffer is sent in the background even if it reached the threshold.
+  void CorkedAsyncWrite(const iovec* v, uint32_t len, AsyncWriteCb cb);
+
  private:
+  struct CorkState;
+
+  static void OnCorkTickEnd(void* arg);
+
+  bool IsCorkFlusher() const;
+  size_t AppendCorked(const iovec* v, uint32_t len);
+  void ScheduleCorkFlush();
+  void StartCorkFlush();
+  void AsyncCorkWrite();
+  void OnCorkFlushed(error_code ec);
+
   // We must reference proactor in each socket so that we could support write_some/read_some
   // with predefined interface and be compliant with SyncWriteStream/SyncReadStream concepts.
   ProactorBase* proactor_;
   uint32_t timeout_ = UINT32_MAX;
+  std::unique_ptr<CorkState> cork_;
 };
 
 class LinuxSocketBase : public FiberSocketBase {
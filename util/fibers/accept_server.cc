@@ -4,8 +4,14 @@
 
 #include "util/accept_server.h"
 
+#include <absl/base/macros.h>
 #include <signal.h>
 
+#ifdef __linux__
+#include <linux/filter.h>
+#include <sched.h>
+#endif
+
 #include "base/logging.h"
 #include "util/fiber_socket_base.h"
 #include "util/listener_interface.h"
@@ -83,13 +89,11 @@ unsigned short AcceptServer::AddListener(unsigned short port, ListenerInterface*
   return ep.port();
 }
 
-error_code AcceptServer::AddListener(const char* bind_addr, uint16_t port,
-                                     ListenerInterface* listener) {
-  CHECK(listener && !listener->socket());
-  CHECK(!was_run_);
+namespace {
 
+error_code Resolve(const char* bind_addr, uint16_t port, addrinfo** servinfo) {
   char str_port[16];
-  struct addrinfo hints, *servinfo;
+  struct addrinfo hints;
 
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_UNSPEC;
@@ -97,26 +101,48 @@ error_code AcceptServer::AddListener(const char* bind_addr, uint16_t port,
   hints.ai_flags = AI_PASSIVE; /* Tuned for binding, see man getaddrinfo. */
 
   absl::numbers_internal::FastIntToBuffer(port, str_port);
-  int res = getaddrinfo(bind_addr, str_port, &hints, &servinfo);
+  int res = getaddrinfo(bind_addr, str_port, &hints, servinfo);
   if (res != 0) {
     const char* errmsg = gai_strerror(res);
     LOG(ERROR) << "Error resolving address " << bind_addr << ": " << errmsg;
     return make_error_code(errc::address_not_available);
   }
-  CHECK(servinfo);
+  CHECK(*servinfo);
+  return error_code{};
+}
 
-  ProactorBase* next = pool_->GetNextProactor();
+#ifdef __linux__
 
-  unique_ptr<FiberSocketBase> fs{next->CreateSocket()};
+// Steers connections to socket `cpu % num_socks` of the SO_REUSEPORT group.
+error_code AttachCpuBpf(int fd, unsigned num_socks) {
+  struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t(SKF_AD_OFF + SKF_AD_CPU)},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_socks},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog = {.len = ABSL_ARRAYSIZE(code), .filter = code};
+
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+    return error_code{errno, system_category()};
+  return error_code{};
+}
+
+#endif
+
+}  // namespace
+
+error_code AcceptServer::OpenListener(const addrinfo* servinfo, ListenerInterface* listener,
+                                      bool reuse_port, ProactorBase* proactor,
+                                      unique_ptr<FiberSocketBase>* dest) {
+  unique_ptr<FiberSocketBase> fs{proactor->CreateSocket()};
   DCHECK(fs);
 
   error_code ec;
-  bool success = false;
   int family_pref[2] = {AF_INET, AF_INET6};
 
   // Try ip4 first
-  for (unsigned j = 0; j < 2 && !success; ++j) {
-    for (addrinfo* p = servinfo; p != NULL; p = p->ai_next) {
+  for (unsigned j = 0; j < 2; ++j) {
+    for (const addrinfo* p = servinfo; p != NULL; p = p->ai_next) {
       if (p->ai_family != family_pref[j])
         continue;
 
@@ -128,23 +154,46 @@ error_code AcceptServer::AddListener(const char* bind_addr, uint16_t port,
       if (ec)
         break;
 
+      if (reuse_port) {
+        const int val = 1;
+        if (setsockopt(fs->native_handle(), SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0) {
+          ec.assign(errno, system_category());
+          break;
+        }
+      }
+
       ec = fs->Bind(p->ai_addr, p->ai_addrlen);
       if (ec)
         break;
       ec = fs->Listen(backlog_);
       if (!ec) {
-        const char* safe_bind = bind_addr ? bind_addr : "";
-        VLOG(1) << "AddListener [" << fs->native_handle() << "] family: " << p->ai_family << " "
-                << safe_bind << ":" << port;
-        success = true;
-        break;
+        VLOG(1) << "AddListener [" << fs->native_handle() << "] family: " << p->ai_family;
+        *dest = std::move(fs);
+        return ec;
       }
     }
   }
 
+  return ec ? ec : make_error_code(errc::address_family_not_supported);
+}
+
+error_code AcceptServer::AddListener(const char* bind_addr, uint16_t port,
+                                     ListenerInterface* listener) {
+  CHECK(listener && !listener->socket());
+  CHECK(!was_run_);
+
+  struct addrinfo* servinfo;
+  error_code ec = Resolve(bind_addr, port, &servinfo);
+  if (ec)
+    return ec;
+
+  unique_ptr<FiberSocketBase> fs;
+  ec = OpenListener(servinfo, listener, false, pool_->GetNextProactor(), &fs);
   freeaddrinfo(servinfo);
 
-  if (success) {
+  if (!ec) {
+    const char* safe_bind = bind_addr ? bind_addr : "";
+    VLOG(1) << "Listening on " << safe_bind << ":" << port;
     listener->RegisterPool(pool_);
     listener->sock_ = std::move(fs);
     list_interface_.emplace_back(listener);
@@ -153,6 +202,82 @@ error_code AcceptServer::AddListener(const char* bind_addr, uint16_t port,
   return ec;
 }
 
+error_code AcceptServer::AddShardedListener(const char* bind_addr, uint16_t port,
+                                            ListenerInterface* listener,
+                                            AcceptSteering steering) {
+  CHECK(listener && !listener->socket());
+  CHECK(!was_run_);
+
+#ifdef __linux__
+  struct addrinfo* servinfo;
+  error_code ec = Resolve(bind_addr, port, &servinfo);
+  if (ec)
+    return ec;
+
+  vector<unique_ptr<FiberSocketBase>> socks(pool_->size());
+  for (unsigned i = 0; i < socks.size(); ++i) {
+    ProactorBase* pb = pool_->at(i);
+    ec = OpenListener(servinfo, listener, true, pb, &socks[i]);
+    if (ec)
+      break;
+
+    // The rest of the shards must bind to the port that the kernel chose for the first one.
+    if (i == 0 && port == 0) {
+      port = socks[0]->LocalEndpoint().port();
+      freeaddrinfo(servinfo);
+      servinfo = nullptr;
+      ec = Resolve(bind_addr, port, &servinfo);
+      if (ec)
+        break;
+    }
+
+    if (steering == AcceptSteering::INCOMING_CPU) {
+      // An unpinned thread migrates, so the CPU we sample is only a hint.
+      auto [cpu, pinned] = pb->Await([] {
+        cpu_set_t cps;
+        bool pinned = sched_getaffinity(0, sizeof(cps), &cps) == 0 && CPU_COUNT(&cps) == 1;
+        return make_pair(sched_getcpu(), pinned);
+      });
+      LOG_IF(WARNING, !pinned) << "Proactor " << i << " is not pinned to a CPU, "
+                               << "INCOMING_CPU steering may send connections to other threads";
+      int fd = socks[i]->native_handle();
+      if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        ec.assign(errno, system_category());
+        break;
+      }
+    }
+  }
+  if (servinfo)
+    freeaddrinfo(servinfo);
+
+  if (!ec && steering == AcceptSteering::CPU_BPF) {
+    ec = AttachCpuBpf(socks[0]->native_handle(), socks.size());
+  }
+
+  if (ec) {
+    for (auto& sock : socks) {
+      if (sock)
+        sock->proactor()->Await([&] { (void)sock->Close(); });
+    }
+    return ec;
+  }
+
+  VLOG(1) << "Listening on " << (bind_addr ? bind_addr : "") << ":" << port << " with "
+          << socks.size() << " shards";
+
+  listener->RegisterPool(pool_);
+  listener->sock_ = std::move(socks[0]);
+  listener->shard_socks_.assign(make_move_iterator(socks.begin() + 1),
+                                make_move_iterator(socks.end()));
+  listener->sharded_ = true;
+  list_interface_.emplace_back(listener);
+
+  return ec;
+#else
+  return make_error_code(errc::operation_not_supported);
+#endif
+}
+
 error_code AcceptServer::AddUDSListener(const char* path, mode_t permissions,
                                         ListenerInterface* listener) {
   CHECK(listener && !listener->socket());
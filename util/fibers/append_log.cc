@@ -0,0 +1,271 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/append_log.h"
+
+#include <absl/crc/crc32c.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/endian.h"
+#include "base/logging.h"
+#include "util/fibers/uring_proactor.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+using nonstd::make_unexpected;
+
+namespace {
+
+constexpr size_t kAlign = 4096;
+
+uint32_t RecordCrc(const uint8_t* header, io::Bytes payload) {
+  absl::crc32c_t crc = absl::ComputeCrc32c(io::View(io::Bytes{header, 4}));
+  return uint32_t(absl::ExtendCrc32c(crc, io::View(payload)));
+}
+
+}  // namespace
+
+AppendLog::AppendLog(unique_ptr<LinuxFile> file, UringProactor* proactor, const Options& opts)
+    : file_(std::move(file)),
+      proactor_(proactor),
+      opts_(opts),
+      pending_(kAlign, align_val_t{kAlign}),
+      flushing_(kAlign, align_val_t{kAlign}) {
+}
+
+AppendLog::~AppendLog() {
+  if (file_) {
+    error_code ec = Close();
+    LOG_IF(WARNING, ec) << "Error closing append log " << ec.message();
+  }
+}
+
+auto AppendLog::Open(string_view path, const Options& opts) -> io::Result<unique_ptr<AppendLog>> {
+  ProactorBase* me = ProactorBase::me();
+  DCHECK(me->GetKind() == ProactorBase::IOURING);
+  UringProactor* p = static_cast<UringProactor*>(CHECK_NOTNULL(me));
+
+  auto file = OpenLinux(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (!file)
+    return make_unexpected(file.error());
+
+  // Find the end of the last valid record.
+  AppendLogReader reader(file->get());
+  string record;
+  while (true) {
+    io::Result<bool> res = reader.Next(&record);
+    if (!res)
+      return make_unexpected(res.error());
+    if (!*res)
+      break;
+  }
+
+  int fd = (*file)->fd();
+  struct stat sb;
+  if (fstat(fd, &sb) < 0)
+    return make_unexpected(error_code{errno, system_category()});
+
+  if (size_t(sb.st_size) > reader.offset()) {
+    LOG(WARNING) << "Truncating " << sb.st_size - reader.offset() << " bytes of the torn tail of "
+                 << path;
+    if (ftruncate(fd, reader.offset()) < 0)
+      return make_unexpected(error_code{errno, system_category()});
+  }
+
+  unique_ptr<AppendLog> log(new AppendLog(std::move(*file), p, opts));
+  error_code ec = log->Init(reader.offset());
+  if (ec)
+    return make_unexpected(ec);
+
+  log->flush_fb_ = Fiber("append_log_flush", [log = log.get()] { log->FlushLoop(); });
+  return log;
+}
+
+error_code AppendLog::Init(size_t file_end) {
+  file_end_ = file_end;
+  tail_len_ = file_end % kAlign;
+
+  if (tail_len_ > 0) {
+    pending_.EnsureCapacity(tail_len_);
+    iovec v{.iov_base = pending_.AppendBuffer().data(), .iov_len = tail_len_};
+    error_code ec = file_->Read(&v, 1, file_end - tail_len_, 0);
+    if (ec)
+      return ec;
+    pending_.CommitWrite(tail_len_);
+  }
+  return error_code{};
+}
+
+error_code AppendLog::Append(io::Bytes record) {
+  if (record.size() > kMaxRecordSize)
+    return make_error_code(errc::message_size);
+  if (closing_)
+    return make_error_code(errc::operation_canceled);
+
+  // Close waits for the appends in flight to return, after that the log may be destroyed.
+  ++appends_;
+
+  // The records that arrive while a full group is being committed wait for the commit,
+  // so the next group does not grow without bounds.
+  commit_ec_.await(
+      [this] { return PendingBytes() < opts_.max_batch_bytes || closing_ || bool(ec_); });
+
+  error_code ec = ec_;
+  if (closing_) {
+    ec = make_error_code(errc::operation_canceled);
+  } else if (!ec) {
+    uint8_t header[kHeaderSize];
+    base::LE::StoreT<uint32_t>(record.size(), header);
+    base::LE::StoreT<uint32_t>(RecordCrc(header, record), header + 4);
+
+    pending_.WriteAndCommit(header, kHeaderSize);
+    pending_.WriteAndCommit(record.data(), record.size());
+
+    uint64_t group = next_group_;
+    flush_ec_.notify();
+    commit_ec_.await([&] { return committed_group_ >= group; });
+    ec = ec_;
+  }
+
+  if (--appends_ == 0 && closing_)
+    commit_ec_.notifyAll();
+
+  return ec;
+}
+
+error_code AppendLog::Close() {
+  if (!file_)
+    return ec_;
+
+  // The records of the appends in flight are already pending, the flush fiber commits them
+  // before it exits.
+  closing_ = true;
+  flush_ec_.notify();
+  flush_fb_.JoinIfNeeded();
+  commit_ec_.await([this] { return appends_ == 0; });
+
+  error_code ec = file_->Close();
+  file_.reset();
+
+  return ec_ ? ec_ : ec;
+}
+
+void AppendLog::FlushLoop() {
+  while (true) {
+    flush_ec_.await([this] { return PendingBytes() > 0 || closing_; });
+    if (PendingBytes() == 0)  // closing
+      break;
+
+    // Give other fibers a chance to join the group.
+    if (opts_.max_delay_usec && !closing_ && PendingBytes() < opts_.max_batch_bytes) {
+      auto tp = chrono::steady_clock::now() + chrono::microseconds(opts_.max_delay_usec);
+      flush_ec_.await_until(
+          [this] { return PendingBytes() >= opts_.max_batch_bytes || closing_; }, tp);
+    }
+
+    Commit();
+  }
+}
+
+void AppendLog::Commit() {
+  uint64_t group = next_group_++;
+  size_t write_offs = file_end_ - tail_len_;
+
+  // New records go into pending_ while the group is being written. They are preceded by
+  // the tail of the last partial block, so the next write starts aligned as well.
+  std::swap(pending_, flushing_);
+  size_t new_end = write_offs + flushing_.InputLen();
+  tail_len_ = new_end % kAlign;
+  DCHECK_EQ(0u, pending_.InputLen());
+  if (tail_len_) {
+    io::Bytes data = flushing_.InputBuffer();
+    pending_.WriteAndCommit(data.data() + data.size() - tail_len_, tail_len_);
+  }
+
+  if (!ec_) {
+    io::Bytes data = flushing_.InputBuffer();
+    int fd = file_->fd();
+
+    FiberChain chain(proactor_, 2);
+    chain.Next().PrepWrite(fd, data.data(), data.size(), write_offs);
+    chain.Next().PrepFSync(fd, IORING_FSYNC_DATASYNC);
+    const FiberChain::IoResult* res = chain.Get();
+
+    if (res[0] < 0) {
+      ec_ = error_code{-res[0], system_category()};
+    } else if (size_t(res[0]) < data.size()) {
+      // A short write cancels the linked fdatasync, so we finish both here.
+      ec_ = file_->Write(data.subspan(res[0]), write_offs + res[0], 0);
+      if (!ec_) {
+        FiberCall fc(proactor_);
+        fc->PrepFSync(fd, IORING_FSYNC_DATASYNC);
+        FiberCall::IoResult sync_res = fc.Get();
+        if (sync_res < 0)
+          ec_ = error_code{-sync_res, system_category()};
+      }
+    } else if (res[1] < 0) {
+      ec_ = error_code{-res[1], system_category()};
+    }
+
+    LOG_IF(ERROR, ec_) << "Append log commit failed: " << ec_.message();
+  }
+
+  if (!ec_)
+    file_end_ = new_end;
+
+  flushing_.Clear();
+  committed_group_ = group;
+  commit_ec_.notifyAll();
+}
+
+io::Result<bool> AppendLogReader::Next(string* dest) {
+  uint8_t header[AppendLog::kHeaderSize];
+  io::Result<size_t> res = ReadFull(offset_, header, sizeof(header));
+  if (!res)
+    return make_unexpected(res.error());
+  if (*res < sizeof(header))
+    return false;
+
+  uint32_t len = base::LE::LoadT<uint32_t>(header);
+  uint32_t crc = base::LE::LoadT<uint32_t>(header + 4);
+  if (len > AppendLog::kMaxRecordSize)
+    return false;
+
+  dest->resize(len);
+  uint8_t* payload = reinterpret_cast<uint8_t*>(dest->data());
+  res = ReadFull(offset_ + sizeof(header), payload, len);
+  if (!res)
+    return make_unexpected(res.error());
+  if (*res < len)
+    return false;
+
+  if (RecordCrc(header, io::Bytes{payload, len}) != crc) {
+    VLOG(1) << "Checksum mismatch at offset " << offset_;
+    return false;
+  }
+
+  offset_ += sizeof(header) + len;
+  return true;
+}
+
+io::Result<size_t> AppendLogReader::ReadFull(size_t offset, uint8_t* dest, size_t len) {
+  size_t read = 0;
+  while (read < len) {
+    iovec v{.iov_base = dest + read, .iov_len = len - read};
+    io::Result<size_t> res = file_->ReadSome(&v, 1, offset + read, 0);
+    if (!res)
+      return res;
+    if (*res == 0)  // eof
+      break;
+    read += *res;
+  }
+  return read;
+}
+
+}  // namespace fb2
+}  // namespace util
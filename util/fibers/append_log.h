@@ -0,0 +1,129 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "base/io_buf.h"
+#include "util/fibers/fiber2.h"
+#include "util/fibers/synchronization.h"
+#include "util/fibers/uring_file.h"
+
+namespace util {
+namespace fb2 {
+
+class UringProactor;
+
+// Append-only log of checksummed records with group commit. Many fibers may call Append
+// concurrently: their records are coalesced into a single write that starts at a 4K aligned
+// offset, followed by a linked fdatasync, and all the fibers of the group are woken up
+// once the group is durable.
+//
+// Each record is framed as: 4 bytes length | 4 bytes CRC32C of length and payload | payload.
+// Integers are stored in little endian.
+//
+// Must be opened and used in the context of the same uring proactor thread.
+class AppendLog {
+  AppendLog(const AppendLog&) = delete;
+  void operator=(const AppendLog&) = delete;
+
+ public:
+  static constexpr size_t kHeaderSize = 8;
+  static constexpr size_t kMaxRecordSize = 1U << 30;
+
+  struct Options {
+    // How long a commit group waits for more records before it is written.
+    uint32_t max_delay_usec = 200;
+
+    // A commit group is written right away once it accumulates that many bytes. Appends wait
+    // while the next group is that large and the previous one is still being committed.
+    uint32_t max_batch_bytes = 1U << 20;
+  };
+
+  // Opens or creates the log. The existing records are verified and a torn tail left
+  // by a crash is truncated, so that new records follow the last valid one.
+  static io::Result<std::unique_ptr<AppendLog>> Open(std::string_view path, const Options& opts);
+
+  static io::Result<std::unique_ptr<AppendLog>> Open(std::string_view path) {
+    return Open(path, Options{});
+  }
+
+  ~AppendLog();
+
+  // Appends the record and suspends until the commit group it belongs to is durable.
+  // After a failed commit the log is broken and all the following calls fail.
+  // Fails with operation_canceled once Close was called and with message_size if the record
+  // is larger than kMaxRecordSize.
+  std::error_code Append(io::Bytes record);
+
+  // Waits for the pending records to become durable and for the appends in flight to return,
+  // then closes the file.
+  std::error_code Close();
+
+  // The durable size of the log in bytes.
+  size_t size() const {
+    return file_end_;
+  }
+
+ private:
+  AppendLog(std::unique_ptr<LinuxFile> file, UringProactor* proactor, const Options& opts);
+
+  // Loads the tail of the last partial block so that the next write starts aligned.
+  std::error_code Init(size_t file_end);
+
+  void FlushLoop();
+  void Commit();
+
+  size_t PendingBytes() const {
+    return pending_.InputLen() - tail_len_;
+  }
+
+  std::unique_ptr<LinuxFile> file_;
+  UringProactor* proactor_;
+  Options opts_;
+
+  // Records of the accumulating group, preceded by tail_len_ bytes of the last partial block
+  // that are already in the file.
+  base::IoBuf pending_;
+  base::IoBuf flushing_;
+  size_t tail_len_ = 0;
+  size_t file_end_ = 0;
+
+  uint64_t next_group_ = 1;
+  uint64_t committed_group_ = 0;
+  unsigned appends_ = 0;  // Append calls in flight.
+  bool closing_ = false;
+  std::error_code ec_;
+
+  EventCount flush_ec_, commit_ec_;
+  Fiber flush_fb_;
+};
+
+// Reads records of an AppendLog sequentially and verifies their checksums.
+class AppendLogReader {
+ public:
+  explicit AppendLogReader(LinuxFile* file) : file_(file) {
+  }
+
+  // Reads the next record into dest. Returns false when the valid part of the log ends:
+  // at EOF or at the first incomplete or corrupted record.
+  io::Result<bool> Next(std::string* dest);
+
+  // The end offset of the last valid record.
+  size_t offset() const {
+    return offset_;
+  }
+
+ private:
+  // Returns the number of bytes read, less than len only at EOF.
+  io::Result<size_t> ReadFull(size_t offset, uint8_t* dest, size_t len);
+
+  LinuxFile* file_;
+  size_t offset_ = 0;
+};
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,176 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/buffered_socket.h"
+
+#include <limits.h>
+
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace util {
+
+using namespace std;
+using nonstd::make_unexpected;
+
+namespace {
+
+// Do not bother receiving into less than that.
+constexpr size_t kMinRecvLen = 256;
+
+}  // namespace
+
+BufferedSocket::BufferedSocket(FiberSocketBase* sock, size_t read_capacity)
+    : sock_(sock), read_buf_(read_capacity), read_capacity_(read_capacity) {
+}
+
+io::Result<size_t> BufferedSocket::Fill() {
+  if (read_buf_.AppendLen() < kMinRecvLen) {
+    read_buf_.EnsureCapacity(max(read_capacity_, kMinRecvLen));
+  }
+
+  io::Result<size_t> res = sock_->Recv(read_buf_.AppendBuffer());
+  if (res) {
+    read_buf_.CommitWrite(*res);
+  }
+  return res;
+}
+
+error_code BufferedSocket::FillAtLeast(size_t len) {
+  if (read_buf_.InputLen() < len) {
+    read_buf_.EnsureCapacity(len - read_buf_.InputLen());
+  }
+
+  while (read_buf_.InputLen() < len) {
+    io::Result<size_t> res = Fill();
+    if (!res)
+      return res.error();
+  }
+  return error_code{};
+}
+
+io::Result<io::Bytes> BufferedSocket::ReadUntil(string_view delim, size_t max_len) {
+  DCHECK(!delim.empty());
+
+  size_t scanned = 0;  // the prefix that does not contain the beginning of delim.
+  while (true) {
+    string_view input = io::View(Peek());
+    size_t pos = input.find(delim, scanned);
+    if (pos != string_view::npos) {
+      if (pos + delim.size() > max_len)
+        break;
+      return Peek().subspan(0, pos + delim.size());
+    }
+
+    if (input.size() >= max_len)
+      break;
+
+    if (input.size() >= delim.size())
+      scanned = input.size() - delim.size() + 1;
+
+    io::Result<size_t> res = Fill();
+    if (!res)
+      return make_unexpected(res.error());
+  }
+
+  return make_unexpected(make_error_code(errc::message_size));
+}
+
+io::Result<size_t> BufferedSocket::Recv(const iovec* v, size_t len) {
+  if (read_buf_.InputLen() == 0) {
+    size_t total = 0;
+    for (size_t i = 0; i < len; ++i)
+      total += v[i].iov_len;
+
+    // Large reads do not benefit from the intermediate copy.
+    if (total >= read_capacity_)
+      return sock_->Recv(v, len);
+
+    io::Result<size_t> res = Fill();
+    if (!res)
+      return res;
+  }
+
+  io::Bytes input = Peek();
+  size_t copied = 0;
+  for (size_t i = 0; i < len && copied < input.size(); ++i) {
+    size_t sz = min(v[i].iov_len, input.size() - copied);
+    memcpy(v[i].iov_base, input.data() + copied, sz);
+    copied += sz;
+  }
+  Consume(copied);
+
+  return copied;
+}
+
+void BufferedSocket::Enqueue(io::Bytes buf) {
+  if (buf.empty())
+    return;
+
+  write_q_.push_back(WriteEntry{buf.data(), 0, buf.size()});
+  pending_len_ += buf.size();
+}
+
+void BufferedSocket::EnqueueCopy(io::Bytes buf) {
+  if (buf.empty())
+    return;
+
+  size_t offset = write_buf_.InputLen();
+  write_buf_.WriteAndCommit(buf.data(), buf.size());
+  pending_len_ += buf.size();
+
+  // Extend the previous copy if they are adjacent.
+  if (!write_q_.empty()) {
+    WriteEntry& last = write_q_.back();
+    if (last.data == nullptr && last.offset + last.len == offset) {
+      last.len += buf.size();
+      return;
+    }
+  }
+  write_q_.push_back(WriteEntry{nullptr, offset, buf.size()});
+}
+
+error_code BufferedSocket::Flush() {
+  if (write_q_.empty())
+    return error_code{};
+
+  // write_buf_ does not move anymore, so we can resolve the copies.
+  uint8_t* copies = const_cast<uint8_t*>(write_buf_.InputBuffer().data());
+  iovs_.resize(write_q_.size());
+  for (size_t i = 0; i < write_q_.size(); ++i) {
+    const WriteEntry& e = write_q_[i];
+    uint8_t* data = e.data ? const_cast<uint8_t*>(e.data) : copies + e.offset;
+    iovs_[i] = iovec{.iov_base = data, .iov_len = e.len};
+  }
+
+  error_code ec;
+  for (size_t i = 0; i < iovs_.size() && !ec; i += IOV_MAX) {
+    ec = sock_->Write(iovs_.data() + i, min<size_t>(IOV_MAX, iovs_.size() - i));
+  }
+
+  write_q_.clear();
+  write_buf_.Clear();
+  pending_len_ = 0;
+
+  return ec;
+}
+
+io::Result<size_t> BufferedSocket::WriteSome(const iovec* v, uint32_t len) {
+  if (write_q_.empty())
+    return sock_->WriteSome(v, len);
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    Enqueue(io::Bytes{reinterpret_cast<const uint8_t*>(v[i].iov_base), v[i].iov_len});
+    total += v[i].iov_len;
+  }
+
+  error_code ec = Flush();
+  if (ec)
+    return make_unexpected(ec);
+  return total;
+}
+
+}  // namespace util
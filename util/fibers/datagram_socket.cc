@@ -0,0 +1,455 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/datagram_socket.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <deque>
+
+#include "base/logging.h"
+#include "util/fibers/detail/fiber_interface.h"
+#include "util/fibers/epoll_proactor.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/uring_proactor.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define VSOCK(verbosity) VLOG(verbosity) << "dsock[" << fd_ << "] "
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+using nonstd::make_unexpected;
+
+namespace {
+
+constexpr unsigned kMaxBatch = 32;
+constexpr size_t kGroControlSize = CMSG_SPACE(sizeof(int));
+constexpr size_t kGsoControlSize = CMSG_SPACE(sizeof(uint16_t));
+
+inline error_code from_errno() {
+  return error_code(errno, system_category());
+}
+
+// Returns the GRO segment size from the control messages or 0 if there is none.
+uint16_t GroSegmentSize(msghdr& msg) {
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int size;
+      memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+      return size;
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+struct DatagramSocket::MultiShot {
+  struct Chunk {
+    int res;
+    uint16_t buf_id;
+  };
+
+  msghdr msg;  // layout template for the kernel, must outlive the request.
+  std::deque<Chunk> chunks;
+  detail::FiberInterface* waiter = nullptr;
+  uint64_t user_data = 0;  // of the armed request, 0 if none.
+  uint16_t group_id;
+  bool no_bufs = false;
+};
+
+DatagramSocket::DatagramSocket(ProactorBase* proactor) : proactor_(proactor) {
+}
+
+DatagramSocket::~DatagramSocket() {
+  error_code ec = Close();
+  LOG_IF(WARNING, ec) << "Error closing socket " << ec << "/" << ec.message();
+}
+
+auto DatagramSocket::Create(unsigned short protocol_family) -> error_code {
+  CHECK_LT(fd_, 0);
+  DCHECK(proactor_->InMyThread());
+
+  fd_ = socket(protocol_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0)
+    return from_errno();
+
+  if (proactor_->GetKind() == ProactorBase::EPOLL) {
+    auto cb = [this](uint32_t mask, int, EpollProactor*) {
+      if ((mask & (EPOLLIN | EPOLLERR)) && read_waiter_) {
+        detail::FiberActive()->ActivateOther(exchange(read_waiter_, nullptr));
+      }
+      if ((mask & (EPOLLOUT | EPOLLERR)) && write_waiter_) {
+        detail::FiberActive()->ActivateOther(exchange(write_waiter_, nullptr));
+      }
+    };
+    arm_index_ = static_cast<EpollProactor*>(proactor_)->Arm(fd_, std::move(cb),
+                                                             EPOLLIN | EPOLLOUT | EPOLLET);
+  }
+
+  return error_code{};
+}
+
+auto DatagramSocket::Bind(const endpoint_type& ep) -> error_code {
+  if (fd_ < 0) {
+    error_code ec = Create(ep.protocol().family());
+    if (ec)
+      return ec;
+  }
+
+  if (bind(fd_, ep.data(), ep.size()) < 0)
+    return from_errno();
+  return error_code{};
+}
+
+auto DatagramSocket::Connect(const endpoint_type& ep) -> error_code {
+  if (fd_ < 0) {
+    error_code ec = Create(ep.protocol().family());
+    if (ec)
+      return ec;
+  }
+
+  if (connect(fd_, ep.data(), ep.size()) < 0)
+    return from_errno();
+  return error_code{};
+}
+
+auto DatagramSocket::Close() -> error_code {
+  if (fd_ < 0)
+    return error_code{};
+
+  DCHECK(proactor_->InMyThread());
+
+  if (multishot_) {
+    CancelRecvMultishot();
+    multishot_.reset();
+  }
+
+  if (arm_index_ >= 0) {
+    static_cast<EpollProactor*>(proactor_)->Disarm(fd_, arm_index_);
+    arm_index_ = -1;
+  }
+
+  error_code ec;
+  if (close(fd_) < 0)
+    ec = from_errno();
+  fd_ = -1;
+
+  return ec;
+}
+
+auto DatagramSocket::LocalEndpoint() const -> endpoint_type {
+  endpoint_type endpoint;
+  if (fd_ < 0)
+    return endpoint;
+
+  socklen_t addr_len = endpoint.capacity();
+  if (getsockname(fd_, endpoint.data(), &addr_len) == 0)
+    endpoint.resize(addr_len);
+
+  return endpoint;
+}
+
+auto DatagramSocket::EnableGso(uint16_t segment_size) -> error_code {
+  int val = segment_size;
+  if (setsockopt(fd_, SOL_UDP, UDP_SEGMENT, &val, sizeof(val)) < 0)
+    return from_errno();
+  return error_code{};
+}
+
+auto DatagramSocket::EnableGro() -> error_code {
+  int val = 1;
+  if (setsockopt(fd_, SOL_UDP, UDP_GRO, &val, sizeof(val)) < 0)
+    return from_errno();
+
+  CHECK(!multishot_ || multishot_->user_data == 0) << "GRO must be enabled before receiving";
+  gro_ = true;
+  if (multishot_)
+    multishot_->msg.msg_controllen = kGroControlSize;
+
+  return error_code{};
+}
+
+auto DatagramSocket::RecvBatch(absl::Span<Datagram> dgrams) -> io::Result<unsigned> {
+  CHECK_GE(fd_, 0);
+  CHECK(!dgrams.empty());
+
+  if (multishot_)
+    return RecvMultishot(dgrams);
+
+  unsigned count = min<size_t>(dgrams.size(), kMaxBatch);
+  mmsghdr msgs[kMaxBatch];
+  iovec iovs[kMaxBatch];
+  uint8_t control[kMaxBatch][kGroControlSize];
+
+  memset(msgs, 0, sizeof(mmsghdr) * count);
+  for (unsigned i = 0; i < count; ++i) {
+    iovs[i] = iovec{dgrams[i].data, dgrams[i].size};
+    msghdr& hdr = msgs[i].msg_hdr;
+    hdr.msg_iov = &iovs[i];
+    hdr.msg_iovlen = 1;
+    hdr.msg_name = dgrams[i].peer.data();
+    hdr.msg_namelen = dgrams[i].peer.capacity();
+    if (gro_) {
+      hdr.msg_control = control[i];
+      hdr.msg_controllen = kGroControlSize;
+    }
+  }
+
+  while (true) {
+    int res = recvmmsg(fd_, msgs, count, MSG_DONTWAIT, nullptr);
+    if (res > 0) {
+      for (int i = 0; i < res; ++i) {
+        msghdr& hdr = msgs[i].msg_hdr;
+        Datagram& dgram = dgrams[i];
+        dgram.size = msgs[i].msg_len;
+        dgram.truncated = hdr.msg_flags & MSG_TRUNC;
+        dgram.peer.resize(hdr.msg_namelen);
+        dgram.segment_size = gro_ ? GroSegmentSize(hdr) : 0;
+      }
+      return res;
+    }
+
+    if (errno == EINTR)
+      continue;
+
+    if (errno != EAGAIN)
+      return make_unexpected(from_errno());
+
+    error_code ec = WaitReady(POLLIN);
+    if (ec)
+      return make_unexpected(ec);
+  }
+}
+
+auto DatagramSocket::SendBatch(absl::Span<const Datagram> dgrams) -> io::Result<unsigned> {
+  CHECK_GE(fd_, 0);
+  CHECK(!dgrams.empty());
+
+  unsigned count = min<size_t>(dgrams.size(), kMaxBatch);
+  mmsghdr msgs[kMaxBatch];
+  iovec iovs[kMaxBatch];
+  uint8_t control[kMaxBatch][kGsoControlSize];
+
+  memset(msgs, 0, sizeof(mmsghdr) * count);
+  for (unsigned i = 0; i < count; ++i) {
+    const Datagram& dgram = dgrams[i];
+    iovs[i] = iovec{dgram.data, dgram.size};
+    msghdr& hdr = msgs[i].msg_hdr;
+    hdr.msg_iov = &iovs[i];
+    hdr.msg_iovlen = 1;
+
+    // Connected sockets send to their peer.
+    if (dgram.peer.port() != 0) {
+      hdr.msg_name = const_cast<sockaddr*>(dgram.peer.data());
+      hdr.msg_namelen = dgram.peer.size();
+    }
+
+    if (dgram.segment_size) {
+      hdr.msg_control = control[i];
+      hdr.msg_controllen = kGsoControlSize;
+      cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      memcpy(CMSG_DATA(cmsg), &dgram.segment_size, sizeof(uint16_t));
+    }
+  }
+
+  while (true) {
+    int res = sendmmsg(fd_, msgs, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (res > 0)
+      return res;
+
+    if (errno == EINTR)
+      continue;
+
+    if (errno != EAGAIN)
+      return make_unexpected(from_errno());
+
+    error_code ec = WaitReady(POLLOUT);
+    if (ec)
+      return make_unexpected(ec);
+  }
+}
+
+auto DatagramSocket::WaitReady(unsigned poll_mask) -> error_code {
+  if (proactor_->GetKind() == ProactorBase::IOURING) {
+    FiberCall fc(static_cast<UringProactor*>(proactor_));
+    fc->PrepPollAdd(fd_, poll_mask);
+    int res = fc.Get();
+    if (res < 0)
+      return error_code(-res, system_category());
+    return error_code{};
+  }
+
+  // Epoll is armed in edge-triggered mode, so the event will arrive after EAGAIN.
+  detail::FiberInterface*& waiter = poll_mask == POLLIN ? read_waiter_ : write_waiter_;
+  DCHECK(waiter == nullptr);
+  waiter = detail::FiberActive();
+  waiter->Suspend();
+
+  return error_code{};
+}
+
+bool DatagramSocket::EnableRecvMultishot(uint16_t group_id) {
+  CHECK_GE(fd_, 0);
+
+  if (proactor_->GetKind() != ProactorBase::IOURING)
+    return false;
+
+  UringProactor* up = static_cast<UringProactor*>(proactor_);
+  if (!up->HasBufferRing(group_id))
+    return false;
+
+  if (!multishot_) {
+    multishot_.reset(new MultiShot);
+    memset(&multishot_->msg, 0, sizeof(msghdr));
+    multishot_->msg.msg_namelen = sizeof(sockaddr_in6);
+    multishot_->msg.msg_controllen = gro_ ? kGroControlSize : 0;
+  }
+  multishot_->group_id = group_id;
+
+  return true;
+}
+
+void DatagramSocket::ArmRecvMultishot() {
+  MultiShot* ms = multishot_.get();
+  DCHECK_EQ(ms->user_data, 0u);
+
+  auto cb = [this](detail::FiberInterface* current, UringProactor::IoResult res, uint32_t flags) {
+    MultiShot* ms = multishot_.get();
+
+    if (flags & IORING_CQE_F_BUFFER) {
+      ms->chunks.push_back(MultiShot::Chunk{res, uint16_t(flags >> IORING_CQE_BUFFER_SHIFT)});
+    } else if (res == -ENOBUFS) {
+      // The ring is exhausted and the kernel terminated the request. We rearm it lazily.
+      ms->no_bufs = true;
+    } else if (res < 0 && res != -ECANCELED) {
+      ms->chunks.push_back(MultiShot::Chunk{res, 0});
+    }
+
+    if ((flags & IORING_CQE_F_MORE) == 0) {
+      ms->user_data = 0;
+    }
+
+    if (ms->waiter) {
+      current->ActivateOther(exchange(ms->waiter, nullptr));
+    }
+  };
+
+  UringProactor* up = static_cast<UringProactor*>(proactor_);
+  SubmitEntry se = up->GetSubmitEntry(std::move(cb));
+  se.PrepRecvMsgMultishot(fd_, &ms->msg, ms->group_id, 0);
+  ms->user_data = se.sqe()->user_data;
+}
+
+void DatagramSocket::CancelRecvMultishot() {
+  MultiShot* ms = multishot_.get();
+  UringProactor* up = static_cast<UringProactor*>(proactor_);
+
+  if (ms->user_data) {
+    FiberCall fc(up);
+    fc->PrepCancel(ms->user_data);
+    int res = fc.Get();
+    VSOCK(2) << "Cancelled multishot recvmsg " << res;
+
+    // The callback references this socket, so we must wait for the final completion.
+    while (ms->user_data) {
+      ms->waiter = detail::FiberActive();
+      ms->waiter->Suspend();
+    }
+  }
+
+  for (const auto& chunk : ms->chunks) {
+    if (chunk.res >= 0)
+      up->ReplenishBuffer(ms->group_id, chunk.buf_id);
+  }
+  ms->chunks.clear();
+}
+
+auto DatagramSocket::RecvMultishot(absl::Span<Datagram> dgrams) -> io::Result<unsigned> {
+  MultiShot* ms = multishot_.get();
+  UringProactor* up = static_cast<UringProactor*>(proactor_);
+
+  // Completions without a valid datagram are dropped, so we wait until one arrives.
+  while (true) {
+    while (ms->chunks.empty()) {
+      if (ms->user_data == 0) {
+        if (ms->no_bufs) {
+          // Let other fibers process and return their buffers before we try again.
+          ms->no_bufs = false;
+          ThisFiber::Yield();
+          continue;
+        }
+        ArmRecvMultishot();
+      }
+
+      ms->waiter = detail::FiberActive();
+      ms->waiter->Suspend();
+    }
+
+    unsigned count = 0;
+    while (count < dgrams.size() && !ms->chunks.empty()) {
+      MultiShot::Chunk chunk = ms->chunks.front();
+      if (chunk.res < 0) {
+        if (count > 0)  // report the error with the next call.
+          break;
+        ms->chunks.pop_front();
+        return make_unexpected(error_code(-chunk.res, system_category()));
+      }
+      ms->chunks.pop_front();
+
+      uint8_t* buf = up->GetBufRingPtr(ms->group_id, chunk.buf_id);
+      io_uring_recvmsg_out* out = io_uring_recvmsg_validate(buf, chunk.res, &ms->msg);
+      if (out == nullptr) {
+        LOG(DFATAL) << "Provided buffer is too small for recvmsg header";
+        up->ReplenishBuffer(ms->group_id, chunk.buf_id);
+        continue;
+      }
+
+      Datagram& dgram = dgrams[count++];
+      size_t len = io_uring_recvmsg_payload_length(out, chunk.res, &ms->msg);
+      size_t copy_len = min<size_t>(len, dgram.size);
+      memcpy(dgram.data, io_uring_recvmsg_payload(out, &ms->msg), copy_len);
+      dgram.size = copy_len;
+      dgram.truncated = len > copy_len || (out->flags & MSG_TRUNC);
+
+      size_t namelen = min<size_t>(out->namelen, dgram.peer.capacity());
+      memcpy(dgram.peer.data(), io_uring_recvmsg_name(out), namelen);
+      dgram.peer.resize(namelen);
+
+      dgram.segment_size = 0;
+      for (cmsghdr* cmsg = io_uring_recvmsg_cmsg_firsthdr(out, &ms->msg); cmsg;
+           cmsg = io_uring_recvmsg_cmsg_nexthdr(out, &ms->msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+          int size;
+          memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+          dgram.segment_size = size;
+        }
+      }
+
+      up->ReplenishBuffer(ms->group_id, chunk.buf_id);
+    }
+
+    if (count > 0)
+      return count;
+  }
+}
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,123 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/types/span.h>
+#include <sys/socket.h>
+
+#include <boost/asio/ip/udp.hpp>
+#include <memory>
+
+#include "io/io.h"
+
+namespace util {
+namespace fb2 {
+
+class ProactorBase;
+
+namespace detail {
+class FiberInterface;
+}  // namespace detail
+
+// Fiber-friendly UDP socket that sends and receives datagrams in batches.
+// Must be created, used and closed in the thread of its proactor.
+// On epoll the batches map to recvmmsg/sendmmsg. On io_uring recvmmsg/sendmmsg are issued
+// after the socket becomes ready, or the socket can switch to a multishot RECVMSG request
+// that fills buffers from a provided buffer ring (see EnableRecvMultishot).
+class DatagramSocket {
+  DatagramSocket(const DatagramSocket&) = delete;
+  void operator=(const DatagramSocket&) = delete;
+
+ public:
+  using endpoint_type = ::boost::asio::ip::udp::endpoint;
+  using error_code = std::error_code;
+
+  explicit DatagramSocket(ProactorBase* proactor);
+  ~DatagramSocket();
+
+  struct Datagram {
+    uint8_t* data = nullptr;
+
+    // Capacity of data for RecvBatch, which replaces it with the size of the received datagram.
+    uint32_t size = 0;
+
+    // Source of a received datagram or destination of a sent one. Unconnected sockets
+    // require destination.
+    endpoint_type peer;
+
+    // For received datagrams with GRO enabled: the size of the coalesced segments,
+    // 0 if the datagram was not coalesced. For sent datagrams: the GSO segment size,
+    // 0 to use the socket default (see EnableGso).
+    uint16_t segment_size = 0;
+
+    // Set by RecvBatch if the datagram did not fit into data.
+    bool truncated = false;
+  };
+
+  // Creates a socket. By default with AF_INET family.
+  error_code Create(unsigned short protocol_family = AF_INET);
+
+  error_code Bind(const endpoint_type& ep);
+
+  // Sets the default destination and filters out datagrams from other peers.
+  error_code Connect(const endpoint_type& ep);
+
+  error_code Close();
+
+  bool IsOpen() const {
+    return fd_ >= 0;
+  }
+
+  int native_handle() const {
+    return fd_;
+  }
+
+  endpoint_type LocalEndpoint() const;
+
+  // Enables UDP generic segmentation offload: sent datagrams longer than `segment_size` are
+  // split by the kernel (or the NIC) into datagrams of `segment_size` bytes.
+  error_code EnableGso(uint16_t segment_size);
+
+  // Enables UDP generic receive offload: the kernel may coalesce consecutive datagrams
+  // of the same flow into a single received buffer. See Datagram::segment_size.
+  error_code EnableGro();
+
+  // Receives up to dgrams.size() datagrams, suspending until at least one is available.
+  // Returns the number of received datagrams.
+  io::Result<unsigned> RecvBatch(absl::Span<Datagram> dgrams);
+
+  // Sends the datagrams, suspending while the socket send buffer is full. Returns
+  // the number of sent datagrams, which may be less than dgrams.size().
+  io::Result<unsigned> SendBatch(absl::Span<const Datagram> dgrams);
+
+  // io_uring only. Switches receives to a single multishot RECVMSG request that fills
+  // buffers from the provided buffer ring `group_id` (see UringProactor::RegisterBufferRing).
+  // Buffers must be large enough to hold the largest datagram plus the io_uring_recvmsg_out
+  // header, the peer address and the GRO control message.
+  // Returns false if the proactor is not io_uring or does not have the buffer ring.
+  bool EnableRecvMultishot(uint16_t group_id);
+
+ private:
+  // Suspends until the socket is readable (POLLIN) or writable (POLLOUT).
+  error_code WaitReady(unsigned poll_mask);
+
+  io::Result<unsigned> RecvMultishot(absl::Span<Datagram> dgrams);
+  void ArmRecvMultishot();
+  void CancelRecvMultishot();
+
+  ProactorBase* proactor_;
+  int fd_ = -1;
+  int arm_index_ = -1;  // epoll only.
+  bool gro_ = false;
+
+  detail::FiberInterface* read_waiter_ = nullptr;
+  detail::FiberInterface* write_waiter_ = nullptr;
+
+  struct MultiShot;
+  std::unique_ptr<MultiShot> multishot_;
+};
+
+}  // namespace fb2
+}  // namespace util
@@ -181,6 +181,11 @@ void EpollProactor::MainLoop(detail::Scheduler* scheduler) {
   while (true) {
     ++loop_cnt;
     num_task_runs = 0;
+
+    // The fibers that were ready have run, so we let them coalesce their work.
+    if (!tick_end_.empty())
+      RunTickEnd();
+
     bool task_queue_exhausted = true;
 
     tq_seq = tq_seq_.load(memory_order_acquire);
@@ -10,6 +10,7 @@
 
 #ifdef __linux__
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #else
 #include <sys/event.h>
 #endif
@@ -121,6 +122,7 @@ auto EpollSocket::Close() -> error_code {
   error_code ec;
   if (fd_ >= 0) {
     DCHECK_EQ(GetProactor()->thread_id(), pthread_self());
+    SetCork(0);  // Sends the corked data.
 
     int fd = native_handle();
     DVSOCK(1) << "Closing socket";
@@ -256,6 +258,9 @@ auto EpollSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
   CHECK_GT(len, 0U);
   CHECK_GE(fd_, 0);
 
+  if (IsCorked())
+    return CorkedWrite(ptr, len);
+
   CHECK(write_context_ == NULL);
 
   msghdr msg;
@@ -305,6 +310,70 @@ auto EpollSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
   return nonstd::make_unexpected(std::move(ec));
 }
 
+#ifdef __linux__
+auto EpollSocket::SendFile(int fd, off_t offset, size_t len) -> Result<size_t> {
+  CHECK(proactor());
+  CHECK_GE(fd_, 0);
+
+  // The file data follows the corked data.
+  if (IsCorked()) {
+    error_code ec = FlushCork();
+    if (ec)
+      return nonstd::make_unexpected(ec);
+  }
+
+  CHECK(write_context_ == NULL);
+
+  int sock = native_handle();
+  size_t sent = 0;
+  int res = 0;
+  write_context_ = detail::FiberActive();
+  absl::Cleanup clean = [this]() { write_context_ = nullptr; };
+
+  while (sent < len) {
+    if (fd_ & IS_SHUTDOWN) {
+      res = ECONNABORTED;
+      break;
+    }
+
+    off_t file_offs = offset + sent;
+    ssize_t n = sendfile(sock, fd, &file_offs, len - sent);
+    if (n > 0) {
+      sent += n;
+      continue;
+    }
+
+    if (n == 0)  // eof
+      return sent;
+
+    res = errno;
+    if (res == EINTR)
+      continue;
+    if (res != EAGAIN)
+      break;
+
+    error_code ec;
+    if (SuspendMyself(write_context_, &ec) && ec) {
+      // Unlike the other calls, SendFile reports the expired timeout() as ETIMEDOUT.
+      if (ec == errc::operation_canceled)
+        ec = make_error_code(errc::timed_out);
+      return nonstd::make_unexpected(std::move(ec));
+    }
+  }
+
+  if (res == 0)
+    return sent;
+
+  if (res == EPIPE)
+    res = ECONNABORTED;
+
+  std::error_code ec(res, std::system_category());
+  VSOCK(1) << "SendFile error " << ec << " on " << RemoteEndpoint();
+
+  return nonstd::make_unexpected(std::move(ec));
+}
+#endif
+
 void EpollSocket::AsyncWriteSome(const iovec* v, uint32_t len, AsyncWriteCb cb) {
   auto res = WriteSome(v, len);
   cb(res);
@@ -378,6 +447,10 @@ io::Result<size_t> EpollSocket::Recv(const io::MutableBytes& mb, int flags) {
 }
 
 auto EpollSocket::Shutdown(int how) -> error_code {
+  // The corked data is sent before the write side is closed.
+  if (how != SHUT_RD && IsCorked())
+    (void)FlushCork();
+
   auto ec = LinuxSocketBase::Shutdown(how);
 
 #ifdef __APPLE__
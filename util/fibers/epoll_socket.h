@@ -29,6 +29,11 @@ class EpollSocket : public LinuxSocketBase {
   Result<size_t> WriteSome(const iovec* ptr, uint32_t len) override;
   void AsyncWriteSome(const iovec* v, uint32_t len, AsyncWriteCb cb) override;
 
+#ifdef __linux__
+  // Uses sendfile(2).
+  Result<size_t> SendFile(int fd, off_t offset, size_t len) override;
+#endif
+
   Result<size_t> RecvMsg(const msghdr& msg, int flags) override;
   Result<size_t> Recv(const io::MutableBytes& mb, int flags = 0) override;
 
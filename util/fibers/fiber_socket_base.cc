@@ -6,11 +6,16 @@
 
 #include <netinet/in.h>
 #include <poll.h>
+#include <unistd.h>
 
 #include <boost/fiber/context.hpp>
 
+#include "base/io_buf.h"
 #include "base/logging.h"
 #include "base/stl_util.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/proactor_base.h"
+#include "util/fibers/synchronization.h"
 
 #define VSOCK(verbosity) VLOG(verbosity) << "sock[" << native_handle() << "] "
 #define DVSOCK(verbosity) DVLOG(verbosity) << "sock[" << native_handle() << "] "
@@ -33,10 +38,207 @@ inline ssize_t posix_err_wrap(ssize_t res, FiberSocketBase::error_code* ec) {
 
 }  // namespace
 
+struct FiberSocketBase::CorkState {
+  base::IoBuf pending, inflight;
+  uint32_t threshold = 0;
+  bool scheduled = false;  // registered to run at the end of the proactor tick.
+  bool in_flight = false;
+  error_code ec;  // the error of the last background write.
+
+  // Asynchronous writes of `inflight` use vec, submitting is set while we issue them.
+  iovec vec;
+  bool submitting = false;
+
+  // The fiber that writes `inflight` on engines without asynchronous writes.
+  fb2::detail::FiberInterface* flusher = nullptr;
+  fb2::EventCount flushed;
+};
+
+FiberSocketBase::FiberSocketBase(ProactorBase* pb) : proactor_(pb) {
+}
+
+FiberSocketBase::~FiberSocketBase() {
+}
+
+void FiberSocketBase::SetCork(uint32_t threshold) {
+  if (threshold == 0) {
+    if (cork_) {
+      error_code ec = FlushCork();
+      VLOG_IF(1, ec) << "Error flushing corked data " << ec.message();
+
+      // The write timed out and still references the buffer. It fails once we shut down.
+      CorkState* cs = cork_.get();
+      if (cs->in_flight) {
+        (void)Shutdown(SHUT_RDWR);
+        cs->flushed.await([cs] { return !cs->in_flight; });
+      }
+
+      if (cork_->scheduled)
+        proactor_->CancelTickEnd(this);
+      cork_.reset();
+    }
+    return;
+  }
+
+  if (!cork_)
+    cork_.reset(new CorkState);
+  cork_->threshold = threshold;
+}
+
+error_code FiberSocketBase::FlushCork() {
+  if (!cork_)
+    return error_code{};
+
+  CorkState* cs = cork_.get();
+  auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_);
+  auto written = [cs] { return !cs->in_flight; };
+
+  while (!cs->ec && (cs->in_flight || cs->pending.InputLen() > 0)) {
+    if (!cs->in_flight)
+      StartCorkFlush();
+
+    if (timeout_ == UINT32_MAX) {
+      cs->flushed.await(written);
+    } else if (cs->flushed.await_until(written, deadline) == cv_status::timeout) {
+      // The peer does not read. Part of the data may be on the wire, so the following
+      // writes fail as well.
+      cs->ec = make_error_code(errc::timed_out);
+    }
+  }
+
+  return cs->ec;
+}
+
+Result<size_t> FiberSocketBase::CorkedWrite(const iovec* v, uint32_t len) {
+  CorkState* cs = cork_.get();
+  if (cs->ec)
+    return nonstd::make_unexpected(cs->ec);
+
+  size_t total = AppendCorked(v, len);
+  if (cs->pending.InputLen() >= cs->threshold) {
+    error_code ec = FlushCork();
+    if (ec)
+      return nonstd::make_unexpected(ec);
+  } else {
+    ScheduleCorkFlush();
+  }
+
+  return total;
+}
+
+void FiberSocketBase::CorkedAsyncWrite(const iovec* v, uint32_t len, AsyncWriteCb cb) {
+  CorkState* cs = cork_.get();
+  if (cs->ec) {
+    cb(nonstd::make_unexpected(cs->ec));
+    return;
+  }
+
+  size_t total = AppendCorked(v, len);
+  if (cs->pending.InputLen() >= cs->threshold && !cs->in_flight) {
+    StartCorkFlush();
+  } else {
+    ScheduleCorkFlush();
+  }
+
+  cb(total);
+}
+
+size_t FiberSocketBase::AppendCorked(const iovec* v, uint32_t len) {
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    cork_->pending.WriteAndCommit(v[i].iov_base, v[i].iov_len);
+    total += v[i].iov_len;
+  }
+  return total;
+}
+
+void FiberSocketBase::ScheduleCorkFlush() {
+  if (!cork_->scheduled) {
+    cork_->scheduled = true;
+    proactor_->RunAtTickEnd(&FiberSocketBase::OnCorkTickEnd, this);
+  }
+}
+
+void FiberSocketBase::OnCorkTickEnd(void* arg) {
+  FiberSocketBase* me = static_cast<FiberSocketBase*>(arg);
+  CorkState* cs = me->cork_.get();
+  cs->scheduled = false;
+
+  // If a write is in flight, its completion sends the rest.
+  if (!cs->in_flight && !cs->ec && cs->pending.InputLen() > 0)
+    me->StartCorkFlush();
+}
+
+bool FiberSocketBase::IsCorkFlusher() const {
+  return cork_->submitting || (cork_->flusher && cork_->flusher == fb2::detail::FiberActive());
+}
+
+void FiberSocketBase::StartCorkFlush() {
+  CorkState* cs = cork_.get();
+  DCHECK(!cs->in_flight);
+
+  cs->in_flight = true;
+  swap(cs->pending, cs->inflight);
+
+  if (proactor_->GetKind() == ProactorBase::IOURING) {
+    AsyncCorkWrite();
+    return;
+  }
+
+  io::Bytes data = cs->inflight.InputBuffer();
+  iovec v{.iov_base = const_cast<uint8_t*>(data.data()), .iov_len = data.size()};
+
+  // AsyncWriteSome of other engines blocks the calling fiber, so we can not call it from
+  // the proactor loop. Instead, a dedicated fiber writes the data.
+  fb2::Fiber("cork_flush", [this, v] {
+    cork_->flusher = fb2::detail::FiberActive();
+    error_code ec = Write(&v, 1);
+    cork_->flusher = nullptr;
+    OnCorkFlushed(ec);
+  }).Detach();
+}
+
+void FiberSocketBase::AsyncCorkWrite() {
+  CorkState* cs = cork_.get();
+  io::Bytes data = cs->inflight.InputBuffer();
+  cs->vec = iovec{.iov_base = const_cast<uint8_t*>(data.data()), .iov_len = data.size()};
+
+  cs->submitting = true;
+  AsyncWriteSome(&cs->vec, 1, [this](Result<size_t> res) {
+    if (!res) {
+      OnCorkFlushed(res.error());
+      return;
+    }
+
+    cork_->inflight.ConsumeInput(*res);
+    if (cork_->inflight.InputLen() > 0) {
+      AsyncCorkWrite();
+    } else {
+      OnCorkFlushed(error_code{});
+    }
+  });
+  cs->submitting = false;
+}
+
+void FiberSocketBase::OnCorkFlushed(error_code ec) {
+  CorkState* cs = cork_.get();
+  cs->inflight.Clear();
+  cs->in_flight = false;
+
+  if (ec) {
+    cs->ec = ec;
+  } else if (!cs->ec && cs->pending.InputLen() > 0 && !cs->scheduled) {
+    StartCorkFlush();
+  }
+  cs->flushed.notifyAll();
+}
+
 void FiberSocketBase::SetProactor(ProactorBase* p) {
   if (p == proactor_)
     return;
 
+  CHECK(!cork_ || (!cork_->in_flight && !cork_->scheduled)) << "Corked data must be flushed";
+
   if (proactor_) {  // migration path
     OnResetProactor();
     proactor_ = nullptr;
@@ -57,6 +259,30 @@ Result<size_t> FiberSocketBase::Recv(const iovec* ptr, size_t len) {
   return RecvMsg(msg, 0);
 }
 
+Result<size_t> FiberSocketBase::SendFile(int fd, off_t offset, size_t len) {
+  constexpr size_t kBufSize = 1U << 16;
+  unique_ptr<uint8_t[]> buf(new uint8_t[min(len, kBufSize)]);
+
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t res = pread(fd, buf.get(), min(len - sent, kBufSize), offset + sent);
+    if (res < 0) {
+      if (errno == EINTR)
+        continue;
+      return nonstd::make_unexpected(error_code(errno, system_category()));
+    }
+    if (res == 0)  // eof
+      break;
+
+    error_code ec = Write(io::Bytes(buf.get(), res));
+    if (ec)
+      return nonstd::make_unexpected(ec);
+    sent += res;
+  }
+
+  return sent;
+}
+
 LinuxSocketBase::~LinuxSocketBase() {
   int fd = native_handle();
 
@@ -2,16 +2,23 @@
 // Author: Roman Gershman (romange@gmail.com)
 //
 
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
 #include <thread>
 
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "util/asio_stream_adapter.h"
+#include "util/buffered_socket.h"
 #include "util/fiber_socket_base.h"
 #include "util/fibers/fibers.h"
 #include "util/fibers/synchronization.h"
 
 #ifdef __linux__
+#include "util/fibers/datagram_socket.h"
+#include "util/fibers/pool.h"
 #include "util/fibers/uring_proactor.h"
+#include "util/fibers/uring_socket.h"
 #endif
 #include "util/fibers/epoll_proactor.h"
 
@@ -262,6 +269,292 @@ TEST_P(FiberSocketTest, AsyncWrite) {
   proactor_->Await([&] { (void)sock->Close(); });
 }
 
+TEST_P(FiberSocketTest, ZeroCopyWrite) {
+  unique_ptr<FiberSocketBase> sock(proactor_->CreateSocket());
+  proactor_->Await([&] {
+    error_code ec = sock->Connect(listen_ep_);
+    EXPECT_FALSE(ec) << ec.message();
+  });
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  // Epoll ignores the threshold and copies as usual.
+  sock->SetZeroCopyThreshold(1024);
+
+  string payload(1 << 20, 'a');
+  for (size_t i = 0; i < payload.size(); i += 4096)
+    payload[i] = 'a' + (i / 4096) % 26;
+  const string expected = payload;
+
+  Fiber read_fb = proactor_->LaunchFiber([&] {
+    string received(payload.size(), '\0');
+    size_t offs = 0;
+    while (offs < received.size()) {
+      auto res = conn_socket_->Recv(
+          io::MutableBytes(reinterpret_cast<uint8_t*>(received.data()) + offs,
+                           received.size() - offs));
+      ASSERT_TRUE(res) << res.error().message();
+      offs += *res;
+    }
+    EXPECT_EQ(expected, received);
+  });
+
+  proactor_->Await([&] {
+    error_code ec = sock->Write(io::Buffer(payload));
+    EXPECT_FALSE(ec) << ec.message();
+
+    // Reusing the buffer right away must not affect the data on the wire.
+    payload.assign(payload.size(), 'z');
+  });
+  read_fb.Join();
+
+  proactor_->Await([&] { (void)sock->Close(); });
+}
+
+TEST_P(FiberSocketTest, SendFile) {
+  unique_ptr<FiberSocketBase> sock(proactor_->CreateSocket());
+  proactor_->Await([&] {
+    error_code ec = sock->Connect(listen_ep_);
+    EXPECT_FALSE(ec) << ec.message();
+  });
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  string content(3 << 20, '\0');
+  for (size_t i = 0; i < content.size(); ++i)
+    content[i] = 'a' + (i * 7 + i / 4096) % 26;
+
+  string path = base::GetTestTempPath("sendfile.bin");
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(ssize_t(content.size()), write(fd, content.data(), content.size()));
+
+  constexpr size_t kOffset = 1000;
+  const string expected = content.substr(kOffset);
+
+  Fiber read_fb = proactor_->LaunchFiber([&] {
+    string received(expected.size(), '\0');
+    size_t offs = 0;
+    while (offs < received.size()) {
+      auto res = conn_socket_->Recv(
+          io::MutableBytes(reinterpret_cast<uint8_t*>(received.data()) + offs,
+                           received.size() - offs));
+      ASSERT_TRUE(res) << res.error().message();
+      offs += *res;
+    }
+    EXPECT_TRUE(expected == received);
+  });
+
+  proactor_->Await([&] {
+    // Asks for more than the file holds, so the transfer stops at eof.
+    auto res = sock->SendFile(fd, kOffset, content.size());
+    ASSERT_TRUE(res) << res.error().message();
+    EXPECT_EQ(expected.size(), *res);
+  });
+  read_fb.Join();
+
+  // The file position is not changed by SendFile.
+  EXPECT_EQ(off_t(content.size()), lseek(fd, 0, SEEK_CUR));
+  close(fd);
+  unlink(path.c_str());
+
+  proactor_->Await([&] { (void)sock->Close(); });
+}
+
+TEST_P(FiberSocketTest, SendFileTimeout) {
+  unique_ptr<FiberSocketBase> sock(proactor_->CreateSocket());
+  proactor_->Await([&] {
+    error_code ec = sock->Connect(listen_ep_);
+    EXPECT_FALSE(ec) << ec.message();
+  });
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  string path = base::GetTestTempPath("sendfile_timeout.bin");
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  string content(16 << 20, 'x');
+  ASSERT_EQ(ssize_t(content.size()), write(fd, content.data(), content.size()));
+
+  // Nobody reads, so the socket buffers fill up and the transfer times out.
+  proactor_->Await([&] {
+    sock->set_timeout(50);
+    auto res = sock->SendFile(fd, 0, content.size());
+    ASSERT_FALSE(res);
+    EXPECT_EQ(errc::timed_out, res.error()) << res.error().message();
+  });
+
+  close(fd);
+  unlink(path.c_str());
+
+  proactor_->Await([&] { (void)sock->Close(); });
+}
+
+TEST_P(FiberSocketTest, Cork) {
+  unique_ptr<FiberSocketBase> sock(proactor_->CreateSocket());
+  proactor_->Await([&] {
+    error_code ec = sock->Connect(listen_ep_);
+    EXPECT_FALSE(ec) << ec.message();
+  });
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  auto read_str = [&](size_t len) {
+    string res(len, '\0');
+    auto read_res = sock->Read(io::MutableBytes(reinterpret_cast<uint8_t*>(res.data()), len));
+    EXPECT_TRUE(read_res) << read_res.error().message();
+    return res;
+  };
+
+  proactor_->Await([&] {
+    conn_socket_->SetCork(1024);
+
+    // Small writes are coalesced and sent once the fiber suspends.
+    string expected;
+    for (unsigned i = 0; i < 100; ++i) {
+      string msg = absl::StrCat(":", i, "\r\n");
+      ASSERT_FALSE(conn_socket_->Write(io::Buffer(msg)));
+      expected += msg;
+    }
+    EXPECT_EQ(expected, read_str(expected.size()));
+
+    // Reaching the threshold sends the data right away.
+    string big(2000, 'x');
+    ASSERT_FALSE(conn_socket_->Write(io::Buffer("+OK\r\n")));
+    ASSERT_FALSE(conn_socket_->Write(io::Buffer(big)));
+    ASSERT_FALSE(conn_socket_->FlushCork());
+    EXPECT_EQ("+OK\r\n" + big, read_str(5 + big.size()));
+
+    ASSERT_FALSE(conn_socket_->Write(io::Buffer("-ERR\r\n")));
+    conn_socket_->SetCork(0);
+    EXPECT_EQ("-ERR\r\n", read_str(6));
+
+    // Asynchronous writes and SendFile keep their order relative to the corked data.
+    conn_socket_->SetCork(1024);
+    ASSERT_FALSE(conn_socket_->Write(io::Buffer("a")));
+    conn_socket_->AsyncWrite(io::Buffer("b"), [](error_code ec) { EXPECT_FALSE(ec); });
+    ASSERT_FALSE(conn_socket_->Write(io::Buffer("c")));
+    EXPECT_EQ("abc", read_str(3));
+
+    string path = base::GetTestTempPath("cork_sendfile.bin");
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(4, write(fd, "file", 4));
+    ASSERT_FALSE(conn_socket_->Write(io::Buffer("d")));
+    auto send_res = conn_socket_->SendFile(fd, 0, 4);
+    ASSERT_TRUE(send_res) << send_res.error().message();
+    EXPECT_EQ("dfile", read_str(5));
+    close(fd);
+    unlink(path.c_str());
+
+    // Shutdown sends the corked data first.
+    ASSERT_FALSE(conn_socket_->Write(io::Buffer("bye")));
+    ASSERT_FALSE(conn_socket_->Shutdown(SHUT_WR));
+    EXPECT_EQ("bye", read_str(3));
+  });
+
+  proactor_->Await([&] { (void)sock->Close(); });
+}
+
+TEST_P(FiberSocketTest, CorkCloseTimeout) {
+  unique_ptr<FiberSocketBase> sock(proactor_->CreateSocket());
+  proactor_->Await([&] {
+    error_code ec = sock->Connect(listen_ep_);
+    EXPECT_FALSE(ec) << ec.message();
+  });
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  // Nobody reads, so the flush of Close times out and the socket is shut down.
+  proactor_->Await([&] {
+    conn_socket_->set_timeout(50);
+    conn_socket_->SetCork(1U << 30);
+    string big(16 << 20, 'x');
+    ASSERT_FALSE(conn_socket_->Write(io::Buffer(big)));
+    (void)conn_socket_->Close();
+  });
+
+  proactor_->Await([&] { (void)sock->Close(); });
+}
+
+TEST_P(FiberSocketTest, BufferedSocket) {
+  unique_ptr<FiberSocketBase> sock(proactor_->CreateSocket());
+  proactor_->Await([&] {
+    error_code ec = sock->Connect(listen_ep_);
+    EXPECT_FALSE(ec) << ec.message();
+  });
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  proactor_->Await([&] {
+    // A header split between writes, followed by a body.
+    ASSERT_FALSE(sock->Write(io::Buffer("GET / HTTP/1.1\r\nHost: ")));
+    Fiber writer([&] {
+      ThisFiber::SleepFor(1ms);
+      EXPECT_FALSE(sock->Write(io::Buffer("a\r\n\r\nPING\r\n")));
+    });
+
+    BufferedSocket bs(conn_socket_.get(), 16);
+    auto line = bs.ReadUntil("\r\n\r\n");
+    ASSERT_TRUE(line) << line.error().message();
+    EXPECT_EQ("GET / HTTP/1.1\r\nHost: a\r\n\r\n", io::View(*line));
+    bs.Consume(line->size());
+    writer.Join();
+
+    ASSERT_FALSE(bs.FillAtLeast(6));
+    EXPECT_EQ("PING\r\n", io::View(bs.Peek()));
+
+    // The buffered input is returned first.
+    char buf[4];
+    iovec v{.iov_base = buf, .iov_len = sizeof(buf)};
+    auto rres = bs.Recv(&v, 1);
+    ASSERT_TRUE(rres);
+    EXPECT_EQ("PING", string_view(buf, *rres));
+    bs.Consume(2);
+    EXPECT_EQ(0u, bs.Peek().size());
+
+    ASSERT_FALSE(sock->Write(io::Buffer("long line\n")));
+    auto limit = bs.ReadUntil("\n", 3);
+    EXPECT_EQ(limit.error(), errc::message_size);
+
+    // Write side: one flush for all the queued buffers.
+    string big(10000, 'x');
+    bs.Enqueue(io::Buffer("+OK\r\n"));
+    {
+      string tmp = "$3\r\nfoo\r\n";
+      bs.EnqueueCopy(io::Buffer(tmp));
+    }
+    bs.EnqueueCopy(io::Buffer(":1\r\n"));
+    bs.Enqueue(io::Buffer(big));
+    EXPECT_EQ(5 + 9 + 4 + big.size(), bs.PendingWrite());
+    ASSERT_FALSE(bs.Flush());
+    EXPECT_EQ(0u, bs.PendingWrite());
+
+    string expected = absl::StrCat("+OK\r\n$3\r\nfoo\r\n:1\r\n", big);
+    string received(expected.size(), '\0');
+    auto read_res = sock->Read(
+        io::MutableBytes(reinterpret_cast<uint8_t*>(received.data()), received.size()));
+    ASSERT_TRUE(read_res);
+    EXPECT_EQ(expected.size(), *read_res);
+    EXPECT_EQ(expected, received);
+
+    // The wrapper is a stream for Asio and Beast.
+    AsioStreamAdapter<BufferedSocket> adapter(bs);
+    ASSERT_FALSE(sock->Write(io::Buffer("ping")));
+    char abuf[4];
+    boost::system::error_code bec;
+    boost::asio::read(adapter, boost::asio::buffer(abuf), bec);
+    ASSERT_FALSE(bec) << bec.message();
+    EXPECT_EQ("ping", string_view(abuf, sizeof(abuf)));
+
+    boost::asio::write(adapter, boost::asio::buffer("pong", 4), bec);
+    ASSERT_FALSE(bec) << bec.message();
+    read_res = sock->Read(io::MutableBytes(reinterpret_cast<uint8_t*>(abuf), sizeof(abuf)));
+    ASSERT_TRUE(read_res);
+    EXPECT_EQ("pong", string_view(abuf, sizeof(abuf)));
+  });
+}
+
 TEST_P(FiberSocketTest, UDS) {
   string path = base::GetTestTempPath("sock.uds");
   unlink(path.c_str());
@@ -330,5 +623,402 @@ TEST_P(FiberSocketTest, UDS) {
   LOG(INFO) << "Finished";
 }
 
+#ifdef __linux__
+// Tests of io_uring-only features, instantiated just for the uring engine.
+class UringSocketTest : public FiberSocketTest {};
+
+INSTANTIATE_TEST_SUITE_P(Engines, UringSocketTest, testing::Values("uring"));
+
+TEST_P(UringSocketTest, RecvMultishot) {
+
+  UringProactor* up = static_cast<UringProactor*>(proactor_.get());
+  int reg_res = proactor_->AwaitBrief([&] { return up->RegisterBufferRing(0, 16, 64); });
+  if (reg_res != 0) {
+    GTEST_SKIP() << "Buffer rings are not supported: " << reg_res;
+    return;
+  }
+
+  unique_ptr<FiberSocketBase> sock(proactor_->CreateSocket());
+  proactor_->Await([&] {
+    error_code ec = sock->Connect(listen_ep_);
+    EXPECT_FALSE(ec) << ec.message();
+  });
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  proactor_->Await([&] {
+    UringSocket* conn = static_cast<UringSocket*>(conn_socket_.get());
+    conn->EnableRecvMultishot(0);
+
+    // Spans several provided buffers.
+    string payload(150, 'x');
+    auto wres = sock->WriteSome(io::Buffer(payload));
+    EXPECT_EQ(payload.size(), wres.value_or(0));
+
+    uint8_t buf[256];
+    size_t total = 0;
+    while (total < payload.size()) {
+      auto rres = conn->Recv(io::MutableBytes(buf + total, sizeof(buf) - total));
+      ASSERT_TRUE(rres) << rres.error().message();
+      total += *rres;
+    }
+    EXPECT_EQ(payload, io::View(io::Bytes(buf, total)));
+
+    wres = sock->WriteSome(io::Buffer("PING"));
+    EXPECT_EQ(4u, wres.value_or(0));
+    auto pres = conn->RecvProvided();
+    ASSERT_TRUE(pres);
+    EXPECT_EQ("PING", io::View(pres->buffer));
+    conn->ReturnProvided(*pres);
+
+    (void)sock->Close();
+    auto rres = conn->Recv(io::MutableBytes(buf));
+    EXPECT_EQ(rres.error(), errc::connection_aborted);
+  });
+}
+
+TEST_P(UringSocketTest, RecvAdaptive) {
+
+  UringProactor* up = static_cast<UringProactor*>(proactor_.get());
+  if (!up->HasRecvPollFirst()) {
+    GTEST_SKIP() << "IORING_RECVSEND_POLL_FIRST is not supported";
+    return;
+  }
+
+  unique_ptr<FiberSocketBase> sock(proactor_->CreateSocket());
+  proactor_->Await([&] {
+    error_code ec = sock->Connect(listen_ep_);
+    EXPECT_FALSE(ec) << ec.message();
+  });
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  proactor_->Await([&] {
+    UringSocket* conn = static_cast<UringSocket*>(conn_socket_.get());
+    conn->SetRecvAdaptive(true);
+    UringSocket::RecvStats start = UringSocket::GetRecvStats();
+
+    // Busy phase: the data is always ready, so the socket switches to inline receives.
+    string payload(4000, 'x');
+    EXPECT_FALSE(sock->Write(io::Buffer(payload)));
+
+    char buf[100];
+    size_t total = 0;
+    while (total < payload.size()) {
+      auto rres = conn->Recv(io::MutableBytes(reinterpret_cast<uint8_t*>(buf), sizeof(buf)));
+      ASSERT_TRUE(rres) << rres.error().message();
+      total += *rres;
+    }
+    UringSocket::RecvStats busy = UringSocket::GetRecvStats();
+    EXPECT_GT(busy.inline_hits, start.inline_hits);
+
+    // Idle phase: every receive waits for the peer, so the socket switches to poll-first.
+    for (unsigned i = 0; i < 20; ++i) {
+      Fiber writer([&] {
+        ThisFiber::SleepFor(1ms);
+        EXPECT_FALSE(sock->Write(io::Buffer("ping")));
+      });
+      auto rres = conn->Recv(io::MutableBytes(reinterpret_cast<uint8_t*>(buf), sizeof(buf)));
+      ASSERT_TRUE(rres) << rres.error().message();
+      EXPECT_EQ(4u, *rres);
+      writer.Join();
+    }
+    UringSocket::RecvStats idle = UringSocket::GetRecvStats();
+    EXPECT_GT(idle.poll_first_cnt, busy.poll_first_cnt);
+    EXPECT_GT(idle.inline_misses, busy.inline_misses);
+
+    (void)sock->Close();
+    auto rres = conn->Recv(io::MutableBytes(reinterpret_cast<uint8_t*>(buf), sizeof(buf)));
+    EXPECT_EQ(rres.error(), errc::connection_aborted);
+  });
+}
+
+TEST_P(UringSocketTest, AcceptMultishot) {
+
+  // Satisfy the single-shot accept that was issued by SetUp.
+  unique_ptr<FiberSocketBase> first(proactor_->CreateSocket());
+  proactor_->Await([&] {
+    error_code ec = first->Connect(listen_ep_);
+    EXPECT_FALSE(ec) << ec.message();
+  });
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  UringSocket* listener = static_cast<UringSocket*>(listen_socket_.get());
+  bool enabled = proactor_->AwaitBrief([&] { return listener->EnableAcceptMultishot(); });
+  if (!enabled) {
+    GTEST_SKIP() << "Multishot accept is not supported";
+    return;
+  }
+
+  constexpr unsigned kNumConns = 3;
+  vector<unique_ptr<FiberSocketBase>> accepted;
+  Fiber accept_fb = proactor_->LaunchFiber("AcceptMulti", [&] {
+    for (unsigned i = 0; i < kNumConns; ++i) {
+      auto res = listener->Accept();
+      ASSERT_TRUE(res) << res.error().message();
+      accepted.emplace_back(*res);
+      accepted.back()->SetProactor(proactor_.get());
+    }
+  });
+
+  vector<unique_ptr<FiberSocketBase>> clients;
+  proactor_->Await([&] {
+    for (unsigned i = 0; i < kNumConns; ++i) {
+      clients.emplace_back(proactor_->CreateSocket());
+      error_code ec = clients.back()->Connect(listen_ep_);
+      EXPECT_FALSE(ec) << ec.message();
+    }
+  });
+  accept_fb.Join();
+  ASSERT_EQ(kNumConns, accepted.size());
+
+  proactor_->Await([&] {
+    auto wres = clients[1]->WriteSome(io::Buffer("PING"));
+    EXPECT_EQ(4u, wres.value_or(0));
+
+    uint8_t buf[16];
+    auto rres = accepted[1]->Recv(io::MutableBytes(buf));
+    ASSERT_TRUE(rres);
+    EXPECT_EQ("PING", io::View(io::Bytes(buf, *rres)));
+
+    for (auto& sock : accepted)
+      (void)sock->Close();
+    for (auto& sock : clients)
+      (void)sock->Close();
+    (void)first->Close();
+  });
+}
+#endif
+
+#ifdef __linux__
+TEST_P(FiberSocketTest, Datagram) {
+  constexpr unsigned kNumDgrams = 10;
+  constexpr uint16_t kBufGroup = 3;
+
+  auto address = boost::asio::ip::make_address("127.0.0.1");
+  DatagramSocket::endpoint_type bind_ep{address, 0};
+
+  DatagramSocket sender(proactor_.get()), receiver(proactor_.get());
+  proactor_->Await([&] {
+    ASSERT_FALSE(sender.Bind(bind_ep));
+    ASSERT_FALSE(receiver.Bind(bind_ep));
+  });
+  DatagramSocket::endpoint_type recv_ep = receiver.LocalEndpoint();
+  uint16_t send_port = sender.LocalEndpoint().port();
+
+  bool multishot = false;
+  if (GetParam() == "uring") {
+    UringProactor* up = static_cast<UringProactor*>(proactor_.get());
+    multishot = up->AwaitBrief([&] {
+      return up->RegisterBufferRing(kBufGroup, 16, 2048) == 0 &&
+             receiver.EnableRecvMultishot(kBufGroup);
+    });
+    LOG(INFO) << "Multishot recvmsg: " << multishot;
+  }
+
+  Fiber recv_fb = proactor_->LaunchFiber([&] {
+    char storage[kNumDgrams][64];
+    DatagramSocket::Datagram dgrams[kNumDgrams];
+    unsigned received = 0;
+    while (received < kNumDgrams) {
+      for (unsigned i = 0; i < kNumDgrams; ++i) {
+        dgrams[i].data = reinterpret_cast<uint8_t*>(storage[i]);
+        dgrams[i].size = sizeof(storage[i]);
+      }
+
+      auto res = receiver.RecvBatch(absl::MakeSpan(dgrams, kNumDgrams - received));
+      ASSERT_TRUE(res) << res.error().message();
+      for (unsigned i = 0; i < *res; ++i) {
+        EXPECT_EQ(absl::StrCat("dgram", received + i), string(storage[i], dgrams[i].size));
+        EXPECT_EQ(send_port, dgrams[i].peer.port());
+        EXPECT_FALSE(dgrams[i].truncated);
+      }
+      received += *res;
+    }
+  });
+
+  proactor_->Await([&] {
+    string payloads[kNumDgrams];
+    DatagramSocket::Datagram dgrams[kNumDgrams];
+    for (unsigned i = 0; i < kNumDgrams; ++i) {
+      payloads[i] = absl::StrCat("dgram", i);
+      dgrams[i].data = reinterpret_cast<uint8_t*>(payloads[i].data());
+      dgrams[i].size = payloads[i].size();
+      dgrams[i].peer = recv_ep;
+    }
+
+    unsigned sent = 0;
+    while (sent < kNumDgrams) {
+      auto res = sender.SendBatch(absl::MakeConstSpan(dgrams + sent, kNumDgrams - sent));
+      ASSERT_TRUE(res) << res.error().message();
+      sent += *res;
+    }
+  });
+  recv_fb.Join();
+
+  proactor_->Await([&] {
+    EXPECT_FALSE(sender.Close());
+    EXPECT_FALSE(receiver.Close());
+  });
+}
+
+// Packets per second over loopback, range(0) selects io_uring.
+void BM_DatagramPps(benchmark::State& state) {
+  constexpr unsigned kBatch = 32, kSize = 64, kPerIter = 1024;
+
+  unique_ptr<Pool> pool(state.range(0) ? Pool::IOUring(kRingDepth, 1) : Pool::Epoll(1));
+  pool->Run();
+  ProactorBase* proactor = pool->at(0);
+
+  auto address = boost::asio::ip::make_address("127.0.0.1");
+  DatagramSocket::endpoint_type bind_ep{address, 0};
+
+  DatagramSocket sender(proactor), receiver(proactor);
+  proactor->Await([&] {
+    CHECK(!receiver.Bind(bind_ep));
+    CHECK(!sender.Connect(receiver.LocalEndpoint()));
+  });
+
+  // Datagrams can be dropped, so the receiver stops once it sees the marker that
+  // the sender repeats after the payload.
+  bool done = false;
+  size_t received = 0;
+  Fiber recv_fb = proactor->LaunchFiber([&] {
+    uint8_t storage[kBatch][kSize];
+    DatagramSocket::Datagram dgrams[kBatch];
+    while (!done) {
+      for (unsigned i = 0; i < kBatch; ++i) {
+        dgrams[i].data = storage[i];
+        dgrams[i].size = kSize;
+      }
+      auto res = receiver.RecvBatch(absl::MakeSpan(dgrams));
+      CHECK(res) << res.error().message();
+      for (unsigned i = 0; i < *res; ++i) {
+        if (dgrams[i].size == 1)
+          done = true;
+        else
+          ++received;
+      }
+    }
+  });
+
+  uint8_t payload[kSize] = {0};
+  DatagramSocket::Datagram dgrams[kBatch];
+  for (auto& dgram : dgrams) {
+    dgram.data = payload;
+    dgram.size = kSize;
+  }
+
+  while (state.KeepRunning()) {
+    proactor->Await([&] {
+      for (unsigned sent = 0; sent < kPerIter;) {
+        auto res = sender.SendBatch(absl::MakeConstSpan(dgrams));
+        CHECK(res) << res.error().message();
+        sent += *res;
+      }
+    });
+  }
+
+  proactor->Await([&] {
+    DatagramSocket::Datagram marker;
+    marker.data = payload;
+    marker.size = 1;
+    while (!done) {
+      CHECK(sender.SendBatch(absl::MakeConstSpan(&marker, 1)));
+      ThisFiber::SleepFor(1ms);
+    }
+  });
+  recv_fb.Join();
+
+  // Counts the datagrams that were received, not the ones that were sent.
+  state.SetItemsProcessed(received);
+
+  proactor->Await([&] {
+    CHECK(!sender.Close());
+    CHECK(!receiver.Close());
+  });
+  pool->Stop();
+}
+BENCHMARK(BM_DatagramPps)->Arg(0)->Arg(1)->ArgName("uring")->UseRealTime();
+
+// A ping server at pipeline depth 16: the client sends 16 requests at once and the server
+// answers each of them with its own write. range(0) enables corking, range(1) selects io_uring.
+void BM_PipelinedPing(benchmark::State& state) {
+  constexpr unsigned kDepth = 16;
+  const string_view kPing = "PING\r\n", kPong = "+PONG\r\n";
+
+  unique_ptr<Pool> pool(state.range(1) ? Pool::IOUring(kRingDepth, 1) : Pool::Epoll(1));
+  pool->Run();
+  ProactorBase* proactor = pool->at(0);
+
+  unique_ptr<FiberSocketBase> listener(proactor->CreateSocket());
+  unique_ptr<FiberSocketBase> client(proactor->CreateSocket()), server;
+  proactor->Await([&] {
+    CHECK(!listener->Listen(0, 0));
+    auto address = boost::asio::ip::make_address("127.0.0.1");
+    FiberSocketBase::endpoint_type ep{address, listener->LocalEndpoint().port()};
+
+    Fiber accept_fb([&] {
+      auto res = listener->Accept();
+      CHECK(res) << res.error().message();
+      server.reset(*res);
+      server->SetProactor(proactor);
+    });
+    CHECK(!client->Connect(ep));
+    accept_fb.Join();
+    if (state.range(0))
+      server->SetCork(1U << 16);
+  });
+
+  Fiber server_fb = proactor->LaunchFiber([&] {
+    char buf[256];
+    size_t partial = 0;  // bytes of an incomplete request.
+    while (true) {
+      auto res = server->Recv(io::MutableBytes(reinterpret_cast<uint8_t*>(buf), sizeof(buf)));
+      if (!res || *res == 0)
+        break;
+
+      // Every request is answered separately, as a request handler would do.
+      partial += *res;
+      for (; partial >= kPing.size(); partial -= kPing.size()) {
+        if (server->Write(io::Buffer(kPong)))
+          return;
+      }
+    }
+  });
+
+  string requests, responses(kDepth * kPong.size(), '\0');
+  for (unsigned i = 0; i < kDepth; ++i)
+    requests.append(kPing);
+
+  while (state.KeepRunning()) {
+    proactor->Await([&] {
+      CHECK(!client->Write(io::Buffer(requests)));
+      auto res = client->Read(
+          io::MutableBytes(reinterpret_cast<uint8_t*>(responses.data()), responses.size()));
+      CHECK(res) << res.error().message();
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * kDepth);
+
+  proactor->Await([&] {
+    (void)client->Shutdown(SHUT_RDWR);
+    server_fb.Join();
+    (void)server->Close();
+    (void)client->Close();
+    (void)listener->Close();
+  });
+  pool->Stop();
+}
+BENCHMARK(BM_PipelinedPing)
+    ->Args({0, 0})
+    ->Args({1, 0})
+    ->Args({0, 1})
+    ->Args({1, 1})
+    ->ArgNames({"cork", "uring"})
+    ->UseRealTime();
+#endif
+
 }  // namespace fb2
 }  // namespace util
@@ -4,23 +4,35 @@
 
 #include "util/fibers/fibers.h"
 
+#include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
 
 #include <condition_variable>
 #include <mutex>
 #include <thread>
 
+#include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "util/fibers/epoll_proactor.h"
 #include "util/fibers/future.h"
+#include "util/fibers/pool.h"
 #include "util/fibers/synchronization.h"
 
 #ifdef __linux__
+#include <sys/socket.h>
 #include <sys/syscall.h>
 
+#include "util/fiber_socket_base.h"
+#include "util/fibers/append_log.h"
+#include "util/fibers/file_ops.h"
+#include "util/fibers/fiberqueue_threadpool.h"
+#include "util/fibers/uring_file.h"
 #include "util/fibers/uring_proactor.h"
 
+ABSL_DECLARE_FLAG(uint32_t, uring_sqpoll_threads);
+ABSL_DECLARE_FLAG(bool, uring_defer_taskrun);
+
 // older linux systems do not expose this system call so we wrap it in our own function.
 int my_gettid() {
   return syscall(SYS_gettid);
@@ -733,5 +745,621 @@ TEST_P(ProactorTest, Periodic) {
   EXPECT_GT(cnt, 0u);
 }
 
+#ifdef __linux__
+// Tests of io_uring-only features, instantiated just for the uring engine.
+class UringProactorTest : public ProactorTest {};
+
+INSTANTIATE_TEST_SUITE_P(Engines, UringProactorTest, testing::Values("uring"));
+
+TEST_P(UringProactorTest, RegisteredBuffers) {
+
+  UringProactor* up = static_cast<UringProactor*>(proactor());
+  int reg_res = up->AwaitBrief([&] { return up->RegisterBuffers(1U << 22); });
+  if (reg_res != 0) {
+    GTEST_SKIP() << "Could not register buffers: " << reg_res;
+    return;
+  }
+
+  up->Await([&] {
+    using RegisteredBuffer = UringProactor::RegisteredBuffer;
+    RegisteredBuffer small = up->ProvideRegisteredBuffer(100);
+    ASSERT_TRUE(small.data);
+    EXPECT_EQ(UringProactor::kMinRegBufSize, small.size);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(small.data) % 4096);
+
+    RegisteredBuffer buf = up->ProvideRegisteredBuffer(20000);
+    ASSERT_TRUE(buf.data);
+    EXPECT_EQ(32768u, buf.size);
+    EXPECT_EQ(buf.buf_index, up->FindRegisteredBuffer(buf.data + 10, 100));
+    EXPECT_EQ(-1, up->FindRegisteredBuffer(&buf, sizeof(buf)));
+    EXPECT_FALSE(up->ProvideRegisteredBuffer(UringProactor::kMaxRegBufSize + 1).data);
+
+    // The largest class does not fit into its share of the budget.
+    EXPECT_FALSE(up->ProvideRegisteredBuffer(UringProactor::kMaxRegBufSize).data);
+
+    string path = absl::StrCat(testing::TempDir(), "/regbuf.bin");
+    auto file = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_TRUE(file);
+
+    memset(buf.data, 'r', buf.size);
+    error_code ec = (*file)->Write(io::Bytes(buf.data, buf.size), 0, 0);
+    ASSERT_FALSE(ec) << ec.message();
+
+    memset(buf.data, 0, buf.size);
+    iovec v{buf.data, buf.size};
+    auto read_res = (*file)->ReadSome(&v, 1, 0, 0);
+    ASSERT_TRUE(read_res);
+    EXPECT_EQ(buf.size, *read_res);
+    EXPECT_EQ(string(buf.size, 'r'), string(reinterpret_cast<char*>(buf.data), buf.size));
+
+    EXPECT_FALSE((*file)->Close());
+    unlink(path.c_str());
+
+    up->ReturnRegisteredBuffer(buf);
+    up->ReturnRegisteredBuffer(small);
+  });
+}
+
+TEST_P(UringProactorTest, ReadAhead) {
+
+  UringProactor* up = static_cast<UringProactor*>(proactor());
+  up->Await([&] {
+    constexpr size_t kFileSize = (1U << 20) + 1234;
+    string content(kFileSize, '\0');
+    for (size_t i = 0; i < kFileSize; ++i)
+      content[i] = 'a' + (i * 7 + i / 4096) % 26;
+
+    string path = absl::StrCat(testing::TempDir(), "/readahead.bin");
+    auto file = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_TRUE(file);
+    io::Bytes src(reinterpret_cast<uint8_t*>(content.data()), kFileSize);
+    error_code ec = (*file)->Write(src, 0, 0);
+    ASSERT_FALSE(ec) << ec.message();
+    EXPECT_FALSE((*file)->Close());
+
+    for (bool direct : {false, true}) {
+      io::ReadonlyFile::Options opts;
+      opts.readahead_depth = 8;
+      opts.readahead_block = 1U << 16;
+      opts.direct = direct;
+
+      auto res = fb2::OpenRead(path, opts);
+      if (!res) {
+        // For example, tmpfs does not support O_DIRECT.
+        LOG(WARNING) << "Could not open with direct=" << direct << ": " << res.error().message();
+        continue;
+      }
+      unique_ptr<io::ReadonlyFile> rf(*res);
+      ASSERT_EQ(kFileSize, rf->Size());
+
+      // Sequential scan in chunks that do not align with the blocks.
+      string dest(kFileSize, '\0');
+      size_t offset = 0;
+      while (offset < kFileSize) {
+        size_t chunk = min<size_t>(10000, kFileSize - offset);
+        auto read_res = rf->Read(offset, {reinterpret_cast<uint8_t*>(dest.data()) + offset, chunk});
+        ASSERT_TRUE(read_res) << read_res.error().message();
+        ASSERT_EQ(chunk, *read_res);
+        offset += chunk;
+      }
+      EXPECT_TRUE(dest == content);
+
+      // Backward and random reads restart the read-ahead.
+      char buf[5000];
+      for (size_t pos : {size_t(1000), size_t(500000), size_t(20), kFileSize - 100}) {
+        auto read_res = rf->Read(pos, {reinterpret_cast<uint8_t*>(buf), sizeof(buf)});
+        ASSERT_TRUE(read_res);
+        size_t expected = min(sizeof(buf), kFileSize - pos);
+        ASSERT_EQ(expected, *read_res);
+        EXPECT_EQ(content.substr(pos, expected), string(buf, expected));
+      }
+
+      // Reading past the end returns eof.
+      auto read_res = rf->Read(kFileSize, {reinterpret_cast<uint8_t*>(buf), sizeof(buf)});
+      ASSERT_TRUE(read_res);
+      EXPECT_EQ(0u, *read_res);
+
+      EXPECT_FALSE(rf->Close());
+    }
+    unlink(path.c_str());
+  });
+}
+
+TEST_P(UringProactorTest, BufferedWrite) {
+
+  UringProactor* up = static_cast<UringProactor*>(proactor());
+  up->Await([&] {
+    constexpr size_t kFileSize = (1U << 20) + 4321;
+    string content(kFileSize, '\0');
+    for (size_t i = 0; i < kFileSize; ++i)
+      content[i] = 'a' + (i * 13 + i / 4096) % 26;
+
+    string path = absl::StrCat(testing::TempDir(), "/buffered.bin");
+    for (bool direct : {false, true}) {
+      io::WriteFile::Options opts;
+      opts.buffers_in_flight = 3;
+      opts.buffer_size = 1U << 16;
+      opts.direct = direct;
+
+      auto res = fb2::OpenWrite(path, opts);
+      if (!res) {
+        // For example, tmpfs does not support O_DIRECT.
+        LOG(WARNING) << "Could not open with direct=" << direct << ": " << res.error().message();
+        continue;
+      }
+      unique_ptr<io::WriteFile> wf(*res);
+
+      // Chunks smaller and larger than the buffers.
+      size_t offset = 0, chunk = 100;
+      while (offset < kFileSize) {
+        size_t len = min(chunk, kFileSize - offset);
+        error_code ec = wf->Write(string_view(content).substr(offset, len));
+        ASSERT_FALSE(ec) << ec.message();
+        offset += len;
+        chunk = chunk * 3 % 200000 + 1;
+      }
+      error_code ec = wf->Close();
+      ASSERT_FALSE(ec) << ec.message();
+
+      auto rres = OpenRead(path);
+      ASSERT_TRUE(rres);
+      unique_ptr<io::ReadonlyFile> rf(*rres);
+      ASSERT_EQ(kFileSize, rf->Size());
+
+      string dest(kFileSize, '\0');
+      auto read_res = rf->Read(0, {reinterpret_cast<uint8_t*>(dest.data()), kFileSize});
+      ASSERT_TRUE(read_res);
+      EXPECT_EQ(kFileSize, *read_res);
+      EXPECT_TRUE(dest == content);
+      EXPECT_FALSE(rf->Close());
+    }
+
+    // Appends with buffers in flight land after the existing content.
+    io::WriteFile::Options opts;
+    opts.append = true;
+    opts.buffers_in_flight = 3;
+    opts.buffer_size = 4096;
+    auto res = fb2::OpenWrite(path, opts);
+    ASSERT_TRUE(res) << res.error().message();
+    unique_ptr<io::WriteFile> wf(*res);
+    ASSERT_FALSE(wf->Write(string_view(content).substr(0, 50000)));
+    ASSERT_FALSE(wf->Close());
+
+    struct stat sb;
+    ASSERT_EQ(0, stat(path.c_str(), &sb));
+    EXPECT_EQ(kFileSize + 50000, size_t(sb.st_size));
+
+    auto rres = OpenRead(path);
+    ASSERT_TRUE(rres);
+    unique_ptr<io::ReadonlyFile> rf(*rres);
+    string dest(50000, '\0');
+    auto read_res = rf->Read(kFileSize, {reinterpret_cast<uint8_t*>(dest.data()), dest.size()});
+    ASSERT_TRUE(read_res);
+    EXPECT_TRUE(dest == content.substr(0, 50000));
+    EXPECT_FALSE(rf->Close());
+
+    // The end of an existing file is not aligned for O_DIRECT.
+    opts.direct = true;
+    res = fb2::OpenWrite(path, opts);
+    ASSERT_FALSE(res);
+    EXPECT_EQ(errc::invalid_argument, res.error());
+
+    // Files that are destroyed without Close() write their buffered data.
+    opts.direct = false;
+    opts.append = false;
+    res = fb2::OpenWrite(path, opts);
+    ASSERT_TRUE(res) << res.error().message();
+    wf.reset(*res);
+    ASSERT_FALSE(wf->Write(string_view(content).substr(0, 5000)));
+    wf.reset();
+    ASSERT_EQ(0, stat(path.c_str(), &sb));
+    EXPECT_EQ(5000, sb.st_size);
+
+    unlink(path.c_str());
+  });
+}
+
+TEST_P(UringProactorTest, AppendLog) {
+
+  UringProactor* up = static_cast<UringProactor*>(proactor());
+  up->Await([&] {
+    constexpr unsigned kFibers = 50, kRecords = 20;
+    string path = absl::StrCat(testing::TempDir(), "/append.log");
+    unlink(path.c_str());
+
+    auto make_record = [](unsigned fiber, unsigned index) {
+      return absl::StrCat(fiber, ":", index, ":", string(fiber * 7 + index, 'x'));
+    };
+
+    auto res = AppendLog::Open(path);
+    ASSERT_TRUE(res) << res.error().message();
+    unique_ptr<AppendLog> log = std::move(*res);
+
+    vector<Fiber> fibers;
+    for (unsigned i = 0; i < kFibers; ++i) {
+      fibers.emplace_back([&, i] {
+        for (unsigned j = 0; j < kRecords; ++j) {
+          string record = make_record(i, j);
+          error_code ec = log->Append(io::Buffer(record));
+          ASSERT_FALSE(ec) << ec.message();
+        }
+      });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+    size_t log_size = log->size();
+    ASSERT_FALSE(log->Close());
+
+    // Every record is read back, records of each fiber in order.
+    auto verify = [&](size_t expected_count) {
+      auto file = OpenLinux(path, O_RDONLY, 0);
+      ASSERT_TRUE(file);
+      AppendLogReader reader(file->get());
+      vector<unsigned> next(kFibers, 0);
+      string record;
+      size_t count = 0;
+      while (true) {
+        auto next_res = reader.Next(&record);
+        ASSERT_TRUE(next_res);
+        if (!*next_res)
+          break;
+        unsigned fiber = 0;
+        ASSERT_TRUE(absl::SimpleAtoi(record.substr(0, record.find(':')), &fiber));
+        ASSERT_LT(fiber, kFibers);
+        EXPECT_EQ(make_record(fiber, next[fiber]), record);
+        ++next[fiber];
+        ++count;
+      }
+      EXPECT_EQ(expected_count, count);
+      (*file)->Close();
+    };
+    verify(kFibers * kRecords);
+
+    // Simulate a torn write: garbage after the last valid record is truncated on reopen
+    // and new records follow the old ones.
+    int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(11, write(fd, "\x20\0\0\0garbage", 11));
+    close(fd);
+
+    res = AppendLog::Open(path, AppendLog::Options{.max_delay_usec = 0});
+    ASSERT_TRUE(res) << res.error().message();
+    log = std::move(*res);
+    EXPECT_EQ(log_size, log->size());
+    string record = make_record(0, kRecords);
+    ASSERT_FALSE(log->Append(io::Buffer(record)));
+    ASSERT_FALSE(log->Close());
+
+    struct stat sb;
+    ASSERT_EQ(0, stat(path.c_str(), &sb));
+    EXPECT_EQ(log_size + AppendLog::kHeaderSize + record.size(), size_t(sb.st_size));
+    verify(kFibers * kRecords + 1);
+
+    unlink(path.c_str());
+  });
+}
+
+TEST_P(UringProactorTest, AppendLogCloseInFlight) {
+
+  UringProactor* up = static_cast<UringProactor*>(proactor());
+  up->Await([&] {
+    constexpr unsigned kFibers = 10;
+    string path = absl::StrCat(testing::TempDir(), "/append_close.log");
+    unlink(path.c_str());
+
+    // The group waits long enough for Close to be called while the appends are in flight.
+    auto res = AppendLog::Open(path, AppendLog::Options{.max_delay_usec = 100000});
+    ASSERT_TRUE(res) << res.error().message();
+    unique_ptr<AppendLog> log = std::move(*res);
+
+    unsigned done = 0;
+    vector<Fiber> fibers;
+    for (unsigned i = 0; i < kFibers; ++i) {
+      fibers.emplace_back([&] {
+        EXPECT_FALSE(log->Append(io::Buffer("record")));
+        ++done;
+      });
+    }
+    ThisFiber::Yield();  // the fibers wait for their commit group.
+
+    // Starts only after Close was called.
+    error_code late_ec;
+    fibers.emplace_back([&] { late_ec = log->Append(io::Buffer("late")); });
+
+    ASSERT_FALSE(log->Close());
+    EXPECT_EQ(kFibers, done);
+    log.reset();
+
+    for (auto& fb : fibers)
+      fb.Join();
+    EXPECT_EQ(errc::operation_canceled, late_ec);
+
+    struct stat sb;
+    ASSERT_EQ(0, stat(path.c_str(), &sb));
+    EXPECT_EQ(kFibers * (AppendLog::kHeaderSize + 6), size_t(sb.st_size));
+
+    unlink(path.c_str());
+  });
+}
+
+TEST_P(UringProactorTest, AppendLogBackpressure) {
+
+  UringProactor* up = static_cast<UringProactor*>(proactor());
+  up->Await([&] {
+    constexpr unsigned kFibers = 20, kRecords = 10;
+    string path = absl::StrCat(testing::TempDir(), "/append_backpressure.log");
+    unlink(path.c_str());
+
+    // Every group fills up, so most appends wait for the commit in flight.
+    auto res = AppendLog::Open(path, AppendLog::Options{.max_batch_bytes = 4096});
+    ASSERT_TRUE(res) << res.error().message();
+    unique_ptr<AppendLog> log = std::move(*res);
+
+    uint8_t byte = 0;
+    EXPECT_EQ(errc::message_size, log->Append({&byte, AppendLog::kMaxRecordSize + 1}));
+
+    string record(3000, 'r');
+    vector<Fiber> fibers;
+    for (unsigned i = 0; i < kFibers; ++i) {
+      fibers.emplace_back([&] {
+        for (unsigned j = 0; j < kRecords; ++j)
+          EXPECT_FALSE(log->Append(io::Buffer(record)));
+      });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+    ASSERT_FALSE(log->Close());
+
+    struct stat sb;
+    ASSERT_EQ(0, stat(path.c_str(), &sb));
+    EXPECT_EQ(kFibers * kRecords * (AppendLog::kHeaderSize + record.size()), size_t(sb.st_size));
+
+    unlink(path.c_str());
+  });
+}
+
+TEST_P(ProactorTest, FileOps) {
+  FiberQueueThreadPool tp(1);
+  string dir = absl::StrCat(testing::TempDir(), "/file_ops_", string(GetParam()));
+
+  // On epoll the calls either block or run in the thread pool.
+  for (bool use_tp : {false, true}) {
+    SetFileOpsThreadPool(use_tp ? &tp : nullptr);
+    proactor()->Await([&] {
+      ASSERT_FALSE(Mkdirat(AT_FDCWD, dir));
+      EXPECT_EQ(EEXIST, Mkdirat(AT_FDCWD, dir).value());
+
+      string path = absl::StrCat(dir, "/a.txt");
+      auto fd = OpenAt(AT_FDCWD, path, O_CREAT | O_WRONLY | O_CLOEXEC);
+      ASSERT_TRUE(fd) << fd.error().message();
+      ASSERT_EQ(5, write(*fd, "hello", 5));
+      close(*fd);
+
+      auto stx = Statx(AT_FDCWD, path);
+      ASSERT_TRUE(stx);
+      EXPECT_EQ(5u, stx->stx_size);
+      EXPECT_TRUE(S_ISREG(stx->stx_mode));
+
+      string new_path = absl::StrCat(dir, "/b.txt");
+      ASSERT_FALSE(Renameat(AT_FDCWD, path, AT_FDCWD, new_path));
+      EXPECT_EQ(ENOENT, Statx(AT_FDCWD, path).error().value());
+      EXPECT_EQ(ENOENT, OpenAt(AT_FDCWD, path, O_RDONLY).error().value());
+
+      for (unsigned i = 0; i < 100; ++i) {
+        fd = OpenAt(AT_FDCWD, absl::StrCat(dir, "/f", i, ".bin"), O_CREAT | O_WRONLY);
+        ASSERT_TRUE(fd);
+        ASSERT_EQ(0, ftruncate(*fd, i));
+        close(*fd);
+      }
+
+      auto files = StatFiles(absl::StrCat(dir, "/f*.bin"));
+      ASSERT_TRUE(files);
+      ASSERT_EQ(100u, files->size());
+      size_t total = 0;
+      for (const auto& file : *files)
+        total += file.size;
+      EXPECT_EQ(99u * 100 / 2, total);
+
+      for (unsigned i = 0; i < 100; ++i)
+        ASSERT_FALSE(Unlinkat(AT_FDCWD, absl::StrCat(dir, "/f", i, ".bin")));
+      ASSERT_FALSE(Unlinkat(AT_FDCWD, new_path));
+      EXPECT_EQ(ENOENT, Unlinkat(AT_FDCWD, new_path).value());
+      ASSERT_FALSE(Unlinkat(AT_FDCWD, dir, AT_REMOVEDIR));
+
+      files = StatFiles(absl::StrCat(dir, "/*"));
+      ASSERT_TRUE(files);
+      EXPECT_TRUE(files->empty());
+    });
+  }
+  SetFileOpsThreadPool(nullptr);
+}
+
+TEST_P(UringProactorTest, FiberChain) {
+
+  UringProactor* up = static_cast<UringProactor*>(proactor());
+  up->Await([&] {
+    string path = absl::StrCat(testing::TempDir(), "/chain.bin");
+    auto file = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_TRUE(file);
+    int fd = (*file)->fd();
+
+    char buf[16] = "chained";
+    char rbuf[16] = {0};
+    {
+      FiberChain chain(up, 3);
+      chain.Next().PrepWrite(fd, buf, 7, 0);
+      chain.Next().PrepFSync(fd, IORING_FSYNC_DATASYNC);
+      chain.Next().PrepRead(fd, rbuf, sizeof(rbuf), 0);
+      const FiberChain::IoResult* res = chain.Get();
+      EXPECT_EQ(7, res[0]);
+      EXPECT_EQ(0, res[1]);
+      EXPECT_EQ(7, res[2]);
+      EXPECT_STREQ("chained", rbuf);
+    }
+
+    {
+      // A failure breaks the soft link, but not the hard one.
+      FiberChain chain(up, 3);
+      chain.Next(true).PrepRead(-1, rbuf, sizeof(rbuf), 0);
+      chain.Next().PrepRead(fd, rbuf, sizeof(rbuf), 0);
+      chain.Next().PrepRead(fd, rbuf, sizeof(rbuf), 0);
+      const FiberChain::IoResult* res = chain.Get();
+      EXPECT_EQ(-EBADF, res[0]);
+      EXPECT_EQ(7, res[1]);
+      EXPECT_EQ(7, res[2]);
+    }
+
+    {
+      FiberChain chain(up, 2);
+      chain.Next().PrepRead(-1, rbuf, sizeof(rbuf), 0);
+      chain.Next().PrepRead(fd, rbuf, sizeof(rbuf), 0);
+      const FiberChain::IoResult* res = chain.Get();
+      EXPECT_EQ(-EBADF, res[0]);
+      EXPECT_EQ(-ECANCELED, res[1]);
+    }
+
+    EXPECT_FALSE((*file)->Close());
+    unlink(path.c_str());
+  });
+}
+
+TEST_F(FiberTest, SqPollPool) {
+  absl::SetFlag(&FLAGS_uring_sqpoll_threads, 1);
+  unique_ptr<Pool> pool(Pool::IOUring(16, 3));
+  absl::SetFlag(&FLAGS_uring_sqpoll_threads, 0);
+
+  pool->Run();
+
+  atomic_uint32_t sqpoll_cnt{0};
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+    UringProactor* up = static_cast<UringProactor*>(p);
+    if (up->HasSqPoll())
+      sqpoll_cnt.fetch_add(1, memory_order_relaxed);
+
+    // Exercise submissions through the shared poller thread.
+    ThisFiber::SleepFor(1ms);
+    FiberCall fc(up);
+    fc->PrepNOP();
+    EXPECT_EQ(0, fc.Get());
+  });
+  EXPECT_EQ(3u, sqpoll_cnt.load());
+
+  pool->Stop();
+}
+
+// The submission queue of 16 entries overflows while the shared poller consumes it,
+// and socket requests run through the poller.
+TEST_F(FiberTest, SqPollSubmissions) {
+  absl::SetFlag(&FLAGS_uring_sqpoll_threads, 1);
+  unique_ptr<Pool> pool(Pool::IOUring(16, 2));
+  absl::SetFlag(&FLAGS_uring_sqpoll_threads, 0);
+
+  pool->Run();
+
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+    UringProactor* up = static_cast<UringProactor*>(p);
+    ASSERT_TRUE(up->HasSqPoll());
+
+    vector<Fiber> fibers;
+    for (unsigned i = 0; i < 128; ++i) {
+      fibers.emplace_back([up] {
+        FiberCall fc(up);
+        fc->PrepNOP();
+        EXPECT_EQ(0, fc.Get());
+      });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds));
+    unique_ptr<FiberSocketBase> left(up->CreateSocket(fds[0]));
+    unique_ptr<FiberSocketBase> right(up->CreateSocket(fds[1]));
+
+    string msg(1 << 16, 'x');
+    Fiber writer([&] { EXPECT_FALSE(left->Write(io::Buffer(msg))); });
+    string received(msg.size(), '\0');
+    auto res = right->Read(
+        io::MutableBytes(reinterpret_cast<uint8_t*>(received.data()), received.size()));
+    writer.Join();
+    ASSERT_TRUE(res);
+    EXPECT_EQ(msg.size(), *res);
+    EXPECT_EQ(msg, received);
+
+    (void)left->Close();
+    (void)right->Close();
+  });
+
+  pool->Stop();
+}
+
+TEST_F(FiberTest, DeferTaskrun) {
+  absl::SetFlag(&FLAGS_uring_defer_taskrun, true);
+  ProactorThread pth(0, ProactorBase::IOURING);
+  UringProactor* up = static_cast<UringProactor*>(pth.get());
+
+  // Await returns after the proactor thread initialized the ring.
+  bool defer_taskrun = up->AwaitBrief([&] { return up->HasDeferTaskrun(); });
+  absl::SetFlag(&FLAGS_uring_defer_taskrun, false);
+  LOG(INFO) << "DEFER_TASKRUN: " << defer_taskrun;
+
+  // Completions must be reaped both while spinning and after the loop went to sleep.
+  up->Await([&] {
+    for (unsigned i = 0; i < 10; ++i) {
+      FiberCall fc(up);
+      fc->PrepNOP();
+      EXPECT_EQ(0, fc.Get());
+    }
+    ThisFiber::SleepFor(5ms);
+
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    FiberCall fc(up, 1);
+    fc->PrepPollAdd(fds[0], POLLIN);  // nobody writes, so it times out.
+    EXPECT_EQ(-ECANCELED, fc.Get());
+    close(fds[0]);
+    close(fds[1]);
+  });
+}
+
+// All-to-all: every proactor sends brief tasks to all the others, through the task queues
+// or, if range(0) is set, through MSG_RING.
+void BM_DispatchBriefAllToAll(benchmark::State& state) {
+  constexpr unsigned kNumThreads = 4, kIters = 1024;
+  constexpr unsigned kTasks = kNumThreads * (kNumThreads - 1) * kIters;
+  bool use_ring = state.range(0);
+
+  unique_ptr<Pool> pool(Pool::IOUring(256, kNumThreads));
+  pool->Run();
+
+  atomic_uint32_t done{0};
+  while (state.KeepRunning()) {
+    done.store(0, memory_order_relaxed);
+    pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+      for (unsigned i = 0; i < kIters; ++i) {
+        for (unsigned j = 0; j < kNumThreads; ++j) {
+          if (j == index)
+            continue;
+          UringProactor* dest = static_cast<UringProactor*>(pool->at(j));
+          auto task = [&] { done.fetch_add(1, memory_order_relaxed); };
+          if (use_ring)
+            dest->DispatchBriefRing(task);
+          else
+            dest->DispatchBrief(task);
+        }
+        if (i % 64 == 0)
+          ThisFiber::Yield();  // Let the loop submit and run incoming tasks.
+      }
+    });
+    while (done.load(memory_order_relaxed) < kTasks)
+      this_thread::sleep_for(10us);
+  }
+  state.SetItemsProcessed(state.iterations() * kTasks);
+
+  pool->Stop();
+}
+BENCHMARK(BM_DispatchBriefAllToAll)->Arg(0)->Arg(1)->ArgName("ring")->UseRealTime();
+#endif
+
 }  // namespace fb2
 }  // namespace util
@@ -0,0 +1,201 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/file_ops.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "base/logging.h"
+#include "util/fibers/detail/fiber_interface.h"
+#include "util/fibers/fiberqueue_threadpool.h"
+#include "util/fibers/uring_proactor.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+using nonstd::make_unexpected;
+
+namespace {
+
+constexpr unsigned kMaxStatxInFlight = 64;
+
+atomic<FiberQueueThreadPool*> file_ops_tp{nullptr};
+
+inline error_code ErrorFromResult(int res) {
+  return res < 0 ? error_code{-res, system_category()} : error_code{};
+}
+
+// Runs a blocking system call that returns -1 and sets errno on error.
+// Returns the result of the call or -errno.
+template <typename F> int RunBlocking(F&& f) {
+  auto cb = [&f]() -> int {
+    int res = f();
+    return res < 0 ? -errno : res;
+  };
+
+  FiberQueueThreadPool* tp = file_ops_tp.load(memory_order_acquire);
+  return tp ? tp->Await(std::move(cb)) : cb();
+}
+
+// Submits the request prepared by `prep` on io_uring or runs `sys_call` otherwise.
+// Returns the result of the operation or -errno.
+template <typename P, typename S> int Execute(P&& prep, S&& sys_call) {
+  ProactorBase* me = ProactorBase::me();
+  CHECK(me);
+
+  if (me->GetKind() == ProactorBase::IOURING) {
+    FiberCall fc(static_cast<UringProactor*>(me));
+    prep(fc.operator->());
+    return fc.Get();
+  }
+
+  return RunBlocking(std::forward<S>(sys_call));
+}
+
+int SysStatx(int dfd, const char* path, int flags, unsigned mask, struct statx* buf) {
+  // statx(2) wrapper is not available in musl.
+  return syscall(SYS_statx, dfd, path, flags, mask, buf);
+}
+
+io::StatShort ToStatShort(string name, const struct statx& stx) {
+  time_t ns = stx.stx_mtime.tv_sec * 1000000000ULL + stx.stx_mtime.tv_nsec;
+  return io::StatShort{std::move(name), ns, stx.stx_size, stx.stx_mode};
+}
+
+// Issues statx requests for all the paths, at most kMaxStatxInFlight at a time.
+io::StatShortVec UringStatFiles(UringProactor* proactor, vector<string> paths) {
+  vector<struct statx> bufs(paths.size());
+  vector<int> results(paths.size(), 0);
+  unsigned in_flight = 0;
+  detail::FiberInterface* waiter = nullptr;
+
+  size_t next = 0;
+  while (next < paths.size() || in_flight > 0) {
+    for (; next < paths.size() && in_flight < kMaxStatxInFlight; ++next) {
+      auto cb = [&, i = next](detail::FiberInterface* current, UringProactor::IoResult res,
+                              uint32_t) {
+        results[i] = res;
+        --in_flight;
+        if (waiter)
+          current->ActivateOther(exchange(waiter, nullptr));
+      };
+
+      SubmitEntry se = proactor->GetSubmitEntry(std::move(cb));
+      se.PrepStatx(AT_FDCWD, paths[next].c_str(), 0, STATX_BASIC_STATS, &bufs[next]);
+      ++in_flight;
+    }
+
+    waiter = detail::FiberActive();
+    waiter->Suspend();
+  }
+
+  io::StatShortVec res;
+  res.reserve(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (results[i] < 0) {
+      LOG(WARNING) << "Bad stat for " << paths[i] << " " << ErrorFromResult(results[i]).message();
+      continue;
+    }
+    res.push_back(ToStatShort(std::move(paths[i]), bufs[i]));
+  }
+
+  return res;
+}
+
+io::Result<io::StatShortVec> SyncStatFiles(string_view glob) {
+  io::Result<vector<string>> paths = io::Glob(glob);
+  if (!paths)
+    return make_unexpected(paths.error());
+
+  io::StatShortVec res;
+  struct statx stx;
+  for (string& path : *paths) {
+    if (SysStatx(AT_FDCWD, path.c_str(), 0, STATX_BASIC_STATS, &stx) == 0) {
+      res.push_back(ToStatShort(std::move(path), stx));
+    } else {
+      LOG(WARNING) << "Bad stat for " << path << " " << strerror(errno);
+    }
+  }
+  return res;
+}
+
+}  // namespace
+
+void SetFileOpsThreadPool(FiberQueueThreadPool* tp) {
+  file_ops_tp.store(tp, memory_order_release);
+}
+
+io::Result<int> OpenAt(int dfd, string_view path, int flags, mode_t mode) {
+  string p(path);
+  int res = Execute([&](SubmitEntry* se) { se->PrepOpenAt(dfd, p.c_str(), flags, mode); },
+                    [&] { return openat(dfd, p.c_str(), flags, mode); });
+  if (res < 0)
+    return make_unexpected(ErrorFromResult(res));
+  return res;
+}
+
+io::Result<struct statx> Statx(int dfd, string_view path, int flags, unsigned mask) {
+  string p(path);
+  struct statx stx;
+  int res = Execute([&](SubmitEntry* se) { se->PrepStatx(dfd, p.c_str(), flags, mask, &stx); },
+                    [&] { return SysStatx(dfd, p.c_str(), flags, mask, &stx); });
+  if (res < 0)
+    return make_unexpected(ErrorFromResult(res));
+  return stx;
+}
+
+error_code Unlinkat(int dfd, string_view path, int flags) {
+  string p(path);
+  int res = Execute([&](SubmitEntry* se) { se->PrepUnlinkAt(dfd, p.c_str(), flags); },
+                    [&] { return unlinkat(dfd, p.c_str(), flags); });
+  return ErrorFromResult(res);
+}
+
+error_code Renameat(int olddfd, string_view oldpath, int newdfd, string_view newpath,
+                    unsigned flags) {
+  string op(oldpath), np(newpath);
+  auto prep = [&](SubmitEntry* se) {
+    se->PrepRenameAt(olddfd, op.c_str(), newdfd, np.c_str(), flags);
+  };
+  auto sys_call = [&]() -> int {
+    if (flags)  // renameat2(2) wrapper is not available in musl.
+      return syscall(SYS_renameat2, olddfd, op.c_str(), newdfd, np.c_str(), flags);
+    return renameat(olddfd, op.c_str(), newdfd, np.c_str());
+  };
+  return ErrorFromResult(Execute(prep, sys_call));
+}
+
+error_code Mkdirat(int dfd, string_view path, mode_t mode) {
+  string p(path);
+  int res = Execute([&](SubmitEntry* se) { se->PrepMkdirAt(dfd, p.c_str(), mode); },
+                    [&] { return mkdirat(dfd, p.c_str(), mode); });
+  return ErrorFromResult(res);
+}
+
+io::Result<io::StatShortVec> StatFiles(string_view glob) {
+  ProactorBase* me = ProactorBase::me();
+  CHECK(me);
+
+  FiberQueueThreadPool* tp = file_ops_tp.load(memory_order_acquire);
+  if (me->GetKind() != ProactorBase::IOURING) {
+    if (tp)
+      return tp->Await([glob] { return SyncStatFiles(glob); });
+    return SyncStatFiles(glob);
+  }
+
+  // glob(3) does not have an io_uring counterpart.
+  io::Result<vector<string>> paths = tp ? tp->Await([glob] { return io::Glob(glob); })
+                                        : io::Glob(glob);
+  if (!paths)
+    return make_unexpected(paths.error());
+
+  return UringStatFiles(static_cast<UringProactor*>(me), std::move(*paths));
+}
+
+}  // namespace fb2
+}  // namespace util
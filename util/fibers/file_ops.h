@@ -0,0 +1,48 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef STATX_BASIC_STATS
+#include <linux/stat.h>  // musl does not define struct statx.
+#endif
+
+#include "io/file_util.h"
+
+namespace util {
+namespace fb2 {
+
+class FiberQueueThreadPool;
+
+// Fiber-friendly filesystem metadata operations. They suspend only the calling fiber and
+// must be called from a proactor thread. On io_uring proactors they are submitted as io_uring
+// requests. On other proactors the system calls run in the thread pool set with
+// SetFileOpsThreadPool, or block the proactor thread if no pool is set.
+// dfd is either a directory descriptor or AT_FDCWD, as with the corresponding *at(2) calls.
+
+// tp must outlive all the calls. Pass nullptr to reset.
+void SetFileOpsThreadPool(FiberQueueThreadPool* tp);
+
+// Returns the opened file descriptor.
+io::Result<int> OpenAt(int dfd, std::string_view path, int flags, mode_t mode = 0644);
+
+io::Result<struct statx> Statx(int dfd, std::string_view path, int flags = 0,
+                               unsigned mask = STATX_BASIC_STATS);
+
+std::error_code Unlinkat(int dfd, std::string_view path, int flags = 0);
+
+std::error_code Renameat(int olddfd, std::string_view oldpath, int newdfd,
+                         std::string_view newpath, unsigned flags = 0);
+
+std::error_code Mkdirat(int dfd, std::string_view path, mode_t mode = 0755);
+
+// Similar to io::StatFiles but stats the matched files in parallel: on io_uring up to
+// 64 statx requests are in flight at a time.
+io::Result<io::StatShortVec> StatFiles(std::string_view glob);
+
+}  // namespace fb2
+}  // namespace util
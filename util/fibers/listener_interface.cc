@@ -90,40 +90,25 @@ void ListenerInterface::RunAcceptLoop() {
     conn_list.emplace(this, new TLConnList{});
   });
 
-  while (true) {
-    FiberSocketBase::AcceptResult res = sock_->Accept();
-    if (!res.has_value()) {
-      FiberSocketBase::error_code ec = res.error();
-      if (ec != errc::connection_aborted) {
-        LOG(ERROR) << "Error calling accept " << ec << "/" << ec.message();
-      }
-      break;
-    }
-
-    unique_ptr<FiberSocketBase> peer{res.value()};
-
-    VSOCK(2, *peer) << "Accepted " << peer->RemoteEndpoint();
-
-    uint32_t prev_connections = open_connections_.fetch_add(1, std::memory_order_acquire);
-    if (prev_connections >= max_clients_) {
-      peer->SetProactor(sock_->proactor());
-      OnMaxConnectionsReached(peer.get());
-      (void)peer->Close();
-      open_connections_.fetch_sub(1, std::memory_order_release);
-      continue;
-    }
-
-    // Most probably next is in another thread.
-    fb2::ProactorBase* next = PickConnectionProactor(peer.get());
+  // Each shard accepts in the thread of its proactor.
+  fb2::BlockingCounter shards_bc(shard_socks_.size());
+  for (auto& sock : shard_socks_) {
+    sock->proactor()->Dispatch([this, sock = sock.get(), shards_bc]() mutable {
+      ThisFiber::SetName("AcceptLoop");
+      AcceptConnections(sock, true);
+      shards_bc.Dec();
+    });
+  }
 
-    peer->SetProactor(next);
-    Connection* conn = NewConnection(next);
-    conn->SetSocket(peer.release());
-    conn->owner_ = this;
+  AcceptConnections(sock_.get(), sharded_);
 
-    // Run cb in its Proactor thread.
-    next->Dispatch([this, conn] { RunSingleConnection(conn); });
+  for (auto& sock : shard_socks_) {
+    sock->proactor()->Await([sock = sock.get()] {
+      if (sock->IsOpen())
+        sock->Shutdown(SHUT_RDWR);
+    });
   }
+  shards_bc.Wait();
 
   sock_->Shutdown(SHUT_RDWR);
   PreShutdown();
@@ -161,9 +146,55 @@ void ListenerInterface::RunAcceptLoop() {
   PostShutdown();
   error_code ec = sock_->Close();
   LOG_IF(WARNING, ec) << "Socket close failed: " << ec.message();
+  for (auto& sock : shard_socks_) {
+    ec = sock->proactor()->Await([sock = sock.get()] { return sock->Close(); });
+    LOG_IF(WARNING, ec) << "Socket close failed: " << ec.message();
+  }
+  shard_socks_.clear();
   LOG(INFO) << "Listener stopped for port " << ep.port();
 }
 
+void ListenerInterface::AcceptConnections(FiberSocketBase* sock, bool local) {
+  while (true) {
+    FiberSocketBase::AcceptResult res = sock->Accept();
+    if (!res.has_value()) {
+      FiberSocketBase::error_code ec = res.error();
+      if (ec != errc::connection_aborted) {
+        LOG(ERROR) << "Error calling accept " << ec << "/" << ec.message();
+      }
+      break;
+    }
+
+    unique_ptr<FiberSocketBase> peer{res.value()};
+
+    if (!peer->IsDirect()) {
+      VSOCK(2, *peer) << "Accepted " << peer->RemoteEndpoint();
+    }
+
+    uint32_t prev_connections = open_connections_.fetch_add(1, std::memory_order_acquire);
+    if (prev_connections >= max_clients_) {
+      peer->SetProactor(sock->proactor());
+      OnMaxConnectionsReached(peer.get());
+      (void)peer->Close();
+      open_connections_.fetch_sub(1, std::memory_order_release);
+      continue;
+    }
+
+    // Most probably next is in another thread.
+    // Direct descriptors live in the file table of the accepting ring and can not migrate.
+    fb2::ProactorBase* next = (local || peer->IsDirect()) ? sock->proactor()
+                                                          : PickConnectionProactor(peer.get());
+
+    peer->SetProactor(next);
+    Connection* conn = NewConnection(next);
+    conn->SetSocket(peer.release());
+    conn->owner_ = this;
+
+    // Run cb in its Proactor thread.
+    next->Dispatch([this, conn] { RunSingleConnection(conn); });
+  }
+}
+
 ListenerInterface::~ListenerInterface() {
   VLOG(1) << "Destroying ListenerInterface " << this;
 }
@@ -234,6 +265,12 @@ void ListenerInterface::Migrate(Connection* conn, fb2::ProactorBase* dest) {
   if (src_proactor == dest)
     return;
 
+  // Direct descriptors are bound to the file table of their ring.
+  if (conn->socket()->IsDirect()) {
+    VLOG(1) << "Can not migrate a direct socket";
+    return;
+  }
+
   VLOG(1) << "Migrating from " << src_proactor->thread_id() << " to " << dest->thread_id();
 
   conn->OnPreMigrateThread();
@@ -4,6 +4,10 @@
 
 #include "util/fibers/pool.h"
 
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
+
+#include "base/flags.h"
 #include "base/logging.h"
 #include "util/fibers/epoll_proactor.h"
 
@@ -11,6 +15,14 @@
 #include "util/fibers/uring_proactor.h"
 #endif
 
+ABSL_FLAG(uint32_t, uring_sqpoll_threads, 0,
+          "If positive, io_uring proactors submit via that many shared SQPOLL kernel threads");
+ABSL_FLAG(std::string, uring_sqpoll_cpus, "",
+          "Comma separated list of cpus to pin the SQPOLL threads to. "
+          "Proactor threads are not pinned to these cpus");
+ABSL_FLAG(uint32_t, uring_sqpoll_idle_ms, 1000,
+          "Idle time in milliseconds after which a SQPOLL thread goes to sleep");
+
 namespace util {
 namespace fb2 {
 
@@ -23,6 +35,21 @@ Pool* Pool::Epoll(size_t pool_size) {
 Pool* Pool::IOUring(size_t ring_depth, size_t pool_size) {
   Pool* res = new Pool(ProactorBase::Kind::IOURING, pool_size);
   res->ring_depth_ = ring_depth;
+
+  unsigned sqpoll_threads = absl::GetFlag(FLAGS_uring_sqpoll_threads);
+  if (sqpoll_threads > 0) {
+    res->sqpoll_threads_ = std::min<size_t>(sqpoll_threads, res->size());
+    res->sqpoll_idle_ms_ = absl::GetFlag(FLAGS_uring_sqpoll_idle_ms);
+    res->sqpoll_fds_.resize(res->sqpoll_threads_, -1);
+
+    std::string cpus = absl::GetFlag(FLAGS_uring_sqpoll_cpus);
+    for (auto cpu_str : absl::StrSplit(cpus, ',', absl::SkipEmpty())) {
+      unsigned cpu;
+      CHECK(absl::SimpleAtoi(cpu_str, &cpu)) << "Invalid cpu " << cpu_str;
+      res->sqpoll_cpus_.push_back(cpu);
+      res->reserved_cpus_.push_back(cpu);
+    }
+  }
   return res;
 }
 #endif
@@ -52,7 +79,30 @@ void Pool::InitInThread(unsigned index) {
     case ProactorBase::Kind::IOURING: {
 #ifdef __linux__
       UringProactor* p = static_cast<UringProactor*>(proactor_[index]);
-      p->Init(ring_depth_);
+      if (sqpoll_threads_ == 0) {
+        p->Init(ring_depth_);
+        break;
+      }
+
+      unsigned group = index % sqpoll_threads_;
+      if (index == group) {  // owns the poller thread of the group.
+        int cpu = group < sqpoll_cpus_.size() ? sqpoll_cpus_[group] : -1;
+        p->SetSqPoll(sqpoll_idle_ms_, cpu);
+        p->Init(ring_depth_);
+
+        std::lock_guard lk(sqpoll_mu_);
+        sqpoll_fds_[group] = p->ring_fd();
+        sqpoll_cv_.notify_all();
+      } else {
+        int wq_fd;
+        {
+          std::unique_lock lk(sqpoll_mu_);
+          sqpoll_cv_.wait(lk, [&] { return sqpoll_fds_[group] >= 0; });
+          wq_fd = sqpoll_fds_[group];
+        }
+        p->SetSqPoll(sqpoll_idle_ms_);
+        p->Init(ring_depth_, wq_fd);
+      }
 #else
       CHECK(false);
 #endif
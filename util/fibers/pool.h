@@ -4,6 +4,9 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <mutex>
+
 #include "util/proactor_pool.h"
 
 namespace util {
@@ -12,6 +15,8 @@ namespace fb2 {
 class Pool : public ProactorPool {
  public:
   static Pool* Epoll(size_t pool_size = 0);
+  // If --uring_sqpoll_threads is positive, the proactors share that many SQPOLL kernel threads:
+  // proactor i attaches to the poller of proactor i % uring_sqpoll_threads.
   static Pool* IOUring(size_t ring_depth, size_t pool_size = 0);
 
  private:
@@ -21,6 +26,15 @@ class Pool : public ProactorPool {
   ProactorBase::Kind kind_;
   unsigned ring_depth_ = 0;
 
+  unsigned sqpoll_threads_ = 0;
+  uint32_t sqpoll_idle_ms_ = 0;
+  std::vector<int> sqpoll_cpus_;
+
+  // Ring fds of the proactors that own the SQPOLL threads, -1 until they are initialized.
+  std::vector<int> sqpoll_fds_;
+  std::mutex sqpoll_mu_;
+  std::condition_variable sqpoll_cv_;
+
   ProactorBase* CreateProactor() final;
   void InitInThread(unsigned index) final;
 };
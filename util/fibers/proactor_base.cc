@@ -15,6 +15,7 @@ constexpr int kNumSig = _NSIG;
 constexpr int kNumSig = NSIG;
 #endif
 
+#include <algorithm>
 #include <mutex>  // once_flag
 
 #include "base/logging.h"
@@ -116,6 +117,28 @@ uint32_t ProactorBase::AddOnIdleTask(OnIdleTask f) {
   return res;
 }
 
+void ProactorBase::CancelTickEnd(void* arg) {
+  auto cancelled = [arg](const auto& item) { return item.second == arg; };
+  tick_end_.erase(remove_if(tick_end_.begin(), tick_end_.end(), cancelled), tick_end_.end());
+
+  // Callbacks may cancel the ones that run after them in the same tick.
+  for (auto& item : tick_end_run_) {
+    if (item.second == arg)
+      item.first = nullptr;
+  }
+}
+
+void ProactorBase::RunTickEnd() {
+  // Callbacks may register new callbacks that will run in the next tick.
+  tick_end_run_.swap(tick_end_);
+  for (size_t i = 0; i < tick_end_run_.size(); ++i) {
+    auto [cb, arg] = tick_end_run_[i];
+    if (cb)
+      cb(arg);
+  }
+  tick_end_run_.clear();
+}
+
 bool ProactorBase::RunOnIdleTasks() {
   if (on_idle_arr_.empty())
     return false;
@@ -173,6 +173,20 @@ class ProactorBase {
 
   bool RemoveOnIdleTask(uint32_t id);
 
+  using TickEndCb = void (*)(void* arg);
+
+  //! Runs cb(arg) from the I/O loop once the fibers that are ready now have run and before
+  //! the proactor submits the pending I/O or waits for new events. Allows coalescing the
+  //! work of many fibers, for example writes of corked sockets. cb must not block.
+  //! Must be called from the proactor thread.
+  void RunAtTickEnd(TickEndCb cb, void* arg) {
+    tick_end_.emplace_back(cb, arg);
+  }
+
+  //! Cancels the pending RunAtTickEnd callbacks with `arg`.
+  //! Must be called from the proactor thread.
+  void CancelTickEnd(void* arg);
+
   // Migrates the calling fibers to the destination proactor.
   // Calling fiber must belong to this proactor.
   void Migrate(ProactorBase* dest);
@@ -214,6 +228,8 @@ class ProactorBase {
   // Returns true if we should continue spinning or false otherwise.
   bool RunOnIdleTasks();
 
+  void RunTickEnd();
+
   static void Pause(unsigned strength);
   static void ModuleInit();
 
@@ -258,6 +274,9 @@ class ProactorBase {
   std::vector<OnIdleWrapper> on_idle_arr_;
   uint32_t on_idle_next_ = 0;
 
+  // RunAtTickEnd callbacks. tick_end_run_ holds the ones that are running now.
+  std::vector<std::pair<TickEndCb, void*>> tick_end_, tick_end_run_;
+
   absl::flat_hash_map<uint32_t, PeriodicItem*> periodic_map_;
 
   struct TLInfo {
@@ -228,6 +228,20 @@ void ProactorPool::SetupProactors() {
   char buf[32];
 
   cpu_set_t online_cpus = OnlineCpus();
+#if defined(__linux__) || defined(__FreeBSD__)
+  if (!reserved_cpus_.empty()) {
+    cpu_set_t available = online_cpus;
+    for (unsigned cpu : reserved_cpus_) {
+      CPU_CLR(cpu, &available);
+    }
+
+    if (CPU_COUNT(&available) > 0) {
+      online_cpus = available;
+    } else {
+      LOG(WARNING) << "All online cpus are reserved, ignoring the reservation";
+    }
+  }
+#endif
   unsigned num_online_cpus = CPU_COUNT(&online_cpus);
   unsigned rel_to_abs_cpu[num_online_cpus];
   unsigned rel_cpu_index = 0, abs_cpu_index = 0;
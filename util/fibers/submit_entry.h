@@ -6,6 +6,8 @@
 
 #include <liburing/io_uring.h>
 
+struct statx;
+
 namespace util {
 namespace fb2 {
 class UringProactor;
@@ -32,6 +34,35 @@ class SubmitEntry {
     sqe_->len = mode;
   }
 
+  void PrepStatx(int dfd, const char* path, int flags, unsigned mask, struct statx* statxbuf) {
+    PrepFd(IORING_OP_STATX, dfd);
+    sqe_->addr = (unsigned long)path;
+    sqe_->len = mask;
+    sqe_->off = (unsigned long)statxbuf;
+    sqe_->statx_flags = flags;
+  }
+
+  void PrepUnlinkAt(int dfd, const char* path, int flags) {
+    PrepFd(IORING_OP_UNLINKAT, dfd);
+    sqe_->addr = (unsigned long)path;
+    sqe_->unlink_flags = flags;
+  }
+
+  void PrepRenameAt(int olddfd, const char* oldpath, int newdfd, const char* newpath,
+                    unsigned flags) {
+    PrepFd(IORING_OP_RENAMEAT, olddfd);
+    sqe_->addr = (unsigned long)oldpath;
+    sqe_->len = newdfd;
+    sqe_->addr2 = (unsigned long)newpath;
+    sqe_->rename_flags = flags;
+  }
+
+  void PrepMkdirAt(int dfd, const char* path, mode_t mode) {
+    PrepFd(IORING_OP_MKDIRAT, dfd);
+    sqe_->addr = (unsigned long)path;
+    sqe_->len = mode;
+  }
+
   // mask is a bit-OR of POLLXXX flags.
   void PrepPollAdd(int fd, unsigned mask) {
     PrepFd(IORING_OP_POLL_ADD, fd);
@@ -54,6 +85,17 @@ class SubmitEntry {
     sqe_->msg_flags = flags;
   }
 
+  // Multishot receive. The kernel selects the destination buffers from the provided buffer
+  // ring `bgid` and keeps posting completions with IORING_CQE_F_MORE set while the request
+  // stays armed.
+  void PrepRecvMultishot(int fd, uint16_t bgid, unsigned flags) {
+    PrepFd(IORING_OP_RECV, fd);
+    sqe_->msg_flags = flags;
+    sqe_->ioprio |= IORING_RECV_MULTISHOT;
+    sqe_->flags |= IOSQE_BUFFER_SELECT;
+    sqe_->buf_group = bgid;
+  }
+
   void PrepRecvMsg(int fd, const struct msghdr* msg, unsigned flags) {
     PrepFd(IORING_OP_RECVMSG, fd);
     sqe_->addr = (unsigned long)msg;
@@ -61,6 +103,17 @@ class SubmitEntry {
     sqe_->msg_flags = flags;
   }
 
+  // Multishot recvmsg: every completion carries a provided buffer from the group `bgid` that
+  // holds io_uring_recvmsg_out followed by the name, the control data and the payload.
+  // msg_namelen and msg_controllen of `msg` define the space reserved for the name and
+  // the control data, so `msg` must stay valid while the request is armed.
+  void PrepRecvMsgMultishot(int fd, const struct msghdr* msg, uint16_t bgid, unsigned flags) {
+    PrepRecvMsg(fd, msg, flags);
+    sqe_->ioprio |= IORING_RECV_MULTISHOT;
+    sqe_->flags |= IOSQE_BUFFER_SELECT;
+    sqe_->buf_group = bgid;
+  }
+
   void PrepRead(int fd, void* buf, unsigned size, size_t offset) {
     PrepFd(IORING_OP_READ, fd);
     sqe_->addr = (unsigned long)buf;
@@ -109,6 +162,12 @@ class SubmitEntry {
     sqe_->rw_flags = flags;
   }
 
+  // fsync_flags is either 0 or IORING_FSYNC_DATASYNC for fdatasync semantics.
+  void PrepFSync(int fd, unsigned fsync_flags) {
+    PrepFd(IORING_OP_FSYNC, fd);
+    sqe_->fsync_flags = fsync_flags;
+  }
+
   void PrepFallocate(int fd, int mode, off_t offset, off_t len) {
     PrepFd(IORING_OP_FALLOCATE, fd);
     sqe_->off = offset;
@@ -123,6 +182,18 @@ class SubmitEntry {
     sqe_->off = offset;
   }
 
+  // Moves nbytes from fd_in to fd_out, one of which must be a pipe. Offsets of -1 mean that
+  // the corresponding descriptor is a pipe or that its file position is used.
+  void PrepSplice(int fd_in, int64_t off_in, int fd_out, int64_t off_out, unsigned nbytes,
+                  unsigned splice_flags) {
+    PrepFd(IORING_OP_SPLICE, fd_out);
+    sqe_->len = nbytes;
+    sqe_->off = off_out;
+    sqe_->splice_off_in = off_in;
+    sqe_->splice_fd_in = fd_in;
+    sqe_->splice_flags = splice_flags;
+  }
+
   void PrepSend(int fd, const void* buf, size_t len, unsigned flags) {
     PrepFd(IORING_OP_SEND, fd);
     sqe_->addr = (unsigned long)buf;
@@ -137,6 +208,23 @@ class SubmitEntry {
     sqe_->msg_flags = flags;
   }
 
+  // Zero-copy send. Posts two completions: the result with IORING_CQE_F_MORE set and then
+  // a notification with IORING_CQE_F_NOTIF once the kernel does not reference `buf` anymore.
+  void PrepSendZc(int fd, const void* buf, size_t len, unsigned flags, unsigned zc_flags = 0) {
+    PrepFd(IORING_OP_SEND_ZC, fd);
+    sqe_->addr = (unsigned long)buf;
+    sqe_->len = len;
+    sqe_->msg_flags = flags;
+    sqe_->ioprio = zc_flags;
+  }
+
+  void PrepSendMsgZc(int fd, const struct msghdr* msg, unsigned flags) {
+    PrepFd(IORING_OP_SENDMSG_ZC, fd);
+    sqe_->addr = (unsigned long)msg;
+    sqe_->len = 1;
+    sqe_->msg_flags = flags;
+  }
+
   void PrepConnect(int fd, const struct sockaddr* addr, socklen_t addrlen) {
     PrepFd(IORING_OP_CONNECT, fd);
     sqe_->addr = (unsigned long)addr;
@@ -144,10 +232,28 @@ class SubmitEntry {
     sqe_->off = addrlen;
   }
 
+  // Multishot accept. The request stays armed and posts a completion with IORING_CQE_F_MORE
+  // for every accepted connection. If `direct` is true, the accepted sockets are installed
+  // into a free slot of the fixed file table and the completion result is the slot index.
+  void PrepAcceptMultishot(int fd, unsigned accept_flags, bool direct) {
+    PrepFd(IORING_OP_ACCEPT, fd);
+    sqe_->addr = 0;
+    sqe_->addr2 = 0;
+    sqe_->accept_flags = accept_flags;
+    sqe_->ioprio |= IORING_ACCEPT_MULTISHOT;
+    sqe_->file_index = direct ? IORING_FILE_INDEX_ALLOC : 0;
+  }
+
   void PrepClose(int fd) {
     PrepFd(IORING_OP_CLOSE, fd);
   }
 
+  // Closes the descriptor at `file_index` of the fixed file table.
+  void PrepCloseDirect(unsigned file_index) {
+    PrepFd(IORING_OP_CLOSE, 0);
+    sqe_->file_index = file_index + 1;
+  }
+
   void PrepTimeout(const timespec* ts, bool is_abs = true) {
     PrepFd(IORING_OP_TIMEOUT, -1);
     sqe_->addr = (unsigned long)ts;
@@ -169,6 +275,13 @@ class SubmitEntry {
     sqe_->timeout_flags = 0;
   }
 
+  // Cancels the request that was submitted with `user_data`.
+  void PrepCancel(uint64_t user_data, int flags = 0) {
+    PrepFd(IORING_OP_ASYNC_CANCEL, -1);
+    sqe_->addr = user_data;
+    sqe_->cancel_flags = flags;
+  }
+
   // how is either: SHUT_RD, SHUT_WR or SHUT_RDWR.
   void PrepShutdown(int fd, int how) {
     PrepFd(IORING_OP_SHUTDOWN, fd);
@@ -7,8 +7,10 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include "base/io_buf.h"
 #include "base/logging.h"
 
+#include "util/fibers/detail/fiber_interface.h"
 #include "util/fibers/uring_proactor.h"
 
 namespace util {
@@ -30,9 +32,9 @@ class ReadFileImpl : public ReadonlyFile {
 
   virtual ~ReadFileImpl();
 
-  error_code Close() final;
+  error_code Close() override;
 
-  SizeOrError Read(size_t offset, const iovec* v, uint32_t len) final;
+  SizeOrError Read(size_t offset, const iovec* v, uint32_t len) override;
 
   size_t Size() const final {
     return file_size_;
@@ -42,24 +44,70 @@ class ReadFileImpl : public ReadonlyFile {
     return fd_;
   };
 
- private:
+ protected:
   int fd_;
   const size_t file_size_;
   Proactor* proactor_;
 };
 
-class WriteFileImpl final : public WriteFile {
+// Serves sequential reads from a ring of aligned blocks that are read ahead asynchronously.
+// Non-sequential reads drain the ring and restart the read-ahead at the new offset.
+class ReadAheadFileImpl final : public ReadFileImpl {
+ public:
+  ReadAheadFileImpl(int fd, size_t sz, Proactor* proactor, const ReadonlyFile::Options& opts);
+  ~ReadAheadFileImpl();
+
+  error_code Close() final;
+
+  SizeOrError Read(size_t offset, const iovec* v, uint32_t len) final;
+
+ private:
+  struct Block {
+    uint8_t* buf = nullptr;
+    size_t offset = 0;  // file offset of buf[0].
+    int res = 0;        // bytes read or -errno, valid when the read is not pending.
+    bool pending = false;
+  };
+
+  // Returns the block in the ring that holds `offset` or null if there is none.
+  // Drops the blocks that precede it.
+  Block* FindBlock(size_t offset);
+
+  // Drains the ring and restarts the read-ahead from `offset`.
+  void Reset(size_t offset);
+  void Fill();
+  void Submit(unsigned index, size_t offset);
+  void PopHead();
+
+  void WaitFor(const Block& block);
+  void Drain();
+
+  std::vector<Block> blocks_;
+  uint8_t* arena_ = nullptr;
+  size_t block_size_;
+
+  unsigned head_ = 0;      // index of the oldest block in the ring.
+  unsigned queued_ = 0;    // number of blocks in the ring, starting from head_.
+  unsigned window_ = 0;    // current read-ahead window in blocks.
+  unsigned pending_ = 0;   // number of reads in flight, including dropped blocks.
+  size_t next_offset_ = 0; // file offset of the next block to read.
+
+  detail::FiberInterface* waiter_ = nullptr;
+};
+
+class WriteFileImpl : public WriteFile {
  public:
   WriteFileImpl(Proactor* p, std::string_view file_name) : WriteFile(file_name), proactor_(p) {
   }
 
   virtual ~WriteFileImpl();
 
-  error_code Close();
+  error_code Close() override;
 
-  Result<size_t> WriteSome(const iovec* v, uint32_t len);
+  Result<size_t> WriteSome(const iovec* v, uint32_t len) override;
 
-  error_code Open(int flags);
+  // With append, the writes start at the end of the existing file.
+  error_code Open(int flags, bool append);
 
  protected:
   int fd_ = -1;
@@ -67,6 +115,43 @@ class WriteFileImpl final : public WriteFile {
   off_t offs_ = 0;
 };
 
+// Accumulates writes into aligned buffers and flushes them in the background, keeping up to
+// `buffers_in_flight` writes in flight. The writer waits only when the next buffer to fill
+// is still being written.
+class BufferedWriteFileImpl final : public WriteFileImpl {
+ public:
+  BufferedWriteFileImpl(Proactor* p, std::string_view file_name, const WriteFile::Options& opts);
+  ~BufferedWriteFileImpl();
+
+  error_code Close() final;
+
+  Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+ private:
+  struct Buffer {
+    base::IoBuf buf;
+    off_t offset = 0;  // file offset of the buffer.
+    int res = 0;       // result of the last write, valid when it's not pending.
+    bool pending = false;
+  };
+
+  // Writes the current buffer in the background and switches to the next one.
+  void Flush();
+
+  // Waits for the buffer write to complete and finishes short writes.
+  error_code Finish(Buffer* buffer);
+  void Drain();
+
+  std::vector<Buffer> buffers_;
+  unsigned cur_ = 0;
+  unsigned pending_ = 0;
+  size_t buffer_size_;
+  bool direct_;
+  error_code ec_;
+
+  detail::FiberInterface* waiter_ = nullptr;
+};
+
 class LinuxFileImpl : public LinuxFile {
  public:
   LinuxFileImpl(int fd, Proactor* p) : proactor_(p) {
@@ -118,8 +203,16 @@ io::Result<size_t> WriteSomeInternal(int fd, const struct iovec* iov, unsigned i
   CHECK_GE(fd, 0);
   CHECK_GT(iovcnt, 0u);
 
+  // Buffers from the registered pool do not need to be pinned for each request.
+  int buf_index = iovcnt == 1 ? p->FindRegisteredBuffer(iov->iov_base, iov->iov_len) : -1;
+
   FiberCall fc(p);
-  fc->PrepWriteV(fd, iov, iovcnt, offset, flags);
+  if (buf_index >= 0) {
+    fc->PrepWriteFixed(fd, iov->iov_base, iov->iov_len, offset, buf_index);
+    fc->sqe()->rw_flags = flags;
+  } else {
+    fc->PrepWriteV(fd, iov, iovcnt, offset, flags);
+  }
   FiberCall::IoResult io_res = fc.Get();
   if (io_res < 0) {
     return make_unexpected(error_code{-io_res, system_category()});
@@ -132,8 +225,15 @@ io::Result<size_t> ReadSomeInternal(int fd, const struct iovec* iov, unsigned io
   CHECK_GE(fd, 0);
   CHECK_GT(iovcnt, 0u);
 
+  int buf_index = iovcnt == 1 ? p->FindRegisteredBuffer(iov->iov_base, iov->iov_len) : -1;
+
   FiberCall fc(p);
-  fc->PrepReadV(fd, iov, iovcnt, offset, flags);
+  if (buf_index >= 0) {
+    fc->PrepReadFixed(fd, iov->iov_base, iov->iov_len, offset, buf_index);
+    fc->sqe()->rw_flags = flags;
+  } else {
+    fc->PrepReadV(fd, iov, iovcnt, offset, flags);
+  }
   FiberCall::IoResult io_res = fc.Get();
   if (io_res < 0) {
     return make_unexpected(error_code{-io_res, system_category()});
@@ -229,11 +329,177 @@ io::SizeOrError ReadFileImpl::Read(size_t offset, const iovec* v, uint32_t len)
   return read_total;
 }
 
+ReadAheadFileImpl::ReadAheadFileImpl(int fd, size_t sz, Proactor* proactor,
+                                     const ReadonlyFile::Options& opts)
+    : ReadFileImpl(fd, sz, proactor) {
+  constexpr size_t kAlign = 4096;  // satisfies O_DIRECT requirements.
+
+  block_size_ = (max<size_t>(opts.readahead_block, 1) + kAlign - 1) & ~(kAlign - 1);
+  blocks_.resize(max<uint32_t>(opts.readahead_depth, 1));
+
+  void* ptr = nullptr;
+  CHECK_EQ(0, posix_memalign(&ptr, kAlign, block_size_ * blocks_.size()));
+  arena_ = reinterpret_cast<uint8_t*>(ptr);
+  for (size_t i = 0; i < blocks_.size(); ++i) {
+    blocks_[i].buf = arena_ + i * block_size_;
+  }
+}
+
+ReadAheadFileImpl::~ReadAheadFileImpl() {
+  // The kernel may still write into the blocks.
+  Drain();
+  free(arena_);
+}
+
+error_code ReadAheadFileImpl::Close() {
+  Drain();
+  queued_ = 0;
+  return ReadFileImpl::Close();
+}
+
+io::SizeOrError ReadAheadFileImpl::Read(size_t offset, const iovec* v, uint32_t len) {
+  DCHECK_GE(fd_, 0);
+
+  size_t read_total = 0;
+  size_t iov_offs = 0;
+
+  while (len > 0 && offset < file_size_) {
+    Block* block = FindBlock(offset);
+    if (block == nullptr) {
+      Reset(offset);
+      continue;
+    }
+
+    WaitFor(*block);
+    if (block->res < 0) {
+      error_code ec{-block->res, system_category()};
+      Drain();
+      queued_ = 0;  // the next read restarts the read-ahead.
+      return make_unexpected(ec);
+    }
+
+    size_t block_end = block->offset + block->res;
+    if (offset >= block_end) {
+      if (block_end >= file_size_)  // eof
+        break;
+
+      // A short read in the middle of the file. Read the rest again.
+      Reset(offset);
+      continue;
+    }
+
+    size_t count = min(block_end - offset, v->iov_len - iov_offs);
+    memcpy(reinterpret_cast<uint8_t*>(v->iov_base) + iov_offs,
+           block->buf + (offset - block->offset), count);
+    offset += count;
+    iov_offs += count;
+    read_total += count;
+
+    if (iov_offs == v->iov_len) {
+      ++v;
+      --len;
+      iov_offs = 0;
+    }
+
+    if (offset == block->offset + block_size_) {
+      // The block was consumed sequentially, grow the window.
+      PopHead();
+      window_ = min<unsigned>(window_ * 2, blocks_.size());
+      Fill();
+    }
+  }
+
+  return read_total;
+}
+
+auto ReadAheadFileImpl::FindBlock(size_t offset) -> Block* {
+  if (queued_ == 0)
+    return nullptr;
+
+  size_t start = blocks_[head_].offset;
+  if (offset < start || offset >= start + queued_ * block_size_)
+    return nullptr;
+
+  // Skip the blocks that the caller did not read.
+  for (size_t skip = (offset - start) / block_size_; skip > 0; --skip) {
+    PopHead();
+  }
+  Fill();
+
+  return &blocks_[head_];
+}
+
+void ReadAheadFileImpl::Reset(size_t offset) {
+  Drain();
+
+  head_ = 0;
+  queued_ = 0;
+  window_ = min<unsigned>(2, blocks_.size());
+  next_offset_ = offset - offset % block_size_;
+  Fill();
+}
+
+void ReadAheadFileImpl::Fill() {
+  while (queued_ < window_ && next_offset_ < file_size_) {
+    unsigned index = (head_ + queued_) % blocks_.size();
+
+    // The block was dropped but its read has not completed yet.
+    if (blocks_[index].pending)
+      break;
+
+    Submit(index, next_offset_);
+    next_offset_ += block_size_;
+    ++queued_;
+  }
+}
+
+void ReadAheadFileImpl::Submit(unsigned index, size_t offset) {
+  Block& block = blocks_[index];
+  block.offset = offset;
+  block.pending = true;
+  ++pending_;
+
+  auto cb = [this, index](detail::FiberInterface* current, Proactor::IoResult res, uint32_t) {
+    Block& block = blocks_[index];
+    block.res = res;
+    block.pending = false;
+    --pending_;
+
+    if (waiter_) {
+      detail::FiberInterface* waiter = exchange(waiter_, nullptr);
+      current->ActivateOther(waiter);
+    }
+  };
+
+  SubmitEntry se = proactor_->GetSubmitEntry(std::move(cb));
+  se.PrepRead(fd_, block.buf, block_size_, offset);
+}
+
+void ReadAheadFileImpl::PopHead() {
+  DCHECK_GT(queued_, 0u);
+  head_ = (head_ + 1) % blocks_.size();
+  --queued_;
+}
+
+void ReadAheadFileImpl::WaitFor(const Block& block) {
+  while (block.pending) {
+    waiter_ = detail::FiberActive();
+    waiter_->Suspend();
+  }
+}
+
+void ReadAheadFileImpl::Drain() {
+  while (pending_ > 0) {
+    waiter_ = detail::FiberActive();
+    waiter_->Suspend();
+  }
+}
+
 WriteFileImpl::~WriteFileImpl() {
   CloseFile(fd_, proactor_);
 }
 
-error_code WriteFileImpl::Open(int flags) {
+error_code WriteFileImpl::Open(int flags, bool append) {
   CHECK_EQ(fd_, -1);
 
   FiberCall fc(proactor_);
@@ -245,6 +511,15 @@ error_code WriteFileImpl::Open(int flags) {
   }
   fd_ = io_res;
 
+  // We write at explicit offsets instead of O_APPEND, which ignores them: the buffered writes
+  // may complete out of order.
+  if (append) {
+    struct stat sb;
+    if (fstat(fd_, &sb) < 0)
+      return error_code{errno, system_category()};
+    offs_ = sb.st_size;
+  }
+
   return error_code{};
 }
 
@@ -262,6 +537,168 @@ Result<size_t> WriteFileImpl::WriteSome(const iovec* v, uint32_t len) {
   return res;
 }
 
+constexpr size_t kDirectAlign = 4096;
+
+BufferedWriteFileImpl::BufferedWriteFileImpl(Proactor* p, std::string_view file_name,
+                                             const WriteFile::Options& opts)
+    : WriteFileImpl(p, file_name), direct_(opts.direct) {
+  buffer_size_ = (max<size_t>(opts.buffer_size, 1) + kDirectAlign - 1) & ~(kDirectAlign - 1);
+
+  // One buffer is filled while the others are in flight.
+  unsigned count = max<uint32_t>(opts.buffers_in_flight, 1) + 1;
+  buffers_.reserve(count);
+  for (unsigned i = 0; i < count; ++i) {
+    buffers_.push_back(Buffer{base::IoBuf{buffer_size_, align_val_t{kDirectAlign}}});
+  }
+}
+
+BufferedWriteFileImpl::~BufferedWriteFileImpl() {
+  // The buffered data is written if the file was not closed.
+  if (fd_ >= 0) {
+    error_code ec = Close();
+    LOG_IF(ERROR, ec) << "Could not write " << create_file_name_ << ": " << ec.message();
+  }
+
+  // The kernel may still read from the buffers.
+  Drain();
+}
+
+Result<size_t> BufferedWriteFileImpl::WriteSome(const iovec* v, uint32_t len) {
+  if (ec_)
+    return make_unexpected(ec_);
+
+  size_t written = 0;
+  for (; len > 0; ++v, --len) {
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(v->iov_base);
+    size_t left = v->iov_len;
+
+    while (left > 0) {
+      base::IoBuf& buf = buffers_[cur_].buf;
+      size_t count = min(left, buffer_size_ - buf.InputLen());
+      memcpy(buf.AppendBuffer().data(), src, count);
+      buf.CommitWrite(count);
+      src += count;
+      left -= count;
+      written += count;
+
+      if (buf.InputLen() == buffer_size_) {
+        Flush();
+
+        // Blocks only if all the buffers are in flight. The bytes that were already copied
+        // are accepted, the error is reported by the next call.
+        error_code ec = Finish(&buffers_[cur_]);
+        if (ec)
+          return written > 0 ? Result<size_t>(written) : make_unexpected(ec);
+      }
+    }
+  }
+
+  return written;
+}
+
+error_code BufferedWriteFileImpl::Close() {
+  if (fd_ < 0)
+    return ec_;
+
+  base::IoBuf& buf = buffers_[cur_].buf;
+  size_t tail = buf.InputLen();
+  off_t file_end = offs_ + tail;
+  bool padded = false;
+
+  if (tail > 0) {
+    // O_DIRECT requires aligned length, so pad the tail and truncate the file later.
+    if (direct_ && tail % kDirectAlign) {
+      size_t pad = kDirectAlign - tail % kDirectAlign;
+      memset(buf.AppendBuffer().data(), 0, pad);
+      buf.CommitWrite(pad);
+      padded = true;
+    }
+    Flush();
+  }
+
+  for (auto& buffer : buffers_) {
+    error_code ec = Finish(&buffer);
+    if (ec && !ec_)
+      ec_ = ec;
+  }
+
+  if (!ec_ && padded && ftruncate(fd_, file_end) < 0)
+    ec_ = error_code{errno, system_category()};
+
+  error_code ec = WriteFileImpl::Close();
+  return ec_ ? ec_ : ec;
+}
+
+void BufferedWriteFileImpl::Flush() {
+  Buffer& buffer = buffers_[cur_];
+  DCHECK(!buffer.pending);
+
+  buffer.offset = offs_;
+  buffer.pending = true;
+  offs_ += buffer.buf.InputLen();
+  ++pending_;
+
+  auto cb = [this, index = cur_](detail::FiberInterface* current, Proactor::IoResult res,
+                                 uint32_t) {
+    Buffer& buffer = buffers_[index];
+    buffer.res = res;
+    buffer.pending = false;
+    --pending_;
+
+    if (waiter_) {
+      detail::FiberInterface* waiter = exchange(waiter_, nullptr);
+      current->ActivateOther(waiter);
+    }
+  };
+
+  io::Bytes data = buffer.buf.InputBuffer();
+  SubmitEntry se = proactor_->GetSubmitEntry(std::move(cb));
+  se.PrepWrite(fd_, data.data(), data.size(), buffer.offset);
+
+  cur_ = (cur_ + 1) % buffers_.size();
+}
+
+error_code BufferedWriteFileImpl::Finish(Buffer* buffer) {
+  while (buffer->pending) {
+    waiter_ = detail::FiberActive();
+    waiter_->Suspend();
+  }
+
+  base::IoBuf& buf = buffer->buf;
+  if (buf.InputLen() == 0)
+    return ec_;
+
+  int res = buffer->res;
+  if (res < 0) {
+    ec_ = error_code{-res, system_category()};
+  } else if (size_t(res) < buf.InputLen()) {
+    // Finish the short write synchronously.
+    auto rest = buf.InputBuffer().subspan(res);
+    iovec vec{.iov_base = rest.data(), .iov_len = rest.size()};
+    off_t offset = buffer->offset + res;
+    while (vec.iov_len > 0 && !ec_) {
+      Result<size_t> wres = WriteSomeInternal(fd_, &vec, 1, offset, 0, proactor_);
+      if (!wres) {
+        ec_ = wres.error();
+      } else {
+        vec.iov_base = reinterpret_cast<uint8_t*>(vec.iov_base) + *wres;
+        vec.iov_len -= *wres;
+        offset += *wres;
+      }
+    }
+  }
+  buf.Clear();
+
+  return ec_;
+}
+
+void BufferedWriteFileImpl::Drain() {
+  while (pending_ > 0) {
+    waiter_ = detail::FiberActive();
+    waiter_->Suspend();
+  }
+}
+
 LinuxFileImpl::~LinuxFileImpl() {
   CloseFile(fd_, proactor_);
 }
@@ -288,27 +725,37 @@ std::error_code LinuxFileImpl::Close() {
 }  // namespace
 
 io::Result<io::WriteFile*> OpenWrite(std::string_view path, io::WriteFile::Options opts) {
+  // The end of an existing file is not necessarily aligned for O_DIRECT.
+  if (opts.append && opts.direct)
+    return make_unexpected(make_error_code(errc::invalid_argument));
+
   int flags = O_CREAT | O_WRONLY | O_CLOEXEC;
-  if (opts.append)
-    flags |= O_APPEND;
-  else
+  if (!opts.append)
     flags |= O_TRUNC;
+  if (opts.direct)
+    flags |= O_DIRECT;
 
   ProactorBase* me = ProactorBase::me();
   DCHECK(me->GetKind() == ProactorBase::IOURING);
 
   Proactor* p = static_cast<Proactor*>(CHECK_NOTNULL(me));
 
-  unique_ptr<WriteFileImpl> impl(new WriteFileImpl{p, path});
-  error_code ec = impl->Open(flags);
+  unique_ptr<WriteFileImpl> impl;
+  if (opts.buffers_in_flight > 0 || opts.direct)
+    impl.reset(new BufferedWriteFileImpl{p, path, opts});
+  else
+    impl.reset(new WriteFileImpl{p, path});
+  error_code ec = impl->Open(flags, opts.append);
   if (ec)
     return make_unexpected(ec);
 
   return impl.release();
 }
 
-io::Result<io::ReadonlyFile*> OpenRead(std::string_view path) {
+io::Result<io::ReadonlyFile*> OpenRead(std::string_view path, const ReadonlyFile::Options& opts) {
   int flags = O_RDONLY | O_CLOEXEC;
+  if (opts.direct)
+    flags |= O_DIRECT;
 
   ProactorBase* me = ProactorBase::me();
   DCHECK(me->GetKind() == ProactorBase::IOURING);
@@ -345,6 +792,9 @@ io::Result<io::ReadonlyFile*> OpenRead(std::string_view path) {
     }
   }
 
+  if (opts.readahead_depth > 0 || opts.direct)
+    return new ReadAheadFileImpl(fd, sb.st_size, p, opts);
+
   return new ReadFileImpl(fd, sb.st_size, p);
 }
 
@@ -18,7 +18,8 @@ namespace fb2 {
 io::Result<io::WriteFile*> OpenWrite(std::string_view path,
                                      io::WriteFile::Options opts = io::WriteFile::Options());
 
-io::Result<io::ReadonlyFile*> OpenRead(std::string_view path);
+io::Result<io::ReadonlyFile*> OpenRead(
+    std::string_view path, const io::ReadonlyFile::Options& opts = io::ReadonlyFile::Options());
 
 // Uring based linux file. Similarly, works only within the same proactor thread where it has
 // been open. Unlike classic IO classes can read and write at specified offsets.
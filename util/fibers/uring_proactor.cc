@@ -9,6 +9,8 @@
 #include <poll.h>
 #include <string.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "base/flags.h"
 #include "base/histogram.h"
@@ -18,6 +20,21 @@
 #include "util/fibers/uring_socket.h"
 
 ABSL_FLAG(bool, proactor_register_fd, false, "If true tries to register file descriptors");
+ABSL_FLAG(bool, uring_defer_taskrun, false,
+          "Experimental. If true, sets up rings with IORING_SETUP_SINGLE_ISSUER | "
+          "IORING_SETUP_DEFER_TASKRUN when the kernel supports it");
+ABSL_FLAG(uint32_t, uring_send_zc_threshold, 0,
+          "If positive, socket writes of at least that many bytes use zero-copy sends");
+ABSL_FLAG(uint32_t, uring_direct_accept_slots, 0,
+          "If positive and proactor_register_fd is set, reserves that many fixed file slots "
+          "for sockets that are accepted directly into the io_uring file table");
+ABSL_FLAG(bool, uring_recv_adaptive, false,
+          "If true, socket receives choose between inline recv, immediate recv requests and "
+          "poll-first recv requests based on how often the data was ready recently");
+ABSL_FLAG(bool, uring_small_fixed_writes, false,
+          "Experimental. If true and the proactor has registered buffers, socket writes of "
+          "up to 64 bytes are copied into a registered buffer and sent without waiting for "
+          "their completion. Their errors are not reported to the writer");
 
 #define URING_CHECK(x)                                                        \
   do {                                                                        \
@@ -59,6 +76,10 @@ constexpr uint64_t kUserDataCbIndex = 1024;
 constexpr uint16_t kMsgRingSubmitTag = 1;
 constexpr uint16_t kTimeoutSubmitTag = 2;
 
+// user_data of MSG_RING completions that carry a task pointer. Heap pointers never have
+// the top bit set.
+constexpr uint64_t kRingTaskBit = 1ULL << 63;
+
 }  // namespace
 
 UringProactor::UringProactor() : ProactorBase() {
@@ -67,11 +88,33 @@ UringProactor::UringProactor() : ProactorBase() {
 UringProactor::~UringProactor() {
   CHECK(is_stopped_);
   if (thread_id_ != -1U) {
+    for (size_t i = 0; i < bufring_groups_.size(); ++i) {
+      auto& group = bufring_groups_[i];
+      if (group.ring) {
+        io_uring_free_buf_ring(&ring_, group.ring, group.nentries, i);
+        delete[] group.storage;
+      }
+    }
     io_uring_queue_exit(&ring_);
   }
+  if (reg_buf_mem_) {
+    munmap(reg_buf_mem_, reg_buf_mem_size_);
+  }
+  for (const Pipe& pipe : pipes_) {
+    close(pipe.read_fd);
+    close(pipe.write_fd);
+  }
   VLOG(1) << "Closing wake_fd " << wake_fd_ << " ring fd: " << ring_.ring_fd;
 }
 
+void UringProactor::SetSqPoll(uint32_t idle_ms, int cpu) {
+  CHECK_EQ(0U, thread_id_) << "SetSqPoll must be called before Init";
+  CHECK_LE(idle_ms, uint32_t(INT32_MAX));
+
+  sqpoll_idle_ms_ = idle_ms;
+  sqpoll_cpu_ = cpu;
+}
+
 void UringProactor::Init(size_t ring_size, int wq_fd) {
   CHECK_EQ(0U, ring_size & (ring_size - 1));
   CHECK_GE(ring_size, 8U);
@@ -80,38 +123,74 @@ void UringProactor::Init(size_t ring_size, int wq_fd) {
   base::sys::KernelVersion kver;
   base::sys::GetKernelVersion(&kver);
 
-  CHECK(kver.kernel > 5 || (kver.kernel = 5 && kver.major >= 8))
+  CHECK(kver.kernel > 5 || (kver.kernel == 5 && kver.major >= 8))
       << "Versions 5.8 or higher are supported";
 
   io_uring_params params;
   memset(&params, 0, sizeof(params));
 
-#if 0
-  if (FLAGS_proactor_register_fd && geteuid() == 0) {
+  if (sqpoll_idle_ms_ >= 0) {
     params.flags |= IORING_SETUP_SQPOLL;
-    LOG_FIRST_N(INFO, 1) << "Root permissions - setting SQPOLL flag";
+    params.sq_thread_idle = sqpoll_idle_ms_;
+    if (sqpoll_cpu_ >= 0 && wq_fd < 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = sqpoll_cpu_;
+    }
   }
 
   // Optionally reuse the already created work-queue from another uring.
+  // If that ring has SQPOLL, its kernel poller thread is shared as well.
   if (wq_fd > 0) {
     params.flags |= IORING_SETUP_ATTACH_WQ;
     params.wq_fd = wq_fd;
   }
-#endif
 
   // If we setup flags that kernel does not recognize, it fails the setup call.
+  accept_multishot_f_ = 0;
+  recv_poll_first_f_ = 0;
   if (kver.kernel > 5 || (kver.kernel == 5 && kver.major >= 19)) {
-    params.flags |= IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.flags |= IORING_SETUP_SUBMIT_ALL;
+
+    // The kernel rejects task-run IPI related flags together with SQPOLL.
+    if ((params.flags & IORING_SETUP_SQPOLL) == 0)
+      params.flags |= IORING_SETUP_COOP_TASKRUN;
+    accept_multishot_f_ = 1;
+    recv_poll_first_f_ = 1;
+  }
+
+  // Each proactor is the single issuer of its ring, so the completions can be processed
+  // when we enter the kernel to fetch them instead of interrupting the thread.
+  bool defer_taskrun = absl::GetFlag(FLAGS_uring_defer_taskrun) &&
+                       (params.flags & IORING_SETUP_SQPOLL) == 0 &&
+                       (kver.kernel > 6 || (kver.kernel == 6 && kver.major >= 1));
+  if (defer_taskrun) {
+    params.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
   }
 
-  // it seems that SQPOLL requires registering each fd, including sockets fds.
-  // need to check if its worth pursuing.
-  // For sure not in short-term.
-  // params.flags = IORING_SETUP_SQPOLL;
   VLOG(1) << "Create uring of size " << ring_size;
 
   // If this fails with 'can not allocate memory' most probably you need to increase maxlock limit.
   int init_res = io_uring_queue_init_params(ring_size, &ring_, &params);
+  if (init_res == -EINVAL && defer_taskrun) {
+    // Backported kernels may report a version that does not match their feature set.
+    LOG(WARNING) << "DEFER_TASKRUN is not supported, falling back to the default setup";
+    params.flags &= ~(IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+    init_res = io_uring_queue_init_params(ring_size, &ring_, &params);
+  }
+
+  // Before 5.11 the SQPOLL thread handles only registered files, and our sockets and files
+  // are mostly not registered, so their requests would fail with EBADF.
+  if (init_res == 0 && (params.flags & IORING_SETUP_SQPOLL) &&
+      (params.features & IORING_FEAT_SQPOLL_NONFIXED) == 0) {
+    LOG(WARNING) << "SQPOLL requires registered files on this kernel, falling back to "
+                    "the default setup";
+    io_uring_queue_exit(&ring_);
+    params.flags &= ~(IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF);
+    params.sq_thread_idle = 0;
+    params.sq_thread_cpu = 0;
+    init_res = io_uring_queue_init_params(ring_size, &ring_, &params);
+  }
+
   if (init_res < 0) {
     init_res = -init_res;
     if (init_res == ENOMEM) {
@@ -125,12 +204,20 @@ void UringProactor::Init(size_t ring_size, int wq_fd) {
                << SafeErrorMessage(init_res);
   }
   sqpoll_f_ = (params.flags & IORING_SETUP_SQPOLL) != 0;
+  defer_taskrun_f_ = (params.flags & IORING_SETUP_DEFER_TASKRUN) != 0;
+  VLOG_IF(1, defer_taskrun_f_) << "DEFER_TASKRUN enabled";
 
   io_uring_probe* uring_probe = io_uring_get_probe_ring(&ring_);
 
   msgring_f_ = io_uring_opcode_supported(uring_probe, IORING_OP_MSG_RING);
+  send_zc_f_ = io_uring_opcode_supported(uring_probe, IORING_OP_SEND_ZC) &&
+               io_uring_opcode_supported(uring_probe, IORING_OP_SENDMSG_ZC);
   io_uring_free_probe(uring_probe);
   VLOG_IF(1, msgring_f_) << "msgring supported!";
+  VLOG_IF(1, send_zc_f_) << "zero-copy send supported!";
+  send_zc_threshold_ = send_zc_f_ ? absl::GetFlag(FLAGS_uring_send_zc_threshold) : 0;
+  recv_adaptive_f_ = recv_poll_first_f_ && absl::GetFlag(FLAGS_uring_recv_adaptive);
+  small_fixed_writes_f_ = absl::GetFlag(FLAGS_uring_small_fixed_writes);
 
   unsigned req_feats = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_FAST_POLL | IORING_FEAT_NODROP;
   CHECK_EQ(req_feats, params.features & req_feats)
@@ -142,7 +229,8 @@ void UringProactor::Init(size_t ring_size, int wq_fd) {
   wake_fixed_fd_ = wake_fd_;
   register_fd_ = absl::GetFlag(FLAGS_proactor_register_fd);
   if (register_fd_) {
-    register_fds_.resize(64, -1);
+    uint32_t direct_slots = absl::GetFlag(FLAGS_uring_direct_accept_slots);
+    register_fds_.resize(64 + direct_slots, -1);
     register_fds_[0] = wake_fd_;
     wake_fixed_fd_ = 0;
 
@@ -151,6 +239,18 @@ void UringProactor::Init(size_t ring_size, int wq_fd) {
     absl::Duration duration = absl::Now() - start;
     VLOG(1) << "io_uring_register_files took " << absl::ToInt64Microseconds(duration) << " usec";
     CHECK_EQ(0, res);
+
+    // Direct accepts let the kernel pick the slot, so we hand it the tail of the table
+    // that RegisterFd never touches.
+    if (direct_slots > 0 && accept_multishot_f_) {
+      res = io_uring_register_file_alloc_range(&ring_, 64, direct_slots);
+      if (res == 0) {
+        direct_accept_start_ = 64;
+        direct_accept_len_ = direct_slots;
+      } else {
+        LOG(WARNING) << "io_uring_register_file_alloc_range failed: " << SafeErrorMessage(-res);
+      }
+    }
   }
 
   size_t sz = ring_.sq.ring_sz + params.sq_entries * sizeof(struct io_uring_sqe);
@@ -170,6 +270,13 @@ void UringProactor::Init(size_t ring_size, int wq_fd) {
 }
 
 void UringProactor::DispatchCqe(detail::FiberInterface* current, const io_uring_cqe& cqe) {
+  if ((cqe.user_data & kRingTaskBit) && cqe.user_data != UINT64_MAX) {
+    RingTask* task = reinterpret_cast<RingTask*>(cqe.user_data & ~kRingTaskBit);
+    (*task)();
+    delete task;
+    return;
+  }
+
   uint32_t user_data = cqe.user_data & 0xFFFFFFFF;
   if (user_data >= kUserDataCbIndex) {  // our heap range surely starts higher than 1k.
     if (ABSL_PREDICT_FALSE(cqe.user_data == UINT64_MAX)) {
@@ -193,6 +300,16 @@ void UringProactor::DispatchCqe(detail::FiberInterface* current, const io_uring_
 
     CbType func = std::move(e.cb);
 
+    // Multishot requests keep their completion entry until the final cqe arrives.
+    // We move the callback out during the call because it may submit new requests and
+    // regrow centries_.
+    if (cqe.flags & IORING_CQE_F_MORE) {
+      func(current, cqe.res, cqe.flags);
+      DCHECK(!centries_[index].cb);
+      centries_[index].cb = std::move(func);
+      return;
+    }
+
     // Set e to be the head of free-list.
     e.index = next_free_ce_;
     next_free_ce_ = index;
@@ -230,12 +347,21 @@ SubmitEntry UringProactor::GetSubmitEntry(CbType cb, uint16_t submit_tag) {
     int submitted = io_uring_submit(&ring_);
     if (submitted > 0) {
       res = io_uring_get_sqe(&ring_);
+
+      // With SQPOLL the kernel thread consumes the ring asynchronously.
+      if (res == NULL && sqpoll_f_) {
+        io_uring_sqring_wait(&ring_);
+        res = io_uring_get_sqe(&ring_);
+      }
     } else {
       ++get_entry_submit_fail_;
       LOG(FATAL) << "Fatal error submitting to iouring: " << -submitted;
     }
   }
 
+  // Without SQPOLL the submitted entries are consumed synchronously, with SQPOLL we waited
+  // for the poller, so a free entry exists in both configurations.
+  DCHECK(res) << "No free sqe, sqpoll: " << bool(sqpoll_f_);
   memset(res, 0, sizeof(io_uring_sqe));
 
   if (cb) {
@@ -260,44 +386,140 @@ SubmitEntry UringProactor::GetSubmitEntry(CbType cb, uint16_t submit_tag) {
   return SubmitEntry{res};
 }
 
-int UringProactor::RegisterBuffers() {
-  unique_ptr<uint8_t[]> reg_buf(new uint8_t[1U << 16]);
-  iovec vec[1];
-  vec[0].iov_base = reg_buf.get();
-  vec[0].iov_len = 1U << 16;
-  int res = io_uring_register_buffers(&ring_, vec, 1);
+int UringProactor::RegisterBuffers(size_t budget) {
+  CHECK(reg_buf_classes_.empty()) << "Buffers were already registered";
+
+  constexpr unsigned kNumClasses = kMaxRegBufShift - kMinRegBufShift + 1;
+
+  // The classes share the budget that the smaller ones left. The class indices are the fixed
+  // buffer indices, so we stop at the first class that does not fit into its share.
+  size_t total = 0;
+  vector<RegBufClass> classes;
+  for (unsigned i = 0; i < kNumClasses; ++i) {
+    RegBufClass cls;
+    cls.size = kMinRegBufSize << i;
+    cls.count = (budget - total) / (kNumClasses - i) / cls.size;
+    if (cls.count == 0)
+      break;
+    total += size_t(cls.size) * cls.count;
+    classes.push_back(std::move(cls));
+  }
+
+  if (classes.empty())
+    return EINVAL;
+
+  void* mem = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return errno;
+  }
+
+  iovec vec[kNumClasses];
+  uint8_t* next = reinterpret_cast<uint8_t*>(mem);
+  for (unsigned i = 0; i < classes.size(); ++i) {
+    classes[i].arena = next;
+    vec[i].iov_base = next;
+    vec[i].iov_len = size_t(classes[i].size) * classes[i].count;
+    next += vec[i].iov_len;
+  }
+
+  int res = io_uring_register_buffers(&ring_, vec, classes.size());
   if (res < 0) {
+    munmap(mem, total);
     return -res;
   }
 
-  free_req_buf_id_ = 0;
-  for (int i = 0; i < 1024; ++i) {
-    uint8_t* next = reg_buf.get() + i * 64;
-    absl::little_endian::Store16(next, i + 1);
+  for (auto& cls : classes) {
+    cls.free_ids.resize(cls.count);
+    for (uint32_t j = 0; j < cls.count; ++j) {
+      cls.free_ids[j] = cls.count - j - 1;  // lower ids are popped first.
+    }
   }
 
-  registered_buf_ = std::move(reg_buf);
+  VPRO(1) << "Registered " << total << " bytes of fixed buffers";
+  reg_buf_mem_ = reinterpret_cast<uint8_t*>(mem);
+  reg_buf_mem_size_ = total;
+  reg_buf_classes_ = std::move(classes);
   return 0;
 }
 
-uint8_t* UringProactor::ProvideRegisteredBuffer() {
-  if (free_req_buf_id_ < 0 || free_req_buf_id_ >= 1024)
-    return nullptr;
-
-  int res = free_req_buf_id_;
-  free_req_buf_id_ = absl::little_endian::Load16(&registered_buf_[free_req_buf_id_ * 64]);
-  return registered_buf_.get() + res * 64;
+auto UringProactor::ProvideRegisteredBuffer(size_t size) -> RegisteredBuffer {
+  RegisteredBuffer res;
+  if (reg_buf_classes_.empty() || size > kMaxRegBufSize)
+    return res;
+
+  unsigned index = 0;
+  while ((kMinRegBufSize << index) < size)
+    ++index;
+
+  // Fall back to larger classes if the best fit is exhausted.
+  for (; index < reg_buf_classes_.size(); ++index) {
+    auto& cls = reg_buf_classes_[index];
+    if (!cls.free_ids.empty()) {
+      uint32_t id = cls.free_ids.back();
+      cls.free_ids.pop_back();
+      res.data = cls.arena + size_t(id) * cls.size;
+      res.size = cls.size;
+      res.buf_index = index;
+      break;
+    }
+  }
+  return res;
 }
 
-void UringProactor::ReturnRegisteredBuffer(uint8_t* addr) {
-  DCHECK(registered_buf_);
-  intptr_t offs = addr - registered_buf_.get();
+void UringProactor::ReturnRegisteredBuffer(const RegisteredBuffer& buf) {
+  DCHECK_LT(buf.buf_index, reg_buf_classes_.size());
+  auto& cls = reg_buf_classes_[buf.buf_index];
+  DCHECK_EQ(buf.size, cls.size);
+
+  intptr_t offs = buf.data - cls.arena;
   DCHECK_GE(offs, 0);
-  DCHECK_LT(offs, 1 << 16);
+  DCHECK_EQ(0u, offs % cls.size);
+  DCHECK_LT(size_t(offs) / cls.size, cls.count);
 
-  unsigned buf_id = offs / 64;
-  absl::little_endian::Store16(&registered_buf_[buf_id * 64], free_req_buf_id_);
-  free_req_buf_id_ = buf_id;
+  cls.free_ids.push_back(offs / cls.size);
+}
+
+int UringProactor::RegisterBufferRing(uint16_t group_id, uint16_t nentries, unsigned esize) {
+  CHECK_EQ(0U, nentries & (nentries - 1)) << "nentries must be a power of 2";
+  CHECK_GT(esize, 0U);
+
+  if (group_id >= bufring_groups_.size()) {
+    bufring_groups_.resize(group_id + 1);
+  }
+  CHECK(bufring_groups_[group_id].ring == nullptr) << "Buffer ring " << group_id
+                                                   << " is already registered";
+
+  int res = 0;
+  io_uring_buf_ring* br = io_uring_setup_buf_ring(&ring_, nentries, group_id, 0, &res);
+  if (br == nullptr) {
+    return -res;
+  }
+
+  auto& group = bufring_groups_[group_id];
+  group.ring = br;
+  group.storage = new uint8_t[size_t(nentries) * esize];
+  group.esize = esize;
+  group.nentries = nentries;
+
+  unsigned mask = io_uring_buf_ring_mask(nentries);
+  for (unsigned i = 0; i < nentries; ++i) {
+    io_uring_buf_ring_add(br, GetBufRingPtr(group_id, i), esize, i, mask, i);
+  }
+  io_uring_buf_ring_advance(br, nentries);
+
+  VPRO(1) << "Registered buffer ring " << group_id << " with " << nentries << " buffers of size "
+          << esize;
+  return 0;
+}
+
+void UringProactor::ReplenishBuffer(uint16_t group_id, uint16_t buf_id) {
+  DCHECK(HasBufferRing(group_id));
+  auto& group = bufring_groups_[group_id];
+  DCHECK_LT(buf_id, group.nentries);
+
+  io_uring_buf_ring_add(group.ring, GetBufRingPtr(group_id, buf_id), group.esize, buf_id,
+                        io_uring_buf_ring_mask(group.nentries), 0);
+  io_uring_buf_ring_advance(group.ring, 1);
 }
 
 UringProactor::EpollIndex UringProactor::EpollAdd(int fd, EpollCB cb, uint32_t event_mask) {
@@ -418,8 +640,13 @@ unsigned UringProactor::RegisterFd(int source_fd) {
   if (!register_fd_)
     return source_fd;
 
-  auto next = std::find(register_fds_.begin() + next_free_fd_, register_fds_.end(), -1);
-  if (next == register_fds_.end()) {
+  auto end = direct_accept_len_ ? register_fds_.begin() + direct_accept_start_
+                                : register_fds_.end();
+  auto next = std::find(register_fds_.begin() + next_free_fd_, end, -1);
+  if (next == end) {
+    // Regrowing the table would drop the direct descriptors that live in its tail.
+    CHECK_EQ(0u, direct_accept_len_) << "Fixed file table is full";
+
     size_t prev_sz = register_fds_.size();
     register_fds_.resize(prev_sz * 2, -1);
     register_fds_[prev_sz] = source_fd;
@@ -474,7 +701,14 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
   while (true) {
     ++loop_cnt;
 
-    int num_submitted = io_uring_submit(&ring_);
+    // The fibers that were ready have run, so we let them coalesce their work before submitting.
+    if (!tick_end_.empty())
+      RunTickEnd();
+
+    // With DEFER_TASKRUN the completions are posted only when we enter the kernel for them,
+    // so we submit and reap in a single syscall.
+    int num_submitted =
+        defer_taskrun_f_ ? io_uring_submit_and_get_events(&ring_) : io_uring_submit(&ring_);
     bool ring_busy = false;
 
     if (num_submitted >= 0) {
@@ -659,11 +893,10 @@ const static uint64_t wake_val = 1;
 void UringProactor::WakeRing() {
   tq_wakeup_ev_.fetch_add(1, std::memory_order_relaxed);
 
-  UringProactor* caller = static_cast<UringProactor*>(ProactorBase::me());
-
-  DCHECK(caller != this);
+  DCHECK(ProactorBase::me() != this);
 
-  if (caller && caller->msgring_f_) {
+  UringProactor* caller = MsgRingCaller();
+  if (caller) {
     SubmitEntry se = caller->GetSubmitEntry(nullptr, kMsgRingSubmitTag);
     se.PrepMsgRing(ring_.ring_fd, 0, 0);
   } else {
@@ -672,6 +905,71 @@ void UringProactor::WakeRing() {
   }
 }
 
+UringProactor* UringProactor::MsgRingCaller() const {
+  ProactorBase* caller = ProactorBase::me();
+
+  // The caller may be an epoll proactor or an external thread.
+  if (caller == nullptr || caller == this || caller->GetKind() != IOURING)
+    return nullptr;
+
+  UringProactor* res = static_cast<UringProactor*>(caller);
+  return res->msgring_f_ ? res : nullptr;
+}
+
+void UringProactor::PostRingTask(UringProactor* target, RingTask* task) {
+  DCHECK_EQ(ProactorBase::me(), this);
+
+  auto cb = [target, task](detail::FiberInterface*, IoResult res, uint32_t) {
+    if (res < 0) {
+      // The message was not posted, for example because the target CQ overflowed.
+      // Deliver the task via the task queue instead.
+      VLOG(1) << "MSG_RING task failed: " << -res;
+      target->DispatchBrief([task] {
+        (*task)();
+        delete task;
+      });
+    }
+  };
+  SubmitEntry se = GetSubmitEntry(std::move(cb), kMsgRingSubmitTag);
+  se.PrepMsgRing(target->ring_.ring_fd, 0, uint64_t(task) | kRingTaskBit);
+}
+
+auto UringProactor::AcquirePipe() -> Pipe {
+  Pipe res;
+  if (!pipes_.empty()) {
+    res = pipes_.back();
+    pipes_.pop_back();
+    return res;
+  }
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    res.read_fd = -errno;
+    return res;
+  }
+  res.read_fd = fds[0];
+  res.write_fd = fds[1];
+
+  // Larger pipes mean less splice calls per transfer. The size is capped by
+  // /proc/sys/fs/pipe-max-size, so we keep whatever size the kernel gave us.
+  fcntl(res.write_fd, F_SETPIPE_SZ, 1U << 20);
+  int size = fcntl(res.write_fd, F_GETPIPE_SZ);
+  res.size = size > 0 ? size : 1U << 16;
+
+  return res;
+}
+
+void UringProactor::ReleasePipe(const Pipe& pipe, bool dirty) {
+  constexpr size_t kMaxPooledPipes = 16;
+
+  if (dirty || pipes_.size() >= kMaxPooledPipes) {
+    close(pipe.read_fd);
+    close(pipe.write_fd);
+    return;
+  }
+  pipes_.push_back(pipe);
+}
+
 void UringProactor::EpollAddInternal(EpollIndex id) {
   auto uring_cb = [id, this](detail::FiberInterface* p, IoResult res, uint32_t flags) {
     auto& epoll = epoll_entries_[id];
@@ -707,8 +1005,19 @@ void UringProactor::EpollDelInternal(EpollIndex id) {
 FiberCall::FiberCall(UringProactor* proactor, uint32_t timeout_msec) : me_(detail::FiberActive()) {
   auto waker = [this](detail::FiberInterface* current, UringProactor::IoResult res,
                       uint32_t flags) {
+    // Zero-copy notification, the result was delivered by the previous completion.
+    if (flags & IORING_CQE_F_NOTIF) {
+      current->ActivateOther(me_);
+      return;
+    }
+
     io_res_ = res;
     res_flags_ = flags;
+
+    // Zero-copy sends post a notification after the result. The caller may reuse its buffers
+    // only after that, so we wake it up on the last completion.
+    if (flags & IORING_CQE_F_MORE)
+      return;
     current->ActivateOther(me_);
   };
 
@@ -733,5 +1042,70 @@ FiberCall::~FiberCall() {
   CHECK(!me_) << "Get was not called!";
 }
 
+FiberChain::FiberChain(UringProactor* proactor, unsigned steps)
+    : proactor_(proactor), me_(detail::FiberActive()), steps_(steps) {
+  CHECK_GT(steps, 0u);
+  CHECK_LE(steps, kMaxSteps);
+
+  // A chain that was split between two submissions would lose its links.
+  proactor->WaitTillAvailable(steps);
+}
+
+FiberChain::~FiberChain() {
+  CHECK(!me_) << "Get was not called!";
+}
+
+SubmitEntry FiberChain::Next(bool hard_link) {
+  CHECK_LT(added_, steps_);
+
+  auto waker = [this, index = added_](detail::FiberInterface* current, IoResult res,
+                                      uint32_t flags) {
+    // Same as with FiberCall, a zero-copy send completes with its notification.
+    if ((flags & IORING_CQE_F_NOTIF) == 0) {
+      results_[index] = res;
+      if (flags & IORING_CQE_F_MORE)
+        return;
+    }
+
+    if (--pending_ == 0)
+      current->ActivateOther(me_);
+  };
+
+  SubmitEntry se = proactor_->GetSubmitEntry(std::move(waker));
+  if (last_sqe_) {
+    last_sqe_->flags |= (last_hard_link_ ? IOSQE_IO_HARDLINK : IOSQE_IO_LINK);
+  }
+
+  last_sqe_ = se.sqe();
+  last_hard_link_ = hard_link;
+  ++added_;
+  ++pending_;
+
+  return se;
+}
+
+void FiberChain::LinkTimeout(uint32_t timeout_msec) {
+  CHECK(last_sqe_) << "Nothing to limit";
+  CHECK_LT(added_, steps_);
+
+  last_sqe_->flags |= IOSQE_IO_LINK;
+  last_sqe_ = nullptr;
+  ++added_;
+
+  ts_.tv_sec = (timeout_msec / 1000);
+  ts_.tv_nsec = (timeout_msec % 1000) * 1000000;
+  SubmitEntry tm = proactor_->GetSubmitEntry(nullptr, kTimeoutSubmitTag);
+  tm.PrepLinkTimeout(&ts_);
+}
+
+auto FiberChain::Get() -> const IoResult* {
+  CHECK_EQ(added_, steps_) << "The chain is incomplete";
+
+  me_->Suspend();
+  me_ = nullptr;
+
+  return results_;
+}
+
 }  // namespace fb2
 }  // namespace util
@@ -25,6 +25,14 @@ class UringProactor : public ProactorBase {
   UringProactor();
   ~UringProactor();
 
+  // Makes the ring use a kernel thread that polls the submission queue (IORING_SETUP_SQPOLL),
+  // so that submissions do not need syscalls. The thread goes to sleep after `idle_ms`
+  // milliseconds without submissions. If cpu >= 0 the thread is pinned to that cpu.
+  // Must be called before Init. Rings that are initialized with wq_fd of a SQPOLL ring
+  // share its poller thread and ignore `cpu`. Kernels before 5.11 poll only registered files,
+  // so Init falls back to the default setup there, see HasSqPoll().
+  void SetSqPoll(uint32_t idle_ms, int cpu = -1);
+
   void Init(size_t ring_size, int wq_fd = -1);
 
   using IoResult = int;
@@ -65,10 +73,59 @@ class UringProactor : public ProactorBase {
     return sqpoll_f_;
   }
 
+  // Whether the ring was set up with DEFER_TASKRUN, see --uring_defer_taskrun.
+  bool HasDeferTaskrun() const {
+    return defer_taskrun_f_;
+  }
+
+  // Whether the kernel supports IORING_OP_MSG_RING. If it does, uring proactors wake each
+  // other by posting directly into the target completion queue instead of using the eventfd.
+  bool HasMsgRing() const {
+    return msgring_f_;
+  }
+
+  // Runs `f` on this proactor by posting it into its completion queue with IORING_OP_MSG_RING.
+  // Unlike DispatchBrief it does not go through the task queue and its wakeup handshake, but
+  // allocates the task on heap. Falls back to DispatchBrief if the calling thread is not
+  // another uring proactor with MSG_RING support or if the message could not be delivered.
+  template <typename Func> void DispatchBriefRing(Func&& f);
+
   bool HasRegisterFd() const {
     return register_fd_;
   }
 
+  // Whether the kernel supports multishot accept requests.
+  bool HasAcceptMultishot() const {
+    return accept_multishot_f_;
+  }
+
+  // Whether sockets can be accepted directly into the fixed file table.
+  // Direct descriptors do not have a regular file descriptor and are bound to this proactor.
+  bool HasDirectAccept() const {
+    return direct_accept_len_ > 0;
+  }
+
+  // Whether the kernel supports zero-copy sends (IORING_OP_SEND_ZC and IORING_OP_SENDMSG_ZC).
+  bool HasSendZc() const {
+    return send_zc_f_;
+  }
+
+  // Default minimal size of socket writes that use zero-copy sends. 0 if disabled.
+  uint32_t send_zc_threshold() const {
+    return send_zc_threshold_;
+  }
+
+  // Whether the kernel supports IORING_RECVSEND_POLL_FIRST for socket receives.
+  bool HasRecvPollFirst() const {
+    return recv_poll_first_f_;
+  }
+
+  // Whether sockets choose their receive strategy adaptively by default
+  // (see --uring_recv_adaptive and UringSocket::SetRecvAdaptive).
+  bool recv_adaptive() const {
+    return recv_adaptive_f_;
+  }
+
   int ring_fd() const {
     return ring_.ring_fd;
   }
@@ -86,17 +143,83 @@ class UringProactor : public ProactorBase {
     return IOURING;
   }
 
-  // Currently only a single bin of 1024 buffers of size 64 bytes (total 64K) is supported.
-  // Returns 0 on success, errno on failure.
-  int RegisterBuffers();
+  // Registered buffers are page aligned and grouped into power-of-2 size classes
+  // from kMinRegBufSize to kMaxRegBufSize. Each class is registered as a single fixed buffer
+  // whose index is the class index.
+  static constexpr unsigned kMinRegBufShift = 12, kMaxRegBufShift = 20;
+  static constexpr size_t kMinRegBufSize = 1U << kMinRegBufShift;
+  static constexpr size_t kMaxRegBufSize = 1U << kMaxRegBufShift;
+
+  struct RegisteredBuffer {
+    uint8_t* data = nullptr;
+    uint32_t size = 0;
+    uint16_t buf_index = 0;
+  };
+
+  // Registers the pool of fixed buffers. At most `budget` bytes are split evenly between the size
+  // classes. The largest classes are left out if a buffer does not fit into their share,
+  // and EINVAL is returned if none fits. The memory is pinned by the kernel and accounted
+  // against RLIMIT_MEMLOCK. Returns 0 on success, errno on failure.
+  int RegisterBuffers(size_t budget = 1U << 23);
 
   bool HasRegisteredBuffers() const {
-    return bool(registered_buf_);
+    return !reg_buf_classes_.empty();
+  }
+
+  // Whether small socket writes are sent from registered buffers without waiting for them,
+  // see --uring_small_fixed_writes. Takes effect only with RegisterBuffers().
+  bool small_fixed_writes() const {
+    return small_fixed_writes_f_;
+  }
+
+  // Returns a registered buffer of at least `size` bytes or a buffer with null data if
+  // none is available or the size is larger than kMaxRegBufSize.
+  RegisteredBuffer ProvideRegisteredBuffer(size_t size);
+  void ReturnRegisteredBuffer(const RegisteredBuffer& buf);
+
+  // Returns the fixed buffer index if [addr, addr + len) lies within the pool, -1 otherwise.
+  int FindRegisteredBuffer(const void* addr, size_t len) const {
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(addr);
+    for (size_t i = 0; i < reg_buf_classes_.size(); ++i) {
+      const auto& cls = reg_buf_classes_[i];
+      if (ptr >= cls.arena && ptr + len <= cls.arena + size_t(cls.size) * cls.count)
+        return i;
+    }
+    return -1;
+  }
+
+  // Registers a ring of provided buffers that can be used by multishot receives.
+  // The ring holds `nentries` buffers of `esize` bytes each and is identified by `group_id`.
+  // nentries must be a power of 2. Returns 0 on success, errno on failure.
+  int RegisterBufferRing(uint16_t group_id, uint16_t nentries, unsigned esize);
+
+  bool HasBufferRing(uint16_t group_id) const {
+    return group_id < bufring_groups_.size() && bufring_groups_[group_id].ring != nullptr;
+  }
+
+  // Returns the address of the buffer `buf_id` that belongs to the buffer ring `group_id`.
+  uint8_t* GetBufRingPtr(uint16_t group_id, uint16_t buf_id) const {
+    const auto& group = bufring_groups_[group_id];
+    return group.storage + size_t(buf_id) * group.esize;
   }
 
-  // Returns a buffer of size 64 or null if no buffers are found.
-  uint8_t* ProvideRegisteredBuffer();
-  void ReturnRegisteredBuffer(uint8_t* addr);
+  // Returns the buffer back to the ring so that the kernel could use it for the next receives.
+  void ReplenishBuffer(uint16_t group_id, uint16_t buf_id);
+
+  // Pipe used to splice data between a file and a socket.
+  struct Pipe {
+    int read_fd = -1;
+    int write_fd = -1;
+    uint32_t size = 0;  // pipe capacity.
+  };
+
+  // Returns an empty pipe from the proactor pool, creating it if needed.
+  // On failure, returns a pipe with read_fd holding -errno.
+  Pipe AcquirePipe();
+
+  // Returns the pipe to the pool. Pipes that may still hold data must be closed
+  // with `dirty` set to true.
+  void ReleasePipe(const Pipe& pipe, bool dirty = false);
 
   using EpollCB = std::function<void(uint32_t)>;
   using EpollIndex = unsigned;
@@ -115,6 +238,12 @@ class UringProactor : public ProactorBase {
 
   void MainLoop(detail::Scheduler* sched) final;
   void WakeRing() final;
+
+  using RingTask = fu2::unique_function<void()>;
+
+  // Returns the proactor of the calling thread if it can send MSG_RING requests to this one.
+  UringProactor* MsgRingCaller() const;
+  void PostRingTask(UringProactor* target, RingTask* task);
   void EpollAddInternal(EpollIndex id);
   void EpollDelInternal(EpollIndex id);
 
@@ -125,7 +254,12 @@ class UringProactor : public ProactorBase {
   uint8_t sqpoll_f_ : 1;
   uint8_t register_fd_ : 1;
   uint8_t msgring_f_ : 1;
-  uint8_t : 5;
+  uint8_t accept_multishot_f_ : 1;
+  uint8_t send_zc_f_ : 1;
+  uint8_t defer_taskrun_f_ : 1;
+  uint8_t recv_poll_first_f_ : 1;
+  uint8_t recv_adaptive_f_ : 1;
+  uint8_t small_fixed_writes_f_ : 1;
 
   EventCount sqe_avail_;
 
@@ -147,10 +281,33 @@ class UringProactor : public ProactorBase {
   int32_t next_free_ce_ = -1;
   uint32_t pending_cb_cnt_ = 0;
   uint32_t next_free_fd_ = 0;  // next available fd for register files.
+
+  // The range of fixed file slots that is reserved for kernel allocations by direct accepts.
+  // RegisterFd allocates only below direct_accept_start_.
+  uint32_t direct_accept_start_ = 0, direct_accept_len_ = 0;
+  uint32_t send_zc_threshold_ = 0;
+  int32_t sqpoll_idle_ms_ = -1;  // -1 - SQPOLL is disabled.
+  int32_t sqpoll_cpu_ = -1;
   uint32_t get_entry_sq_full_ = 0, get_entry_submit_fail_ = 0, get_entry_await_ = 0;
 
-  int32_t free_req_buf_id_ = -1;
-  std::unique_ptr<uint8_t[]> registered_buf_;
+  struct RegBufClass {
+    uint8_t* arena = nullptr;
+    uint32_t size = 0;   // size of each buffer in the class.
+    uint32_t count = 0;  // number of buffers in the class.
+    std::vector<uint32_t> free_ids;
+  };
+  std::vector<RegBufClass> reg_buf_classes_;
+  uint8_t* reg_buf_mem_ = nullptr;
+  size_t reg_buf_mem_size_ = 0;
+
+  struct BufRingGroup {
+    io_uring_buf_ring* ring = nullptr;
+    uint8_t* storage = nullptr;
+    uint32_t esize = 0;
+    uint16_t nentries = 0;
+  };
+  std::vector<BufRingGroup> bufring_groups_;
+  std::vector<Pipe> pipes_;
 
   struct EpollEntry {
     EpollCB cb;
@@ -198,5 +355,60 @@ class FiberCall {
   uint32_t res_flags_ = 0;  // set by waker upon completion.
 };
 
+// Similar to FiberCall but submits a chain of linked requests, for example write -> fsync or
+// send -> close. The requests run one after another in the kernel, and the calling fiber is
+// woken once when all of them complete.
+// Usage:
+//   FiberChain chain(proactor, 2);
+//   chain.Next().PrepWrite(fd, buf, len, offset);
+//   chain.Next().PrepFSync(fd, IORING_FSYNC_DATASYNC);
+//   const FiberChain::IoResult* res = chain.Get();
+class FiberChain {
+  FiberChain(const FiberChain&) = delete;
+  void operator=(const FiberChain&) = delete;
+
+ public:
+  using IoResult = UringProactor::IoResult;
+  static constexpr unsigned kMaxSteps = 8;
+
+  // Reserves submission entries for `steps` requests so that the chain is submitted at once.
+  FiberChain(UringProactor* proactor, unsigned steps);
+
+  ~FiberChain();
+
+  // Returns the entry for the next request in the chain. If the request fails, the requests
+  // following it complete with -ECANCELED, unless `hard_link` is true.
+  SubmitEntry Next(bool hard_link = false);
+
+  // Limits the last request to timeout_msec, after which it completes with -ECANCELED.
+  // Takes one of the reserved steps and must be the last one.
+  void LinkTimeout(uint32_t timeout_msec);
+
+  // Suspends until all the requests complete and returns their results in the chain order.
+  const IoResult* Get();
+
+ private:
+  UringProactor* proactor_;
+  detail::FiberInterface* me_;
+
+  unsigned steps_;
+  unsigned added_ = 0;
+  unsigned pending_ = 0;
+
+  io_uring_sqe* last_sqe_ = nullptr;
+  bool last_hard_link_ = false;
+  IoResult results_[kMaxSteps];
+  timespec ts_;  // in case of timeout.
+};
+
+template <typename Func> void UringProactor::DispatchBriefRing(Func&& f) {
+  UringProactor* caller = MsgRingCaller();
+  if (caller == nullptr) {
+    DispatchBrief(std::forward<Func>(f));
+    return;
+  }
+  caller->PostRingTask(this, new RingTask(std::forward<Func>(f)));
+}
+
 }  // namespace fb2
 }  // namespace util
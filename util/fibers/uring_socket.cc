@@ -7,9 +7,13 @@
 #include <netinet/in.h>
 #include <poll.h>
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "base/stl_util.h"
 
+ABSL_FLAG(bool, uring_accept_multishot, false,
+          "If true, listening sockets accept connections with a multishot accept request");
+
 #define VSOCK(verbosity) VLOG(verbosity) << "sock[" << native_handle() << "] "
 #define DVSOCK(verbosity) DVLOG(verbosity) << "sock[" << native_handle() << "] "
 
@@ -35,6 +39,13 @@ auto Unexpected(std::errc e) {
   return make_unexpected(make_error_code(e));
 }
 
+// The adaptive receive strategy keeps the readiness of the last 8 receives in a bitmask.
+constexpr unsigned kRecvInlineMinReady = 5;     // receive inline at this many ready bits.
+constexpr unsigned kRecvPollFirstMaxReady = 2;  // poll first at this many ready bits or less.
+constexpr unsigned kRecvProbeInterval = 8;      // probe readiness inline every N receives.
+
+thread_local UringSocket::RecvStats tl_recv_stats;
+
 }  // namespace
 
 UringSocket::~UringSocket() {
@@ -48,14 +59,34 @@ auto UringSocket::Close() -> error_code {
   error_code ec;
   if (fd_ >= 0) {
     DCHECK_EQ(GetProactor()->thread_id(), pthread_self());
+    SetCork(0);  // Sends the corked data.
 
     DVSOCK(1) << "Closing socket";
 
     int fd = native_handle();
     Proactor* p = GetProactor();
+    if (multishot_) {
+      CancelRecvMultishot();
+      multishot_.reset();
+    }
+
+    if (multiaccept_) {
+      CancelAcceptMultishot();
+      multiaccept_.reset();
+    }
+
     if ((fd_ & REGISTER_FD) && p) {
       unsigned fixed_fd = fd;
       fd = p->TranslateFixedFd(fixed_fd);
+      if (fd < 0) {  // direct descriptor, it exists only in the fixed file table.
+        FiberCall fc(p);
+        fc->PrepCloseDirect(fixed_fd);
+        IoResult res = fc.Get();
+        if (res < 0)
+          ec = error_code(-res, system_category());
+        fd_ = -1;
+        return ec;
+      }
       p->UnregisterFd(fixed_fd);
     }
     posix_err_wrap(::close(fd), &ec);
@@ -64,9 +95,38 @@ auto UringSocket::Close() -> error_code {
   return ec;
 }
 
+auto UringSocket::Shutdown(int how) -> error_code {
+  // The corked data is sent before the write side is closed.
+  if (how != SHUT_RD && IsCorked())
+    (void)FlushCork();
+
+  if ((fd_ & REGISTER_FD) == 0)
+    return LinuxSocketBase::Shutdown(how);
+
+  CHECK_GE(fd_, 0);
+
+  error_code ec;
+  if (fd_ & IS_SHUTDOWN)
+    return ec;
+
+  // native_handle() is an index into the fixed file table, so we shutdown via io_uring.
+  FiberCall fc(GetProactor());
+  fc->PrepShutdown(native_handle(), how);
+  fc->sqe()->flags |= IOSQE_FIXED_FILE;
+  IoResult res = fc.Get();
+  if (res < 0)
+    ec = error_code(-res, system_category());
+  fd_ |= IS_SHUTDOWN;  // Enter shutdown state unrelated to the success of the call.
+
+  return ec;
+}
+
 auto UringSocket::Accept() -> AcceptResult {
   CHECK(proactor());
 
+  if (multiaccept_ || (absl::GetFlag(FLAGS_uring_accept_multishot) && EnableAcceptMultishot()))
+    return AcceptMultishot();
+
   error_code ec;
 
   int fd = native_handle();
@@ -115,8 +175,6 @@ auto UringSocket::Connect(const endpoint_type& ep) -> error_code {
   VSOCK(1) << "Connect [" << fd << "] " << ep.address().to_string() << ":" << ep.port();
 
   Proactor* p = GetProactor();
-  CHECK(!p->HasSqPoll()) << "Not supported with SQPOLL, TBD";
-
   unsigned dense_id = fd;
 
   if (p->HasRegisterFd()) {
@@ -149,47 +207,72 @@ auto UringSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
     return Unexpected(errc::connection_aborted);
   }
 
+  if (IsCorked())
+    return CorkedWrite(ptr, len);
+
   int fd = native_handle();
   Proactor* p = GetProactor();
   ssize_t res = 0;
   size_t short_len = 0;
-  uint8_t* reg_buf = nullptr;
+  Proactor::RegisteredBuffer reg_buf;
 
   VSOCK(2) << "WriteSome [" << fd << "] " << len;
 
-  // WARNING: raw, experimental code.
-  if (p->HasRegisteredBuffers() && len < 16) {
+  // WARNING: raw, experimental code, opt-in with --uring_small_fixed_writes.
+  if (p->small_fixed_writes() && p->HasRegisteredBuffers() && len < 16) {
     for (uint32_t i = 0; i < len; ++i) {
       short_len += ptr[i].iov_len;
     }
 
     if (short_len <= 64) {
-      reg_buf = p->ProvideRegisteredBuffer();
+      reg_buf = p->ProvideRegisteredBuffer(short_len);
     }
   }
 
-  if (reg_buf) {
-    uint8_t* next = reg_buf;
+  if (reg_buf.data) {
+    uint8_t* next = reg_buf.data;
     for (uint32_t i = 0; i < len; ++i) {
       memcpy(next, ptr[i].iov_base, ptr[i].iov_len);
       next += ptr[i].iov_len;
     }
-    auto cb = [p, reg_buf](detail::FiberInterface*, Proactor::IoResult res, uint32_t flags) {
+    auto cb = [p, reg_buf, short_len](detail::FiberInterface*, Proactor::IoResult res,
+                                       uint32_t flags) {
       p->ReturnRegisteredBuffer(reg_buf);
-      CHECK_GT(res, 0);  // TODO - handle errors.
+
+      // The write has been reported as done, the socket may be gone by now. A peer reset
+      // surfaces in the next operation on the socket.
+      VLOG_IF(1, res < 0 || size_t(res) < short_len)
+          << "Fixed write of " << short_len << " bytes failed: " << res;
     };
 
     SubmitEntry se = p->GetSubmitEntry(std::move(cb));
-    se.PrepWriteFixed(fd, reg_buf, short_len, 0, 0);
+    se.PrepWriteFixed(fd, reg_buf.data, short_len, 0, reg_buf.buf_index);
     se.sqe()->flags |= register_flag();
 
     return short_len;  // optimistic
   }
 
+  // Zero-copy sends complete only after the kernel released the buffers, so the semantics
+  // of WriteSome are preserved.
+  bool zc = UseSendZc(ptr, len);
+
   if (len == 1) {
+    // Zero-copy sends from the registered pool skip pinning the user pages.
+    int buf_index = zc ? p->FindRegisteredBuffer(ptr->iov_base, ptr->iov_len) : -1;
+
     while (true) {
       FiberCall fc(p, timeout());
-      fc->PrepSend(fd, ptr->iov_base, ptr->iov_len, MSG_NOSIGNAL);
+      if (zc) {
+        if (buf_index >= 0) {
+          fc->PrepSendZc(fd, ptr->iov_base, ptr->iov_len, MSG_NOSIGNAL,
+                         IORING_RECVSEND_FIXED_BUF);
+          fc->sqe()->buf_index = buf_index;
+        } else {
+          fc->PrepSendZc(fd, ptr->iov_base, ptr->iov_len, MSG_NOSIGNAL);
+        }
+      } else {
+        fc->PrepSend(fd, ptr->iov_base, ptr->iov_len, MSG_NOSIGNAL);
+      }
       fc->sqe()->flags |= register_flag();
 
       res = fc.Get();  // Interrupt point
@@ -202,6 +285,12 @@ auto UringSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
       if (res == EAGAIN)  // EAGAIN can happen in case of CQ overflow.
         continue;
 
+      if (zc && res == EOPNOTSUPP) {  // Not all socket families support zero-copy.
+        zc_threshold_ = 0;
+        zc = false;
+        continue;
+      }
+
       if (res == EPIPE)  // We do not care about EPIPE that can happen when we shutdown our socket.
         res = ECONNABORTED;
 
@@ -215,7 +304,11 @@ auto UringSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
 
     while (true) {
       FiberCall fc(p, timeout());
-      fc->PrepSendMsg(fd, &msg, MSG_NOSIGNAL);
+      if (zc) {
+        fc->PrepSendMsgZc(fd, &msg, MSG_NOSIGNAL);
+      } else {
+        fc->PrepSendMsg(fd, &msg, MSG_NOSIGNAL);
+      }
       fc->sqe()->flags |= register_flag();
 
       res = fc.Get();  // Interrupt point
@@ -228,6 +321,12 @@ auto UringSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
       if (res == EAGAIN)  // EAGAIN can happen in case of CQ overflow.
         continue;
 
+      if (zc && res == EOPNOTSUPP) {  // Not all socket families support zero-copy.
+        zc_threshold_ = 0;
+        zc = false;
+        continue;
+      }
+
       if (res == EPIPE)  // We do not care about EPIPE that can happen when we shutdown our socket.
         res = ECONNABORTED;
 
@@ -241,12 +340,211 @@ auto UringSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
   return make_unexpected(std::move(ec));
 }
 
+auto UringSocket::SendFile(int fd, off_t offset, size_t len) -> Result<size_t> {
+  CHECK(proactor());
+  CHECK_GE(fd_, 0);
+
+  if (fd_ & IS_SHUTDOWN) {
+    return Unexpected(errc::connection_aborted);
+  }
+
+  // The file data follows the corked data.
+  if (IsCorked()) {
+    error_code ec = FlushCork();
+    if (ec)
+      return make_unexpected(ec);
+  }
+
+  Proactor* p = GetProactor();
+  Proactor::Pipe pipe = p->AcquirePipe();
+  if (pipe.read_fd < 0) {
+    return make_unexpected(error_code(-pipe.read_fd, system_category()));
+  }
+
+  int sock = native_handle();
+  size_t sent = 0;
+  size_t in_pipe = 0;
+  int res = 0;
+
+  while (sent < len) {
+    unsigned chunk = min<size_t>(len - sent, pipe.size);
+
+    // Fill the pipe from the file and drain it into the socket within the same submission.
+    // If the first splice is short, the second one is cancelled and we drain the pipe below.
+    bool has_timeout = timeout() != UINT32_MAX;
+    FiberChain chain(p, has_timeout ? 3 : 2);
+    chain.Next().PrepSplice(fd, offset + sent, pipe.write_fd, -1, chunk, 0);
+    SubmitEntry se = chain.Next();
+    se.PrepSplice(pipe.read_fd, -1, sock, -1, chunk, 0);
+    se.sqe()->flags |= register_flag();
+    if (has_timeout)
+      chain.LinkTimeout(timeout());
+
+    const FiberChain::IoResult* results = chain.Get();
+    if (results[0] < 0) {
+      res = -results[0];
+      break;
+    }
+    if (results[0] == 0)  // eof
+      break;
+
+    in_pipe = results[0];
+
+    // The pipe was filled, so the socket splice was cancelled by the timeout.
+    if (results[1] == -ECANCELED && unsigned(results[0]) == chunk) {
+      res = ETIMEDOUT;
+      break;
+    }
+    if (results[1] > 0)
+      in_pipe -= results[1];
+
+    while (in_pipe > 0) {
+      FiberCall fc(p, timeout());
+      fc->PrepSplice(pipe.read_fd, -1, sock, -1, in_pipe, 0);
+      fc->sqe()->flags |= register_flag();
+      res = fc.Get();
+
+      if (res > 0) {
+        in_pipe -= res;
+        res = 0;
+        continue;
+      }
+
+      res = res == 0 ? ECONNABORTED : -res;
+      if (res != EAGAIN)
+        break;
+
+      // The socket is non-blocking, so splice fails when its send buffer is full.
+      FiberCall poll_fc(p, timeout());
+      poll_fc->PrepPollAdd(sock, POLLOUT);
+      poll_fc->sqe()->flags |= register_flag();
+      res = poll_fc.Get();
+      if (res < 0) {
+        res = res == -ECANCELED ? ETIMEDOUT : -res;
+        break;
+      }
+      res = 0;
+    }
+
+    if (res)
+      break;
+
+    // A short file splice is not the end of file, the pipe may not fit the chunk when
+    // the offset is not page aligned. Only an empty splice ends the file.
+    sent += results[0];
+  }
+
+  // The pipe must be empty before it's reused.
+  p->ReleasePipe(pipe, in_pipe > 0);
+
+  if (res == 0)
+    return sent;
+
+  if (res == EPIPE)
+    res = ECONNABORTED;
+
+  error_code ec(res, system_category());
+  VSOCK(1) << "SendFile error " << ec << " on " << RemoteEndpoint();
+
+  return make_unexpected(std::move(ec));
+}
+
+auto UringSocket::GetRecvStats() -> RecvStats {
+  return tl_recv_stats;
+}
+
+auto UringSocket::ChooseRecvPath(int flags) -> RecvPath {
+  Proactor* p = GetProactor();
+  bool adaptive = recv_adaptive_ < 0 ? p->recv_adaptive() : recv_adaptive_;
+  if (!adaptive || !p->HasRecvPollFirst() || (flags & MSG_DONTWAIT))
+    return RECV_IMMEDIATE;
+
+  // Fixed descriptors may not have a regular descriptor for the inline recv.
+  bool can_inline = (fd_ & REGISTER_FD) == 0;
+  unsigned ready = __builtin_popcount(recv_history_);
+
+  // Only inline receives tell whether the data was ready when we asked for it,
+  // so we probe from time to time to let sockets that became busy switch over.
+  if (can_inline && (ready >= kRecvInlineMinReady || ++recv_probe_ % kRecvProbeInterval == 0))
+    return RECV_INLINE;
+
+  return ready <= kRecvPollFirstMaxReady ? RECV_POLL_FIRST : RECV_IMMEDIATE;
+}
+
+template <typename InlineRecv, typename PrepRecv>
+ssize_t UringSocket::AdaptiveRecv(int flags, InlineRecv&& inline_recv, PrepRecv&& prep) {
+  RecvPath path = ChooseRecvPath(flags);
+
+  if (path == RECV_INLINE) {
+    ssize_t res = inline_recv();
+    if (res >= 0 || errno != EAGAIN) {
+      if (res < 0)
+        return -errno;
+      ++tl_recv_stats.inline_hits;
+      recv_history_ = (recv_history_ << 1) | 1;
+      return res;
+    }
+    ++tl_recv_stats.inline_misses;
+    recv_history_ <<= 1;
+    path = RECV_POLL_FIRST;
+  }
+
+  while (true) {
+    FiberCall fc(GetProactor(), timeout());
+    prep(fc.operator->());
+    fc->sqe()->flags |= register_flag();
+    if (path == RECV_POLL_FIRST) {
+      fc->sqe()->ioprio |= IORING_RECVSEND_POLL_FIRST;
+      ++tl_recv_stats.poll_first_cnt;
+    } else {
+      ++tl_recv_stats.immediate_cnt;
+    }
+    ssize_t res = fc.Get();
+
+    if (res > 0) {
+      // Data left in the socket means that the next receive will find it ready, and an empty
+      // socket that it will wait. Both are recorded, so the history follows the socket.
+      bool nonempty = fc.flags() & IORING_CQE_F_SOCK_NONEMPTY;
+      recv_history_ = (recv_history_ << 1) | nonempty;
+      return res;
+    }
+    DVSOCK(2) << "Got " << res;
+
+    // EAGAIN can happen in case of CQ overflow.
+    if (res == -EAGAIN && (flags & MSG_DONTWAIT) == 0) {
+      continue;
+    }
+    return res;
+  }
+}
+
+bool UringSocket::UseSendZc(const iovec* v, uint32_t len) {
+  Proactor* p = GetProactor();
+  if (!p->HasSendZc())
+    return false;
+
+  uint32_t threshold = zc_threshold_ == UINT32_MAX ? p->send_zc_threshold() : zc_threshold_;
+  if (threshold == 0)
+    return false;
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    total += v[i].iov_len;
+  }
+  return total >= threshold;
+}
+
 void UringSocket::AsyncWriteSome(const iovec* v, uint32_t len, AsyncWriteCb cb) {
   if (fd_ & IS_SHUTDOWN) {
     cb(Unexpected(errc::connection_aborted));
     return;
   }
 
+  if (IsCorked()) {
+    CorkedAsyncWrite(v, len, std::move(cb));
+    return;
+  }
+
   // this time we can not store it on stack.
   //
   msghdr* msg = new msghdr;
@@ -287,31 +585,24 @@ auto UringSocket::RecvMsg(const msghdr& msg, int flags) -> Result<size_t> {
   Proactor* p = GetProactor();
   DCHECK(ProactorBase::me() == p);
 
-  ssize_t res;
-  VSOCK(2) << "RecvMsg [" << fd << "]";
-
-  while (true) {
-    FiberCall fc(p, timeout());
-    fc->PrepRecvMsg(fd, &msg, flags);
-    fc->sqe()->flags |= register_flag();
-    res = fc.Get();
-
-    if (res > 0) {
-      return res;
-    }
-    DVSOCK(2) << "Got " << res;
+  if (multishot_) {
+    return RecvMultishot(msg.msg_iov, msg.msg_iovlen, flags);
+  }
 
-    res = -res;
-    // EAGAIN can happen in case of CQ overflow.
-    if (res == EAGAIN && (flags & MSG_DONTWAIT) == 0) {
-      continue;
-    }
+  VSOCK(2) << "RecvMsg [" << fd << "]";
 
-    if (res == 0)
-      res = ECONNABORTED;
-    break;
+  ssize_t res = AdaptiveRecv(
+      flags,
+      [&] { return recvmsg(fd, const_cast<msghdr*>(&msg), flags | MSG_DONTWAIT); },
+      [&](SubmitEntry* se) { se->PrepRecvMsg(fd, &msg, flags); });
+  if (res > 0) {
+    return res;
   }
 
+  res = -res;
+  if (res == 0)
+    res = ECONNABORTED;
+
   error_code ec(res, system_category());
   VSOCK(1) << "Error " << ec << " on " << RemoteEndpoint();
 
@@ -324,29 +615,22 @@ io::Result<size_t> UringSocket::Recv(const io::MutableBytes& mb, int flags) {
   DCHECK(ProactorBase::me() == p);
 
   VSOCK(2) << "Recv [" << fd << "] " << flags;
-  ssize_t res;
-  while (true) {
-    FiberCall fc(p, timeout());
-    fc->PrepRecv(fd, mb.data(), mb.size(), flags);
-    fc->sqe()->flags |= register_flag();
-    res = fc.Get();
-
-    if (res > 0) {
-      return res;
-    }
-    DVSOCK(2) << "Got " << res;
-
-    res = -res;
-    // EAGAIN can happen in case of CQ overflow.
-    if (res == EAGAIN && (flags & MSG_DONTWAIT) == 0) {
-      continue;
-    }
+  if (multishot_) {
+    iovec v{.iov_base = mb.data(), .iov_len = mb.size()};
+    return RecvMultishot(&v, 1, flags);
+  }
 
-    if (res == 0)
-      res = ECONNABORTED;
-    break;
+  ssize_t res = AdaptiveRecv(
+      flags, [&] { return recv(fd, mb.data(), mb.size(), flags | MSG_DONTWAIT); },
+      [&](SubmitEntry* se) { se->PrepRecv(fd, mb.data(), mb.size(), flags); });
+  if (res > 0) {
+    return res;
   }
 
+  res = -res;
+  if (res == 0)
+    res = ECONNABORTED;
+
   error_code ec(res, system_category());
   VSOCK(1) << "Error " << ec << " on " << RemoteEndpoint();
 
@@ -389,5 +673,298 @@ void UringSocket::CancelOnErrorCb() {
   }
 }
 
+void UringSocket::EnableRecvMultishot(uint16_t group_id) {
+  CHECK(!multishot_);
+  CHECK_GE(fd_, 0);
+  DCHECK(ProactorBase::me() == GetProactor());
+  CHECK(GetProactor()->HasBufferRing(group_id)) << "Buffer ring " << group_id
+                                                << " is not registered";
+
+  multishot_.reset(new MultiShot);
+  multishot_->group_id = group_id;
+  ArmRecvMultishot();
+}
+
+auto UringSocket::RecvProvided() -> Result<ProvidedBuffer> {
+  CHECK(multishot_);
+
+  error_code ec = WaitMultishotChunk(0);
+  if (ec) {
+    return make_unexpected(std::move(ec));
+  }
+
+  MultiShot::Chunk chunk = multishot_->chunks.front();
+  multishot_->chunks.pop_front();
+
+  uint8_t* buf = GetProactor()->GetBufRingPtr(multishot_->group_id, chunk.buf_id);
+  return ProvidedBuffer{io::Bytes{buf + chunk.offset, size_t(chunk.res) - chunk.offset},
+                        chunk.buf_id};
+}
+
+void UringSocket::ReturnProvided(const ProvidedBuffer& pbuf) {
+  DCHECK(multishot_);
+  GetProactor()->ReplenishBuffer(multishot_->group_id, pbuf.buf_id);
+}
+
+void UringSocket::OnResetProactor() {
+  CHECK(!multishot_) << "Sockets in multishot mode can not migrate";
+  CHECK(!multiaccept_) << "Sockets in multishot mode can not migrate";
+  CHECK_EQ(0, fd_ & REGISTER_FD) << "Fixed descriptors are bound to their ring";
+}
+
+bool UringSocket::EnableAcceptMultishot() {
+  Proactor* p = GetProactor();
+  CHECK(p);
+
+  if (!p->HasAcceptMultishot())
+    return false;
+
+  if (!multiaccept_) {
+    multiaccept_.reset(new MultiAccept);
+    multiaccept_->direct = p->HasDirectAccept();
+  }
+  return true;
+}
+
+auto UringSocket::AcceptMultishot() -> AcceptResult {
+  MultiAccept* ma = multiaccept_.get();
+
+  while (ma->results.empty()) {
+    if (fd_ & IS_SHUTDOWN) {
+      return Unexpected(errc::connection_aborted);
+    }
+
+    if (ma->user_data == 0) {
+      ArmAcceptMultishot();
+    }
+
+    ma->waiter = detail::FiberActive();
+    ma->waiter->Suspend();
+  }
+
+  int32_t res = ma->results.front();
+  ma->results.pop_front();
+
+  if (res < 0) {
+    // Listening sockets that were shut down fail the pending accept with EINVAL.
+    if (fd_ & IS_SHUTDOWN) {
+      return Unexpected(errc::connection_aborted);
+    }
+    return make_unexpected(error_code(-res, system_category()));
+  }
+
+  UringSocket* fs = new UringSocket{nullptr};
+  fs->fd_ = (res << kFdShift) | (fd_ & kInheritedFlags);
+  if (ma->direct) {
+    fs->fd_ |= REGISTER_FD;
+  }
+  return fs;
+}
+
+void UringSocket::ArmAcceptMultishot() {
+  MultiAccept* ma = multiaccept_.get();
+  DCHECK_EQ(ma->user_data, 0u);
+
+  auto cb = [ma](detail::FiberInterface* current, IoResult res, uint32_t flags) {
+    if (res != -ECANCELED) {
+      ma->results.push_back(res);
+    }
+
+    if ((flags & IORING_CQE_F_MORE) == 0) {
+      ma->user_data = 0;
+    }
+
+    if (ma->waiter) {
+      detail::FiberInterface* waiter = ma->waiter;
+      ma->waiter = nullptr;
+      current->ActivateOther(waiter);
+    }
+  };
+
+  // Direct descriptors do not support SOCK_CLOEXEC.
+  unsigned accept_flags = ma->direct ? SOCK_NONBLOCK : SOCK_NONBLOCK | SOCK_CLOEXEC;
+  SubmitEntry se = GetProactor()->GetSubmitEntry(std::move(cb));
+  se.PrepAcceptMultishot(native_handle(), accept_flags, ma->direct);
+  se.sqe()->flags |= register_flag();
+  ma->user_data = se.sqe()->user_data;
+}
+
+void UringSocket::CancelAcceptMultishot() {
+  MultiAccept* ma = multiaccept_.get();
+  Proactor* p = GetProactor();
+  DCHECK(ma->waiter == nullptr) << "Can not close a socket with a pending Accept";
+
+  if (ma->user_data) {
+    FiberCall fc(p);
+    fc->PrepCancel(ma->user_data);
+    IoResult res = fc.Get();
+    VSOCK(2) << "Cancelled multishot accept " << res;
+
+    // The callback references the accept state, so we must wait for the final completion.
+    while (ma->user_data) {
+      ma->waiter = detail::FiberActive();
+      ma->waiter->Suspend();
+    }
+  }
+
+  // Close connections that were accepted but never picked up.
+  for (int32_t res : ma->results) {
+    if (res < 0)
+      continue;
+    if (ma->direct) {
+      FiberCall fc(p);
+      fc->PrepCloseDirect(res);
+      fc.Get();
+    } else {
+      ::close(res);
+    }
+  }
+  ma->results.clear();
+}
+
+void UringSocket::ArmRecvMultishot() {
+  DCHECK_EQ(multishot_->user_data, 0u);
+
+  auto cb = [this](detail::FiberInterface* current, Proactor::IoResult res, uint32_t flags) {
+    OnRecvMultishot(current, res, flags);
+  };
+
+  SubmitEntry se = GetProactor()->GetSubmitEntry(std::move(cb));
+  se.PrepRecvMultishot(native_handle(), multishot_->group_id, 0);
+  se.sqe()->flags |= register_flag();
+  multishot_->user_data = se.sqe()->user_data;
+}
+
+void UringSocket::OnRecvMultishot(detail::FiberInterface* current, IoResult res, uint32_t flags) {
+  MultiShot* ms = multishot_.get();
+
+  if (flags & IORING_CQE_F_BUFFER) {
+    uint16_t buf_id = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (res > 0) {
+      ms->chunks.push_back(MultiShot::Chunk{res, buf_id});
+    } else {
+      GetProactor()->ReplenishBuffer(ms->group_id, buf_id);
+    }
+  } else if (res == -ENOBUFS) {
+    // The ring is exhausted and the kernel terminated the request. We rearm it lazily.
+    ms->no_bufs = true;
+  } else if (res <= 0 && res != -ECANCELED) {
+    ms->chunks.push_back(MultiShot::Chunk{res, 0});
+  }
+
+  if ((flags & IORING_CQE_F_MORE) == 0) {
+    ms->user_data = 0;
+  }
+
+  if (ms->waiter) {
+    detail::FiberInterface* waiter = ms->waiter;
+    ms->waiter = nullptr;
+    current->ActivateOther(waiter);
+  }
+}
+
+void UringSocket::CancelRecvMultishot() {
+  MultiShot* ms = multishot_.get();
+  Proactor* p = GetProactor();
+
+  if (ms->user_data) {
+    FiberCall fc(p);
+    fc->PrepCancel(ms->user_data);
+    IoResult res = fc.Get();
+    VSOCK(2) << "Cancelled multishot recv " << res;
+
+    // The callback references this socket, so we must wait for the final completion.
+    while (ms->user_data) {
+      ms->waiter = detail::FiberActive();
+      ms->waiter->Suspend();
+    }
+  }
+
+  for (const auto& chunk : ms->chunks) {
+    if (chunk.res > 0)
+      p->ReplenishBuffer(ms->group_id, chunk.buf_id);
+  }
+  ms->chunks.clear();
+}
+
+auto UringSocket::WaitMultishotChunk(int flags) -> error_code {
+  MultiShot* ms = multishot_.get();
+
+  while (ms->chunks.empty()) {
+    if (fd_ & IS_SHUTDOWN) {
+      return make_error_code(errc::connection_aborted);
+    }
+
+    if (flags & MSG_DONTWAIT) {
+      return make_error_code(errc::resource_unavailable_try_again);
+    }
+
+    if (ms->user_data == 0) {
+      if (ms->no_bufs) {
+        // Let other fibers process and return their buffers before we try again.
+        ms->no_bufs = false;
+        ThisFiber::Yield();
+      }
+      ArmRecvMultishot();
+    }
+
+    ms->waiter = detail::FiberActive();
+    if (timeout() == UINT32_MAX) {
+      ms->waiter->Suspend();
+    } else if (ms->waiter->WaitUntil(chrono::steady_clock::now() +
+                                     chrono::milliseconds(timeout()))) {
+      ms->waiter = nullptr;
+      return make_error_code(errc::operation_canceled);
+    }
+  }
+
+  const MultiShot::Chunk& head = ms->chunks.front();
+  if (head.res <= 0) {
+    int err = head.res == 0 ? ECONNABORTED : -head.res;
+    ms->chunks.pop_front();
+    error_code ec(err, system_category());
+    VSOCK(1) << "Error " << ec << " on " << RemoteEndpoint();
+    return ec;
+  }
+
+  return error_code{};
+}
+
+auto UringSocket::RecvMultishot(const iovec* v, uint32_t len, int flags) -> Result<size_t> {
+  error_code ec = WaitMultishotChunk(flags);
+  if (ec) {
+    return make_unexpected(std::move(ec));
+  }
+
+  MultiShot* ms = multishot_.get();
+  Proactor* p = GetProactor();
+  size_t copied = 0, iov_offs = 0;
+
+  // Copy the chunks that are already here without waiting for more.
+  while (len > 0 && !ms->chunks.empty() && ms->chunks.front().res > 0) {
+    MultiShot::Chunk& chunk = ms->chunks.front();
+    const uint8_t* src = p->GetBufRingPtr(ms->group_id, chunk.buf_id) + chunk.offset;
+    size_t sz = std::min<size_t>(chunk.res - chunk.offset, v->iov_len - iov_offs);
+
+    memcpy(reinterpret_cast<uint8_t*>(v->iov_base) + iov_offs, src, sz);
+    copied += sz;
+    chunk.offset += sz;
+    iov_offs += sz;
+
+    if (chunk.offset == uint32_t(chunk.res)) {
+      p->ReplenishBuffer(ms->group_id, chunk.buf_id);
+      ms->chunks.pop_front();
+    }
+
+    if (iov_offs == v->iov_len) {
+      ++v;
+      --len;
+      iov_offs = 0;
+    }
+  }
+
+  return copied;
+}
+
 }  // namespace fb2
 }  // namespace util
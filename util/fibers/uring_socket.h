@@ -6,6 +6,8 @@
 
 #include <liburing.h>
 
+#include <deque>
+
 #include "util/fiber_socket_base.h"
 #include "util/fibers/uring_proactor.h"
 
@@ -32,13 +34,41 @@ class UringSocket : public LinuxSocketBase {
 
   ABSL_MUST_USE_RESULT error_code Connect(const endpoint_type& ep) final;
   ABSL_MUST_USE_RESULT error_code Close() final;
+  error_code Shutdown(int how) final;
 
   io::Result<size_t> WriteSome(const iovec* v, uint32_t len) override;
+
+  //! Overrides the proactor default (see --uring_send_zc_threshold) for this socket.
+  void SetZeroCopyThreshold(uint32_t bytes) final {
+    zc_threshold_ = bytes;
+  }
   void AsyncWriteSome(const iovec* v, uint32_t len, AsyncWriteCb cb) override;
 
+  // Splices the file into the socket through a pipe from the proactor pool, so the data
+  // does not pass through user memory.
+  Result<size_t> SendFile(int fd, off_t offset, size_t len) override;
+
   Result<size_t> RecvMsg(const msghdr& msg, int flags) override;
   Result<size_t> Recv(const io::MutableBytes& mb, int flags = 0) override;
 
+  //! Overrides the proactor default (see --uring_recv_adaptive) for this socket.
+  //! With the adaptive strategy, sockets that usually have data ready receive it with
+  //! an inline non-blocking recv(2), mostly idle sockets submit IORING_RECVSEND_POLL_FIRST
+  //! requests that skip the initial receive attempt, and the rest submit regular requests.
+  void SetRecvAdaptive(bool enable) {
+    recv_adaptive_ = enable;
+  }
+
+  // Counters of the receive paths, per proactor thread.
+  struct RecvStats {
+    uint64_t inline_hits = 0;     // inline recv calls that returned data.
+    uint64_t inline_misses = 0;   // inline recv calls that were followed by a request.
+    uint64_t immediate_cnt = 0;   // recv requests that the kernel attempts right away.
+    uint64_t poll_first_cnt = 0;  // recv requests that wait for readiness first.
+  };
+
+  static RecvStats GetRecvStats();
+
   using FiberSocketBase::IsConnClosed;
 
   //! Subsribes to one-shot poll. event_mask is a mask of POLLXXX values.
@@ -55,16 +85,103 @@ class UringSocket : public LinuxSocketBase {
   void RegisterOnErrorCb(std::function<void(uint32_t)> cb) final;
   void CancelOnErrorCb() final;
 
+  // A chunk of received data that resides in a provided buffer ring of the proactor.
+  // Must be returned via ReturnProvided() once it has been processed.
+  struct ProvidedBuffer {
+    io::Bytes buffer;
+    uint16_t buf_id;
+  };
+
+  //! Switches the socket into multishot receive mode. A single multishot recv request stays
+  //! armed and the kernel fills buffers from the provided buffer ring `group_id`
+  //! (see UringProactor::RegisterBufferRing) instead of the caller buffers.
+  //! Recv/RecvMsg keep working by copying out of the provided buffers, RecvProvided allows
+  //! zero-copy access. The socket can not migrate to another proactor while in this mode.
+  void EnableRecvMultishot(uint16_t group_id);
+
+  bool HasRecvMultishot() const {
+    return bool(multishot_);
+  }
+
+  //! Returns the next received chunk without copying it. Requires multishot mode.
+  Result<ProvidedBuffer> RecvProvided();
+
+  //! Returns the buffer back to the proactor buffer ring.
+  void ReturnProvided(const ProvidedBuffer& pbuf);
+
+  //! Switches a listening socket into multishot accept mode. A single accept request stays
+  //! armed and accepted connections are queued until Accept() picks them up.
+  //! If the proactor has direct accepts enabled (see UringProactor::HasDirectAccept),
+  //! the accepted sockets are born as REGISTER_FD sockets that have no regular descriptor
+  //! and must stay on the proactor of the listener.
+  //! Returns false if the kernel does not support multishot accept.
+  bool EnableAcceptMultishot();
+
  private:
   Proactor* GetProactor() {
     return static_cast<Proactor*>(proactor());
   }
 
+  void OnResetProactor() final;
+
+  void ArmRecvMultishot();
+  void OnRecvMultishot(detail::FiberInterface* current, Proactor::IoResult res, uint32_t flags);
+  void CancelRecvMultishot();
+
+  AcceptResult AcceptMultishot();
+  void ArmAcceptMultishot();
+  void CancelAcceptMultishot();
+
+  // Waits until there is a received chunk at the head of the queue.
+  error_code WaitMultishotChunk(int flags);
+  Result<size_t> RecvMultishot(const iovec* v, uint32_t len, int flags);
+
   uint8_t register_flag() const {
     return fd_ & REGISTER_FD ? IOSQE_FIXED_FILE : 0;
   }
 
+  // Whether the write should use zero-copy send.
+  bool UseSendZc(const iovec* v, uint32_t len);
+
+  enum RecvPath : uint8_t { RECV_INLINE, RECV_IMMEDIATE, RECV_POLL_FIRST };
+  RecvPath ChooseRecvPath(int flags);
+
+  // Tries inline_recv and/or submits the request prepared by prep, depending on
+  // ChooseRecvPath. Returns the number of received bytes or -errno.
+  template <typename InlineRecv, typename PrepRecv>
+  ssize_t AdaptiveRecv(int flags, InlineRecv&& inline_recv, PrepRecv&& prep);
+
   uint32_t error_cb_id_ = UINT32_MAX;
+  uint32_t zc_threshold_ = UINT32_MAX;  // UINT32_MAX - use the proactor default.
+
+  int8_t recv_adaptive_ = -1;    // -1 - use the proactor default.
+  uint8_t recv_history_ = 0x0F;  // set bits mark recent receives that found data ready.
+  uint8_t recv_probe_ = 0;       // counts receives between inline probes.
+
+  struct MultiShot {
+    struct Chunk {
+      int32_t res;  // number of bytes received, 0 on EOF, or -errno.
+      uint16_t buf_id;
+      uint32_t offset = 0;  // how many bytes were already consumed by Recv.
+    };
+
+    std::deque<Chunk> chunks;
+    detail::FiberInterface* waiter = nullptr;
+    uint64_t user_data = 0;  // user_data of the armed request or 0 if it's not armed.
+    uint16_t group_id = 0;
+    bool no_bufs = false;  // the buffer ring was exhausted during the last receive.
+  };
+
+  // Allocated only in multishot mode to keep idle sockets small.
+  std::unique_ptr<MultiShot> multishot_;
+
+  struct MultiAccept {
+    std::deque<int32_t> results;  // accepted descriptors or -errno.
+    detail::FiberInterface* waiter = nullptr;
+    uint64_t user_data = 0;  // user_data of the armed request or 0 if it's not armed.
+    bool direct = false;
+  };
+  std::unique_ptr<MultiAccept> multiaccept_;
 };
 
 }  // namespace fb2
@@ -0,0 +1,386 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/client_pool.h"
+
+#include <absl/strings/str_cat.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "util/fiber_socket_base.h"
+#include "util/fibers/proactor_base.h"
+
+namespace util {
+namespace http {
+
+using namespace std;
+
+namespace h2 = boost::beast::http;
+
+struct ClientPool::Host {
+  string name;
+  uint16_t port;
+
+  vector<unique_ptr<Conn>> conns;  // connected.
+  deque<Conn*> idle;               // the most recently used at the back.
+  unsigned connecting = 0;
+
+  // Changes whenever a connection is released or closed, wakes up the requests that wait
+  // for a connection.
+  uint64_t epoch = 0;
+  fb2::EventCount release_ec;
+
+  void Notify() {
+    ++epoch;
+    release_ec.notifyAll();
+  }
+};
+
+ClientPool::Handle::Handle(Handle&& other) noexcept
+    : pool_(exchange(other.pool_, nullptr)),
+      conn_(other.conn_),
+      reused_(other.reused_),
+      keep_alive_(other.keep_alive_) {
+}
+
+auto ClientPool::Handle::operator=(Handle&& other) noexcept -> Handle& {
+  if (this != &other) {
+    Release();
+    pool_ = exchange(other.pool_, nullptr);
+    conn_ = other.conn_;
+    reused_ = other.reused_;
+    keep_alive_ = other.keep_alive_;
+  }
+  return *this;
+}
+
+ClientPool::Handle::~Handle() {
+  Release();
+}
+
+Client* ClientPool::Handle::client() const {
+  DCHECK(pool_);
+  return conn_->client.get();
+}
+
+void ClientPool::Handle::Release() {
+  if (pool_) {
+    pool_->Release(Lease{conn_, 0, reused_}, error_code{}, keep_alive_);
+    pool_ = nullptr;
+  }
+}
+
+ClientPool::ClientPool(fb2::ProactorBase* proactor, const ClientPoolOptions& opts)
+    : proactor_(proactor), opts_(opts) {
+  CHECK(proactor_->InMyThread());
+  CHECK_GT(opts_.max_connections, 0u);
+  CHECK_GT(opts_.pipeline_depth, 0u);
+
+  // Closing a socket may block, so the idle connections are evicted by a fiber.
+  if (opts_.idle_timeout_ms) {
+    evict_fb_ = fb2::Fiber("http_pool_evict", [this] { RunEviction(); });
+  }
+}
+
+ClientPool::~ClientPool() {
+  DCHECK(proactor_->InMyThread());
+
+  stopping_ = true;
+  evict_ec_.notify();
+  if (evict_fb_.IsJoinable())
+    evict_fb_.Join();
+
+  for (auto& [key, host] : hosts_) {
+    DCHECK_EQ(host->connecting, 0u) << key;
+    DCHECK_EQ(host->idle.size(), host->conns.size()) << key << " has connections in use";
+    for (auto& conn : host->conns) {
+      if (FiberSocketBase* sock = conn->client->socket())
+        (void)sock->Close();
+    }
+  }
+}
+
+auto ClientPool::Acquire(string_view host, uint16_t port) -> io::Result<Handle> {
+  io::Result<Lease> lease = Checkout(host, port, true);
+  if (!lease)
+    return nonstd::make_unexpected(lease.error());
+
+  return Handle{this, lease->conn, lease->reused};
+}
+
+error_code ClientPool::Warmup(string_view host, uint16_t port, unsigned count) {
+  DCHECK(proactor_->InMyThread());
+
+  Host* h = GetHost(host, port);
+  error_code result;
+  vector<fb2::Fiber> fibers;
+  while (h->conns.size() + h->connecting < min(count, opts_.max_connections)) {
+    ++h->connecting;
+    fibers.emplace_back("http_pool_warmup", [this, h, &result] {
+      io::Result<Conn*> res = Connect(h);
+      if (res) {
+        Park(*res);
+      } else if (!result) {
+        result = res.error();
+      }
+    });
+  }
+
+  for (auto& fb : fibers)
+    fb.Join();
+  return result;
+}
+
+void ClientPool::EvictIdle() {
+  if (opts_.idle_timeout_ms == 0)
+    return;
+
+  uint64_t now = ProactorBase::GetMonotonicTimeNs();
+  uint64_t timeout_ns = uint64_t(opts_.idle_timeout_ms) * 1000000;
+
+  // Closing preempts, so we first take the connections out of the pool.
+  vector<Conn*> expired;
+  for (auto& [key, host] : hosts_) {
+    while (!host->idle.empty() && host->idle.front()->last_used_ns + timeout_ns <= now) {
+      expired.push_back(host->idle.front());
+      expired.back()->broken = true;
+      host->idle.pop_front();
+    }
+  }
+
+  stats_.idle_evictions += expired.size();
+  for (Conn* conn : expired)
+    Close(conn);
+}
+
+size_t ClientPool::ConnectionCount(string_view host, uint16_t port) const {
+  auto it = hosts_.find(absl::StrCat(host, ":", port));
+  return it == hosts_.end() ? 0 : it->second->conns.size();
+}
+
+bool ClientPool::IsIdempotent(h2::verb verb) {
+  switch (verb) {
+    case h2::verb::get:
+    case h2::verb::head:
+    case h2::verb::put:
+    case h2::verb::delete_:
+    case h2::verb::options:
+    case h2::verb::trace:
+      return true;
+    default:
+      return false;
+  }
+}
+
+auto ClientPool::GetHost(string_view host, uint16_t port) -> Host* {
+  auto [it, inserted] = hosts_.try_emplace(absl::StrCat(host, ":", port));
+  if (inserted) {
+    it->second = make_unique<Host>();
+    it->second->name = host;
+    it->second->port = port;
+  }
+  return it->second.get();
+}
+
+auto ClientPool::Checkout(string_view host, uint16_t port, bool exclusive) -> io::Result<Lease> {
+  DCHECK(proactor_->InMyThread());
+
+  Host* h = GetHost(host, port);
+  bool waited = false;
+
+  while (true) {
+    // The most recently used connection is the least likely to be closed by the server,
+    // and the rest age out.
+    while (!h->idle.empty()) {
+      Conn* conn = h->idle.back();
+      h->idle.pop_back();
+      if (IsAlive(conn)) {
+        ++stats_.reuses;
+        return Take(conn, exclusive, true);
+      }
+
+      ++stats_.idle_evictions;
+      conn->broken = true;
+      Close(conn);
+    }
+
+    if (h->conns.size() + h->connecting < opts_.max_connections) {
+      ++h->connecting;
+      io::Result<Conn*> res = Connect(h);
+      if (!res)
+        return nonstd::make_unexpected(res.error());
+      return Take(*res, exclusive, false);
+    }
+
+    if (!exclusive && opts_.pipeline_depth > 1) {
+      Conn* best = nullptr;
+      for (const auto& conn : h->conns) {
+        if (conn->exclusive || conn->broken || !conn->reusable ||
+            conn->in_flight >= opts_.pipeline_depth) {
+          continue;
+        }
+        if (!best || conn->in_flight < best->in_flight)
+          best = conn.get();
+      }
+
+      if (best) {
+        ++stats_.reuses;
+        ++stats_.pipelined;
+        return Take(best, false, true);
+      }
+    }
+
+    if (!waited) {
+      ++stats_.waits;
+      waited = true;
+    }
+    uint64_t epoch = h->epoch;
+    h->release_ec.await([h, epoch] { return h->epoch != epoch; });
+  }
+}
+
+auto ClientPool::Take(Conn* conn, bool exclusive, bool reused) -> Lease {
+  conn->exclusive = exclusive;
+  ++conn->in_flight;
+  return Lease{conn, conn->next_ticket++, reused};
+}
+
+auto ClientPool::Connect(Host* host) -> io::Result<Conn*> {
+  unique_ptr<Client> client;
+  TlsClient* tls_client = nullptr;
+  if (opts_.ssl_ctx) {
+    tls_client = new TlsClient(proactor_);
+    client.reset(tls_client);
+  } else {
+    client.reset(new Client(proactor_));
+  }
+
+  client->set_connect_timeout_ms(opts_.connect_timeout_ms);
+  if (opts_.on_connect)
+    client->AssignOnConnect(opts_.on_connect);
+
+  string service = absl::StrCat(host->port);
+  error_code ec = tls_client ? tls_client->Connect(host->name, service, opts_.ssl_ctx)
+                             : client->Connect(host->name, service);
+
+  // The waiting requests may connect instead or pipeline on the new connection.
+  DCHECK_GT(host->connecting, 0u);
+  --host->connecting;
+  host->Notify();
+
+  if (ec) {
+    VLOG(1) << "Could not connect to " << host->name << ":" << host->port << " " << ec;
+    ++stats_.connect_errors;
+    if (FiberSocketBase* sock = client->socket())
+      (void)sock->Close();
+    return nonstd::make_unexpected(ec);
+  }
+
+  ++stats_.connects;
+  auto conn = make_unique<Conn>();
+  conn->client = std::move(client);
+  conn->host = host;
+  host->conns.push_back(std::move(conn));
+
+  return host->conns.back().get();
+}
+
+error_code ClientPool::AwaitTurn(const Lease& lease, bool write) {
+  Conn* conn = lease.conn;
+  const uint32_t& turn = write ? conn->write_turn : conn->read_turn;
+  conn->turn_ec.await([&] { return conn->broken || turn == lease.ticket; });
+
+  return conn->broken ? make_error_code(errc::connection_aborted) : error_code{};
+}
+
+void ClientPool::EndWrite(const Lease& lease, error_code ec) {
+  Conn* conn = lease.conn;
+  if (ec)
+    conn->broken = true;
+  ++conn->write_turn;
+  conn->turn_ec.notifyAll();
+}
+
+void ClientPool::Release(const Lease& lease, error_code ec, bool keep_alive) {
+  Conn* conn = lease.conn;
+  if (ec) {
+    conn->broken = true;
+  } else if (!keep_alive) {
+    // The server closes the connection after the responses that were already requested.
+    conn->reusable = false;
+  }
+
+  conn->exclusive = false;
+  ++conn->read_turn;
+  conn->turn_ec.notifyAll();
+
+  DCHECK_GT(conn->in_flight, 0u);
+  if (--conn->in_flight > 0)
+    return;
+
+  if (conn->broken || !conn->reusable) {
+    Host* host = conn->host;
+    conn->broken = true;
+    Close(conn);
+    host->Notify();
+    return;
+  }
+
+  // The failed requests of a broken connection do not advance the turns.
+  conn->write_turn = conn->read_turn = conn->next_ticket;
+  Park(conn);
+}
+
+void ClientPool::Park(Conn* conn) {
+  conn->last_used_ns = ProactorBase::GetMonotonicTimeNs();
+  conn->host->idle.push_back(conn);
+  conn->host->Notify();
+}
+
+bool ClientPool::IsAlive(Conn* conn) const {
+  FiberSocketBase* sock = conn->client->socket();
+  if (!sock || !sock->IsOpen())
+    return false;
+
+  // Direct descriptors are not in the file table of the process.
+  if (sock->IsDirect())
+    return true;
+
+  // Nothing is expected on an idle connection, a server that closed it sent a FIN.
+  // TLS servers may also send session tickets after the handshake of a warmed up connection.
+  char c;
+  ssize_t res = recv(sock->native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (res > 0)
+    return opts_.ssl_ctx != nullptr;
+
+  return res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void ClientPool::Close(Conn* conn) {
+  DCHECK(conn->broken);
+  DCHECK_EQ(conn->in_flight, 0u);
+
+  // Other fibers run while the socket closes, so the connection leaves the pool first.
+  auto& conns = conn->host->conns;
+  auto it = find_if(conns.begin(), conns.end(), [conn](const auto& c) { return c.get() == conn; });
+  DCHECK(it != conns.end());
+  unique_ptr<Conn> closing = std::move(*it);
+  conns.erase(it);
+
+  if (FiberSocketBase* sock = closing->client->socket())
+    (void)sock->Close();
+}
+
+void ClientPool::RunEviction() {
+  auto period = chrono::milliseconds(max(opts_.idle_timeout_ms / 2, 1u));
+  while (!stopping_) {
+    evict_ec_.await_until([this] { return stopping_; }, chrono::steady_clock::now() + period);
+    EvictIdle();
+  }
+}
+
+}  // namespace http
+}  // namespace util
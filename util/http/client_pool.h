@@ -0,0 +1,229 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <openssl/ssl.h>
+
+#include <absl/container/flat_hash_map.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "io/io.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/synchronization.h"
+#include "util/http/http_client.h"
+
+namespace util {
+namespace http {
+
+struct ClientPoolOptions {
+  // Connections per host:port. Once all of them are busy, requests wait for a connection
+  // or, with pipelining, are queued on the least loaded one.
+  unsigned max_connections = 8;
+
+  // Requests that may be sent on a connection before the responses of the previous ones
+  // were read (HTTP/1.1 pipelining). 1 disables pipelining.
+  unsigned pipeline_depth = 1;
+
+  // Idle connections are closed after that period. 0 keeps them until the server closes them.
+  uint32_t idle_timeout_ms = 10000;
+
+  uint32_t connect_timeout_ms = 2000;
+
+  // If set, the connections are TLS connections with this context,
+  // see TlsClient::CreateSslContext(). Not owned.
+  SSL_CTX* ssl_ctx = nullptr;
+
+  // Called with the fd of every new connection, for example to set socket options.
+  std::function<void(int)> on_connect;
+};
+
+/*
+  Keep-alive connections to HTTP servers, keyed by host:port.
+
+  A pool belongs to a single proactor. It must be created, used and destroyed in its thread,
+  therefore it does not lock. Threads that send requests should have a pool each.
+*/
+class ClientPool {
+  struct Conn;
+  struct Host;
+
+ public:
+  // Exclusive use of a pooled connection for a custom exchange.
+  class Handle {
+   public:
+    Handle() = default;
+    Handle(Handle&& other) noexcept;
+    Handle& operator=(Handle&& other) noexcept;
+    ~Handle();
+
+    Client* client() const;
+
+    Client* operator->() const {
+      return client();
+    }
+
+    // Whether the connection served requests before, so the server might have closed it.
+    bool reused() const {
+      return reused_;
+    }
+
+    // Returns the connection to the pool when the handle is destroyed. Otherwise it is closed,
+    // which is the safe choice after errors or partially read responses.
+    void set_keep_alive(bool keep_alive) {
+      keep_alive_ = keep_alive;
+    }
+
+   private:
+    friend class ClientPool;
+
+    Handle(ClientPool* pool, Conn* conn, bool reused)
+        : pool_(pool), conn_(conn), reused_(reused) {
+    }
+
+    void Release();
+
+    ClientPool* pool_ = nullptr;
+    Conn* conn_ = nullptr;
+    bool reused_ = false;
+    bool keep_alive_ = false;
+  };
+
+  struct Stats {
+    uint64_t connects = 0;        // new connections.
+    uint64_t connect_errors = 0;  // connections that failed to connect or to handshake.
+    uint64_t reuses = 0;          // requests and handles served by existing connections.
+    uint64_t pipelined = 0;       // requests queued behind others on a busy connection.
+    uint64_t waits = 0;           // requests that waited because all connections were busy.
+    uint64_t retries = 0;         // requests that failed on a reused connection and were resent.
+    uint64_t idle_evictions = 0;  // idle connections that timed out or were closed by the server.
+  };
+
+  explicit ClientPool(fb2::ProactorBase* proactor, const ClientPoolOptions& opts = {});
+
+  // Closes the connections. The handles and the requests in flight must be done.
+  ~ClientPool();
+
+  ClientPool(const ClientPool&) = delete;
+  ClientPool& operator=(const ClientPool&) = delete;
+
+  /*! @brief Returns a connection to host:port for exclusive use.
+   *
+   *  Reuses an idle connection or connects a new one if max_connections allows, otherwise
+   *  blocks the calling fiber until a connection is released.
+   */
+  io::Result<Handle> Acquire(std::string_view host, uint16_t port);
+
+  /*! @brief Sends req to host:port and reads the response into resp.
+   *
+   *  With pipelining, the connection may be shared with requests of other fibers.
+   *  Requests with idempotent methods that fail on a reused connection, which the server
+   *  might have closed meanwhile, are sent once more on a new connection.
+   */
+  template <typename Req, typename Resp>
+  std::error_code Send(std::string_view host, uint16_t port, const Req& req, Resp* resp);
+
+  // Connects in parallel until host:port has `count` connections, max_connections at most,
+  // so the first requests do not pay for the handshakes. Returns the first error.
+  std::error_code Warmup(std::string_view host, uint16_t port, unsigned count);
+
+  // Closes connections that were idle for longer than idle_timeout_ms. Runs periodically.
+  void EvictIdle();
+
+  // The number of open connections to host:port.
+  size_t ConnectionCount(std::string_view host, uint16_t port) const;
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+ private:
+  // A request in flight on a connection. Requests write and read their responses in the order
+  // of their tickets.
+  struct Lease {
+    Conn* conn;
+    uint32_t ticket;
+    bool reused;
+  };
+
+  static bool IsIdempotent(::boost::beast::http::verb verb);
+
+  Host* GetHost(std::string_view host, uint16_t port);
+
+  io::Result<Lease> Checkout(std::string_view host, uint16_t port, bool exclusive);
+  Lease Take(Conn* conn, bool exclusive, bool reused);
+
+  // Connects in a slot that the caller reserved in host->connecting.
+  io::Result<Conn*> Connect(Host* host);
+
+  // Waits until it is the turn of lease to write or to read.
+  std::error_code AwaitTurn(const Lease& lease, bool write);
+  void EndWrite(const Lease& lease, std::error_code ec);
+  void Release(const Lease& lease, std::error_code ec, bool keep_alive);
+
+  void Park(Conn* conn);
+  bool IsAlive(Conn* conn) const;
+  void Close(Conn* conn);
+  void RunEviction();
+
+  fb2::ProactorBase* proactor_;
+  ClientPoolOptions opts_;
+  absl::flat_hash_map<std::string, std::unique_ptr<Host>> hosts_;
+  Stats stats_;
+
+  bool stopping_ = false;
+  fb2::EventCount evict_ec_;
+  fb2::Fiber evict_fb_;
+};
+
+struct ClientPool::Conn {
+  std::unique_ptr<Client> client;
+  Host* host;
+  uint64_t last_used_ns = 0;
+
+  unsigned in_flight = 0;
+  uint32_t next_ticket = 0, write_turn = 0, read_turn = 0;
+  fb2::EventCount turn_ec;
+
+  bool exclusive = false;  // held by a Handle.
+  bool broken = false;     // an I/O error, the requests in flight fail.
+  bool reusable = true;    // false once a message without keep-alive was exchanged.
+};
+
+template <typename Req, typename Resp>
+std::error_code ClientPool::Send(std::string_view host, uint16_t port, const Req& req,
+                                 Resp* resp) {
+  for (bool retry = IsIdempotent(req.method());; retry = false) {
+    io::Result<Lease> lease = Checkout(host, port, false);
+    if (!lease)
+      return lease.error();
+
+    Client* client = lease->conn->client.get();
+    std::error_code ec = AwaitTurn(*lease, true);
+    if (!ec)
+      ec = client->Send(req);
+    EndWrite(*lease, ec);
+
+    if (!ec)
+      ec = AwaitTurn(*lease, false);
+    if (!ec)
+      ec = client->Recv(resp);
+    Release(*lease, ec, !ec && req.keep_alive() && resp->keep_alive());
+
+    if (!ec || !retry || !lease->reused)
+      return ec;
+
+    ++stats_.retries;
+    *resp = Resp{};
+  }
+}
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,295 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/client_pool.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/string_body.hpp>
+#include <boost/beast/http/write.hpp>
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/asio_stream_adapter.h"
+#include "util/fibers/epoll_proactor.h"
+#include "util/fibers/fibers.h"
+
+namespace util {
+namespace http {
+
+using namespace std;
+using namespace boost;
+using fb2::Fiber;
+namespace h2 = beast::http;
+
+// Serves HTTP/1.1 on the loopback, the responses echo the targets of the requests.
+class ClientPoolTest : public testing::Test {
+ protected:
+  void SetUp() override;
+  void TearDown() override;
+
+  void Serve(FiberSocketBase* sock);
+
+  // Sends GET target with pool and returns the body of the response.
+  string Get(ClientPool* pool, const string& target);
+
+  unique_ptr<fb2::ProactorBase> proactor_;
+  thread proactor_thread_;
+  unique_ptr<FiberSocketBase> listener_;
+  uint16_t port_ = 0;
+
+  Fiber accept_fb_;
+  vector<Fiber> serve_fibers_;
+  vector<unique_ptr<FiberSocketBase>> server_socks_;
+  unsigned accepted_ = 0;
+
+  bool close_connections_ = false;  // responses with "Connection: close".
+  bool drop_connections_ = false;   // closes the connections after keep-alive responses.
+};
+
+void ClientPoolTest::SetUp() {
+  fb2::EpollProactor* proactor = new fb2::EpollProactor;
+  atomic_bool init_done{false};
+  proactor_thread_ = thread{[proactor, &init_done] {
+    proactor->Init();
+    init_done.store(true, memory_order_release);
+    proactor->Run();
+  }};
+
+  while (!init_done.load()) {
+    usleep(1000);
+  }
+  proactor_.reset(proactor);
+
+  proactor_->Await([this] {
+    listener_.reset(proactor_->CreateSocket());
+    CHECK(!listener_->Listen(0, 0));
+    port_ = listener_->LocalEndpoint().port();
+
+    accept_fb_ = Fiber("accept", [this] {
+      while (true) {
+        auto accept_res = listener_->Accept();
+        if (!accept_res)
+          break;
+
+        FiberSocketBase* sock = *accept_res;
+        sock->SetProactor(proactor_.get());
+        server_socks_.emplace_back(sock);
+        ++accepted_;
+        serve_fibers_.emplace_back("serve", [this, sock] { Serve(sock); });
+      }
+    });
+  });
+}
+
+void ClientPoolTest::TearDown() {
+  proactor_->Await([this] {
+    (void)listener_->Shutdown(SHUT_RDWR);
+    accept_fb_.Join();
+
+    // The clients closed their connections.
+    for (auto& fb : serve_fibers_)
+      fb.Join();
+    for (auto& sock : server_socks_)
+      (void)sock->Close();
+    (void)listener_->Close();
+  });
+
+  proactor_->Stop();
+  proactor_thread_.join();
+  proactor_.reset();
+}
+
+void ClientPoolTest::Serve(FiberSocketBase* sock) {
+  AsioStreamAdapter<> adapter(*sock);
+  beast::flat_buffer buf;
+
+  while (true) {
+    h2::request<h2::string_body> req;
+    system::error_code ec;
+    h2::read(adapter, buf, req, ec);
+    if (ec)
+      break;
+
+    h2::response<h2::string_body> resp{h2::status::ok, req.version()};
+    resp.body() = string(req.target());
+    resp.keep_alive(req.keep_alive() && !close_connections_);
+    resp.prepare_payload();
+    h2::write(adapter, resp, ec);
+    if (ec || !resp.keep_alive() || drop_connections_)
+      break;
+  }
+
+  (void)sock->Shutdown(SHUT_RDWR);
+}
+
+string ClientPoolTest::Get(ClientPool* pool, const string& target) {
+  h2::request<h2::empty_body> req{h2::verb::get, target, 11};
+  req.set(h2::field::host, "localhost");
+  h2::response<h2::string_body> resp;
+
+  error_code ec = pool->Send("127.0.0.1", port_, req, &resp);
+  EXPECT_FALSE(ec) << ec.message();
+  return resp.body();
+}
+
+TEST_F(ClientPoolTest, KeepAlive) {
+  proactor_->Await([this] {
+    ClientPool pool(proactor_.get());
+    for (unsigned i = 0; i < 10; ++i) {
+      string target = absl::StrCat("/", i);
+      EXPECT_EQ(target, Get(&pool, target));
+    }
+
+    EXPECT_EQ(1u, accepted_);
+    EXPECT_EQ(1u, pool.ConnectionCount("127.0.0.1", port_));
+    EXPECT_EQ(1u, pool.stats().connects);
+    EXPECT_EQ(9u, pool.stats().reuses);
+  });
+}
+
+TEST_F(ClientPoolTest, MaxConnections) {
+  proactor_->Await([this] {
+    ClientPoolOptions opts;
+    opts.max_connections = 2;
+    ClientPool pool(proactor_.get(), opts);
+
+    vector<Fiber> fibers;
+    for (unsigned i = 0; i < 8; ++i) {
+      fibers.emplace_back([&, i] {
+        for (unsigned j = 0; j < 5; ++j) {
+          string target = absl::StrCat("/", i, "/", j);
+          EXPECT_EQ(target, Get(&pool, target));
+        }
+      });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+
+    EXPECT_EQ(2u, accepted_);
+    EXPECT_EQ(0u, pool.stats().pipelined);
+    EXPECT_GT(pool.stats().waits, 0u);
+  });
+}
+
+TEST_F(ClientPoolTest, Pipelining) {
+  proactor_->Await([this] {
+    ClientPoolOptions opts;
+    opts.max_connections = 1;
+    opts.pipeline_depth = 4;
+    ClientPool pool(proactor_.get(), opts);
+
+    vector<Fiber> fibers;
+    for (unsigned i = 0; i < 8; ++i) {
+      fibers.emplace_back([&, i] {
+        for (unsigned j = 0; j < 5; ++j) {
+          string target = absl::StrCat("/", i, "/", j);
+          EXPECT_EQ(target, Get(&pool, target));
+        }
+      });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+
+    // The responses are matched with the requests of the fibers that sent them.
+    EXPECT_EQ(1u, accepted_);
+    EXPECT_GT(pool.stats().pipelined, 0u);
+  });
+}
+
+TEST_F(ClientPoolTest, IdleEviction) {
+  proactor_->Await([this] {
+    ClientPoolOptions opts;
+    opts.idle_timeout_ms = 10;
+    ClientPool pool(proactor_.get(), opts);
+
+    EXPECT_EQ("/a", Get(&pool, "/a"));
+    ThisFiber::SleepFor(50ms);
+    EXPECT_EQ(0u, pool.ConnectionCount("127.0.0.1", port_));
+    EXPECT_EQ(1u, pool.stats().idle_evictions);
+
+    EXPECT_EQ("/b", Get(&pool, "/b"));
+    EXPECT_EQ(2u, pool.stats().connects);
+  });
+}
+
+TEST_F(ClientPoolTest, ConnectionClose) {
+  close_connections_ = true;
+  proactor_->Await([this] {
+    ClientPool pool(proactor_.get());
+    for (unsigned i = 0; i < 3; ++i) {
+      EXPECT_EQ("/a", Get(&pool, "/a"));
+    }
+
+    EXPECT_EQ(3u, accepted_);
+    EXPECT_EQ(0u, pool.ConnectionCount("127.0.0.1", port_));
+  });
+}
+
+TEST_F(ClientPoolTest, ServerClosedIdle) {
+  drop_connections_ = true;
+  proactor_->Await([this] {
+    ClientPool pool(proactor_.get());
+    EXPECT_EQ("/a", Get(&pool, "/a"));
+    ThisFiber::SleepFor(10ms);  // the FIN arrives.
+
+    // The closed connection is detected before the request is sent.
+    EXPECT_EQ("/b", Get(&pool, "/b"));
+    EXPECT_EQ(2u, pool.stats().connects);
+    EXPECT_EQ(1u, pool.stats().idle_evictions);
+    EXPECT_EQ(0u, pool.stats().retries);
+  });
+}
+
+TEST_F(ClientPoolTest, Warmup) {
+  proactor_->Await([this] {
+    ClientPool pool(proactor_.get());
+    EXPECT_FALSE(pool.Warmup("127.0.0.1", port_, 3));
+    EXPECT_EQ(3u, pool.ConnectionCount("127.0.0.1", port_));
+
+    vector<Fiber> fibers;
+    for (unsigned i = 0; i < 3; ++i) {
+      fibers.emplace_back([&] { EXPECT_EQ("/a", Get(&pool, "/a")); });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+
+    EXPECT_EQ(3u, accepted_);
+    EXPECT_EQ(3u, pool.stats().connects);
+    EXPECT_EQ(3u, pool.stats().reuses);
+  });
+}
+
+TEST_F(ClientPoolTest, Acquire) {
+  proactor_->Await([this] {
+    ClientPool pool(proactor_.get());
+    {
+      auto handle = pool.Acquire("127.0.0.1", port_);
+      ASSERT_TRUE(handle);
+      EXPECT_FALSE(handle->reused());
+
+      h2::request<h2::empty_body> req{h2::verb::get, "/a", 11};
+      h2::response<h2::string_body> resp;
+      ASSERT_FALSE((*handle)->Send(req, &resp));
+      EXPECT_EQ("/a", resp.body());
+      handle->set_keep_alive(true);
+    }
+
+    // Handles that are not kept alive close their connections.
+    {
+      auto handle = pool.Acquire("127.0.0.1", port_);
+      ASSERT_TRUE(handle);
+      EXPECT_TRUE(handle->reused());
+    }
+    EXPECT_EQ(0u, pool.ConnectionCount("127.0.0.1", port_));
+    EXPECT_EQ(1u, accepted_);
+  });
+}
+
+}  // namespace http
+}  // namespace util
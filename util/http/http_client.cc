@@ -5,6 +5,7 @@
 #include "util/http/http_client.h"
 
 #include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
 #include <openssl/err.h>
 
 #include <boost/asio/connect.hpp>
@@ -18,6 +19,7 @@
 #include "util/fiber_socket_base.h"
 #include "util/fibers/dns_resolve.h"
 #include "util/fibers/proactor_base.h"
+#include "util/tls/session_cache.h"
 #include "util/tls/tls_engine.h"
 #include "util/tls/tls_socket.h"
 
@@ -68,7 +70,7 @@ std::error_code Client::Reconnect() {
   }
 
   char ip[INET_ADDRSTRLEN];
-  error_code ec = fb2::DnsResolve(host_.data(), 2000, ip, proactor_);
+  error_code ec = fb2::DnsResolve(host_.data(), connect_timeout_ms_, ip, proactor_);
   if (ec) {
     return ec;
   }
@@ -152,6 +154,9 @@ SSL_CTX* TlsClient::CreateSslContext() {
     // this default is for Security level set to 112 bits of security
     SSL_CTX_set_security_level(ctx, 2);
     SSL_CTX_dane_enable(ctx);  // see https://www.internetsociety.org/resources/deploy360/dane/
+
+    // Reconnects to the same host resume the last session with an abbreviated handshake.
+    tls::EnableClientSessionCache(ctx);
   }
   return ctx;
 }
@@ -178,9 +183,12 @@ std::error_code TlsClient::Connect(string_view host, string_view service, SSL_CT
     SSL_set_tlsext_host_name(ssl_handle, host);
     // verify server cert using server hostname
     SSL_dane_enable(ssl_handle, host);
+    tls::ResumeClientSession(ssl_handle, absl::StrCat(hn, ":", service));
     ec = tls_socket->Connect(FiberSocketBase::endpoint_type{});
     if (!ec) {
       socket_.reset(tls_socket.release());
+    } else {
+      (void)tls_socket->Close();
     }
   }
   return ec;
@@ -75,6 +75,11 @@ class Client {
     return host_;
   }
 
+  // The connection, null before Connect().
+  FiberSocketBase* socket() const {
+    return socket_.get();
+  }
+
   void AssignOnConnect(std::function<void(int)> cb) {
     on_connect_cb_ = std::move(cb);
   }
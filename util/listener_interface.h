@@ -7,6 +7,7 @@
 #include <cstdint>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include "util/fiber_socket_base.h"
 
@@ -94,6 +95,10 @@ class ListenerInterface {
  private:
   void RunAcceptLoop();
 
+  // Accepts connections on sock until it is shut down. If `local` is true, the connections
+  // are handled by the proactor of sock.
+  void AcceptConnections(FiberSocketBase* sock, bool local);
+
   void RunSingleConnection(Connection* conn);
 
   struct TLConnList;  // threadlocal connection list. contains connections for that thread.
@@ -101,6 +106,10 @@ class ListenerInterface {
   static thread_local std::unordered_map<ListenerInterface*, TLConnList*> conn_list;
 
   std::unique_ptr<FiberSocketBase> sock_;
+
+  // Sharded listeners own a SO_REUSEPORT socket per proactor: sock_ and the rest of them.
+  std::vector<std::unique_ptr<FiberSocketBase>> shard_socks_;
+  bool sharded_ = false;
   // Number of max connections. Unlimited by default.
   uint32_t max_clients_{UINT32_MAX};
   // Number of current open connections. Incremented in RunAcceptLoop, decremented at the end of
@@ -213,6 +213,9 @@ class ProactorPool {
 
   std::unique_ptr<ProactorBase*[]> proactor_;
 
+  // CPUs that are dedicated to other threads. Proactor threads are not pinned to them.
+  std::vector<unsigned> reserved_cpus_;
+
  private:
   void SetupProactors();
 
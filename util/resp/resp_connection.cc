@@ -0,0 +1,154 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/resp/resp_connection.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/logging.h"
+#include "util/buffered_socket.h"
+
+namespace util {
+namespace resp {
+
+using namespace std;
+using redis::RespParser;
+
+namespace {
+
+// Replies of a longer batch are written before dispatching the rest of its commands.
+constexpr size_t kMaxBatchOutput = 1U << 16;
+
+}  // namespace
+
+void ReplyBuilder::SendSimpleString(string_view str) {
+  absl::StrAppend(dest_, "+", str, "\r\n");
+}
+
+void ReplyBuilder::SendError(string_view str) {
+  absl::StrAppend(dest_, "-", str, "\r\n");
+}
+
+void ReplyBuilder::SendLong(int64_t val) {
+  absl::StrAppend(dest_, ":", val, "\r\n");
+}
+
+void ReplyBuilder::SendBulkString(string_view str) {
+  absl::StrAppend(dest_, "$", str.size(), "\r\n", str, "\r\n");
+}
+
+void ReplyBuilder::SendNull() {
+  dest_->append("$-1\r\n");
+}
+
+void ReplyBuilder::SendArrayLen(uint32_t len) {
+  absl::StrAppend(dest_, "*", len, "\r\n");
+}
+
+void ReplyBuilder::SendRaw(string_view str) {
+  dest_->append(str);
+}
+
+void RespConnection::HandleRequests() {
+  BufferedSocket bs(socket_.get(), read_buf_size_);
+  RespParser parser;
+  vector<RespParser::Buffer> args;
+  ReplyBuilder rb(&out_);
+  error_code ec;
+
+  while (!ec) {
+    io::Result<size_t> res = bs.Fill();
+    if (!res) {
+      LOG_IF(WARNING, !FiberSocketBase::IsConnClosed(res.error()))
+          << "Error reading from socket " << res.error().message();
+      break;
+    }
+
+    // Dispatch all the complete commands in the buffer.
+    bool batch_started = false;
+    bool protocol_error = false;
+    while (!ec) {
+      uint32_t consumed = 0;
+      RespParser::Status st = parser.Parse(bs.Peek(), &consumed, &args);
+      if (st == RespParser::MORE_INPUT) {
+        bs.Consume(consumed);
+        break;
+      }
+
+      if (st != RespParser::RESP_OK) {
+        VLOG(1) << "Invalid request " << st;
+        rb.SendError("ERR Protocol error");
+        protocol_error = true;
+        break;
+      }
+
+      if (!args.empty()) {
+        batch_started = true;
+        ++num_commands_;
+        DispatchCommand(CmdArgList{args}, &rb);
+      }
+      bs.Consume(consumed);  // may move the input that args reference.
+
+      if (out_.size() >= kMaxBatchOutput) {
+        ++num_batches_;
+        OnBatchEnd();
+        ec = FlushReplies(&bs);
+        batch_started = false;
+      }
+    }
+
+    if (batch_started) {
+      ++num_batches_;
+      OnBatchEnd();
+    }
+
+    if (!ec && (!out_.empty() || !deferred_.empty()))
+      ec = FlushReplies(&bs);
+
+    if (protocol_error)
+      break;
+  }
+
+  LOG_IF(WARNING, ec && !FiberSocketBase::IsConnClosed(ec))
+      << "Error writing to socket " << ec.message();
+
+  // The deferred replies may still reference the connection.
+  pending_ec_.await([this] { return num_pending_ == 0; });
+}
+
+auto RespConnection::Defer() -> DeferredReply* {
+  deferred_.push_back(DeferredReply{out_.size()});
+  ++num_pending_;
+  return &deferred_.back();
+}
+
+void RespConnection::Complete(DeferredReply* reply) {
+  DCHECK(reply);
+  DCHECK_GT(num_pending_, 0u);
+  if (--num_pending_ == 0)
+    pending_ec_.notify();
+}
+
+error_code RespConnection::FlushReplies(BufferedSocket* bs) {
+  pending_ec_.await([this] { return num_pending_ == 0; });
+
+  // Interleave the deferred replies with the ones that were serialized in place.
+  size_t pos = 0;
+  for (const DeferredReply& reply : deferred_) {
+    bs->Enqueue(io::Buffer(string_view(out_).substr(pos, reply.offset_ - pos)));
+    bs->Enqueue(io::Buffer(reply.data_));
+    pos = reply.offset_;
+  }
+  bs->Enqueue(io::Buffer(string_view(out_).substr(pos)));
+
+  error_code ec = bs->Flush();
+
+  out_.clear();
+  deferred_.clear();
+
+  return ec;
+}
+
+}  // namespace resp
+}  // namespace util
@@ -0,0 +1,126 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <deque>
+#include <string>
+#include <string_view>
+
+#include "util/connection.h"
+#include "util/fibers/synchronization.h"
+#include "util/resp/resp_parser.h"
+
+namespace util {
+
+class BufferedSocket;
+
+namespace resp {
+
+using CmdArgList = absl::Span<redis::RespParser::Buffer>;
+
+inline std::string_view ToSV(redis::RespParser::Buffer buf) {
+  return std::string_view{reinterpret_cast<const char*>(buf.data()), buf.size()};
+}
+
+// Serializes RESP2 replies by appending them to a string.
+class ReplyBuilder {
+ public:
+  explicit ReplyBuilder(std::string* dest) : dest_(dest) {
+  }
+
+  void SendSimpleString(std::string_view str);
+
+  // `str` should start with an error code, for example "ERR unknown command".
+  void SendError(std::string_view str);
+
+  void SendLong(int64_t val);
+  void SendBulkString(std::string_view str);
+  void SendNull();
+
+  // Must be followed by `len` replies.
+  void SendArrayLen(uint32_t len);
+
+  // Appends an already serialized reply.
+  void SendRaw(std::string_view str);
+
+ private:
+  std::string* dest_;
+};
+
+// Base class for connections that speak RESP. Parses all the complete commands in the read
+// buffer, dispatches them one after another and writes their replies with a single write
+// once the batch is processed.
+//
+// A command may reply asynchronously, for example when it runs on another shard, by calling
+// Defer() and completing the returned reply later. The replies are written in the order of
+// their commands, so the batch is written only after all its deferred replies complete.
+class RespConnection : public Connection {
+ public:
+  // A reply that is produced after DispatchCommand returns.
+  class DeferredReply {
+   public:
+    ReplyBuilder builder() {
+      return ReplyBuilder{&data_};
+    }
+
+   private:
+    friend class RespConnection;
+
+    explicit DeferredReply(size_t offset) : offset_(offset) {
+    }
+
+    size_t offset_;  // the position of the reply in the batch output.
+    std::string data_;
+  };
+
+  // Sets the size of the read buffer, 4KB by default. The buffer grows to fit longer commands.
+  void set_read_buf_size(size_t sz) {
+    read_buf_size_ = sz;
+  }
+
+  // Number of batches and commands that were handled by the connection.
+  size_t num_batches() const {
+    return num_batches_;
+  }
+
+  size_t num_commands() const {
+    return num_commands_;
+  }
+
+ protected:
+  // Serves requests until the peer closes the connection or sends an invalid request.
+  void HandleRequests() override;
+
+  // Handles a single command. `args` point into the read buffer and are valid only during
+  // the call, but can be modified in place. The reply must be written into `rb` unless
+  // the command calls Defer().
+  virtual void DispatchCommand(CmdArgList args, ReplyBuilder* rb) = 0;
+
+  // Called after all the commands of the batch were dispatched and before waiting for their
+  // deferred replies. Allows submitting the work that was accumulated during the batch.
+  virtual void OnBatchEnd() {
+  }
+
+  // Reserves the place of the reply of the command that is currently dispatched.
+  DeferredReply* Defer();
+
+  // Completes a reply returned by Defer(). Must be called from the connection thread,
+  // other threads should dispatch it to socket()->proactor().
+  void Complete(DeferredReply* reply);
+
+ private:
+  std::error_code FlushReplies(BufferedSocket* bs);
+
+  size_t read_buf_size_ = 4096;
+  size_t num_batches_ = 0, num_commands_ = 0;
+
+  std::string out_;
+  std::deque<DeferredReply> deferred_;
+  unsigned num_pending_ = 0;
+  fb2::EventCount pending_ec_;
+};
+
+}  // namespace resp
+}  // namespace util
@@ -0,0 +1,151 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/resp/resp_connection.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/accept_server.h"
+#include "util/fibers/pool.h"
+#include "util/listener_interface.h"
+
+namespace util {
+namespace resp {
+
+using namespace std;
+using fb2::Pool;
+
+atomic_uint32_t num_batch_ends{0};
+
+// PING, ECHO <val> and DEFER <val> that replies with <val> from another thread.
+class TestConnection : public RespConnection {
+ public:
+  explicit TestConnection(ProactorPool* pp) : pp_(pp) {
+  }
+
+ protected:
+  void DispatchCommand(CmdArgList args, ReplyBuilder* rb) final;
+
+  void OnBatchEnd() final {
+    ++num_batch_ends;
+  }
+
+ private:
+  ProactorPool* pp_;
+};
+
+void TestConnection::DispatchCommand(CmdArgList args, ReplyBuilder* rb) {
+  string_view cmd = ToSV(args[0]);
+  if (cmd == "PING") {
+    rb->SendSimpleString("PONG");
+  } else if (cmd == "ECHO" && args.size() == 2) {
+    rb->SendBulkString(ToSV(args[1]));
+  } else if (cmd == "DEFER" && args.size() == 2) {
+    DeferredReply* reply = Defer();
+    string val(ToSV(args[1]));
+    ProactorBase* me = ProactorBase::me();
+    ProactorBase* shard = pp_->at((ProactorBase::GetIndex() + 1) % pp_->size());
+    shard->DispatchBrief([this, reply, me, val] {
+      reply->builder().SendBulkString(val);
+      me->DispatchBrief([this, reply] { Complete(reply); });
+    });
+  } else {
+    rb->SendError("ERR unknown command");
+  }
+}
+
+class TestListener : public ListenerInterface {
+ public:
+  Connection* NewConnection(ProactorBase* context) final {
+    return new TestConnection(pool());
+  }
+};
+
+class RespConnectionTest : public testing::Test {
+ protected:
+  void SetUp() final;
+
+  void TearDown() final {
+    client_->proactor()->Await([&] { (void)client_->Close(); });
+    as_->Stop(true);
+    pp_->Stop();
+  }
+
+  string Request(string_view req, size_t reply_len);
+
+  unique_ptr<ProactorPool> pp_;
+  unique_ptr<AcceptServer> as_;
+  unique_ptr<FiberSocketBase> client_;
+};
+
+void RespConnectionTest::SetUp() {
+#ifdef __linux__
+  pp_.reset(Pool::IOUring(16, 2));
+#else
+  pp_.reset(Pool::Epoll(2));
+#endif
+  pp_->Run();
+
+  as_.reset(new AcceptServer{pp_.get()});
+  TestListener* listener = new TestListener;
+  auto ec = as_->AddListener("localhost", 0, listener);
+  CHECK(!ec) << ec;
+  uint16_t port = listener->socket()->LocalEndpoint().port();
+  as_->Run();
+
+  ProactorBase* pb = pp_->at(0);
+  client_.reset(pb->CreateSocket());
+  pb->Await([&] {
+    auto address = boost::asio::ip::make_address("127.0.0.1");
+    error_code ec = client_->Connect(FiberSocketBase::endpoint_type{address, port});
+    CHECK(!ec) << ec;
+  });
+}
+
+string RespConnectionTest::Request(string_view req, size_t reply_len) {
+  string res(reply_len, '\0');
+  client_->proactor()->Await([&] {
+    EXPECT_FALSE(client_->Write(io::Buffer(req)));
+    auto read_res = client_->Read(io::MutableBytes(reinterpret_cast<uint8_t*>(res.data()),
+                                                   res.size()));
+    EXPECT_TRUE(read_res) << read_res.error().message();
+  });
+  return res;
+}
+
+TEST_F(RespConnectionTest, Pipeline) {
+  num_batch_ends = 0;
+  string req, expected;
+  for (unsigned i = 0; i < 100; ++i) {
+    string val = absl::StrCat(i);
+    absl::StrAppend(&req, "*2\r\n$4\r\nECHO\r\n$", val.size(), "\r\n", val, "\r\n");
+    absl::StrAppend(&expected, "$", val.size(), "\r\n", val, "\r\n");
+  }
+  req.append("PING\r\n");
+  expected.append("+PONG\r\n");
+
+  EXPECT_EQ(expected, Request(req, expected.size()));
+
+  // The pipeline was sent with one write, so the commands that arrive together are replied
+  // in batches rather than one by one.
+  EXPECT_GT(num_batch_ends.load(), 0u);
+  EXPECT_LT(num_batch_ends.load(), 101u);
+}
+
+TEST_F(RespConnectionTest, Deferred) {
+  string req = "PING\r\n*2\r\n$5\r\nDEFER\r\n$1\r\na\r\n*2\r\n$4\r\nECHO\r\n$1\r\nb\r\n"
+               "*2\r\n$5\r\nDEFER\r\n$2\r\ncd\r\nPING\r\n";
+  string expected = "+PONG\r\n$1\r\na\r\n$1\r\nb\r\n$2\r\ncd\r\n+PONG\r\n";
+
+  // The deferred replies keep the order of their commands.
+  EXPECT_EQ(expected, Request(req, expected.size()));
+
+  expected = "-ERR Protocol error\r\n";
+  EXPECT_EQ(expected, Request("*1\r\n$x\r\n", expected.size()));
+}
+
+}  // namespace resp
+}  // namespace util
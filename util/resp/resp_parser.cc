@@ -1,16 +1,115 @@
 // Copyright 2019, Beeri 15.  All rights reserved.
 // Author: Roman Gershman (romange@gmail.com)
 //
-#include "examples/pingserver/resp_parser.h"
+#include "util/resp/resp_parser.h"
 
 #include <absl/strings/numbers.h>
 
 #include "absl/strings/ascii.h"
 #include "base/logging.h"
 
+#if defined(__aarch64__)
+#include "base/sse2neon.h"
+#define USE_SIMD 1
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#define USE_SIMD 1
+#else
+#define USE_SIMD 0
+#endif
+
 namespace redis {
 
-namespace {}  // namespace
+namespace {
+
+// Returns the first byte in [p, end) that is not part of an inline token, i.e. one of
+// whitespace or control characters, or end if there is none.
+inline uint8_t* FindTokenEnd(uint8_t* p, uint8_t* end) {
+#ifdef __AVX2__
+  const __m256i min32 = _mm256_set1_epi8(33);
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+
+    // v >= 33 as unsigned bytes.
+    __m256i is_token = _mm256_cmpeq_epi8(_mm256_max_epu8(v, min32), v);
+    uint32_t mask = ~uint32_t(_mm256_movemask_epi8(is_token));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+
+#if USE_SIMD
+  const __m128i min16 = _mm_set1_epi8(33);
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i is_token = _mm_cmpeq_epi8(_mm_max_epu8(v, min16), v);
+    uint32_t mask = ~uint32_t(_mm_movemask_epi8(is_token)) & 0xFFFF;
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+
+  while (p != end && *p > 32)
+    ++p;
+  return p;
+}
+
+// Parses 1-8 decimal digits with SWAR. `avail` is the number of bytes that can be read
+// from s. Returns false if any of the digits is not within ['0', '9'].
+inline bool ParseDigits8(const char* s, size_t len, size_t avail, uint64_t* res) {
+  DCHECK(len > 0 && len <= 8 && len <= avail);
+  constexpr uint64_t kZeros = 0x3030303030303030ULL;
+
+  // Left pad with '0', so the first digit is the most significant one.
+  uint64_t chunk;
+  if (avail >= 8) {
+    memcpy(&chunk, s, 8);
+    if (len < 8)
+      chunk = (chunk << (64 - 8 * len)) | (kZeros >> (8 * len));
+  } else {
+    chunk = kZeros;
+    memcpy(reinterpret_cast<char*>(&chunk) + 8 - len, s, len);
+  }
+
+  if ((chunk & 0xF0F0F0F0F0F0F0F0ULL) != kZeros ||
+      ((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) != kZeros) {
+    return false;
+  }
+
+  chunk -= kZeros;
+  chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FFULL;
+  chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFFULL;
+  chunk = (chunk * 10000 + (chunk >> 32)) & 0xFFFFFFFFULL;
+  *res = chunk;
+  return true;
+}
+
+// The same as absl::SimpleAtoi but with a fast path for plain decimal numbers.
+// `avail` is the number of bytes that can be read from str.data().
+inline bool ParseInt64(std::string_view str, size_t avail, int64_t* res) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  bool negative = !str.empty() && str[0] == '-';
+  const char* digits = str.data() + negative;
+  size_t len = str.size() - negative;
+  avail -= negative;
+
+  // Up to 16 digits do not overflow int64_t.
+  if (len > 0 && len <= 16) {
+    uint64_t hi = 0, lo = 0;
+    size_t hi_len = len > 8 ? len - 8 : 0;
+    if ((hi_len == 0 || ParseDigits8(digits, hi_len, avail, &hi)) &&
+        ParseDigits8(digits + hi_len, len - hi_len, avail - hi_len, &lo)) {
+      int64_t val = hi * 100000000ULL + lo;
+      *res = negative ? -val : val;
+      return true;
+    }
+  }
+#endif
+
+  return absl::SimpleAtoi(str, res);
+}
+
+}  // namespace
 
 using namespace std;
 
@@ -125,6 +224,12 @@ void RespParser::CacheState(vector<Buffer>* res) {
 
     for (; last_cached_index_ < cur.size(); ++last_cached_index_) {
       auto& e = cur[last_cached_index_];
+
+      // The bulk string that is being parsed is either empty or already owns a stash
+      // buffer of its full length. It is cached once it is complete.
+      if (state_ == BULK_STR && &e == &top_->back())
+        break;
+
       if (!e.empty()) {
         BlobPtr ptr(new uint8_t[e.size()]);
         memcpy(ptr.get(), e.data(), e.size());
@@ -146,9 +251,17 @@ auto RespParser::ParseInline(Buffer str) -> Status {
   uint8_t* end = str.end();
   uint8_t* token_start = ptr;
 
+  auto skip_token = [&] {
+    if (vectorized_) {
+      ptr = FindTokenEnd(ptr, end);
+    } else {
+      while (ptr != end && *ptr > 32)
+        ++ptr;
+    }
+  };
+
   if (is_broken_token_) {
-    while (ptr != end && *ptr > 32)
-      ++ptr;
+    skip_token();
 
     size_t len = ptr - token_start;
 
@@ -170,8 +283,7 @@ auto RespParser::ParseInline(Buffer str) -> Status {
     DCHECK(!is_broken_token_);
 
     token_start = ptr;
-    while (ptr != end && *ptr > 32)
-      ++ptr;
+    skip_token();
 
     top_->emplace_back(Buffer(token_start, ptr - token_start));
   }
@@ -198,6 +310,7 @@ auto RespParser::ParseNum(Buffer str, int64_t* res) -> ParseResult {
   }
 
   char* s = reinterpret_cast<char*>(str.data() + 1);
+  // Number lines are short, memchr is as fast as it gets for them.
   char* pos = reinterpret_cast<char*>(memchr(s, '\n', str.size() - 1));
   if (!pos) {
     return str.size() < 32 ? ParseResult::MORE : ParseResult::INVALID;
@@ -206,7 +319,9 @@ auto RespParser::ParseNum(Buffer str, int64_t* res) -> ParseResult {
     return ParseResult::INVALID;
   }
 
-  bool success = absl::SimpleAtoi(std::string_view{s, size_t(pos - s - 1)}, res);
+  std::string_view num{s, size_t(pos - s - 1)};
+  bool success = vectorized_ ? ParseInt64(num, str.size() - 1, res)
+                             : absl::SimpleAtoi(num, res);
   if (!success) {
     return ParseResult::INVALID;
   }
@@ -1,10 +1,13 @@
 // Copyright 2019, Beeri 15.  All rights reserved.
 // Author: Roman Gershman (romange@gmail.com)
 //
+#pragma once
+
 #include <absl/container/inlined_vector.h>
 #include <absl/types/span.h>
 
 #include <array>
+#include <memory>
 #include <string_view>
 #include <vector>
 
@@ -22,7 +25,9 @@ class RespParser {
   };
   using Buffer = absl::Span<uint8_t>;
 
-  explicit RespParser() {
+  // If vectorized is false, the parser uses scalar scanning. Both modes return identical
+  // results; the scalar one serves as a baseline for benchmarks.
+  explicit RespParser(bool vectorized = true) : vectorized_(vectorized) {
   }
 
   // It's a zero-copy parser. A user should not invalidate str if the parser returns COMMAND_READY
@@ -77,6 +82,7 @@ class RespParser {
   std::vector<BlobPtr> buf_stash_;
   std::vector<Buffer>* top_ = nullptr;
   bool is_broken_token_ = false;
+  bool vectorized_;
 };
 
 }  // namespace redis
@@ -0,0 +1,176 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/resp/resp_parser.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_join.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace redis {
+
+using namespace std;
+
+namespace {
+
+RespParser::Buffer ToBuf(string& str) {
+  return RespParser::Buffer{reinterpret_cast<uint8_t*>(str.data()), str.size()};
+}
+
+string ToStr(RespParser::Buffer buf) {
+  return string(reinterpret_cast<const char*>(buf.data()), buf.size());
+}
+
+// A mix of commands similar to what a cache sees with a 1:10 SET:GET ratio.
+string CommandMix(unsigned num) {
+  string res;
+  string value(64, 'v');
+  for (unsigned i = 0; i < num; ++i) {
+    string key = absl::StrCat("key:", 100000 + i);
+    if (i % 11 == 0) {
+      absl::StrAppend(&res, "*3\r\n$3\r\nSET\r\n$", key.size(), "\r\n", key, "\r\n$",
+                      value.size(), "\r\n", value, "\r\n");
+    } else {
+      absl::StrAppend(&res, "*2\r\n$3\r\nGET\r\n$", key.size(), "\r\n", key, "\r\n");
+    }
+  }
+  return res;
+}
+
+}  // namespace
+
+// Runs the test for the scalar and the vectorized parser.
+class RespParserTest : public testing::TestWithParam<bool> {
+ protected:
+  // Parses all the commands in `input` feeding the parser with chunks of at most
+  // `chunk` bytes. Returns the commands with their arguments joined by spaces.
+  vector<string> ParseAll(string input, size_t chunk);
+
+  RespParser::Status last_status_ = RespParser::RESP_OK;
+};
+
+vector<string> RespParserTest::ParseAll(string input, size_t chunk) {
+  RespParser parser(GetParam());
+  vector<string> res;
+  vector<RespParser::Buffer> args;
+  string buf;
+  size_t next = 0;
+
+  while (next < input.size() || !buf.empty()) {
+    size_t len = min(chunk, input.size() - next);
+    buf.append(input, next, len);
+    next += len;
+
+    uint32_t consumed = 0;
+    last_status_ = parser.Parse(ToBuf(buf), &consumed, &args);
+    if (last_status_ == RespParser::RESP_OK) {
+      vector<string> strs;
+      for (auto arg : args)
+        strs.push_back(ToStr(arg));
+      res.push_back(absl::StrJoin(strs, " "));
+    } else if (last_status_ != RespParser::MORE_INPUT) {
+      break;
+    }
+    buf.erase(0, consumed);
+
+    if (last_status_ == RespParser::MORE_INPUT && len == 0)
+      break;
+  }
+
+  return res;
+}
+
+INSTANTIATE_TEST_SUITE_P(Vectorized, RespParserTest, testing::Values(false, true));
+
+TEST_P(RespParserTest, Array) {
+  string input = "*3\r\n$3\r\nSET\r\n$3\r\nfoo\r\n$41\r\n"
+                 "0123456789012345678901234567890123456789\n\r\n"
+                 "*2\r\n$3\r\nGET\r\n$0\r\n\r\n";
+  vector<string> expected{"SET foo 0123456789012345678901234567890123456789\n", "GET "};
+
+  for (size_t chunk : {1, 2, 3, 7, 16, 33, 1000}) {
+    EXPECT_EQ(expected, ParseAll(input, chunk)) << chunk;
+  }
+}
+
+TEST_P(RespParserTest, Inline) {
+  string input = "PING\r\n  set  key\tvalue  \n" + string(40, 'x') + " y\r\n";
+  vector<string> expected{"PING", "set key value", string(40, 'x') + " y"};
+
+  for (size_t chunk : {1, 5, 32, 1000}) {
+    EXPECT_EQ(expected, ParseAll(input, chunk)) << chunk;
+  }
+}
+
+TEST_P(RespParserTest, Numbers) {
+  string input = "*1\r\n$16\r\n0123456789abcdef\r\n*01\r\n$+3\r\nabc\r\n";
+  vector<string> expected{"0123456789abcdef", "abc"};
+  EXPECT_EQ(expected, ParseAll(input, 1000));
+
+  ParseAll("*1\r\n$-2\r\n", 1000);
+  EXPECT_EQ(RespParser::INVALID_ARRAYLEN, last_status_);
+
+  ParseAll("*1\r\n$12345678901234567\r\n", 1000);
+  EXPECT_EQ(RespParser::INVALID_ARRAYLEN, last_status_);
+
+  ParseAll("*1\r\n$1x\r\n", 1000);
+  EXPECT_EQ(RespParser::INVALID_ARRAYLEN, last_status_);
+
+  ParseAll("*2\n\r\n", 1000);
+  EXPECT_EQ(RespParser::INVALID_ARRAYLEN, last_status_);
+
+  ParseAll("*1" + string(40, '1'), 1000);
+  EXPECT_EQ(RespParser::INVALID_ARRAYLEN, last_status_);
+}
+
+TEST_P(RespParserTest, Mix) {
+  string input = CommandMix(1000);
+  for (size_t chunk : {1, 100, 4096}) {
+    vector<string> res = ParseAll(input, chunk);
+    ASSERT_EQ(1000u, res.size());
+    EXPECT_EQ("SET key:100000 " + string(64, 'v'), res[0]);
+    EXPECT_EQ("GET key:100999", res.back());
+  }
+}
+
+static void BM_ParseMix(benchmark::State& state) {
+  string input = CommandMix(1000);
+  RespParser parser(state.range(0));
+  vector<RespParser::Buffer> args;
+
+  while (state.KeepRunning()) {
+    RespParser::Buffer buf = ToBuf(input);
+    while (!buf.empty()) {
+      uint32_t consumed = 0;
+      RespParser::Status st = parser.Parse(buf, &consumed, &args);
+      CHECK_EQ(RespParser::RESP_OK, st);
+      buf.remove_prefix(consumed);
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_ParseMix)->Arg(0)->Arg(1)->ArgName("vectorized");
+
+static void BM_ParseInline(benchmark::State& state) {
+  string input;
+  for (unsigned i = 0; i < 1000; ++i)
+    absl::StrAppend(&input, "GET key:", 100000 + i, "\r\n");
+  RespParser parser(state.range(0));
+  vector<RespParser::Buffer> args;
+
+  while (state.KeepRunning()) {
+    RespParser::Buffer buf = ToBuf(input);
+    while (!buf.empty()) {
+      uint32_t consumed = 0;
+      CHECK_EQ(RespParser::RESP_OK, parser.Parse(buf, &consumed, &args));
+      buf.remove_prefix(consumed);
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_ParseInline)->Arg(0)->Arg(1)->ArgName("vectorized");
+
+}  // namespace redis
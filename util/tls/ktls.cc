@@ -0,0 +1,338 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/tls/ktls.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
+#include <cstring>
+#include <string_view>
+
+#include "base/logging.h"
+
+#if defined(__linux__) && OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define KTLS_SUPPORTED 1
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#else
+#define KTLS_SUPPORTED 0
+#endif
+
+namespace util {
+namespace tls {
+
+using namespace std;
+
+KtlsCryptoInfo::~KtlsCryptoInfo() {
+  OPENSSL_cleanse(key, sizeof(key));
+}
+
+#if KTLS_SUPPORTED
+
+namespace {
+
+constexpr size_t kImplicitIvLen = 4;
+constexpr size_t kTls13IvLen = 12;
+
+// TLS 1.3 application traffic secrets of a session.
+struct TrafficSecrets {
+  uint8_t client[EVP_MAX_MD_SIZE];
+  uint8_t server[EVP_MAX_MD_SIZE];
+  size_t client_len = 0, server_len = 0;
+
+  ~TrafficSecrets() {
+    OPENSSL_cleanse(client, sizeof(client));
+    OPENSSL_cleanse(server, sizeof(server));
+  }
+};
+
+void FreeSecrets(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp) {
+  delete static_cast<TrafficSecrets*>(ptr);
+}
+
+int SecretsIndex() {
+  static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, FreeSecrets);
+  return index;
+}
+
+int HexVal(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Parses the hex string `src` into `dest`. Returns the length of the result or 0 on error.
+size_t ParseHex(string_view src, uint8_t* dest, size_t dest_len) {
+  if (src.size() % 2 || src.size() / 2 > dest_len)
+    return 0;
+
+  for (size_t i = 0; i < src.size(); i += 2) {
+    int hi = HexVal(src[i]), lo = HexVal(src[i + 1]);
+    if (hi < 0 || lo < 0)
+      return 0;
+    dest[i / 2] = (hi << 4) | lo;
+  }
+  return src.size() / 2;
+}
+
+// The line has the NSS key log format: "<label> <client random> <secret>".
+void KeylogCb(const SSL* ssl, const char* line) {
+  constexpr string_view kClient = "CLIENT_TRAFFIC_SECRET_0 ";
+  constexpr string_view kServer = "SERVER_TRAFFIC_SECRET_0 ";
+
+  string_view str{line};
+  bool is_client = str.substr(0, kClient.size()) == kClient;
+  if (!is_client && str.substr(0, kServer.size()) != kServer)
+    return;
+
+  str.remove_prefix(kClient.size());
+  size_t pos = str.find(' ');
+  if (pos == string_view::npos)
+    return;
+  str.remove_prefix(pos + 1);
+
+  auto* secrets = static_cast<TrafficSecrets*>(SSL_get_ex_data(ssl, SecretsIndex()));
+  if (!secrets) {
+    secrets = new TrafficSecrets;
+    SSL_set_ex_data(const_cast<SSL*>(ssl), SecretsIndex(), secrets);
+  }
+
+  if (is_client) {
+    secrets->client_len = ParseHex(str, secrets->client, sizeof(secrets->client));
+  } else {
+    secrets->server_len = ParseHex(str, secrets->server, sizeof(secrets->server));
+  }
+}
+
+// HKDF-Expand-Label from RFC 8446, section 7.1 with an empty context.
+bool HkdfExpandLabel(const EVP_MD* md, const uint8_t* secret, size_t secret_len,
+                     string_view label, uint8_t* dest, size_t dest_len) {
+  constexpr string_view kPrefix = "tls13 ";
+  uint8_t info[2 + 1 + 32 + 1];
+  size_t label_len = kPrefix.size() + label.size();
+  DCHECK_LE(label_len, 32u);
+
+  info[0] = dest_len >> 8;
+  info[1] = dest_len & 0xFF;
+  info[2] = label_len;
+  memcpy(info + 3, kPrefix.data(), kPrefix.size());
+  memcpy(info + 3 + kPrefix.size(), label.data(), label.size());
+  info[3 + label_len] = 0;  // context length.
+
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+  bool res = pctx && EVP_PKEY_derive_init(pctx) > 0 && EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+             EVP_PKEY_CTX_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+             EVP_PKEY_CTX_set1_hkdf_key(pctx, const_cast<uint8_t*>(secret), secret_len) > 0 &&
+             EVP_PKEY_CTX_add1_hkdf_info(pctx, info, 4 + label_len) > 0 &&
+             EVP_PKEY_derive(pctx, dest, &dest_len) > 0;
+  EVP_PKEY_CTX_free(pctx);
+
+  return res;
+}
+
+bool Export13(SSL* ssl, const EVP_MD* md, KtlsCryptoInfo* client, KtlsCryptoInfo* server) {
+  auto* secrets = static_cast<TrafficSecrets*>(SSL_get_ex_data(ssl, SecretsIndex()));
+  if (!secrets || !secrets->client_len || !secrets->server_len)
+    return false;
+
+  auto derive = [&](const uint8_t* secret, size_t len, KtlsCryptoInfo* info) {
+    uint8_t iv[kTls13IvLen];
+    if (!HkdfExpandLabel(md, secret, len, "key", info->key, info->key_len) ||
+        !HkdfExpandLabel(md, secret, len, "iv", iv, sizeof(iv))) {
+      return false;
+    }
+    memcpy(info->salt, iv, kImplicitIvLen);
+    memcpy(info->iv, iv + kImplicitIvLen, sizeof(info->iv));
+    return true;
+  };
+
+  bool res = derive(secrets->client, secrets->client_len, client) &&
+             derive(secrets->server, secrets->server_len, server);
+
+  // The secrets are not needed anymore.
+  SSL_set_ex_data(ssl, SecretsIndex(), nullptr);
+  delete secrets;
+
+  return res;
+}
+
+// Derives the key block of RFC 5246, section 6.3. AEAD ciphers do not have MAC keys.
+bool Export12(SSL* ssl, const EVP_MD* md, KtlsCryptoInfo* client, KtlsCryptoInfo* server) {
+  constexpr uint8_t kLabel[] = "key expansion";
+  uint8_t master[SSL_MAX_MASTER_KEY_LENGTH];
+  uint8_t client_random[SSL3_RANDOM_SIZE], server_random[SSL3_RANDOM_SIZE];
+
+  size_t master_len = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+  SSL_get_client_random(ssl, client_random, sizeof(client_random));
+  SSL_get_server_random(ssl, server_random, sizeof(server_random));
+
+  size_t key_len = client->key_len;
+  uint8_t block[2 * (32 + kImplicitIvLen)];
+  size_t block_len = 2 * (key_len + kImplicitIvLen);
+
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr);
+  bool res = master_len > 0 && pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+             EVP_PKEY_CTX_set_tls1_prf_md(pctx, md) > 0 &&
+             EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master, master_len) > 0 &&
+             EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, kLabel, sizeof(kLabel) - 1) > 0 &&
+             EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, server_random, sizeof(server_random)) > 0 &&
+             EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, client_random, sizeof(client_random)) > 0 &&
+             EVP_PKEY_derive(pctx, block, &block_len) > 0;
+  EVP_PKEY_CTX_free(pctx);
+
+  if (res) {
+    memcpy(client->key, block, key_len);
+    memcpy(server->key, block + key_len, key_len);
+    memcpy(client->salt, block + 2 * key_len, kImplicitIvLen);
+    memcpy(server->salt, block + 2 * key_len + kImplicitIvLen, kImplicitIvLen);
+  }
+
+  OPENSSL_cleanse(master, sizeof(master));
+  OPENSSL_cleanse(block, sizeof(block));
+
+  return res;
+}
+
+template <typename CryptoInfo>
+error_code SetCryptoInfo(int fd, bool tx, uint16_t cipher_type, const KtlsCryptoInfo& info) {
+  static_assert(sizeof(CryptoInfo::key) <= sizeof(info.key));
+
+  CryptoInfo ci;
+  memset(&ci, 0, sizeof(ci));
+  ci.info.version = info.version == TLS1_3_VERSION ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+  ci.info.cipher_type = cipher_type;
+
+  uint8_t seq[8];
+  for (unsigned i = 0; i < 8; ++i)
+    seq[i] = info.seq >> (56 - 8 * i);
+
+  memcpy(ci.key, info.key, sizeof(ci.key));
+  memcpy(ci.salt, info.salt, sizeof(ci.salt));
+  memcpy(ci.rec_seq, seq, sizeof(ci.rec_seq));
+
+  // TLS 1.2 records carry an explicit nonce that should be unique, so we start from
+  // the sequence number.
+  memcpy(ci.iv, info.version == TLS1_3_VERSION ? info.iv : seq, sizeof(ci.iv));
+
+  int res = setsockopt(fd, SOL_TLS, tx ? TLS_TX : TLS_RX, &ci, sizeof(ci));
+  OPENSSL_cleanse(&ci, sizeof(ci));
+
+  return res < 0 ? error_code(errno, system_category()) : error_code{};
+}
+
+}  // namespace
+
+bool EnableKtls(SSL_CTX* ctx) {
+  if (SSL_CTX_get_keylog_callback(ctx) != nullptr)
+    return SSL_CTX_get_keylog_callback(ctx) == KeylogCb;
+
+  SSL_CTX_set_keylog_callback(ctx, KeylogCb);
+  return true;
+}
+
+bool IsKtlsEnabled(const SSL_CTX* ctx) {
+  return SSL_CTX_get_keylog_callback(ctx) == KeylogCb;
+}
+
+bool ExportKtlsCryptoInfo(SSL* ssl, uint64_t tx_seq, uint64_t rx_seq, KtlsCryptoInfo* tx,
+                          KtlsCryptoInfo* rx) {
+  int version = SSL_version(ssl);
+  if (version != TLS1_2_VERSION && version != TLS1_3_VERSION)
+    return false;
+
+  const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+  if (!cipher)
+    return false;
+
+  uint16_t key_len = 0;
+  switch (SSL_CIPHER_get_cipher_nid(cipher)) {
+    case NID_aes_128_gcm:
+      key_len = 16;
+      break;
+    case NID_aes_256_gcm:
+      key_len = 32;
+      break;
+    default:
+      return false;
+  }
+
+  const EVP_MD* md = SSL_CIPHER_get_handshake_digest(cipher);
+  if (!md)
+    return false;
+
+  for (KtlsCryptoInfo* info : {tx, rx}) {
+    info->version = version;
+    info->key_len = key_len;
+    memset(info->iv, 0, sizeof(info->iv));
+  }
+  tx->seq = tx_seq;
+  rx->seq = rx_seq;
+
+  KtlsCryptoInfo* client = SSL_is_server(ssl) ? rx : tx;
+  KtlsCryptoInfo* server = SSL_is_server(ssl) ? tx : rx;
+
+  return version == TLS1_3_VERSION ? Export13(ssl, md, client, server)
+                                   : Export12(ssl, md, client, server);
+}
+
+error_code InstallKtlsUlp(int fd) {
+  if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0)
+    return error_code(errno, system_category());
+  return error_code{};
+}
+
+error_code InstallKtls(int fd, bool tx, const KtlsCryptoInfo& info) {
+  if (info.key_len == 16) {
+    return SetCryptoInfo<tls12_crypto_info_aes_gcm_128>(fd, tx, TLS_CIPHER_AES_GCM_128, info);
+  }
+
+  DCHECK_EQ(info.key_len, 32u);
+  return SetCryptoInfo<tls12_crypto_info_aes_gcm_256>(fd, tx, TLS_CIPHER_AES_GCM_256, info);
+}
+
+uint8_t GetKtlsRecordType(const msghdr& msg) {
+  const cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+    return *CMSG_DATA(cmsg);
+  return SSL3_RT_APPLICATION_DATA;
+}
+
+#else
+
+bool EnableKtls(SSL_CTX* ctx) {
+  return false;
+}
+
+bool IsKtlsEnabled(const SSL_CTX* ctx) {
+  return false;
+}
+
+bool ExportKtlsCryptoInfo(SSL* ssl, uint64_t tx_seq, uint64_t rx_seq, KtlsCryptoInfo* tx,
+                          KtlsCryptoInfo* rx) {
+  return false;
+}
+
+error_code InstallKtlsUlp(int fd) {
+  return make_error_code(errc::operation_not_supported);
+}
+
+error_code InstallKtls(int fd, bool tx, const KtlsCryptoInfo& info) {
+  return make_error_code(errc::operation_not_supported);
+}
+
+uint8_t GetKtlsRecordType(const msghdr& msg) {
+  return SSL3_RT_APPLICATION_DATA;
+}
+
+#endif
+
+}  // namespace tls
+}  // namespace util
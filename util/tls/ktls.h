@@ -0,0 +1,63 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <system_error>
+
+namespace util {
+namespace tls {
+
+// Kernel TLS (kTLS) offload. The session is handshaked in userland, then its keys are installed
+// into the TCP socket with setsockopt(SOL_TLS) and the kernel encrypts and decrypts the records.
+// Afterwards the socket is used with plain reads and writes, including sendfile.
+// OpenSSL can not do it by itself (SSL_OP_ENABLE_KTLS) because our sessions use memory BIOs.
+//
+// Supported are TLS 1.2 and TLS 1.3 sessions with AES-GCM ciphers.
+
+// Makes the TLS 1.3 sessions of ctx keep their traffic secrets, which are required for the
+// offload, by installing a keylog callback. Must be called before creating the sessions.
+// Returns false if ctx already has another keylog callback or kTLS is not supported
+// by the platform.
+bool EnableKtls(SSL_CTX* ctx);
+
+// Whether EnableKtls() was called for ctx.
+bool IsKtlsEnabled(const SSL_CTX* ctx);
+
+// The crypto state of one direction of a session.
+struct KtlsCryptoInfo {
+  uint16_t version = 0;  // TLS1_2_VERSION or TLS1_3_VERSION.
+  uint16_t key_len = 0;  // 16 for AES-128-GCM, 32 for AES-256-GCM.
+  uint8_t key[32];
+  uint8_t salt[4];  // the implicit part of the nonce.
+  uint8_t iv[8];    // TLS 1.3 only, the rest of the nonce.
+  uint64_t seq = 0;  // the sequence number of the next record.
+
+  ~KtlsCryptoInfo();
+};
+
+// Derives the crypto state of both directions of the established session.
+// tx_seq and rx_seq are the sequence numbers of the next records the session sends and receives.
+// Returns false if the protocol or the cipher of the session are not supported.
+bool ExportKtlsCryptoInfo(SSL* ssl, uint64_t tx_seq, uint64_t rx_seq, KtlsCryptoInfo* tx,
+                          KtlsCryptoInfo* rx);
+
+// Attaches the TLS upper layer protocol to the connected TCP socket. Fails with ENOENT
+// if the tls kernel module is not loaded.
+std::error_code InstallKtlsUlp(int fd);
+
+// Installs the crypto state of the direction `tx` or rx of the socket after InstallKtlsUlp().
+std::error_code InstallKtls(int fd, bool tx, const KtlsCryptoInfo& info);
+
+// Returns the type of the record that recvmsg() returned from a kTLS socket. The kernel passes
+// the records it does not handle, like alerts or post-handshake messages, with their type
+// in the control message. Returns SSL3_RT_APPLICATION_DATA if there is no such message.
+uint8_t GetKtlsRecordType(const msghdr& msg);
+
+}  // namespace tls
+}  // namespace util
@@ -0,0 +1,436 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/tls/session_cache.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/hash/hash.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "base/logging.h"
+#include "base/spinlock.h"
+
+namespace util {
+namespace tls {
+
+using namespace std;
+
+namespace {
+
+// The counters are updated by all the threads that handshake with the context,
+// including the threads of the handshake offload pool.
+void Inc(atomic_uint64_t* counter) {
+  counter->fetch_add(1, memory_order_relaxed);
+}
+
+// Sessions by key, split into shards with their own locks. Evicts the oldest sessions
+// of a shard when it is full.
+class SessionStore {
+ public:
+  SessionStore(unsigned num_shards, size_t capacity);
+  ~SessionStore();
+
+  // Takes ownership of a reference to sess, replacing the session of key.
+  void Add(string_view key, SSL_SESSION* sess);
+
+  // Returns a new reference to the session of key or nullptr.
+  SSL_SESSION* Get(string_view key);
+
+  // Removes the session of key if it is sess.
+  void Remove(string_view key, const SSL_SESSION* sess);
+
+  atomic_uint64_t hits{0}, misses{0}, evictions{0};
+
+ private:
+  struct Shard {
+    base::SpinLock mu;
+    list<string> order;  // oldest first.
+    absl::flat_hash_map<string, pair<SSL_SESSION*, list<string>::iterator>> sessions;
+  };
+
+  Shard& GetShard(string_view key) {
+    return shards_[absl::Hash<string_view>{}(key) % num_shards_];
+  }
+
+  unsigned num_shards_;
+  size_t shard_capacity_;
+  unique_ptr<Shard[]> shards_;
+};
+
+SessionStore::SessionStore(unsigned num_shards, size_t capacity)
+    : num_shards_(max(num_shards, 1u)),
+      shard_capacity_(max<size_t>(capacity / num_shards_, 1)),
+      shards_(new Shard[num_shards_]) {
+}
+
+SessionStore::~SessionStore() {
+  for (unsigned i = 0; i < num_shards_; ++i) {
+    for (const auto& k_v : shards_[i].sessions)
+      SSL_SESSION_free(k_v.second.first);
+  }
+}
+
+void SessionStore::Add(string_view key, SSL_SESSION* sess) {
+  Shard& shard = GetShard(key);
+  SSL_SESSION* prev = nullptr;
+  SSL_SESSION* evicted = nullptr;
+
+  {
+    lock_guard lk(shard.mu);
+    auto [it, inserted] = shard.sessions.try_emplace(key);
+    if (inserted) {
+      it->second.second = shard.order.emplace(shard.order.end(), key);
+    } else {
+      prev = it->second.first;
+      shard.order.splice(shard.order.end(), shard.order, it->second.second);
+    }
+    it->second.first = sess;
+
+    if (shard.sessions.size() > shard_capacity_) {
+      auto oldest = shard.sessions.find(shard.order.front());
+      evicted = oldest->second.first;
+      shard.sessions.erase(oldest);
+      shard.order.pop_front();
+      Inc(&evictions);
+    }
+  }
+
+  // Freeing may take a while, so we do not hold the lock.
+  if (prev)
+    SSL_SESSION_free(prev);
+  if (evicted)
+    SSL_SESSION_free(evicted);
+}
+
+SSL_SESSION* SessionStore::Get(string_view key) {
+  Shard& shard = GetShard(key);
+  lock_guard lk(shard.mu);
+
+  auto it = shard.sessions.find(key);
+  if (it == shard.sessions.end())
+    return nullptr;
+
+  SSL_SESSION* sess = it->second.first;
+  SSL_SESSION_up_ref(sess);
+  return sess;
+}
+
+void SessionStore::Remove(string_view key, const SSL_SESSION* sess) {
+  Shard& shard = GetShard(key);
+  SSL_SESSION* removed = nullptr;
+
+  {
+    lock_guard lk(shard.mu);
+    auto it = shard.sessions.find(key);
+    if (it == shard.sessions.end() || it->second.first != sess)
+      return;
+
+    removed = it->second.first;
+    shard.order.erase(it->second.second);
+    shard.sessions.erase(it);
+  }
+
+  SSL_SESSION_free(removed);
+}
+
+struct TicketKey {
+  uint8_t name[16];
+  uint8_t aes_key[32];
+  uint8_t hmac_key[32];
+  time_t created;
+};
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+using HmacCtx = EVP_MAC_CTX;
+
+bool InitHmac(EVP_MAC_CTX* hctx, uint8_t* key, size_t len) {
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key, len),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0),
+      OSSL_PARAM_construct_end()};
+  return EVP_MAC_CTX_set_params(hctx, params) > 0;
+}
+#else
+using HmacCtx = HMAC_CTX;
+
+bool InitHmac(HMAC_CTX* hctx, uint8_t* key, size_t len) {
+  return HMAC_Init_ex(hctx, key, len, EVP_sha256(), nullptr) > 0;
+}
+#endif
+
+class ServerCache {
+ public:
+  explicit ServerCache(const ServerSessionOptions& opts)
+      : store(opts.num_shards, opts.capacity),
+        rotation_sec_(max(opts.ticket_key_rotation_sec, 1u)) {
+    lock_guard lk(keys_mu_);
+    Rotate(time(nullptr), false);
+  }
+
+  // See SSL_CTX_set_tlsext_ticket_key_cb for the arguments and the result.
+  int OnTicketKey(uint8_t* name, uint8_t* iv, EVP_CIPHER_CTX* cctx, HmacCtx* hctx, int enc);
+
+  // Drops the current and the previous keys.
+  void ForceRotation() {
+    lock_guard lk(keys_mu_);
+    Rotate(time(nullptr), false);
+  }
+
+  SessionStore store;
+  atomic_uint64_t ticket_hits{0}, ticket_misses{0};
+
+ private:
+  // Replaces the current key with a new one. If keep_previous is set, the current key
+  // becomes the previous one, otherwise there is no previous key.
+  void Rotate(time_t now, bool keep_previous);
+
+  base::SpinLock keys_mu_;
+  TicketKey current_{}, previous_{};
+  time_t previous_expires_ = 0;  // previous_ is accepted until then.
+  uint32_t rotation_sec_;
+};
+
+void ServerCache::Rotate(time_t now, bool keep_previous) {
+  // The replaced key is accepted for one more period, also when the rotation is late
+  // because no tickets were issued for a while.
+  if (keep_previous) {
+    previous_ = current_;
+    previous_expires_ = now + rotation_sec_;
+  } else {
+    OPENSSL_cleanse(&previous_, sizeof(previous_));
+    previous_expires_ = 0;
+  }
+
+  CHECK_EQ(1, RAND_bytes(reinterpret_cast<uint8_t*>(&current_), sizeof(current_)));
+  current_.created = now;
+}
+
+int ServerCache::OnTicketKey(uint8_t* name, uint8_t* iv, EVP_CIPHER_CTX* cctx, HmacCtx* hctx,
+                             int enc) {
+  TicketKey key;
+  int res = 1;
+
+  {
+    lock_guard lk(keys_mu_);
+    time_t now = time(nullptr);
+    if (now - current_.created >= rotation_sec_)
+      Rotate(now, true);
+
+    if (enc || memcmp(name, current_.name, sizeof(current_.name)) == 0) {
+      key = current_;
+    } else if (now < previous_expires_ &&
+               memcmp(name, previous_.name, sizeof(previous_.name)) == 0) {
+      key = previous_;
+      res = 2;  // the ticket is valid but should be renewed.
+    } else {
+      res = 0;
+    }
+  }
+
+  if (res == 0) {
+    Inc(&ticket_misses);
+    return 0;  // falls back to a full handshake.
+  }
+
+  if (enc) {
+    memcpy(name, key.name, sizeof(key.name));
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 ||
+        EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1 ||
+        !InitHmac(hctx, key.hmac_key, sizeof(key.hmac_key))) {
+      res = -1;
+    }
+  } else {
+    if (EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1 ||
+        !InitHmac(hctx, key.hmac_key, sizeof(key.hmac_key))) {
+      res = -1;
+    } else {
+      Inc(&ticket_hits);
+    }
+  }
+
+  OPENSSL_cleanse(&key, sizeof(key));
+  return res;
+}
+
+template <typename T>
+void FreeExData(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp) {
+  delete static_cast<T*>(ptr);
+}
+
+int ServerCacheIndex() {
+  static int index =
+      SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, FreeExData<ServerCache>);
+  return index;
+}
+
+int ClientCacheIndex() {
+  static int index =
+      SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, FreeExData<SessionStore>);
+  return index;
+}
+
+// The peer of a client session.
+int PeerIndex() {
+  static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, FreeExData<string>);
+  return index;
+}
+
+ServerCache* GetServerCache(SSL_CTX* ctx) {
+  return static_cast<ServerCache*>(SSL_CTX_get_ex_data(ctx, ServerCacheIndex()));
+}
+
+string_view SessionId(const SSL_SESSION* sess) {
+  unsigned len = 0;
+  const uint8_t* id = SSL_SESSION_get_id(sess, &len);
+  return string_view{reinterpret_cast<const char*>(id), len};
+}
+
+int ServerNewSessionCb(SSL* ssl, SSL_SESSION* sess) {
+  string_view id = SessionId(sess);
+  if (id.empty())
+    return 0;
+
+  GetServerCache(SSL_get_SSL_CTX(ssl))->store.Add(id, sess);
+  return 1;  // the cache keeps the reference.
+}
+
+SSL_SESSION* ServerGetSessionCb(SSL* ssl, const uint8_t* id, int len, int* copy) {
+  *copy = 0;  // Get() already returns a new reference.
+  string_view key{reinterpret_cast<const char*>(id), size_t(len)};
+  SessionStore& store = GetServerCache(SSL_get_SSL_CTX(ssl))->store;
+  SSL_SESSION* sess = store.Get(key);
+  Inc(sess ? &store.hits : &store.misses);
+  return sess;
+}
+
+void ServerRemoveSessionCb(SSL_CTX* ctx, SSL_SESSION* sess) {
+  GetServerCache(ctx)->store.Remove(SessionId(sess), sess);
+}
+
+int TicketKeyCb(SSL* ssl, uint8_t* name, uint8_t* iv, EVP_CIPHER_CTX* cctx, HmacCtx* hctx,
+                int enc) {
+  int res = GetServerCache(SSL_get_SSL_CTX(ssl))->OnTicketKey(name, iv, cctx, hctx, enc);
+
+  // TLS 1.3 clients use every ticket once, so they need a new one after the resumption.
+  if (res == 1 && !enc && SSL_version(ssl) == TLS1_3_VERSION)
+    res = 2;
+  return res;
+}
+
+int ClientNewSessionCb(SSL* ssl, SSL_SESSION* sess) {
+  auto* store = static_cast<SessionStore*>(
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ClientCacheIndex()));
+  auto* peer = static_cast<const string*>(SSL_get_ex_data(ssl, PeerIndex()));
+  if (!store || !peer)
+    return 0;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (!SSL_SESSION_is_resumable(sess))
+    return 0;
+#endif
+
+  store->Add(*peer, sess);
+  return 1;
+}
+
+}  // namespace
+
+void EnableServerSessionCache(SSL_CTX* ctx, const ServerSessionOptions& opts) {
+  CHECK(!GetServerCache(ctx));
+  SSL_CTX_set_ex_data(ctx, ServerCacheIndex(), new ServerCache(opts));
+
+  // Sessions are resumed only within the same context.
+  static constexpr uint8_t kSessionIdContext[] = "helio";
+  SSL_CTX_set_session_id_context(ctx, kSessionIdContext, sizeof(kSessionIdContext) - 1);
+
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+  SSL_CTX_set_timeout(ctx, opts.timeout_sec);
+  SSL_CTX_sess_set_new_cb(ctx, ServerNewSessionCb);
+  SSL_CTX_sess_set_get_cb(ctx, ServerGetSessionCb);
+  SSL_CTX_sess_set_remove_cb(ctx, ServerRemoveSessionCb);
+
+  if (opts.tickets) {
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, TicketKeyCb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, TicketKeyCb);
+#endif
+  } else {
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+  }
+}
+
+void RotateTicketKeys(SSL_CTX* ctx) {
+  ServerCache* cache = GetServerCache(ctx);
+  CHECK(cache);
+  cache->ForceRotation();
+}
+
+void EnableClientSessionCache(SSL_CTX* ctx, size_t capacity) {
+  CHECK(!SSL_CTX_get_ex_data(ctx, ClientCacheIndex()));
+
+  // Client contexts are usually shared by all the threads.
+  constexpr unsigned kNumShards = 8;
+  SSL_CTX_set_ex_data(ctx, ClientCacheIndex(), new SessionStore(kNumShards, capacity));
+
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, ClientNewSessionCb);
+}
+
+void ResumeClientSession(SSL* ssl, string_view peer) {
+  auto* store = static_cast<SessionStore*>(
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ClientCacheIndex()));
+  if (!store)
+    return;
+
+  delete static_cast<string*>(SSL_get_ex_data(ssl, PeerIndex()));
+  SSL_set_ex_data(ssl, PeerIndex(), new string(peer));
+
+  SSL_SESSION* sess = store->Get(peer);
+  if (!sess) {
+    Inc(&store->misses);
+    return;
+  }
+
+  Inc(&store->hits);
+  SSL_set_session(ssl, sess);
+  SSL_SESSION_free(sess);
+}
+
+SessionCacheStats GetSessionCacheStats(SSL_CTX* ctx) {
+  SessionCacheStats res;
+  if (ServerCache* cache = GetServerCache(ctx)) {
+    res.server_hits = cache->store.hits.load(memory_order_relaxed);
+    res.server_misses = cache->store.misses.load(memory_order_relaxed);
+    res.ticket_hits = cache->ticket_hits.load(memory_order_relaxed);
+    res.ticket_misses = cache->ticket_misses.load(memory_order_relaxed);
+    res.evictions = cache->store.evictions.load(memory_order_relaxed);
+  }
+
+  if (auto* store = static_cast<SessionStore*>(SSL_CTX_get_ex_data(ctx, ClientCacheIndex()))) {
+    res.client_hits = store->hits.load(memory_order_relaxed);
+    res.client_misses = store->misses.load(memory_order_relaxed);
+    res.evictions += store->evictions.load(memory_order_relaxed);
+  }
+  return res;
+}
+
+}  // namespace tls
+}  // namespace util
@@ -0,0 +1,66 @@
+// Copyright 2023, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <openssl/ssl.h>
+
+#include <cstdint>
+#include <string_view>
+
+namespace util {
+namespace tls {
+
+// TLS session resumption, which replaces the full handshake of reconnecting peers
+// with an abbreviated one.
+
+struct ServerSessionOptions {
+  // The cache is split into shards by session id, so every shard has its own lock.
+  // Usually the number of proactors.
+  unsigned num_shards = 16;
+
+  size_t capacity = 1 << 16;  // sessions in the cache, the oldest are evicted first.
+  uint32_t timeout_sec = 7200;  // lifetime of the sessions and the tickets.
+
+  // Whether to issue session tickets, which keep the session state on the client.
+  bool tickets = true;
+
+  // The key that encrypts new tickets is replaced after that period. Tickets that were
+  // encrypted with the previous key are accepted for one more period and are renewed.
+  uint32_t ticket_key_rotation_sec = 3600;
+};
+
+// Makes the server context resume sessions, either by id from a sharded session cache
+// or from session tickets. Must be called before creating the sessions. ctx owns the cache.
+void EnableServerSessionCache(SSL_CTX* ctx, const ServerSessionOptions& opts = {});
+
+// Forces rotation of the ticket keys of ctx, for example after a suspected key compromise.
+// Unlike the periodic rotation, the tickets of the replaced keys are not accepted anymore.
+void RotateTicketKeys(SSL_CTX* ctx);
+
+// Makes the client context keep the last session of every peer, up to `capacity` peers.
+// ctx owns the cache.
+void EnableClientSessionCache(SSL_CTX* ctx, size_t capacity = 1024);
+
+// Offers the last session of `peer`, usually "host:port", to the server. The new sessions
+// of ssl are kept for `peer`. Must be called before the handshake.
+void ResumeClientSession(SSL* ssl, std::string_view peer);
+
+// Counters of the session caches of a context, summed over all the threads that use it.
+struct SessionCacheStats {
+  uint64_t server_hits = 0;    // sessions that were found in the server cache.
+  uint64_t server_misses = 0;  // session ids that were not found.
+  uint64_t ticket_hits = 0;    // tickets that were decrypted.
+  uint64_t ticket_misses = 0;  // tickets with unknown or expired keys.
+  uint64_t client_hits = 0;    // sessions offered by clients.
+  uint64_t client_misses = 0;  // client connections to peers without a session.
+  uint64_t evictions = 0;      // sessions evicted because the cache was full.
+};
+
+// Returns the counters of the server and the client caches of ctx, zero for the caches
+// that were not enabled.
+SessionCacheStats GetSessionCacheStats(SSL_CTX* ctx);
+
+}  // namespace tls
+}  // namespace util
@@ -42,7 +42,9 @@ Engine::Engine(SSL_CTX* context) : ssl_(::SSL_new(context)) {
 
   ::BIO* int_bio = 0;
 
-  BIO_new_bio_pair(&int_bio, 0, &external_bio_, 0);
+  // The output buffer of the session (the write buffer of int_bio) holds several full records,
+  // so they are sent with one write. The input buffer has the default size.
+  BIO_new_bio_pair(&int_bio, kOutputBufSize, &external_bio_, 0);
 
   // SSL_set0_[rw]bio take ownership of the passed reference,
   // so if we call both with the same BIO, we need the refcount to be 2.
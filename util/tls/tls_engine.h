@@ -35,6 +35,14 @@ class Engine {
   using OpResult = io::Result<int, unsigned long>;
   using BufResult = io::Result<Buffer, unsigned long>;
 
+  // The maximal plaintext length of a TLS record and the maximal length of its encryption.
+  static constexpr size_t kMaxRecordLen = SSL3_RT_MAX_PLAIN_LENGTH;
+  static constexpr size_t kMaxEncryptedRecordLen =
+      SSL3_RT_HEADER_LENGTH + SSL3_RT_MAX_PLAIN_LENGTH + SSL3_RT_MAX_ENCRYPTED_OVERHEAD;
+
+  // The size of the output buffer.
+  static constexpr size_t kOutputBufSize = 2 * kMaxEncryptedRecordLen;
+
   // Construct a new engine for the specified context.
   explicit Engine(SSL_CTX* context);
 
@@ -91,6 +99,12 @@ class Engine {
     return BIO_ctrl(external_bio_, BIO_CTRL_PENDING, 0, NULL);
   }
 
+  // Returns the free space in the output buffer. A write of up to kMaxRecordLen bytes
+  // is encrypted completely if there is space for kMaxEncryptedRecordLen bytes.
+  size_t OutputSpace() const {
+    return BIO_ctrl_get_write_guarantee(SSL_get_wbio(ssl_));
+  }
+
   //! It's a bit confusing but when we write into external_bio_ it's like
   //! and input buffer to the engine.
   size_t InputPending() const {
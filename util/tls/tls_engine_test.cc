@@ -7,12 +7,26 @@
 #include <openssl/err.h>
 
 #include <string_view>
+#include <thread>
 
+#include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "util/fibers/epoll_proactor.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 #include "util/fibers/fibers.h"
+#include "util/tls/ktls.h"
+#include "util/tls/session_cache.h"
 #include "util/tls/tls_socket.h"
 
+#ifdef __linux__
+#include "util/fibers/uring_proactor.h"
+
+ABSL_DECLARE_FLAG(bool, proactor_register_fd);
+ABSL_DECLARE_FLAG(bool, uring_accept_multishot);
+ABSL_DECLARE_FLAG(uint32_t, uring_direct_accept_slots);
+#endif
+
 namespace util {
 namespace tls {
 
@@ -333,6 +347,579 @@ TEST_F(SslStreamTest, Write) {
   }
 }
 
+// Creates a context of the protocol `version` with a self-signed certificate.
+static SSL_CTX* CreateCertCtx(int version) {
+  SSL_CTX* ctx = SSL_CTX_new(TLS_method());
+  SSL_CTX_set_min_proto_version(ctx, version);
+  SSL_CTX_set_max_proto_version(ctx, version);
+
+  EVP_PKEY* pkey = nullptr;
+  EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  CHECK_GT(EVP_PKEY_keygen_init(kctx), 0);
+  CHECK_GT(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1), 0);
+  CHECK_GT(EVP_PKEY_keygen(kctx, &pkey), 0);
+  EVP_PKEY_CTX_free(kctx);
+
+  X509* cert = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_set_pubkey(cert, pkey);
+  X509_NAME* name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             reinterpret_cast<const uint8_t*>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  CHECK_GT(X509_sign(cert, pkey, EVP_sha256()), 0);
+  CHECK_EQ(1, SSL_CTX_use_certificate(ctx, cert));
+  CHECK_EQ(1, SSL_CTX_use_PrivateKey(ctx, pkey));
+  X509_free(cert);
+  EVP_PKEY_free(pkey);
+
+  return ctx;
+}
+
+// Passes the output of src to dest.
+static void Transfer(Engine* src, Engine* dest) {
+  while (src->OutputPending() > 0) {
+    auto buf_result = src->PeekOutputBuf();
+    CHECK(buf_result);
+    auto write_result = dest->WriteBuf(*buf_result);
+    CHECK(write_result);
+    src->ConsumeOutputBuf(*write_result);
+  }
+}
+
+// Runs the handshake between the engines. Returns false if it did not complete.
+static bool RunHandshake(Engine* client, Engine* server) {
+  bool client_done = false, server_done = false;
+  for (unsigned i = 0; i < 10 && !(client_done && server_done); ++i) {
+    auto op_result = client->Handshake(Engine::CLIENT);
+    if (!op_result) {
+      LOG(ERROR) << SSLError(op_result.error());
+      return false;
+    }
+    client_done = *op_result >= 0;
+    Transfer(client, server);
+
+    op_result = server->Handshake(Engine::SERVER);
+    if (!op_result) {
+      LOG(ERROR) << SSLError(op_result.error());
+      return false;
+    }
+    server_done = *op_result >= 0;
+    Transfer(server, client);
+  }
+  return client_done && server_done;
+}
+
+// Checks the exported kTLS state by decrypting the records of the session with it.
+class KtlsTest : public testing::TestWithParam<int> {
+ protected:
+  void SetUp() override;
+
+  void TearDown() override {
+    client_engine_.reset();
+    server_engine_.reset();
+  }
+
+  // Decrypts the application data record `rec`. Returns an empty string on failure.
+  static string DecryptRecord(const KtlsCryptoInfo& info, Engine::Buffer rec);
+
+  unique_ptr<Engine> client_engine_, server_engine_;
+};
+
+void KtlsTest::SetUp() {
+  SSL_CTX* ctx = CreateCertCtx(GetParam());
+  CHECK_EQ(1, SSL_CTX_set_cipher_list(ctx, "ECDHE-ECDSA-AES128-GCM-SHA256"));
+  CHECK_EQ(1, SSL_CTX_set_ciphersuites(ctx, "TLS_AES_256_GCM_SHA384"));
+  ASSERT_TRUE(EnableKtls(ctx));
+  ASSERT_TRUE(IsKtlsEnabled(ctx));
+
+  client_engine_.reset(new Engine(ctx));
+  server_engine_.reset(new Engine(ctx));
+  SSL_CTX_free(ctx);
+}
+
+string KtlsTest::DecryptRecord(const KtlsCryptoInfo& info, Engine::Buffer rec) {
+  constexpr size_t kTagLen = 16;
+  CHECK_GT(rec.size(), 5u);
+  const uint8_t* hdr = rec.data();
+  const uint8_t* body = hdr + 5;
+  size_t len = (hdr[3] << 8) | hdr[4];
+  CHECK_EQ(rec.size(), 5 + len);
+
+  uint8_t seq[8];
+  for (unsigned i = 0; i < 8; ++i)
+    seq[i] = info.seq >> (56 - 8 * i);
+
+  uint8_t nonce[12], aad[13];
+  size_t aad_len = 5;
+  memcpy(nonce, info.salt, 4);
+  if (info.version == TLS1_3_VERSION) {
+    for (unsigned i = 0; i < 8; ++i)
+      nonce[4 + i] = info.iv[i] ^ seq[i];
+    memcpy(aad, hdr, 5);
+  } else {
+    memcpy(nonce + 4, body, 8);  // the explicit nonce.
+    body += 8;
+    len -= 8;
+    memcpy(aad, seq, 8);
+    memcpy(aad + 8, hdr, 3);
+    aad[11] = (len - kTagLen) >> 8;
+    aad[12] = (len - kTagLen) & 0xFF;
+    aad_len = 13;
+  }
+
+  size_t data_len = len - kTagLen;
+  string res(data_len, '\0');
+  int out_len = 0;
+  EVP_CIPHER_CTX* cctx = EVP_CIPHER_CTX_new();
+  const EVP_CIPHER* cipher = info.key_len == 16 ? EVP_aes_128_gcm() : EVP_aes_256_gcm();
+  bool ok =
+      EVP_DecryptInit_ex(cctx, cipher, nullptr, info.key, nonce) > 0 &&
+      EVP_DecryptUpdate(cctx, nullptr, &out_len, aad, aad_len) > 0 &&
+      EVP_DecryptUpdate(cctx, reinterpret_cast<uint8_t*>(res.data()), &out_len, body, data_len) &&
+      EVP_CIPHER_CTX_ctrl(cctx, EVP_CTRL_GCM_SET_TAG, kTagLen,
+                          const_cast<uint8_t*>(body + data_len)) > 0 &&
+      EVP_DecryptFinal_ex(cctx, nullptr, &out_len) > 0;
+  EVP_CIPHER_CTX_free(cctx);
+
+  if (!ok)
+    return string{};
+
+  if (info.version == TLS1_3_VERSION) {  // strip the inner content type.
+    CHECK_EQ(23, res.back());
+    res.pop_back();
+  }
+  return res;
+}
+
+INSTANTIATE_TEST_SUITE_P(Versions, KtlsTest, testing::Values(TLS1_2_VERSION, TLS1_3_VERSION));
+
+TEST_P(KtlsTest, ExportCryptoInfo) {
+  Engine* client = client_engine_.get();
+  Engine* server = server_engine_.get();
+
+  ASSERT_TRUE(RunHandshake(client, server));
+
+  // Both directions are after the Finished message with TLS 1.2. With TLS 1.3 the server
+  // sends its session tickets with the application keys.
+  SSL* ssl = server->native_handle();
+  bool tls13 = GetParam() == TLS1_3_VERSION;
+  uint64_t tx_seq = tls13 ? SSL_get_num_tickets(ssl) : 1;
+  uint64_t rx_seq = tls13 ? 0 : 1;
+
+  KtlsCryptoInfo tx, rx;
+  ASSERT_TRUE(ExportKtlsCryptoInfo(ssl, tx_seq, rx_seq, &tx, &rx));
+  EXPECT_EQ(GetParam(), tx.version);
+  EXPECT_EQ(tls13 ? 32 : 16, tx.key_len);
+
+  string_view msg = "hello from server";
+  auto op_result = server->Write(Engine::Buffer{reinterpret_cast<const uint8_t*>(msg.data()),
+                                                msg.size()});
+  ASSERT_TRUE(op_result && *op_result > 0);
+  auto buf_result = server->FetchOutputBuf();
+  ASSERT_TRUE(buf_result);
+  EXPECT_EQ(msg, DecryptRecord(tx, *buf_result));
+
+  msg = "hello from client";
+  op_result = client->Write(Engine::Buffer{reinterpret_cast<const uint8_t*>(msg.data()),
+                                           msg.size()});
+  ASSERT_TRUE(op_result && *op_result > 0);
+  buf_result = client->FetchOutputBuf();
+  ASSERT_TRUE(buf_result);
+  EXPECT_EQ(msg, DecryptRecord(rx, *buf_result));
+}
+
+// Reconnects clients with a session cache to servers with a session cache.
+class SessionCacheTest : public testing::TestWithParam<tuple<int, bool>> {
+ protected:
+  void SetUp() override;
+
+  void TearDown() override {
+    SSL_CTX_free(server_ctx_);
+    SSL_CTX_free(client_ctx_);
+  }
+
+  // Connects a new client to a new server. Returns whether the session was resumed.
+  bool Connect();
+
+  // The counters of the server and the client caches.
+  SessionCacheStats Stats() const {
+    SessionCacheStats res = GetSessionCacheStats(server_ctx_);
+    SessionCacheStats client = GetSessionCacheStats(client_ctx_);
+    res.client_hits = client.client_hits;
+    res.client_misses = client.client_misses;
+    res.evictions += client.evictions;
+    return res;
+  }
+
+  SSL_CTX* server_ctx_ = nullptr;
+  SSL_CTX* client_ctx_ = nullptr;
+};
+
+void SessionCacheTest::SetUp() {
+  auto [version, tickets] = GetParam();
+  server_ctx_ = CreateCertCtx(version);
+  ServerSessionOptions opts;
+  opts.num_shards = 2;
+  opts.tickets = tickets;
+  EnableServerSessionCache(server_ctx_, opts);
+
+  client_ctx_ = SSL_CTX_new(TLS_method());
+  SSL_CTX_set_min_proto_version(client_ctx_, version);
+  SSL_CTX_set_max_proto_version(client_ctx_, version);
+  EnableClientSessionCache(client_ctx_);
+}
+
+bool SessionCacheTest::Connect() {
+  Engine client(client_ctx_), server(server_ctx_);
+  ResumeClientSession(client.native_handle(), "localhost:443");
+  CHECK(RunHandshake(&client, &server));
+
+  // TLS 1.3 clients receive their sessions after the handshake.
+  uint8_t buf[16];
+  CHECK(client.Read(buf, sizeof(buf)));
+  bool reused = SSL_session_reused(client.native_handle()) == 1;
+
+  // Closes the sessions like TlsSocket::Close() does, so they stay resumable.
+  SSL_set_shutdown(client.native_handle(), SSL_SENT_SHUTDOWN);
+  SSL_set_shutdown(server.native_handle(), SSL_SENT_SHUTDOWN);
+  return reused;
+}
+
+INSTANTIATE_TEST_SUITE_P(VersionsTickets, SessionCacheTest,
+                         testing::Combine(testing::Values(TLS1_2_VERSION, TLS1_3_VERSION),
+                                          testing::Bool()));
+
+TEST_P(SessionCacheTest, Resume) {
+  bool tickets = get<1>(GetParam());
+  SessionCacheStats start = Stats();
+
+  EXPECT_FALSE(Connect());
+  EXPECT_TRUE(Connect());
+  EXPECT_TRUE(Connect());
+
+  SessionCacheStats stats = Stats();
+  EXPECT_EQ(1, stats.client_misses - start.client_misses);
+  EXPECT_EQ(2, stats.client_hits - start.client_hits);
+  EXPECT_EQ(tickets ? 0 : 2, stats.server_hits - start.server_hits);
+  EXPECT_EQ(tickets ? 2 : 0, stats.ticket_hits - start.ticket_hits);
+
+  // A forced rotation drops the keys, so the tickets that were issued before it require
+  // a full handshake. The sessions of the server cache are not affected.
+  RotateTicketKeys(server_ctx_);
+  EXPECT_EQ(!tickets, Connect());
+  EXPECT_EQ(tickets, Stats().ticket_misses > start.ticket_misses);
+}
+
+TEST_P(SessionCacheTest, Evict) {
+  SSL_CTX_free(server_ctx_);
+  auto [version, tickets] = GetParam();
+  server_ctx_ = CreateCertCtx(version);
+  ServerSessionOptions opts;
+  opts.num_shards = 1;
+  opts.capacity = 1;
+  opts.tickets = tickets;
+  EnableServerSessionCache(server_ctx_, opts);
+
+  SessionCacheStats start = Stats();
+  EXPECT_FALSE(Connect());
+
+  // A client with another context gets a new session, which evicts the first one.
+  SSL_CTX* other_client = SSL_CTX_new(TLS_method());
+  SSL_CTX_set_min_proto_version(other_client, version);
+  SSL_CTX_set_max_proto_version(other_client, version);
+  EnableClientSessionCache(other_client);
+  swap(client_ctx_, other_client);
+  EXPECT_FALSE(Connect());
+  swap(client_ctx_, other_client);
+  SSL_CTX_free(other_client);
+
+  EXPECT_EQ(tickets, Connect());
+  if (!tickets) {
+    EXPECT_LT(start.evictions, Stats().evictions);
+  }
+}
+
+// The tickets of the previous key are accepted after the key is rotated lazily, when
+// a ticket is decrypted more than a period after the key was created.
+TEST_P(SessionCacheTest, LazyRotation) {
+  SSL_CTX_free(server_ctx_);
+  auto [version, tickets] = GetParam();
+  server_ctx_ = CreateCertCtx(version);
+  ServerSessionOptions opts;
+  opts.num_shards = 1;
+  opts.tickets = tickets;
+  opts.ticket_key_rotation_sec = 1;
+  EnableServerSessionCache(server_ctx_, opts);
+
+  EXPECT_FALSE(Connect());
+  SessionCacheStats start = Stats();
+  this_thread::sleep_for(1100ms);
+  EXPECT_TRUE(Connect());
+
+  SessionCacheStats stats = Stats();
+  EXPECT_EQ(tickets ? 1 : 0, stats.ticket_hits - start.ticket_hits);
+  EXPECT_EQ(0, stats.ticket_misses - start.ticket_misses);
+}
+
+// Checks that the output buffer holds two full records, which are sent with one write.
+TEST(EngineTest, OutputRecords) {
+  SSL_CTX* ctx = CreateCertCtx(TLS1_3_VERSION);
+  Engine client(ctx), server(ctx);
+  SSL_CTX_free(ctx);
+  ASSERT_TRUE(RunHandshake(&client, &server));
+
+  string data(Engine::kMaxRecordLen, 'x');
+  Engine::Buffer record{reinterpret_cast<const uint8_t*>(data.data()), data.size()};
+
+  for (unsigned i = 0; i < 3; ++i) {
+    ASSERT_EQ(0u, server.OutputPending());
+    for (unsigned j = 0; j < 2; ++j) {
+      ASSERT_GE(server.OutputSpace(), Engine::kMaxEncryptedRecordLen);
+      auto op_result = server.Write(record);
+      ASSERT_TRUE(op_result);
+      ASSERT_EQ(int(record.size()), *op_result);
+    }
+    EXPECT_LT(server.OutputSpace(), Engine::kMaxEncryptedRecordLen);
+
+    // The records are contiguous.
+    auto buf_result = server.PeekOutputBuf();
+    ASSERT_TRUE(buf_result);
+    ASSERT_EQ(server.OutputPending(), buf_result->size());
+    server.ConsumeOutputBuf(buf_result->size());
+  }
+}
+
+// A TLS connection over the loopback interface. The sockets run in a proactor thread.
+class TlsSocketPair {
+ public:
+  // setup_server configures the server context. uring runs the sockets in an io_uring proactor.
+  explicit TlsSocketPair(function<void(SSL_CTX*)> setup_server = {}, bool uring = false);
+  ~TlsSocketPair();
+
+  fb2::ProactorBase* proactor() {
+    return proactor_.get();
+  }
+
+  TlsSocket* server() {
+    return server_.get();
+  }
+
+  TlsSocket* client() {
+    return client_.get();
+  }
+
+ private:
+  SSL_CTX* server_ctx_ = nullptr;
+  SSL_CTX* client_ctx_ = nullptr;
+  unique_ptr<fb2::ProactorBase> proactor_;
+  thread proactor_thread_;
+  unique_ptr<TlsSocket> server_, client_;
+};
+
+TlsSocketPair::TlsSocketPair(function<void(SSL_CTX*)> setup_server, bool uring) {
+  server_ctx_ = CreateCertCtx(TLS1_3_VERSION);
+  if (setup_server)
+    setup_server(server_ctx_);
+  client_ctx_ = SSL_CTX_new(TLS_client_method());
+
+  fb2::ProactorBase* proactor;
+#ifdef __linux__
+  if (uring)
+    proactor = new fb2::UringProactor;
+  else
+#endif
+    proactor = new fb2::EpollProactor;
+
+  atomic_bool init_done{false};
+  proactor_thread_ = thread{[proactor, &init_done] {
+#ifdef __linux__
+    if (proactor->GetKind() == fb2::ProactorBase::IOURING)
+      static_cast<fb2::UringProactor*>(proactor)->Init(64);
+    else
+#endif
+      static_cast<fb2::EpollProactor*>(proactor)->Init();
+    init_done.store(true, memory_order_release);
+    proactor->Run();
+  }};
+
+  while (!init_done.load()) {
+    usleep(1000);
+  }
+  proactor_.reset(proactor);
+
+  proactor_->Await([this] {
+    unique_ptr<FiberSocketBase> listener(proactor_->CreateSocket());
+    CHECK(!listener->Listen(0, 0));
+    FiberSocketBase::endpoint_type ep{asio::ip::make_address("127.0.0.1"),
+                                      listener->LocalEndpoint().port()};
+
+    Fiber accept_fb([&] {
+      auto accept_res = listener->Accept();
+      CHECK(accept_res);
+      (*accept_res)->SetProactor(proactor_.get());
+      server_.reset(new TlsSocket(*accept_res));
+      server_->InitSSL(server_ctx_);
+      CHECK(server_->Accept());
+
+      uint8_t byte;
+      CHECK(server_->Recv(io::MutableBytes{&byte, 1}));
+    });
+
+    client_.reset(new TlsSocket(proactor_->CreateSocket()));
+    client_->InitSSL(client_ctx_);
+    CHECK(!client_->Connect(ep));
+
+    // The client handshakes when it writes the first byte.
+    uint8_t byte = 0;
+    CHECK(!client_->Write(io::Bytes{&byte, 1}));
+    accept_fb.Join();
+    (void)listener->Close();
+  });
+}
+
+TlsSocketPair::~TlsSocketPair() {
+  proactor_->Await([this] {
+    (void)client_->Close();
+    (void)server_->Close();
+    client_.reset();
+    server_.reset();
+  });
+
+  proactor_->Stop();
+  proactor_thread_.join();
+  proactor_.reset();
+
+  SSL_CTX_free(server_ctx_);
+  SSL_CTX_free(client_ctx_);
+}
+
+TEST(TlsSocketTest, WriteSome) {
+  TlsSocketPair pair;
+
+  // Buffers around the record size, and many small buffers that are gathered into records.
+  vector<string> bufs;
+  for (size_t len : {1, 0, 100, 16383, 16384, 16385, 40000, 5, 7, 100000, 2})
+    bufs.emplace_back(len, '\0');
+  for (unsigned i = 0; i < 1000; ++i)
+    bufs.emplace_back(50, '\0');
+
+  string expected;
+  vector<iovec> iov;
+  for (string& buf : bufs) {
+    for (char& c : buf)
+      c = 'a' + expected.size() % 23;
+    expected += buf;
+    iov.push_back(iovec{buf.data(), buf.size()});
+  }
+
+  string received(expected.size(), '\0');
+  pair.proactor()->Await([&] {
+    Fiber reader([&] {
+      io::MutableBytes dest{reinterpret_cast<uint8_t*>(received.data()), received.size()};
+      io::Result<size_t> res = pair.client()->Read(dest);
+      ASSERT_TRUE(res);
+      EXPECT_EQ(received.size(), *res);
+    });
+
+    io::Result<size_t> res = pair.server()->WriteSome(iov.data(), iov.size());
+    ASSERT_TRUE(res);
+    EXPECT_EQ(expected.size(), *res);
+    reader.Join();
+  });
+  EXPECT_EQ(expected, received);
+}
+
+TEST(TlsSocketTest, HandshakeOffload) {
+  fb2::FiberQueueThreadPool pool(2);
+  TlsSocketPair pair([&pool](SSL_CTX* ctx) { EnableHandshakeOffload(ctx, &pool, 1); });
+
+  TlsSocket::HandshakeStats stats =
+      pair.proactor()->Await([] { return TlsSocket::GetHandshakeStats(); });
+  EXPECT_EQ(1u, stats.handshakes);
+  EXPECT_EQ(0u, stats.failures);
+  EXPECT_GT(stats.offloaded_steps, 0u);
+  EXPECT_EQ(0u, stats.throttled_steps);
+
+  // The offloaded connection works as usual.
+  string_view msg = "hello";
+  char buf[16];
+  pair.proactor()->Await([&] {
+    CHECK(!pair.server()->Write(io::Buffer(msg)));
+    io::MutableBytes dest{reinterpret_cast<uint8_t*>(buf), sizeof(buf)};
+    io::Result<size_t> res = pair.client()->Recv(dest);
+    ASSERT_TRUE(res);
+    EXPECT_EQ(msg, string_view(buf, *res));
+  });
+}
+
+// Runs the session over the kernel TLS offload where the kernel supports it.
+TEST(TlsSocketTest, Ktls) {
+  TlsSocketPair pair([](SSL_CTX* ctx) { CHECK(EnableKtls(ctx)); });
+  if (!pair.server()->IsKtlsTx()) {
+    GTEST_SKIP() << "kTLS is not supported by the kernel";
+  }
+
+  string msg(100000, 'k');
+  string buf(msg.size(), '\0');
+  io::MutableBytes dest{reinterpret_cast<uint8_t*>(buf.data()), buf.size()};
+  pair.proactor()->Await([&] {
+    Fiber reader([&] {
+      io::Result<size_t> res = pair.client()->Read(dest);
+      ASSERT_TRUE(res) << res.error().message();
+    });
+    ASSERT_FALSE(pair.server()->Write(io::Buffer(msg)));
+    reader.Join();
+    EXPECT_TRUE(msg == buf);
+
+    // The server may receive in userland or in the kernel.
+    buf.assign(buf.size(), '\0');
+    reader = Fiber([&] {
+      io::Result<size_t> res = pair.server()->Read(dest);
+      ASSERT_TRUE(res) << res.error().message();
+    });
+    ASSERT_FALSE(pair.client()->Write(io::Buffer(msg)));
+    reader.Join();
+    EXPECT_TRUE(msg == buf);
+  });
+}
+
+#ifdef __linux__
+// kTLS is not enabled for registered descriptors, which are not in the file table of the process.
+TEST(TlsSocketTest, KtlsDirectFd) {
+  absl::SetFlag(&FLAGS_proactor_register_fd, true);
+  absl::SetFlag(&FLAGS_uring_accept_multishot, true);
+  absl::SetFlag(&FLAGS_uring_direct_accept_slots, 16);
+  TlsSocketPair pair([](SSL_CTX* ctx) { CHECK(EnableKtls(ctx)); }, true);
+  absl::SetFlag(&FLAGS_proactor_register_fd, false);
+  absl::SetFlag(&FLAGS_uring_accept_multishot, false);
+  absl::SetFlag(&FLAGS_uring_direct_accept_slots, 0);
+
+  if (!pair.server()->IsDirect()) {
+    GTEST_SKIP() << "Direct accept is not supported";
+  }
+  EXPECT_FALSE(pair.server()->IsKtlsTx());
+  EXPECT_FALSE(pair.server()->IsKtlsRx());
+
+  string_view msg = "hello";
+  char buf[16];
+  pair.proactor()->Await([&] {
+    io::MutableBytes dest{reinterpret_cast<uint8_t*>(buf), sizeof(buf)};
+    CHECK(!pair.server()->Write(io::Buffer(msg)));
+    io::Result<size_t> res = pair.client()->Recv(dest);
+    ASSERT_TRUE(res);
+    EXPECT_EQ(msg, string_view(buf, *res));
+
+    CHECK(!pair.client()->Write(io::Buffer(msg)));
+    res = pair.server()->Recv(dest);
+    ASSERT_TRUE(res);
+    EXPECT_EQ(msg, string_view(buf, *res));
+  });
+}
+#endif
+
 void BM_TlsWrite(benchmark::State& state) {
   unique_ptr<Engine> client_engine, server_engine;
   SslStreamTest::Options sopts{"srv"}, copts{"client"};
@@ -368,5 +955,41 @@ void BM_TlsWrite(benchmark::State& state) {
 }
 BENCHMARK(BM_TlsWrite)->Arg(1024)->Arg(4096)->ArgName("bytes");
 
+// Writes range(1) buffers of range(0) bytes at a time through a TLS connection.
+void BM_TlsSocketWrite(benchmark::State& state) {
+  TlsSocketPair pair;
+  size_t len = state.range(0), num = state.range(1);
+  string data(len * num, 'x');
+  vector<iovec> iov(num);
+  for (size_t i = 0; i < num; ++i)
+    iov[i] = iovec{data.data() + i * len, len};
+
+  Fiber reader = pair.proactor()->LaunchFiber([&] {
+    constexpr size_t kBufLen = 1 << 16;
+    unique_ptr<uint8_t[]> buf(new uint8_t[kBufLen]);
+    while (pair.client()->Recv(io::MutableBytes{buf.get(), kBufLen})) {
+    }
+  });
+
+  // Amortizes the cost of Await().
+  constexpr unsigned kWritesPerIteration = 16;
+  while (state.KeepRunning()) {
+    pair.proactor()->Await([&] {
+      for (unsigned i = 0; i < kWritesPerIteration; ++i)
+        CHECK(pair.server()->WriteSome(iov.data(), iov.size()));
+    });
+  }
+  state.SetBytesProcessed(state.iterations() * kWritesPerIteration * data.size());
+
+  pair.proactor()->Await([&] { (void)pair.server()->Shutdown(SHUT_RDWR); });
+  reader.Join();
+}
+BENCHMARK(BM_TlsSocketWrite)
+    ->Args({64, 64})
+    ->Args({1024, 16})
+    ->Args({16384, 4})
+    ->ArgNames({"bytes", "buffers"})
+    ->UseRealTime();
+
 }  // namespace tls
 }  // namespace util
@@ -4,11 +4,15 @@
 
 #include "util/tls/tls_socket.h"
 
+#include <absl/cleanup/cleanup.h>
+#include <absl/time/clock.h>
 #include <openssl/err.h>
 
 #include <algorithm>
 
 #include "base/logging.h"
+#include "util/fibers/fiberqueue_threadpool.h"
+#include "util/tls/ktls.h"
 #include "util/tls/tls_engine.h"
 
 namespace util {
@@ -56,8 +60,86 @@ inline error_code SSL2Error(unsigned long err) {
   return error_code{int(err), tls_category};
 }
 
+// Returns the plaintext of the next record from the buffers, starting at offset of *ptr.
+Engine::Buffer GatherRecord(const iovec* ptr, uint32_t len, size_t offset) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(ptr->iov_base) + offset;
+  size_t src_len = ptr->iov_len - offset;
+  if (src_len >= Engine::kMaxRecordLen || len == 1)
+    return Engine::Buffer{src, min(src_len, Engine::kMaxRecordLen)};
+
+  // Small buffers are copied together so that they are encrypted into one record.
+  // The engine encrypts the record before the fiber may switch, so a buffer per thread suffices.
+  thread_local unique_ptr<uint8_t[]> scratch;
+  if (!scratch)
+    scratch.reset(new uint8_t[Engine::kMaxRecordLen]);
+
+  size_t gathered = 0;
+  while (true) {
+    size_t copy_len = min(src_len, Engine::kMaxRecordLen - gathered);
+    memcpy(scratch.get() + gathered, src, copy_len);
+    gathered += copy_len;
+
+    ++ptr;
+    --len;
+    if (len == 0 || gathered == Engine::kMaxRecordLen)
+      break;
+    src = reinterpret_cast<const uint8_t*>(ptr->iov_base);
+    src_len = ptr->iov_len;
+  }
+
+  return Engine::Buffer{scratch.get(), gathered};
+}
+
+thread_local TlsSocket::HandshakeStats tl_handshake_stats;
+
 }  // namespace
 
+struct HandshakeOffload {
+  fb2::FiberQueueThreadPool* pool = nullptr;
+  unsigned max_pending = 0;
+
+  atomic_uint pending{0};  // steps that run or wait in the pool.
+  fb2::EventCount slot_ec;  // notified when a step leaves the pool.
+};
+
+namespace {
+
+void FreeHandshakeOffload(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl,
+                          void* argp) {
+  delete static_cast<HandshakeOffload*>(ptr);
+}
+
+int HandshakeOffloadIndex() {
+  static int index =
+      SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, FreeHandshakeOffload);
+  return index;
+}
+
+}  // namespace
+
+void EnableHandshakeOffload(SSL_CTX* ctx, fb2::FiberQueueThreadPool* pool, unsigned max_pending) {
+  CHECK(pool);
+  CHECK_GT(max_pending, 0u);
+  CHECK(!SSL_CTX_get_ex_data(ctx, HandshakeOffloadIndex()));
+
+  HandshakeOffload* offload = new HandshakeOffload;
+  offload->pool = pool;
+  offload->max_pending = max_pending;
+  SSL_CTX_set_ex_data(ctx, HandshakeOffloadIndex(), offload);
+}
+
+struct TlsSocket::KtlsState {
+  KtlsCryptoInfo rx;
+
+  uint64_t records_written = 0;  // by the engine during the current handshake step.
+  bool handshake_done = false;
+
+  // Records the engine read after the handshake and their total length.
+  uint64_t records_read = 0, bytes_read = 0;
+
+  uint64_t bytes_fed = 0;  // into the engine after the handshake.
+};
+
 TlsSocket::TlsSocket(std::unique_ptr<FiberSocketBase> next)
     : FiberSocketBase(next ? next->proactor() : nullptr), next_sock_(std::move(next)) {
 }
@@ -81,13 +163,42 @@ auto TlsSocket::Shutdown(int how) -> error_code {
 auto TlsSocket::Accept() -> AcceptResult {
   DCHECK(engine_);
 
+  SSL* ssl = engine_->native_handle();
+
+  // The kTLS state is installed with setsockopt, and the native handles of registered sockets
+  // are indices into the fixed file table of the ring, not process descriptors.
+  if (IsKtlsEnabled(SSL_get_SSL_CTX(ssl)) && !IsUDS() && !IsDirect()) {
+    ktls_.reset(new KtlsState);
+    SSL_set_msg_callback(ssl, KtlsMsgCb);
+    SSL_set_msg_callback_arg(ssl, ktls_.get());
+
+    // The kernel does not handle handshake messages.
+    SSL_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+  }
+
+  auto* offload = static_cast<HandshakeOffload*>(
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), HandshakeOffloadIndex()));
+  uint64_t start_ns = absl::GetCurrentTimeNanos();
+  bool done = false;
+  absl::Cleanup count_failure = [&done] {
+    if (!done)
+      ++tl_handshake_stats.failures;
+  };
+
   while (true) {
-    Engine::OpResult op_result = engine_->Handshake(Engine::SERVER);
+    if (ktls_)
+      ktls_->records_written = 0;
+
+    // The steps without new messages of the client do not compute anything.
+    Engine::OpResult op_result = offload && engine_->InputPending() > 0
+                                     ? OffloadHandshake(offload)
+                                     : engine_->Handshake(Engine::SERVER);
     if (!op_result) {
       return make_unexpected(SSL2Error(op_result.error()));
     }
 
-    error_code ec = MaybeSendOutput();
+    // With kTLS we count the records of the last handshake step, so we flush all of them.
+    error_code ec = ktls_ ? FlushOutput() : MaybeSendOutput();
     if (ec) {
       return make_unexpected(ec);
     }
@@ -107,9 +218,50 @@ auto TlsSocket::Accept() -> AcceptResult {
     }
   }
 
+  done = true;
+  uint64_t latency_usec = (absl::GetCurrentTimeNanos() - start_ns) / 1000;
+  ++tl_handshake_stats.handshakes;
+  tl_handshake_stats.latency_usec += latency_usec;
+  tl_handshake_stats.max_latency_usec = max(tl_handshake_stats.max_latency_usec, latency_usec);
+
+  if (ktls_)
+    StartKtls();
+
   return nullptr;
 }
 
+Engine::OpResult TlsSocket::OffloadHandshake(HandshakeOffload* offload) {
+  bool throttled = offload->slot_ec.await([offload] {
+    unsigned pending = offload->pending.load(memory_order_relaxed);
+    while (pending < offload->max_pending) {
+      if (offload->pending.compare_exchange_weak(pending, pending + 1, memory_order_acquire))
+        return true;
+    }
+    return false;
+  });
+
+  int64_t queued_ns = absl::GetCurrentTimeNanos(), started_ns = 0;
+  Engine::OpResult op_result = offload->pool->Await([&] {
+    started_ns = absl::GetCurrentTimeNanos();
+
+    // The error queue of OpenSSL is per thread, Handshake() reads the errors of this step.
+    ERR_clear_error();
+    return engine_->Handshake(Engine::SERVER);
+  });
+
+  offload->pending.fetch_sub(1, memory_order_release);
+  offload->slot_ec.notify();
+
+  ++tl_handshake_stats.offloaded_steps;
+  tl_handshake_stats.throttled_steps += throttled;
+  tl_handshake_stats.offload_wait_usec += max<int64_t>(started_ns - queued_ns, 0) / 1000;
+  return op_result;
+}
+
+auto TlsSocket::GetHandshakeStats() -> HandshakeStats {
+  return tl_handshake_stats;
+}
+
 auto TlsSocket::Connect(const endpoint_type& endpoint) -> error_code {
   DCHECK(engine_);
   auto io_result = engine_->Handshake(Engine::HandshakeType::CLIENT);
@@ -127,6 +279,12 @@ auto TlsSocket::Connect(const endpoint_type& endpoint) -> error_code {
 
 auto TlsSocket::Close() -> error_code {
   DCHECK(engine_);
+
+  // We do not send close_notify, and OpenSSL removes sessions that were not shut down
+  // from the session cache. Keep the established session resumable.
+  SSL* ssl = engine_->native_handle();
+  if (SSL_is_init_finished(ssl))
+    SSL_set_shutdown(ssl, SSL_get_shutdown(ssl) | SSL_SENT_SHUTDOWN);
   next_sock_->Close();
 
   return error_code{};
@@ -138,6 +296,11 @@ io::Result<size_t> TlsSocket::RecvMsg(const msghdr& msg, int flags) {
 
   DLOG_IF(INFO, flags) << "Flags argument is not supported " << flags;
 
+  if (ktls_ && ktls_->handshake_done)
+    MaybeStartKtlsRx();
+  if (ktls_rx_)
+    return RecvKtls(msg, flags);
+
   auto* io = msg.msg_iov;
   size_t io_len = msg.msg_iovlen;
 
@@ -154,6 +317,14 @@ io::Result<size_t> TlsSocket::RecvMsg(const msghdr& msg, int flags) {
       return make_unexpected(SSL2Error(op_result.error()));
     }
 
+    // Once the kernel sends the records, it owns their sequence numbers, so the records
+    // of the engine, for example a KeyUpdate response, would corrupt the stream.
+    if (ktls_tx_ && engine_->OutputPending() > 0) {
+      LOG_FIRST_N(WARNING, 1) << "TLS session output while kTLS sends, closing the connection";
+      (void)next_sock_->Shutdown(SHUT_RDWR);
+      return make_unexpected(make_error_code(errc::protocol_error));
+    }
+
     error_code ec = MaybeSendOutput();
     if (ec) {
       return make_unexpected(ec);
@@ -208,70 +379,56 @@ io::Result<size_t> TlsSocket::Recv(const io::MutableBytes& mb, int flags) {
 }
 
 io::Result<size_t> TlsSocket::WriteSome(const iovec* ptr, uint32_t len) {
-  // Chosen to be sufficiently smaller than the usual MTU (1500) and a multiple of 16.
-  // IP - max 24 bytes. TCP - max 60 bytes. TLS - max 21 bytes.
-  constexpr size_t kBufferSize = 1392;
-  io::Result<size_t> ec;
-  size_t total_sent = 0;
-
-  while (len) {
-    if (ptr->iov_len > kBufferSize || len == 1) {
-      ec = SendBuffer(Engine::Buffer{reinterpret_cast<uint8_t*>(ptr->iov_base), ptr->iov_len});
-      ptr++;
-      len--;
-    } else {
-      alignas(64) uint8_t scratch[kBufferSize];
-      size_t buffered_size = 0;
-      while (len && (buffered_size + ptr->iov_len) <= kBufferSize) {
-        std::memcpy(scratch + buffered_size, ptr->iov_base, ptr->iov_len);
-        buffered_size += ptr->iov_len;
-        ptr++;
-        len--;
-      }
-      ec = SendBuffer({scratch, buffered_size});
-    }
-    if (!ec.has_value()) {
-      return ec;
-    } else {
-      total_sent += ec.value();
-    }
-  }
-  return total_sent;
-}
+  if (ktls_tx_)
+    return next_sock_->WriteSome(ptr, len);
 
-io::Result<size_t> TlsSocket::SendBuffer(Engine::Buffer buf) {
   DCHECK(engine_);
-  DCHECK_GT(buf.size(), 0u);
 
-  size_t send_total = 0;
+  // The buffers are encrypted into full records until the output buffer can not hold another
+  // one, then the records are sent with one write.
+  size_t total_sent = 0, offset = 0;  // offset into *ptr.
 
   while (true) {
-    Engine::OpResult op_result = engine_->Write(buf);
-    if (!op_result) {
-      return make_unexpected(SSL2Error(op_result.error()));
+    while (len && offset == ptr->iov_len) {
+      ++ptr;
+      --len;
+      offset = 0;
     }
+    if (len == 0)
+      break;
 
-    error_code ec = MaybeSendOutput();
-    if (ec) {
-      return make_unexpected(ec);
+    if (engine_->OutputSpace() < Engine::kMaxEncryptedRecordLen) {
+      error_code ec = FlushOutput();
+      if (ec)
+        return make_unexpected(ec);
     }
 
-    int op_val = *op_result;
+    Engine::OpResult op_result = engine_->Write(GatherRecord(ptr, len, offset));
+    if (!op_result) {
+      return make_unexpected(SSL2Error(op_result.error()));
+    }
 
+    int op_val = *op_result;
     if (op_val > 0) {
-      send_total += op_val;
-
-      if (size_t(op_val) == buf.size()) {
-        break;
-      } else {
-        buf.remove_prefix(op_val);
+      total_sent += op_val;
+      offset += op_val;
+      while (len && offset >= ptr->iov_len) {
+        offset -= ptr->iov_len;
+        ++ptr;
+        --len;
       }
+      continue;
     }
 
     if (op_val == Engine::EOF_STREAM) {
       return make_unexpected(make_error_code(errc::connection_reset));
     }
 
+    // The session handshakes, so it may need to write or read its records first.
+    error_code ec = FlushOutput();
+    if (ec)
+      return make_unexpected(ec);
+
     if (op_val == Engine::NEED_READ_AND_MAYBE_WRITE) {
       ec = HandleRead();
       if (ec)
@@ -279,15 +436,29 @@ io::Result<size_t> TlsSocket::SendBuffer(Engine::Buffer buf) {
     }
   }
 
-  return send_total;
+  error_code ec = FlushOutput();
+  if (ec)
+    return make_unexpected(ec);
+
+  return total_sent;
 }
 
 // TODO: to implement async functionality.
 void TlsSocket::AsyncWriteSome(const iovec* v, uint32_t len, AsyncWriteCb cb) {
+  if (ktls_tx_)
+    return next_sock_->AsyncWriteSome(v, len, std::move(cb));
+
   io::Result<size_t> res = WriteSome(v, len);
   cb(res);
 }
 
+io::Result<size_t> TlsSocket::SendFile(int fd, off_t offset, size_t len) {
+  if (ktls_tx_)
+    return next_sock_->SendFile(fd, offset, len);
+
+  return FiberSocketBase::SendFile(fd, offset, len);
+}
+
 SSL* TlsSocket::ssl_handle() {
   return engine_ ? engine_->native_handle() : nullptr;
 }
@@ -308,6 +479,16 @@ auto TlsSocket::MaybeSendOutput() -> error_code {
   return error_code{};
 }
 
+auto TlsSocket::FlushOutput() -> error_code {
+  while (engine_->OutputPending() > 0) {
+    error_code ec = MaybeSendOutput();
+    if (ec)
+      return ec;
+  }
+
+  return error_code{};
+}
+
 auto TlsSocket::HandleRead() -> error_code {
   auto mut_buf = engine_->PeekInputBuf();
   io::Result<size_t> esz = next_sock_->Recv(mut_buf, 0);
@@ -315,6 +496,9 @@ auto TlsSocket::HandleRead() -> error_code {
     return esz.error();
   }
 
+  if (ktls_)
+    ktls_->bytes_fed += *esz;
+
   if (cache_) {
     PlaceBufferInCache(mut_buf, *esz);
     cache_ = false;
@@ -325,6 +509,102 @@ auto TlsSocket::HandleRead() -> error_code {
   return error_code{};
 }
 
+void TlsSocket::KtlsMsgCb(int write_p, int version, int content_type, const void* buf,
+                          size_t len, SSL* ssl, void* arg) {
+  if (content_type != SSL3_RT_HEADER || len != SSL3_RT_HEADER_LENGTH)
+    return;
+
+  KtlsState* state = static_cast<KtlsState*>(arg);
+  if (write_p) {
+    ++state->records_written;
+  } else if (state->handshake_done) {
+    const uint8_t* header = static_cast<const uint8_t*>(buf);
+    ++state->records_read;
+    state->bytes_read += SSL3_RT_HEADER_LENGTH + ((header[3] << 8) | header[4]);
+  }
+}
+
+void TlsSocket::StartKtls() {
+  SSL* ssl = engine_->native_handle();
+  ktls_->handshake_done = true;
+  ktls_->bytes_fed = engine_->InputPending();
+
+  // The Finished messages are the first records that are protected by the TLS 1.2 session keys.
+  // The TLS 1.3 server sends its session tickets with the application keys during the last
+  // handshake step.
+  bool tls13 = SSL_version(ssl) == TLS1_3_VERSION;
+  uint64_t tx_seq = tls13 ? ktls_->records_written : 1;
+  uint64_t rx_seq = tls13 ? 0 : 1;
+
+  KtlsCryptoInfo tx;
+  if (!ExportKtlsCryptoInfo(ssl, tx_seq, rx_seq, &tx, &ktls_->rx)) {
+    VLOG(1) << "kTLS does not support " << SSL_get_version(ssl) << " "
+            << SSL_get_cipher_name(ssl);
+    StopKtls();
+    return;
+  }
+
+  int fd = native_handle();
+  error_code ec = InstallKtlsUlp(fd);
+  if (!ec)
+    ec = InstallKtls(fd, true, tx);
+
+  if (ec) {
+    LOG_FIRST_N(WARNING, 1) << "Could not enable kTLS: " << ec.message();
+    StopKtls();
+    return;
+  }
+
+  ktls_tx_ = true;
+  MaybeStartKtlsRx();
+}
+
+void TlsSocket::MaybeStartKtlsRx() {
+  DCHECK(ktls_ && ktls_->handshake_done);
+
+  // The engine must consume the records that it already read from the socket, including
+  // the data that it decrypted but did not return yet.
+  if (engine_->InputPending() > 0 || ktls_->bytes_read != ktls_->bytes_fed ||
+      SSL_has_pending(engine_->native_handle())) {
+    return;
+  }
+
+  ktls_->rx.seq += ktls_->records_read;
+  error_code ec = InstallKtls(native_handle(), false, ktls_->rx);
+  LOG_IF(WARNING, ec) << "Could not enable kTLS receiving: " << ec.message();
+  ktls_rx_ = !ec;
+
+  StopKtls();
+}
+
+void TlsSocket::StopKtls() {
+  if (ktls_) {
+    SSL_set_msg_callback(engine_->native_handle(), nullptr);
+    ktls_.reset();
+  }
+}
+
+io::Result<size_t> TlsSocket::RecvKtls(const msghdr& msg, int flags) {
+  char cbuf[CMSG_SPACE(sizeof(uint8_t))];
+  msghdr kmsg = msg;
+  kmsg.msg_control = cbuf;
+  kmsg.msg_controllen = sizeof(cbuf);
+
+  io::Result<size_t> res = next_sock_->RecvMsg(kmsg, flags);
+  if (!res)
+    return res;
+
+  // Alerts, including close_notify, end the session like EOF_STREAM does.
+  // Post-handshake messages, like TLS 1.3 key updates, are not supported.
+  uint8_t record_type = GetKtlsRecordType(kmsg);
+  if (record_type == SSL3_RT_ALERT)
+    return make_unexpected(make_error_code(errc::connection_reset));
+  if (record_type != SSL3_RT_APPLICATION_DATA)
+    return make_unexpected(make_error_code(errc::protocol_not_supported));
+
+  return res;
+}
+
 void TlsSocket::CacheOnce() {
   cache_ = true;
 }
@@ -12,9 +12,21 @@
 #include "util/tls/tls_engine.h"
 
 namespace util {
+
+namespace fb2 {
+class FiberQueueThreadPool;
+}  // namespace fb2
+
 namespace tls {
 
 class Engine;
+struct HandshakeOffload;
+
+// Runs the CPU-heavy steps of the server handshakes of ctx, those that process the messages
+// of the client, in `pool` instead of the proactor thread. The I/O stays in the proactor thread.
+// At most `max_pending` steps of ctx run or wait in the pool at a time, the other handshakes
+// wait for them. The pool must outlive ctx.
+void EnableHandshakeOffload(SSL_CTX* ctx, fb2::FiberQueueThreadPool* pool, unsigned max_pending);
 
 class TlsSocket : public FiberSocketBase {
  public:
@@ -47,8 +59,44 @@ class TlsSocket : public FiberSocketBase {
   ::io::Result<size_t> WriteSome(const iovec* ptr, uint32_t len) final;
   void AsyncWriteSome(const iovec* v, uint32_t len, AsyncWriteCb cb) final;
 
+  // SendFile is zero-copy once sending is offloaded to the kernel.
+  ::io::Result<size_t> SendFile(int fd, off_t offset, size_t len) override;
+
+  // The encrypted records are sent from the output buffer of the engine, which is reused only
+  // after the write returns, so they can be sent with zero-copy as well.
+  void SetZeroCopyThreshold(uint32_t bytes) override {
+    next_sock_->SetZeroCopyThreshold(bytes);
+  }
+
   SSL* ssl_handle();
 
+  // Whether sending or receiving is offloaded to the kernel (kTLS). The offload is attempted
+  // by Accept() if EnableKtls() was called for the SSL context, see ktls.h. Receiving is
+  // offloaded only after the engine consumes the records it already read from the socket.
+  // Unix domain sockets and registered (io_uring fixed) descriptors are not offloaded.
+  // While only sending is offloaded, records that the session would send in response to
+  // the received ones, for example KeyUpdate, fail the connection.
+  bool IsKtlsTx() const {
+    return ktls_tx_;
+  }
+
+  bool IsKtlsRx() const {
+    return ktls_rx_;
+  }
+
+  // Counters of the server handshakes, per proactor thread.
+  struct HandshakeStats {
+    uint64_t handshakes = 0;         // completed handshakes.
+    uint64_t failures = 0;           // failed handshakes.
+    uint64_t latency_usec = 0;       // the total latency of the completed handshakes.
+    uint64_t max_latency_usec = 0;   // the maximal latency of a completed handshake.
+    uint64_t offloaded_steps = 0;    // steps that ran in the offload pool.
+    uint64_t throttled_steps = 0;    // offloaded steps that waited for a free slot.
+    uint64_t offload_wait_usec = 0;  // the total time the offloaded steps waited to run.
+  };
+
+  static HandshakeStats GetHandshakeStats();
+
   // Enables caching the first n_bytes received in HandleRead()
   // such that it can be used later to downgrade tls to non-tls
   // connections
@@ -90,13 +138,29 @@ class TlsSocket : public FiberSocketBase {
   virtual void SetProactor(ProactorBase* p) override;
 
  private:
-  io::Result<size_t> SendBuffer(Engine::Buffer buf);
-
   /// Feed encrypted data from the TLS engine into the network socket.
   error_code MaybeSendOutput();
   /// Read encrypted data from the network socket and feed it into the TLS engine.
   error_code HandleRead();
 
+  /// Sends all the pending output of the TLS engine.
+  error_code FlushOutput();
+
+  struct KtlsState;
+
+  // Runs the handshake step in the offload pool, see EnableHandshakeOffload().
+  Engine::OpResult OffloadHandshake(HandshakeOffload* offload);
+
+  // Counts the records of the session while the kTLS offload is pending.
+  static void KtlsMsgCb(int write_p, int version, int content_type, const void* buf, size_t len,
+                        SSL* ssl, void* arg);
+
+  // Called after the handshake, offloads sending and if possible, receiving.
+  void StartKtls();
+  void MaybeStartKtlsRx();
+  void StopKtls();
+  io::Result<size_t> RecvKtls(const msghdr& msg, int flags);
+
   std::unique_ptr<FiberSocketBase> next_sock_;
   std::unique_ptr<Engine> engine_;
 
@@ -104,6 +168,9 @@ class TlsSocket : public FiberSocketBase {
   bool cache_{false};
   size_t n_bytes_{0};
   Buffer cached_bytes_;
+
+  std::unique_ptr<KtlsState> ktls_;  // set while the kTLS offload is pending.
+  bool ktls_tx_ = false, ktls_rx_ = false;
 };
 
 }  // namespace tls